@@ -12,7 +12,27 @@
 
 #import <Cocoa/Cocoa.h>
 
-@class WBBaseUITreeNode;
+@class WBBaseUITreeNode, WBOutlineViewController;
+
+/*!
+ @abstract Lazy children provider.
+ @discussion When a data provider is set, the controller does not expect a fully built tree.
+ Children of a node are requested the first time the node is expanded, and a placeholder
+ is displayed until they are available.
+ */
+@protocol WBOutlineViewDataProvider <NSObject>
+@required
+/* Called on a background queue. Must return an array of WBBaseUITreeNode (or nil). */
+- (NSArray *)outlineViewController:(WBOutlineViewController *)controller childrenOfNode:(WBBaseUITreeNode *)aNode;
+
+@optional
+/* Called on the main thread for nodes that are not loaded yet. Default is ![aNode isLeaf]. */
+- (BOOL)outlineViewController:(WBOutlineViewController *)controller isNodeExpandable:(WBBaseUITreeNode *)aNode;
+/* Called on the main thread. Node displayed while aNode's children are loading. */
+- (WBBaseUITreeNode *)outlineViewController:(WBOutlineViewController *)controller placeholderForNode:(WBBaseUITreeNode *)aNode;
+
+@end
+
 WB_OBJC_EXPORT
 @interface WBOutlineViewController : NSObject {
 @private
@@ -24,6 +44,13 @@ WB_OBJC_EXPORT
     unsigned int:6;
   } wb_ocFlags;
   id wb_delegate;
+
+  /* lazy mode */
+  id<WBOutlineViewDataProvider> wb_provider;
+  NSMapTable *wb_loaded; // loaded nodes
+  NSMapTable *wb_pending; // node -> placeholder
+  NSMutableArray *wb_collapsed; // LRU of collapsed loaded nodes (oldest first)
+  NSUInteger wb_cacheLimit;
 }
 
 - (id)initWithOutlineView:(NSOutlineView *)aView;
@@ -45,6 +72,18 @@ WB_OBJC_EXPORT
 
 - (BOOL)containsNode:(id)aNode;
 
+/* Lazy mode. Setting a nil provider restores the eager mode (default). */
+- (id<WBOutlineViewDataProvider>)dataProvider;
+- (void)setDataProvider:(id<WBOutlineViewDataProvider>)aProvider;
+
+/* Maximum number of collapsed subtrees kept in memory. Default is 64. */
+- (NSUInteger)collapsedCacheLimit;
+- (void)setCollapsedCacheLimit:(NSUInteger)aLimit;
+
+- (BOOL)isNodeLoaded:(WBBaseUITreeNode *)aNode;
+/* discard aNode's children and fetch them again */
+- (void)reloadNode:(WBBaseUITreeNode *)aNode;
+
 - (void)displayNode:(WBBaseUITreeNode *)aNode;
 - (void)editNode:(WBBaseUITreeNode *)aNode column:(NSInteger)column;
 
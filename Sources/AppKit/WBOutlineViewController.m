@@ -13,12 +13,18 @@
 
 @interface WBOutlineViewController () <NSOutlineViewDataSource>
 
+- (void)wb_resetLazyState;
+- (BOOL)wb_isLazyNode:(WBBaseUITreeNode *)aNode;
+- (id)wb_placeholderForNode:(WBBaseUITreeNode *)aNode;
+- (void)wb_didLoadChildren:(NSArray *)children ofNode:(WBBaseUITreeNode *)aNode placeholder:(id)placeholder;
+
 @end
 
 @implementation WBOutlineViewController
 
 - (id)initWithOutlineView:(NSOutlineView *)aView {
   if (self = [super init]) {
+    wb_cacheLimit = 64;
     if (aView)
       [self setOutlineView:aView];
   }
@@ -30,8 +36,12 @@
 }
 
 - (void)dealloc {
+  [self setOutlineView:nil];
   [self setRoot:nil];
-  [wb_outline release];
+  [wb_collapsed release];
+  [wb_pending release];
+  [wb_loaded release];
+  [wb_provider release];
   [super dealloc];
 }
 
@@ -67,6 +77,7 @@
     [[wb_root notificationCenter] removeObserver:self];
   }
   SPXSetterRetain(wb_root, root);
+  [self wb_resetLazyState];
   if (wb_root) {
     NSNotificationCenter *notify = [wb_root notificationCenter];
     [notify addObserver:self selector:@selector(didChangeNodeName:)
@@ -117,13 +128,21 @@
 }
 
 - (void)setOutlineView:(NSOutlineView *)anOutline {
+  NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
   if (wb_outline) {
+    [center removeObserver:self name:NSOutlineViewItemWillExpandNotification object:wb_outline];
+    [center removeObserver:self name:NSOutlineViewItemDidCollapseNotification object:wb_outline];
     [wb_outline setDataSource:nil];
     [wb_outline release];
   }
   wb_outline = [anOutline retain];
   if (wb_outline) {
     [wb_outline setDataSource:self];
+    /* used to maintains the lazy mode LRU */
+    [center addObserver:self selector:@selector(willExpandItem:)
+                   name:NSOutlineViewItemWillExpandNotification object:wb_outline];
+    [center addObserver:self selector:@selector(didCollapseItem:)
+                   name:NSOutlineViewItemDidCollapseNotification object:wb_outline];
   }
 }
 
@@ -136,6 +155,167 @@ BOOL _ContainsNode(WBOutlineViewController *self, id item) {
   return _ContainsNode(self, aNode);
 }
 
+#pragma mark Lazy Mode
+- (id<WBOutlineViewDataProvider>)dataProvider {
+  return wb_provider;
+}
+- (void)setDataProvider:(id<WBOutlineViewDataProvider>)aProvider {
+  if (aProvider != wb_provider) {
+    SPXSetterRetain(wb_provider, aProvider);
+    [self wb_resetLazyState];
+    [wb_outline reloadData];
+  }
+}
+
+- (NSUInteger)collapsedCacheLimit {
+  return wb_cacheLimit;
+}
+- (void)setCollapsedCacheLimit:(NSUInteger)aLimit {
+  wb_cacheLimit = aLimit;
+}
+
+- (BOOL)isNodeLoaded:(WBBaseUITreeNode *)aNode {
+  return !wb_provider || [wb_loaded objectForKey:aNode] != nil;
+}
+
+static
+void _WBNodeSetChildren(WBBaseUITreeNode *node, NSArray *children) {
+  /* lazy loading and eviction must not be undoable */
+  BOOL undo = [node registerUndo];
+  if (undo) [node setRegisterUndo:NO];
+  if (children)
+    [node setChildren:children];
+  else
+    [node removeAllChildren];
+  if (undo) [node setRegisterUndo:YES];
+}
+
+/* Forget aNode and all its loaded descendants. Pending fetches are discarded when they complete. */
+static
+void _WBUnloadNode(WBOutlineViewController *self, WBBaseUITreeNode *aNode) {
+  NSMutableArray *nodes = [NSMutableArray arrayWithObject:aNode];
+  for (WBBaseUITreeNode *node in self->wb_loaded) {
+    if ([node isChildOf:aNode])
+      [nodes addObject:node];
+  }
+  for (WBBaseUITreeNode *node in self->wb_pending) {
+    if ([node isChildOf:aNode])
+      [nodes addObject:node];
+  }
+  for (WBBaseUITreeNode *node in nodes) {
+    [self->wb_loaded removeObjectForKey:node];
+    [self->wb_pending removeObjectForKey:node];
+    [self->wb_collapsed removeObjectIdenticalTo:node];
+  }
+}
+
+- (void)reloadNode:(WBBaseUITreeNode *)aNode {
+  if (!wb_provider || !_ContainsNode(self, aNode))
+    return;
+  [aNode retain];
+  _WBUnloadNode(self, aNode);
+  _WBNodeSetChildren(aNode, nil);
+  if (wb_root == aNode && ![self displayRoot])
+    [wb_outline reloadItem:nil reloadChildren:YES];
+  else
+    [wb_outline reloadItem:aNode reloadChildren:YES];
+  [aNode release];
+}
+
+- (void)wb_resetLazyState {
+  if (wb_provider) {
+    if (!wb_loaded) {
+      wb_loaded = [[NSMapTable alloc] initWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                            valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+      wb_pending = [[NSMapTable alloc] initWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                             valueOptions:NSPointerFunctionsStrongMemory capacity:0];
+      wb_collapsed = [[NSMutableArray alloc] init];
+    }
+  }
+  [wb_loaded removeAllObjects];
+  [wb_pending removeAllObjects];
+  [wb_collapsed removeAllObjects];
+}
+
+- (BOOL)wb_isLazyNode:(WBBaseUITreeNode *)aNode {
+  return wb_provider && [wb_loaded objectForKey:aNode] == nil && ![aNode isLeaf];
+}
+
+- (id)wb_placeholderForNode:(WBBaseUITreeNode *)aNode {
+  id placeholder = [wb_pending objectForKey:aNode];
+  if (placeholder)
+    return placeholder;
+
+  if ([wb_provider respondsToSelector:@selector(outlineViewController:placeholderForNode:)])
+    placeholder = [wb_provider outlineViewController:self placeholderForNode:aNode];
+  if (!placeholder) {
+    placeholder = [WBUITreeNode nodeWithName:NSLocalizedStringFromTableInBundle(@"Loading…", nil, SPXCurrentBundle(), @"Outline view placeholder")];
+  }
+  /* placeholders are never expandable */
+  [placeholder setIsLeaf:YES];
+  [wb_pending setObject:placeholder forKey:aNode];
+
+  /* blocks retain self, aNode and the provider until completion */
+  id<WBOutlineViewDataProvider> provider = wb_provider;
+  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+    NSArray *children = nil;
+    @try {
+      children = [[provider outlineViewController:self childrenOfNode:aNode] copy];
+    } @catch (id exception) {
+      SPXLogException(exception);
+    }
+    dispatch_async(dispatch_get_main_queue(), ^{
+      [self wb_didLoadChildren:children ofNode:aNode placeholder:placeholder];
+      [children release];
+    });
+  });
+  return placeholder;
+}
+
+- (void)wb_didLoadChildren:(NSArray *)children ofNode:(WBBaseUITreeNode *)aNode placeholder:(id)placeholder {
+  /* discard result if the node was unloaded, or reloaded, while fetching */
+  if ([wb_pending objectForKey:aNode] != placeholder || !_ContainsNode(self, aNode))
+    return;
+
+  [wb_loaded setObject:aNode forKey:aNode];
+  [wb_pending removeObjectForKey:aNode];
+  _WBNodeSetChildren(aNode, children);
+  /* set children notifications already trigger a reload */
+  if (![aNode notify]) {
+    if (wb_root == aNode && ![self displayRoot])
+      [wb_outline reloadItem:nil reloadChildren:YES];
+    else
+      [wb_outline reloadItem:aNode reloadChildren:YES];
+  }
+  for (WBBaseUITreeNode *node in [aNode childEnumerator]) {
+    if (![node isCollapsable])
+      [wb_outline expandItem:node];
+  }
+}
+
+- (void)willExpandItem:(NSNotification *)aNotification {
+  if (wb_provider)
+    [wb_collapsed removeObjectIdenticalTo:[[aNotification userInfo] objectForKey:@"NSObject"]];
+}
+
+- (void)didCollapseItem:(NSNotification *)aNotification {
+  WBBaseUITreeNode *item = [[aNotification userInfo] objectForKey:@"NSObject"];
+  if (!wb_provider || ![wb_loaded objectForKey:item])
+    return;
+
+  [wb_collapsed removeObjectIdenticalTo:item];
+  [wb_collapsed addObject:item];
+  /* evict the least recently collapsed subtrees */
+  while ([wb_collapsed count] > wb_cacheLimit) {
+    WBBaseUITreeNode *node = [[wb_collapsed objectAtIndex:0] retain];
+    _WBUnloadNode(self, node);
+    if (_ContainsNode(self, node) && ![wb_outline isItemExpanded:node])
+      _WBNodeSetChildren(node, nil);
+    [node release];
+  }
+}
+
+#pragma mark -
 - (void)displayNode:(WBBaseUITreeNode *)aNode {
   if (_ContainsNode(self, aNode)) {
     // Expand all parents
@@ -236,6 +416,8 @@ BOOL _ContainsNode(WBOutlineViewController *self, id item) {
 #pragma mark -
 #pragma mark OutlineView DataSource
 - (BOOL)outlineView:(NSOutlineView *)outlineView isItemExpandable:(id)item {
+  if (item && [self wb_isLazyNode:item] && [wb_provider respondsToSelector:@selector(outlineViewController:isNodeExpandable:)])
+    return [wb_provider outlineViewController:self isNodeExpandable:item];
   return (nil == item) ? YES : ([item respondsToSelector:@selector(isLeaf)]) ? ![item isLeaf] : [item hasChildren];
 }
 
@@ -244,14 +426,23 @@ BOOL _ContainsNode(WBOutlineViewController *self, id item) {
     if (wb_ocFlags.displayRoot) {
       return wb_root ? 1 : 0;
     } else {
+      if (wb_root && [self wb_isLazyNode:wb_root])
+        return [self wb_placeholderForNode:wb_root] ? 1 : 0;
       return [wb_root count];
     }
   } else {
+    if ([self wb_isLazyNode:item])
+      return [self wb_placeholderForNode:item] ? 1 : 0;
     return [item count];
   }
 }
 
 - (id)outlineView:(NSOutlineView *)outlineView child:(NSInteger)anIndex ofItem:(id)item {
+  if (wb_provider) {
+    id node = item ? : (wb_ocFlags.displayRoot ? nil : wb_root);
+    if (node && [self wb_isLazyNode:node])
+      return [self wb_placeholderForNode:node];
+  }
   return (nil == item) ? (wb_ocFlags.displayRoot ? (id)wb_root : [wb_root childAtIndex:anIndex]) : [item childAtIndex:anIndex];
 }
 
@@ -14,12 +14,28 @@
 
 typedef BOOL (^WBFilterBlock)(NSString *, id);
 
+typedef NS_OPTIONS(NSUInteger, WBFilterOptions) {
+  /* When the search string extends the previous one, only the previous matches are filtered.
+   The filter must be monotonic: an object that matches a string also matches its prefixes. */
+  WBFilterIncremental  = 1 << 0,
+  /* Large arrays are filtered by chunks on several threads. The filter block must be thread safe. */
+  WBFilterConcurrent   = 1 << 1,
+  /* Search string changes are filtered in background, and the arranged objects are updated when done.
+   A new search string cancels the filter in progress. */
+  WBFilterAsynchronous = 1 << 2,
+};
+
 WB_OBJC_EXPORT
 @interface WBTableDataSource : NSArrayController
 
 #pragma mark -
 @property(nonatomic, copy) NSComparator comparator;
 
+/* If set and there is no comparator, objects are sorted by the string at this key path,
+ in -numericCompare: order. Each string is converted once into a collation key,
+ and keys are kept for the next sorts. */
+@property(nonatomic, copy) NSString *collationKeyPath;
+
 #pragma mark -
 - (IBAction)search:(id)sender;
 
@@ -27,4 +43,11 @@ WB_OBJC_EXPORT
 
 @property(nonatomic, copy) WBFilterBlock filterBlock;
 
+/* Filtered objects are in content order. Default is 0 (the whole content is filtered on each change).
+ With WBFilterIncremental or WBFilterAsynchronous, the last result is reused as long as the content
+ does not change. Call -invalidateFilter when a change in the objects affects the result. */
+@property(nonatomic) WBFilterOptions filterOptions;
+
+- (void)invalidateFilter;
+
 @end
@@ -10,7 +10,83 @@
 
 #import <WonderBox/WBTableDataSource.h>
 
-@implementation WBTableDataSource
+#import <WonderBox/NSArray+WonderBox.h>
+#import <WonderBox/NSString+WonderBox.h>
+
+#include <libkern/OSAtomic.h>
+
+#define kWBFilterChunkSize 4096
+
+/* Returns the objects that match search, in the same order, or nil if generation changed. */
+static
+NSArray *_WBFilterObjects(NSArray *objects, NSString *search, WBFilterBlock filter, bool concurrent,
+                          volatile int32_t *generation, int32_t expected) {
+  NSUInteger count = [objects count];
+  if (!count)
+    return [NSArray array];
+
+  id *items = malloc(count * sizeof(*items));
+  uint8_t *matches = malloc(count);
+  [objects getObjects:items range:NSMakeRange(0, count)];
+
+  __block volatile bool cancelled = false;
+  size_t chunks = (count + kWBFilterChunkSize - 1) / kWBFilterChunkSize;
+  void (^filterChunk)(size_t) = ^(size_t chunk) {
+    if (cancelled || (generation && *generation != expected)) {
+      cancelled = true;
+      return;
+    }
+    @autoreleasepool {
+      NSUInteger end = MIN(count, (chunk + 1) * kWBFilterChunkSize);
+      for (NSUInteger idx = chunk * kWBFilterChunkSize; idx < end; idx++)
+        matches[idx] = filter(search, items[idx]) ? 1 : 0;
+    }
+  };
+  if (concurrent && chunks > 1) {
+    dispatch_apply(chunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), filterChunk);
+  } else {
+    for (size_t chunk = 0; chunk < chunks; chunk++)
+      filterChunk(chunk);
+  }
+
+  NSArray *result = nil;
+  if (!cancelled) {
+    NSUInteger kept = 0;
+    for (NSUInteger idx = 0; idx < count; idx++) {
+      if (matches[idx])
+        items[kept++] = items[idx];
+    }
+    result = [NSArray arrayWithObjects:items count:kept];
+  }
+  free(matches);
+  free(items);
+  return result;
+}
+
+WB_INLINE
+bool _WBSearchEqual(NSString *s1, NSString *s2) {
+  return s1 == s2 || [s1 isEqualToString:s2];
+}
+
+@implementation WBTableDataSource {
+@private
+  NSCache *wb_keys;
+  /* last filter result. The source is compared by identity, not by content */
+  NSArray *wb_source;
+  NSUInteger wb_sourceCount;
+  NSString *wb_search;
+  NSArray *wb_matches;
+  volatile int32_t wb_generation;
+}
+
+- (void)dealloc {
+  [_collationKeyPath release];
+  [wb_matches release];
+  [wb_search release];
+  [wb_source release];
+  [wb_keys release];
+  [super dealloc];
+}
 
 #pragma mark -
 #pragma mark Sort Methods
@@ -19,6 +95,34 @@
   [self rearrangeObjects];
 }
 
+- (void)setCollationKeyPath:(NSString *)keyPath {
+  if (![keyPath isEqualToString:_collationKeyPath]) {
+    SPXSetterCopy(_collationKeyPath, keyPath);
+    [self rearrangeObjects];
+  }
+}
+
+/* strings are immutable, so their keys can be reused */
+- (NSArray *)wb_sortObjectsUsingCollationKeys:(NSArray *)objects {
+  if (!wb_keys)
+    wb_keys = [[NSCache alloc] init];
+  NSCache *cache = wb_keys;
+  /* KVC is not thread safe: fetch the strings on this thread, only the keys are computed concurrently */
+  NSArray *strings = [objects valueForKeyPath:_collationKeyPath];
+  return [objects sortedArrayWithValues:strings collationKeys:^NSData *(id str) {
+    if (![str isKindOfClass:[NSString class]])
+      return [NSData data];
+    NSData *key = [cache objectForKey:str];
+    if (!key) {
+      key = [str numericCollationKey];
+      NSString *copy = [str copy];
+      [cache setObject:key forKey:copy];
+      [copy release];
+    }
+    return key;
+  }];
+}
+
 #pragma mark -
 #pragma mark Search Methods
 - (IBAction)search:(id)sender {
@@ -31,36 +135,100 @@
 - (void)setSearchString:(NSString *)aString {
   if (![aString isEqualToString:_searchString]) {
     _searchString = [aString length] > 0 ? [aString copy] : nil;
-    [self rearrangeObjects];
+    if (_filterBlock && (_filterOptions & WBFilterAsynchronous))
+      [self wb_filterInBackground];
+    else
+      [self rearrangeObjects];
   }
 }
 
 - (void)setFilterBlock:(WBFilterBlock)filterBlock {
   _filterBlock = filterBlock;
+  [self invalidateFilter];
+}
+
+- (void)setFilterOptions:(WBFilterOptions)options {
+  _filterOptions = options;
+  [self invalidateFilter];
+}
+
+- (void)invalidateFilter {
+  /* cancel the background filter */
+  OSAtomicIncrement32Barrier(&wb_generation);
+  [self wb_setMatches:nil forObjects:nil search:nil];
   [self rearrangeObjects];
 }
 
+#pragma mark -
+#pragma mark Filter Engine
+- (void)wb_setMatches:(NSArray *)matches forObjects:(NSArray *)objects search:(NSString *)search {
+  SPXSetterRetain(wb_matches, matches);
+  SPXSetterRetain(wb_source, objects);
+  wb_sourceCount = [objects count];
+  SPXSetterCopy(wb_search, search);
+}
+
+- (BOOL)wb_isSource:(NSArray *)objects {
+  /* the controller mutates its content in place: the count catches insertions and removals */
+  return wb_source == objects && wb_sourceCount == [objects count];
+}
+
+/* objects the search can be restricted to */
+- (NSArray *)wb_sourceForObjects:(NSArray *)objects search:(NSString *)search {
+  if ((_filterOptions & WBFilterIncremental) && wb_matches && wb_search &&
+      [search hasPrefix:wb_search] && [self wb_isSource:objects])
+    return wb_matches;
+  return objects;
+}
+
+- (NSArray *)wb_filterObjects:(NSArray *)objects {
+  /* reuse the last result (computed by a previous arrange or by a background filter) */
+  if ((_filterOptions & (WBFilterIncremental | WBFilterAsynchronous)) && wb_matches &&
+      _WBSearchEqual(wb_search, _searchString) && [self wb_isSource:objects])
+    return wb_matches;
+
+  NSArray *source = [self wb_sourceForObjects:objects search:_searchString];
+  NSArray *matches = _WBFilterObjects(source, _searchString, _filterBlock, _filterOptions & WBFilterConcurrent, NULL, 0);
+  if (_filterOptions & (WBFilterIncremental | WBFilterAsynchronous))
+    [self wb_setMatches:matches forObjects:objects search:_searchString];
+  return matches;
+}
+
+- (void)wb_filterInBackground {
+  int32_t generation = OSAtomicIncrement32Barrier(&wb_generation);
+  /* the result is recorded for the content array, but computed on a snapshot */
+  NSArray *objects = [self content];
+  NSUInteger count = [objects count];
+  NSString *search = [[_searchString copy] autorelease];
+  NSArray *source = [NSArray arrayWithArray:[self wb_sourceForObjects:objects search:search]];
+  WBFilterBlock filter = [[_filterBlock copy] autorelease];
+  bool concurrent = _filterOptions & WBFilterConcurrent;
+  volatile int32_t *current = &wb_generation;
+  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+    NSArray *matches = _WBFilterObjects(source, search, filter, concurrent, current, generation);
+    if (matches) {
+      dispatch_async(dispatch_get_main_queue(), ^{
+        /* a newer search may have been started, or the content changed in the meantime */
+        if (generation == wb_generation && count == [objects count]) {
+          [self wb_setMatches:matches forObjects:objects search:search];
+          [self rearrangeObjects];
+        }
+      });
+    }
+  });
+}
+
 #pragma mark -
 #pragma mark Custom Arrange Algorithm
 - (NSArray *)arrangeObjects:(NSArray *)objects {
-  NSArray *result = nil;
-  if (_filterBlock) {
-    id item = nil;
-    NSUInteger count = [objects count];
-    NSMutableArray *filteredObjects = [NSMutableArray arrayWithCapacity:[objects count]];
-    while (count-- > 0) {
-      item = [objects objectAtIndex:count];
-      if (_filterBlock(_searchString, item)) {
-        [filteredObjects addObject:item];
-      }
-    }
-    result = filteredObjects;
-  } else {
-    result = objects;
-  }
+  NSArray *result = objects;
+  if (_filterBlock)
+    result = [self wb_filterObjects:objects];
 
   if (_comparator) {
     result = [result sortedArrayUsingComparator:_comparator];
+  } else if (_collationKeyPath) {
+    result = [self wb_sortObjectsUsingCollationKeys:result];
   } else {
     result = [super arrangeObjects:result];
   }
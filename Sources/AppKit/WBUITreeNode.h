@@ -75,7 +75,11 @@ NSString * const WBUITreeNodeDidSortChildrenNotification;
 - (id)initWithName:(NSString *)aName;
 - (id)initWithName:(NSString *)aName icon:(NSImage *)anIcon; // designated initializer
 
+/* Sort children using their name collation key. Keys are fetched on the calling thread. */
 - (void)sortByName;
+/* Case insensitive key (see -[NSString collationKeyWithOptions:]). WBUITreeNode caches it, so it must be
+ called on the main thread. */
+- (NSData *)nameCollationKey;
 
 - (NSImage *)icon;
 - (void)setIcon:(NSImage *)anIcon;
@@ -125,6 +129,7 @@ WB_OBJC_EXPORT
 @private
   NSImage *wb_icon;
   NSString *wb_name;
+  NSData *wb_nameKey;
 }
 
 
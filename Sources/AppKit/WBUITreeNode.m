@@ -10,6 +10,9 @@
 
 #import <WonderBox/WBUITreeNode.h>
 
+#import <WonderBox/NSArray+WonderBox.h>
+#import <WonderBox/NSString+WonderBox.h>
+
 NSString * const WBNewChildren = @"WBNewChildren";
 NSString * const WBRemovedChild = @"WBRemovedChild";
 NSString * const WBInsertedChild = @"WBInsertedChild";
@@ -40,6 +43,7 @@ NSString * const WBUITreeNodeDidSortChildrenNotification = @"WBUITreeNodeDidSort
   WBUITreeNode *copy = [super copyWithZone:aZone];
   copy->wb_name = [wb_name copyWithZone:aZone];
   copy->wb_icon = [wb_icon copyWithZone:aZone];
+  copy->wb_nameKey = [wb_nameKey retain];
   return copy;
 }
 
@@ -59,6 +63,7 @@ NSString * const WBUITreeNodeDidSortChildrenNotification = @"WBUITreeNodeDidSort
 
 #pragma mark -
 - (void)dealloc {
+  [wb_nameKey release];
   [wb_icon release];
   [wb_name release];
   [super dealloc];
@@ -77,6 +82,14 @@ NSString * const WBUITreeNodeDidSortChildrenNotification = @"WBUITreeNodeDidSort
 }
 - (void)wb_setName:(NSString *)aName {
   SPXSetterCopy(wb_name, aName);
+  [wb_nameKey release];
+  wb_nameKey = nil;
+}
+
+- (NSData *)nameCollationKey {
+  if (!wb_nameKey)
+    wb_nameKey = [[super nameCollationKey] retain];
+  return wb_nameKey;
 }
 
 @end
@@ -217,14 +230,20 @@ NSString * const WBUITreeNodeDidSortChildrenNotification = @"WBUITreeNodeDidSort
 }
 
 #pragma mark Name & Icon
+- (NSData *)nameCollationKey {
+  return [[self name] collationKeyWithOptions:NSCaseInsensitiveSearch];
+}
+
 - (void)sortByName {
-  static NSArray *sSorts = nil;
-  if (!sSorts) {
-    NSSortDescriptor *name = [[NSSortDescriptor alloc] initWithKey:@"name" ascending:YES selector:@selector(caseInsensitiveCompare:)];
-    sSorts = [[NSArray alloc] initWithObjects:name, nil];
-    [name release];
+  /* same order than caseInsensitiveCompare:, but each name is parsed once.
+   The keys are fetched on this thread, as WBUITreeNode caches them: only new names are parsed. */
+  NSArray *children = [self children];
+  if ([children count] > 1) {
+    [self setSortedChildren:[children sortedArrayWithValues:[children valueForKey:@"nameCollationKey"] collationKeys:^NSData *(id key) {
+      /* NSNull for nodes without name */
+      return [key isKindOfClass:[NSData class]] ? key : [NSData data];
+    }]];
   }
-  [self sortUsingDescriptors:sSorts];
 }
 
 - (void)setIcon:(NSImage *)newIcon {
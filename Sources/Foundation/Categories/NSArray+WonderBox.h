@@ -14,4 +14,14 @@
 
 - (BOOL)containsObjectIdenticalTo:(id)anObject;
 
+/* Key sort: the block returns a binary key for each object (for instance -[NSString collationKeyWithOptions:]),
+ and objects are sorted by comparing keys with memcmp(). Keys are computed concurrently,
+ so block must be thread safe. The sort is stable. */
+- (NSArray *)sortedArrayUsingCollationKeys:(NSData *(^)(id object))block;
+/* Same, but block is called with the sort value of each object (values[i] for the i-th object).
+ Use it when fetching the value is not thread safe (KVC, lazy properties): values are fetched by the caller. */
+- (NSArray *)sortedArrayWithValues:(NSArray *)values collationKeys:(NSData *(^)(id value))block;
+/* keyPath: nil to sort the strings themselves */
+- (NSArray *)sortedArrayUsingCollationKeyForKeyPath:(NSString *)keyPath options:(NSStringCompareOptions)options;
+
 @end
@@ -10,10 +10,93 @@
 
 #import <WonderBox/NSArray+WonderBox.h>
 
+#import <WonderBox/NSString+WonderBox.h>
+
+typedef struct _WBCollationItem {
+  uint64_t prefix; // first 8 bytes of the key (big endian)
+  const uint8_t *bytes;
+  size_t length;
+  NSUInteger index;
+} _WBCollationItem;
+
+static
+int _WBCollationItemCompare(const void *lhs, const void *rhs) {
+  const _WBCollationItem *i1 = lhs, *i2 = rhs;
+  if (i1->prefix != i2->prefix)
+    return i1->prefix < i2->prefix ? -1 : 1;
+  size_t length = MIN(i1->length, i2->length);
+  if (length > 8) {
+    int result = memcmp(i1->bytes + 8, i2->bytes + 8, length - 8);
+    if (result) return result;
+  }
+  if (i1->length != i2->length)
+    return i1->length < i2->length ? -1 : 1;
+  /* stable */
+  return i1->index < i2->index ? -1 : (i1->index > i2->index ? 1 : 0);
+}
+
 @implementation NSArray (WBExtensions)
 
 - (BOOL)containsObjectIdenticalTo:(id)anObject {
   return [self indexOfObjectIdenticalTo:anObject] != NSNotFound;
 }
 
+- (NSArray *)sortedArrayUsingCollationKeys:(NSData *(^)(id object))block {
+  return [self sortedArrayWithValues:self collationKeys:block];
+}
+
+- (NSArray *)sortedArrayWithValues:(NSArray *)sortValues collationKeys:(NSData *(^)(id value))block {
+  NSUInteger count = [self count];
+  NSParameterAssert([sortValues count] == count);
+  if (count < 2)
+    return [NSArray arrayWithArray:self];
+
+  id *objects = malloc(count * sizeof(*objects));
+  id *values = sortValues == self ? objects : malloc(count * sizeof(*values));
+  NSData **keys = calloc(count, sizeof(*keys));
+  _WBCollationItem *items = malloc(count * sizeof(*items));
+  [self getObjects:objects range:NSMakeRange(0, count)];
+  if (values != objects)
+    [sortValues getObjects:values range:NSMakeRange(0, count)];
+
+  const NSUInteger stride = 256;
+  dispatch_apply((count + stride - 1) / stride, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk) {
+    @autoreleasepool {
+      NSUInteger end = MIN(count, (chunk + 1) * stride);
+      for (NSUInteger idx = chunk * stride; idx < end; idx++) {
+        keys[idx] = [block(values[idx]) retain];
+        const uint8_t *bytes = [keys[idx] bytes];
+        size_t length = [keys[idx] length];
+        uint64_t prefix = 0;
+        for (size_t byte = 0; byte < 8; byte++)
+          prefix = (prefix << 8) | (byte < length ? bytes[byte] : 0);
+        items[idx] = (_WBCollationItem){ prefix, bytes, length, idx };
+      }
+    }
+  });
+  qsort(items, count, sizeof(*items), _WBCollationItemCompare);
+
+  id *sorted = malloc(count * sizeof(*sorted));
+  for (NSUInteger idx = 0; idx < count; idx++)
+    sorted[idx] = objects[items[idx].index];
+  NSArray *result = [NSArray arrayWithObjects:sorted count:count];
+
+  for (NSUInteger idx = 0; idx < count; idx++)
+    [keys[idx] release];
+  free(sorted);
+  free(items);
+  free(keys);
+  if (values != objects)
+    free(values);
+  free(objects);
+  return result;
+}
+
+- (NSArray *)sortedArrayUsingCollationKeyForKeyPath:(NSString *)keyPath options:(NSStringCompareOptions)options {
+  /* KVC is not thread safe: fetch the strings on this thread */
+  return [self sortedArrayWithValues:keyPath ? [self valueForKeyPath:keyPath] : self collationKeys:^NSData *(id str) {
+    return [str isKindOfClass:[NSString class]] ? [str collationKeyWithOptions:options] : [NSData data];
+  }];
+}
+
 @end
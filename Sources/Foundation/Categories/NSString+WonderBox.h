@@ -15,6 +15,12 @@
 - (BOOL)hasSuffixCaseInsensitive:(NSString *)aString;
 /* Case insensitive + numeric */
 - (NSComparisonResult)numericCompare:(NSString *)aString;
+
+/* Binary keys that order like -compare:options: (see WBTextCreateCollationKey()).
+ Supported options are NSCaseInsensitiveSearch, NSLiteralSearch and NSNumericSearch. */
+- (NSData *)collationKeyWithOptions:(NSStringCompareOptions)options;
+/* key ordered like -numericCompare: */
+- (NSData *)numericCollationKey;
 @end
 
 #pragma mark -
@@ -25,6 +31,8 @@
 
 #pragma mark -
 @interface NSString (WBLineUtilities)
+/* Line numbers start at 1. Each call scans the string up to the line,
+ use a WBTextLineIndexRef (WBTextFunctions.h) for repeated lookups. */
 - (NSRange)rangeOfLine:(NSUInteger)line;
 - (NSRange)rangeOfLine:(NSUInteger)line inRange:(NSRange)aRange;
 
@@ -10,6 +10,8 @@
 
 #import <WonderBox/NSString+WonderBox.h>
 
+#import <WonderBox/WBTextFunctions.h>
+
 @implementation NSString (WBStringComparaison)
 
 - (BOOL)hasPrefixCaseInsensitive:(NSString *)aString {
@@ -30,6 +32,17 @@
   return [self compare:aString options:NSNumericSearch | NSCaseInsensitiveSearch];
 }
 
+- (NSData *)collationKeyWithOptions:(NSStringCompareOptions)options {
+  CFStringCompareFlags flags = options & (NSCaseInsensitiveSearch | NSNumericSearch);
+  if (!(options & NSLiteralSearch))
+    flags |= kCFCompareNonliteral;
+  return SPXCFDataBridgingRelease(WBTextCreateCollationKey(kCFAllocatorDefault, SPXNSToCFString(self), flags));
+}
+
+- (NSData *)numericCollationKey {
+  return [self collationKeyWithOptions:NSNumericSearch | NSCaseInsensitiveSearch];
+}
+
 @end
 
 #pragma mark -
@@ -57,28 +70,18 @@
 }
 
 - (NSRange)rangeOfLine:(NSUInteger)line inRange:(NSRange)aRange {
-  NSRange range;
-  NSUInteger idx = 0;
-  NSUInteger lineNumber = 0;
   NSUInteger maximum = NSMaxRange(aRange);
   if (maximum > [self length])
 		SPXThrowException(NSRangeException, @"Range out of string limit.");
 
-  NSRange (*GetLineRange)(id, SEL, NSRange);
-  SEL selector = @selector(lineRangeForRange:);
-  GetLineRange = (NSRange(*)(id, SEL, NSRange))[self methodForSelector:selector];
-  NSAssert(GetLineRange, @"Error while getting %@", NSStringFromSelector(selector));
-
-  // Find start of the first selected line
-  do {
-    range = GetLineRange(self, selector, NSMakeRange(idx, 0));
-    idx = NSMaxRange(range);
-    lineNumber++;
-  } while (lineNumber < line && idx < maximum);
-  if (lineNumber < line) {
+  /* line numbers start at 1, and the first line always exists */
+  if (line <= 1)
+    return [self lineRangeForRange:NSMakeRange(0, 0)];
+
+  CFRange range = WBTextGetRangeOfLine(SPXNSToCFString(self), line - 1);
+  if (kCFNotFound == range.location || (NSUInteger)range.location >= maximum)
     return NSMakeRange(NSNotFound, 0);
-  }
-  return range;
+  return NSMakeRange(range.location, range.length);
 }
 
 - (NSString *)stringByTrimmingWhitespace {
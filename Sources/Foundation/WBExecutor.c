@@ -0,0 +1,753 @@
+/*
+ *  WBExecutor.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include <WonderBox/WBExecutor.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define kWBExecutorPriorityCount 3
+/* number of operations of a lane performed in a row by a worker before yielding */
+#define kWBExecutorLaneQuantum 16
+
+typedef struct _WBExecutorEvent {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+} WBExecutorEvent;
+
+typedef struct _WBExecutorItem {
+  struct _WBExecutorItem *next;
+  WBExecutorFunction function;
+  void *ctxt;
+  WBExecutorLaneRef lane;
+  WBExecutorGroupRef group;
+  /* synchronous operation */
+  WBExecutorEvent *event;
+  uint64_t time;
+  uint32_t generation;
+  uint8_t priority;
+  bool barrier;
+} WBExecutorItem;
+
+typedef struct _WBExecutorCounters {
+  _Atomic(uint64_t) submitted;
+  _Atomic(uint64_t) completed;
+  _Atomic(uint64_t) cancelled;
+  _Atomic(uint64_t) stolen;
+  _Atomic(uint64_t) maxDepth;
+  _Atomic(uint64_t) totalLatency;
+  _Atomic(uint64_t) maxLatency;
+} WBExecutorCounters;
+
+/* owner pushes and pops at the tail, thieves steal at the head */
+typedef struct _WBExecutorDeque {
+  pthread_mutex_t lock;
+  WBExecutorItem **items;
+  size_t head, tail; // tail - head = count
+  size_t capacity; // power of 2
+} WBExecutorDeque;
+
+typedef struct _WBExecutorWorker {
+  WBExecutorRef executor;
+  pthread_t thread;
+  size_t index;
+  uint32_t seed;
+  WBExecutorDeque deques[kWBExecutorPriorityCount];
+} WBExecutorWorker;
+
+struct __WBExecutor {
+  size_t count;
+  WBExecutorWorker *workers;
+  /* round robin for operations submitted outside the workers */
+  _Atomic(size_t) next;
+  /* operations pushed in the deques */
+  _Atomic(intptr_t) pending;
+  /* parking */
+  pthread_mutex_t park;
+  pthread_cond_t wakeup;
+  _Atomic(int) sleepers;
+  _Atomic(bool) stopping;
+
+  WBExecutorCounters counters;
+};
+
+struct __WBExecutorLane {
+  WBExecutorRef executor;
+  _Atomic(intptr_t) refcnt;
+  char *name;
+  uint8_t priority;
+  size_t width;
+  WBExecutorFunction cancel;
+  _Atomic(uint32_t) generation;
+
+  pthread_mutex_t lock;
+  WBExecutorItem *head, *tail;
+  size_t running;
+  bool barrier; // a barrier is running
+
+  WBExecutorCounters counters;
+};
+
+struct __WBExecutorGroup {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t count;
+  _Atomic(bool) cancelled;
+};
+
+static __thread WBExecutorWorker *sCurrentWorker = NULL;
+
+static void _WBExecutorPush(WBExecutorRef executor, WBExecutorItem *item);
+static void _WBExecutorLaneComplete(WBExecutorLaneRef lane, WBExecutorItem *item, unsigned quantum);
+
+// MARK: Utilities
+static inline
+uint64_t _WBExecutorNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline
+void _WBAtomicMax(_Atomic(uint64_t) *value, uint64_t candidate) {
+  uint64_t current = atomic_load_explicit(value, memory_order_relaxed);
+  while (candidate > current &&
+         !atomic_compare_exchange_weak_explicit(value, &current, candidate, memory_order_relaxed, memory_order_relaxed))
+    continue;
+}
+
+static
+void _WBExecutorCountersSubmit(WBExecutorCounters *counters) {
+  uint64_t submitted = atomic_fetch_add_explicit(&counters->submitted, 1, memory_order_relaxed) + 1;
+  uint64_t done = atomic_load_explicit(&counters->completed, memory_order_relaxed) +
+    atomic_load_explicit(&counters->cancelled, memory_order_relaxed);
+  if (submitted > done)
+    _WBAtomicMax(&counters->maxDepth, submitted - done);
+}
+
+static
+void _WBExecutorCountersStart(WBExecutorCounters *counters, uint64_t latency) {
+  atomic_fetch_add_explicit(&counters->totalLatency, latency, memory_order_relaxed);
+  _WBAtomicMax(&counters->maxLatency, latency);
+}
+
+static
+void _WBExecutorCountersGet(WBExecutorCounters *counters, WBExecutorStatistics *stats) {
+  stats->submitted = atomic_load_explicit(&counters->submitted, memory_order_relaxed);
+  stats->completed = atomic_load_explicit(&counters->completed, memory_order_relaxed);
+  stats->cancelled = atomic_load_explicit(&counters->cancelled, memory_order_relaxed);
+  stats->stolen = atomic_load_explicit(&counters->stolen, memory_order_relaxed);
+  stats->maxDepth = atomic_load_explicit(&counters->maxDepth, memory_order_relaxed);
+  stats->totalLatency = atomic_load_explicit(&counters->totalLatency, memory_order_relaxed);
+  stats->maxLatency = atomic_load_explicit(&counters->maxLatency, memory_order_relaxed);
+  uint64_t done = stats->completed + stats->cancelled;
+  stats->depth = stats->submitted > done ? stats->submitted - done : 0;
+}
+
+static
+void _WBExecutorEventInit(WBExecutorEvent *event) {
+  pthread_mutex_init(&event->lock, NULL);
+  pthread_cond_init(&event->cond, NULL);
+  event->done = false;
+}
+
+static
+void _WBExecutorEventWait(WBExecutorEvent *event) {
+  pthread_mutex_lock(&event->lock);
+  while (!event->done)
+    pthread_cond_wait(&event->cond, &event->lock);
+  pthread_mutex_unlock(&event->lock);
+  pthread_cond_destroy(&event->cond);
+  pthread_mutex_destroy(&event->lock);
+}
+
+static
+void _WBExecutorEventSignal(WBExecutorEvent *event) {
+  pthread_mutex_lock(&event->lock);
+  event->done = true;
+  pthread_cond_signal(&event->cond);
+  pthread_mutex_unlock(&event->lock);
+}
+
+static
+void _WBExecutorGroupEnter(WBExecutorGroupRef group) {
+  pthread_mutex_lock(&group->lock);
+  group->count++;
+  pthread_mutex_unlock(&group->lock);
+}
+
+static
+void _WBExecutorGroupLeave(WBExecutorGroupRef group) {
+  pthread_mutex_lock(&group->lock);
+  if (0 == --group->count)
+    pthread_cond_broadcast(&group->cond);
+  pthread_mutex_unlock(&group->lock);
+}
+
+// MARK: Deque
+static
+int _WBExecutorDequeInit(WBExecutorDeque *deque) {
+  deque->head = deque->tail = 0;
+  deque->capacity = 64;
+  deque->items = malloc(deque->capacity * sizeof(*deque->items));
+  if (!deque->items)
+    return ENOMEM;
+  pthread_mutex_init(&deque->lock, NULL);
+  return 0;
+}
+
+static
+void _WBExecutorDequeDestroy(WBExecutorDeque *deque) {
+  pthread_mutex_destroy(&deque->lock);
+  free(deque->items);
+}
+
+static
+int _WBExecutorDequePush(WBExecutorDeque *deque, WBExecutorItem *item) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail - deque->head == deque->capacity) {
+    WBExecutorItem **items = malloc(2 * deque->capacity * sizeof(*items));
+    if (!items) {
+      pthread_mutex_unlock(&deque->lock);
+      return ENOMEM;
+    }
+    for (size_t idx = deque->head; idx < deque->tail; idx++)
+      items[idx - deque->head] = deque->items[idx & (deque->capacity - 1)];
+    free(deque->items);
+    deque->items = items;
+    deque->tail -= deque->head;
+    deque->head = 0;
+    deque->capacity *= 2;
+  }
+  deque->items[deque->tail++ & (deque->capacity - 1)] = item;
+  pthread_mutex_unlock(&deque->lock);
+  return 0;
+}
+
+static
+WBExecutorItem *_WBExecutorDequePop(WBExecutorDeque *deque, bool steal) {
+  WBExecutorItem *item = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail != deque->head) {
+    if (steal)
+      item = deque->items[deque->head++ & (deque->capacity - 1)];
+    else
+      item = deque->items[--deque->tail & (deque->capacity - 1)];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return item;
+}
+
+// MARK: Operations
+static
+WBExecutorItem *_WBExecutorItemCreate(WBExecutorGroupRef group, WBExecutorFunction function, void *ctxt) {
+  WBExecutorItem *item = calloc(1, sizeof(*item));
+  if (item) {
+    item->group = group;
+    item->function = function;
+    item->ctxt = ctxt;
+    item->time = _WBExecutorNow();
+  }
+  return item;
+}
+
+static
+bool _WBExecutorItemIsCancelled(WBExecutorItem *item) {
+  if (item->group && atomic_load_explicit(&item->group->cancelled, memory_order_relaxed))
+    return true;
+  return item->lane && item->generation != atomic_load_explicit(&item->lane->generation, memory_order_relaxed);
+}
+
+/* perform the operation, without lane bookkeeping */
+static
+void _WBExecutorItemPerform(WBExecutorRef executor, WBExecutorItem *item) {
+  WBExecutorCounters *lcounters = item->lane ? &item->lane->counters : NULL;
+  if (_WBExecutorItemIsCancelled(item)) {
+    if (item->lane && item->lane->cancel)
+      item->lane->cancel(item->ctxt);
+    atomic_fetch_add_explicit(&executor->counters.cancelled, 1, memory_order_relaxed);
+    if (lcounters)
+      atomic_fetch_add_explicit(&lcounters->cancelled, 1, memory_order_relaxed);
+  } else {
+    uint64_t now = _WBExecutorNow();
+    uint64_t latency = now > item->time ? now - item->time : 0;
+    _WBExecutorCountersStart(&executor->counters, latency);
+    if (lcounters)
+      _WBExecutorCountersStart(lcounters, latency);
+
+    item->function(item->ctxt);
+
+    atomic_fetch_add_explicit(&executor->counters.completed, 1, memory_order_relaxed);
+    if (lcounters)
+      atomic_fetch_add_explicit(&lcounters->completed, 1, memory_order_relaxed);
+  }
+  if (item->group)
+    _WBExecutorGroupLeave(item->group);
+  if (item->event)
+    _WBExecutorEventSignal(item->event);
+}
+
+static
+void _WBExecutorRun(WBExecutorRef executor, WBExecutorItem *item) {
+  _WBExecutorItemPerform(executor, item);
+  if (item->lane) {
+    _WBExecutorLaneComplete(item->lane, item, 0);
+  } else {
+    free(item);
+  }
+}
+
+// MARK: Workers
+static
+WBExecutorItem *_WBExecutorFindWork(WBExecutorWorker *worker) {
+  WBExecutorRef executor = worker->executor;
+  for (size_t priority = 0; priority < kWBExecutorPriorityCount; priority++) {
+    WBExecutorItem *item = _WBExecutorDequePop(&worker->deques[priority], false);
+    if (item)
+      return item;
+    /* steal the oldest operation of an other worker, starting at a random victim */
+    worker->seed = worker->seed * 1103515245 + 12345;
+    size_t start = (worker->seed >> 16) % executor->count;
+    for (size_t idx = 0; idx < executor->count; idx++) {
+      WBExecutorWorker *victim = &executor->workers[(start + idx) % executor->count];
+      if (victim == worker)
+        continue;
+      item = _WBExecutorDequePop(&victim->deques[priority], true);
+      if (item) {
+        atomic_fetch_add_explicit(&executor->counters.stolen, 1, memory_order_relaxed);
+        return item;
+      }
+    }
+  }
+  return NULL;
+}
+
+static
+void *_WBExecutorWorkerMain(void *arg) {
+  WBExecutorWorker *worker = (WBExecutorWorker *)arg;
+  WBExecutorRef executor = worker->executor;
+  sCurrentWorker = worker;
+  for (;;) {
+    WBExecutorItem *item = _WBExecutorFindWork(worker);
+    if (item) {
+      atomic_fetch_sub(&executor->pending, 1);
+      _WBExecutorRun(executor, item);
+      continue;
+    }
+    /* nothing to do: park.
+     sleepers is incremented before pending is checked, and submitters increment pending before
+     checking sleepers, so a wake up cannot be lost. */
+    pthread_mutex_lock(&executor->park);
+    atomic_fetch_add(&executor->sleepers, 1);
+    while (atomic_load(&executor->pending) <= 0 && !atomic_load(&executor->stopping))
+      pthread_cond_wait(&executor->wakeup, &executor->park);
+    atomic_fetch_sub(&executor->sleepers, 1);
+    bool stop = atomic_load(&executor->pending) <= 0 && atomic_load(&executor->stopping);
+    pthread_mutex_unlock(&executor->park);
+    if (stop)
+      break;
+  }
+  sCurrentWorker = NULL;
+  return NULL;
+}
+
+static
+void _WBExecutorPush(WBExecutorRef executor, WBExecutorItem *item) {
+  WBExecutorWorker *worker = sCurrentWorker;
+  if (!worker || worker->executor != executor)
+    worker = &executor->workers[atomic_fetch_add_explicit(&executor->next, 1, memory_order_relaxed) % executor->count];
+
+  while (0 != _WBExecutorDequePush(&worker->deques[item->priority], item))
+    sched_yield(); // out of memory: wait for the deque to shrink
+
+  atomic_fetch_add(&executor->pending, 1);
+  if (atomic_load(&executor->sleepers) > 0) {
+    pthread_mutex_lock(&executor->park);
+    pthread_cond_signal(&executor->wakeup);
+    pthread_mutex_unlock(&executor->park);
+  }
+}
+
+// MARK: Executor
+static
+void _WBExecutorDeallocate(WBExecutorRef executor) {
+  for (size_t idx = 0; idx < executor->count; idx++)
+    for (size_t priority = 0; priority < kWBExecutorPriorityCount; priority++)
+      _WBExecutorDequeDestroy(&executor->workers[idx].deques[priority]);
+  pthread_cond_destroy(&executor->wakeup);
+  pthread_mutex_destroy(&executor->park);
+  free(executor->workers);
+  free(executor);
+}
+
+WBExecutorRef WBExecutorCreate(size_t workers) {
+  if (0 == workers) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = ncpu > 0 ? (size_t)ncpu : 1;
+  }
+  WBExecutorRef executor = calloc(1, sizeof(*executor));
+  if (!executor)
+    return NULL;
+  executor->workers = calloc(workers, sizeof(*executor->workers));
+  if (!executor->workers) {
+    free(executor);
+    return NULL;
+  }
+  pthread_mutex_init(&executor->park, NULL);
+  pthread_cond_init(&executor->wakeup, NULL);
+
+  /* initialize all deques before starting any worker, as workers steal from each other */
+  for (size_t idx = 0; idx < workers; idx++) {
+    WBExecutorWorker *worker = &executor->workers[idx];
+    worker->executor = executor;
+    worker->index = idx;
+    worker->seed = (uint32_t)(idx * 2654435761u + 1);
+    for (size_t priority = 0; priority < kWBExecutorPriorityCount; priority++) {
+      if (0 != _WBExecutorDequeInit(&worker->deques[priority])) {
+        while (priority-- > 0)
+          _WBExecutorDequeDestroy(&worker->deques[priority]);
+        _WBExecutorDeallocate(executor);
+        return NULL;
+      }
+    }
+    executor->count++;
+  }
+  /* the worker count must be final before starting the workers */
+  size_t started = 0;
+  for (; started < workers; started++) {
+    /* pthread_create() returns the error, and does not set errno */
+    int err = pthread_create(&executor->workers[started].thread, NULL, _WBExecutorWorkerMain, &executor->workers[started]);
+    if (0 != err) {
+      spx_log_warning("pthread_create: %s", strerror(err));
+      break;
+    }
+  }
+  if (started < workers) {
+    /* stop the started workers */
+    WBExecutorDestroy(executor);
+    return NULL;
+  }
+  return executor;
+}
+
+void WBExecutorDestroy(WBExecutorRef executor) {
+  if (!executor)
+    return;
+
+  pthread_mutex_lock(&executor->park);
+  atomic_store(&executor->stopping, true);
+  pthread_cond_broadcast(&executor->wakeup);
+  pthread_mutex_unlock(&executor->park);
+
+  for (size_t idx = 0; idx < executor->count; idx++) {
+    if (executor->workers[idx].thread)
+      pthread_join(executor->workers[idx].thread, NULL);
+  }
+  _WBExecutorDeallocate(executor);
+}
+
+static WBExecutorRef sDefaultExecutor = NULL;
+static pthread_once_t sDefaultExecutorOnce = PTHREAD_ONCE_INIT;
+
+static
+void _WBExecutorCreateDefault(void) {
+  sDefaultExecutor = WBExecutorCreate(0);
+}
+
+WBExecutorRef WBExecutorGetDefault(void) {
+  pthread_once(&sDefaultExecutorOnce, _WBExecutorCreateDefault);
+  return sDefaultExecutor;
+}
+
+size_t WBExecutorGetCountOfWorkers(WBExecutorRef executor) {
+  return executor->count;
+}
+
+int WBExecutorAsync(WBExecutorRef executor, WBExecutorGroupRef group, WBExecutorPriority priority,
+                    WBExecutorFunction function, void *ctxt) {
+  if (!function || priority < 0 || priority >= kWBExecutorPriorityCount)
+    return EINVAL;
+  WBExecutorItem *item = _WBExecutorItemCreate(group, function, ctxt);
+  if (!item)
+    return ENOMEM;
+  item->priority = (uint8_t)priority;
+  if (group)
+    _WBExecutorGroupEnter(group);
+  _WBExecutorCountersSubmit(&executor->counters);
+  _WBExecutorPush(executor, item);
+  return 0;
+}
+
+void WBExecutorGetStatistics(WBExecutorRef executor, WBExecutorStatistics *stats) {
+  _WBExecutorCountersGet(&executor->counters, stats);
+}
+
+// MARK: Lanes
+WBExecutorLaneRef WBExecutorLaneCreate(WBExecutorRef executor, const char *name, WBExecutorPriority priority, size_t width) {
+  if (!executor || priority < 0 || priority >= kWBExecutorPriorityCount)
+    return NULL;
+  WBExecutorLaneRef lane = calloc(1, sizeof(*lane));
+  if (!lane)
+    return NULL;
+  lane->name = name ? strdup(name) : NULL;
+  lane->executor = executor;
+  lane->priority = (uint8_t)priority;
+  lane->width = width ? width : SIZE_MAX;
+  atomic_init(&lane->refcnt, 1);
+  pthread_mutex_init(&lane->lock, NULL);
+  return lane;
+}
+
+WBExecutorLaneRef WBExecutorLaneRetain(WBExecutorLaneRef lane) {
+  atomic_fetch_add_explicit(&lane->refcnt, 1, memory_order_relaxed);
+  return lane;
+}
+
+void WBExecutorLaneRelease(WBExecutorLaneRef lane) {
+  if (1 == atomic_fetch_sub_explicit(&lane->refcnt, 1, memory_order_acq_rel)) {
+    pthread_mutex_destroy(&lane->lock);
+    free(lane->name);
+    free(lane);
+  }
+}
+
+const char *WBExecutorLaneGetName(WBExecutorLaneRef lane) {
+  return lane->name;
+}
+
+void WBExecutorLaneSetCancelFunction(WBExecutorLaneRef lane, WBExecutorFunction function) {
+  lane->cancel = function;
+}
+
+/* lane must be locked. Returns the next operation allowed to run. */
+static
+WBExecutorItem *_WBExecutorLaneDequeue(WBExecutorLaneRef lane) {
+  WBExecutorItem *item = lane->head;
+  if (!item || lane->barrier)
+    return NULL;
+  if (item->barrier ? lane->running > 0 : lane->running >= lane->width)
+    return NULL;
+
+  lane->head = item->next;
+  if (!lane->head)
+    lane->tail = NULL;
+  item->next = NULL;
+  lane->running++;
+  if (item->barrier)
+    lane->barrier = true;
+  return item;
+}
+
+/* lane must be locked. Schedule the operations allowed to run, and returns the first one. */
+static
+WBExecutorItem *_WBExecutorLaneSchedule(WBExecutorLaneRef lane, WBExecutorItem **others) {
+  WBExecutorItem *first = _WBExecutorLaneDequeue(lane);
+  WBExecutorItem *last = NULL;
+  *others = NULL;
+  if (first) {
+    WBExecutorItem *item;
+    while ((item = _WBExecutorLaneDequeue(lane))) {
+      if (last) last->next = item; else *others = item;
+      last = item;
+    }
+  }
+  return first;
+}
+
+static
+void _WBExecutorLanePushAll(WBExecutorLaneRef lane, WBExecutorItem *items) {
+  while (items) {
+    WBExecutorItem *next = items->next;
+    items->next = NULL;
+    _WBExecutorPush(lane->executor, items);
+    items = next;
+  }
+}
+
+/* called once the operation is performed */
+static
+void _WBExecutorLaneComplete(WBExecutorLaneRef lane, WBExecutorItem *item, unsigned quantum) {
+  for (;;) {
+    WBExecutorItem *others = NULL;
+    pthread_mutex_lock(&lane->lock);
+    lane->running--;
+    if (item->barrier)
+      lane->barrier = false;
+    WBExecutorItem *next = _WBExecutorLaneSchedule(lane, &others);
+    pthread_mutex_unlock(&lane->lock);
+
+    /* the completed operation retains the lane, so it is alive until now */
+    free(item);
+    _WBExecutorLanePushAll(lane, others);
+    if (!next) {
+      WBExecutorLaneRelease(lane);
+      return;
+    }
+    /* serial lane fast path: continue on this worker for a while, then yield to other operations */
+    if (++quantum >= kWBExecutorLaneQuantum || !sCurrentWorker || sCurrentWorker->executor != lane->executor) {
+      _WBExecutorPush(lane->executor, next);
+      WBExecutorLaneRelease(lane);
+      return;
+    }
+    WBExecutorLaneRelease(lane);
+    item = next;
+    _WBExecutorItemPerform(lane->executor, item);
+  }
+}
+
+static
+WBExecutorItem *_WBExecutorLaneCreateItem(WBExecutorLaneRef lane, WBExecutorGroupRef group,
+                                          WBExecutorFunction function, void *ctxt, bool barrier) {
+  WBExecutorItem *item = _WBExecutorItemCreate(group, function, ctxt);
+  if (item) {
+    item->lane = WBExecutorLaneRetain(lane);
+    item->barrier = barrier;
+    item->priority = lane->priority;
+    item->generation = atomic_load_explicit(&lane->generation, memory_order_relaxed);
+    if (group)
+      _WBExecutorGroupEnter(group);
+    _WBExecutorCountersSubmit(&lane->executor->counters);
+    _WBExecutorCountersSubmit(&lane->counters);
+  }
+  return item;
+}
+
+static
+void _WBExecutorLaneEnqueue(WBExecutorLaneRef lane, WBExecutorItem *item) {
+  WBExecutorItem *others = NULL;
+  pthread_mutex_lock(&lane->lock);
+  if (lane->tail) lane->tail->next = item; else lane->head = item;
+  lane->tail = item;
+  WBExecutorItem *first = _WBExecutorLaneSchedule(lane, &others);
+  pthread_mutex_unlock(&lane->lock);
+  if (first) {
+    first->next = others;
+    _WBExecutorLanePushAll(lane, first);
+  }
+}
+
+static
+int _WBExecutorLaneAsync(WBExecutorLaneRef lane, WBExecutorGroupRef group, WBExecutorFunction function, void *ctxt, bool barrier) {
+  if (!function)
+    return EINVAL;
+  WBExecutorItem *item = _WBExecutorLaneCreateItem(lane, group, function, ctxt, barrier);
+  if (!item)
+    return ENOMEM;
+  _WBExecutorLaneEnqueue(lane, item);
+  return 0;
+}
+
+int WBExecutorLaneAsync(WBExecutorLaneRef lane, WBExecutorGroupRef group, WBExecutorFunction function, void *ctxt) {
+  return _WBExecutorLaneAsync(lane, group, function, ctxt, false);
+}
+
+int WBExecutorLaneBarrierAsync(WBExecutorLaneRef lane, WBExecutorGroupRef group, WBExecutorFunction function, void *ctxt) {
+  return _WBExecutorLaneAsync(lane, group, function, ctxt, true);
+}
+
+static
+int _WBExecutorLaneSync(WBExecutorLaneRef lane, WBExecutorFunction function, void *ctxt, bool barrier) {
+  if (!function)
+    return EINVAL;
+  WBExecutorItem *item = _WBExecutorLaneCreateItem(lane, NULL, function, ctxt, barrier);
+  if (!item)
+    return ENOMEM;
+
+  /* fast path: the lane is idle, run on the calling thread */
+  pthread_mutex_lock(&lane->lock);
+  bool inlined = !lane->head && !lane->barrier && (barrier ? lane->running == 0 : lane->running < lane->width);
+  if (inlined) {
+    lane->running++;
+    lane->barrier = barrier;
+  }
+  pthread_mutex_unlock(&lane->lock);
+  if (inlined) {
+    _WBExecutorItemPerform(lane->executor, item);
+    _WBExecutorLaneComplete(lane, item, kWBExecutorLaneQuantum);
+    return 0;
+  }
+
+  WBExecutorEvent event;
+  _WBExecutorEventInit(&event);
+  item->event = &event;
+  _WBExecutorLaneEnqueue(lane, item);
+  _WBExecutorEventWait(&event);
+  return 0;
+}
+
+int WBExecutorLaneSync(WBExecutorLaneRef lane, WBExecutorFunction function, void *ctxt) {
+  return _WBExecutorLaneSync(lane, function, ctxt, false);
+}
+
+int WBExecutorLaneBarrierSync(WBExecutorLaneRef lane, WBExecutorFunction function, void *ctxt) {
+  return _WBExecutorLaneSync(lane, function, ctxt, true);
+}
+
+void WBExecutorLaneCancel(WBExecutorLaneRef lane) {
+  atomic_fetch_add_explicit(&lane->generation, 1, memory_order_relaxed);
+}
+
+void WBExecutorLaneGetStatistics(WBExecutorLaneRef lane, WBExecutorStatistics *stats) {
+  _WBExecutorCountersGet(&lane->counters, stats);
+}
+
+// MARK: Groups
+WBExecutorGroupRef WBExecutorGroupCreate(void) {
+  WBExecutorGroupRef group = calloc(1, sizeof(*group));
+  if (group) {
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->cond, NULL);
+  }
+  return group;
+}
+
+void WBExecutorGroupFree(WBExecutorGroupRef group) {
+  if (!group)
+    return;
+  pthread_cond_destroy(&group->cond);
+  pthread_mutex_destroy(&group->lock);
+  free(group);
+}
+
+bool WBExecutorGroupWait(WBExecutorGroupRef group, uint64_t timeout) {
+  struct timespec deadline;
+  if (timeout) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t nsec = (uint64_t)deadline.tv_nsec + timeout;
+    deadline.tv_sec += (time_t)(nsec / 1000000000ULL);
+    deadline.tv_nsec = (long)(nsec % 1000000000ULL);
+  }
+  pthread_mutex_lock(&group->lock);
+  while (group->count > 0) {
+    if (timeout) {
+      if (ETIMEDOUT == pthread_cond_timedwait(&group->cond, &group->lock, &deadline))
+        break;
+    } else {
+      pthread_cond_wait(&group->cond, &group->lock);
+    }
+  }
+  bool done = 0 == group->count;
+  pthread_mutex_unlock(&group->lock);
+  return done;
+}
+
+void WBExecutorGroupCancel(WBExecutorGroupRef group) {
+  atomic_store(&group->cancelled, true);
+}
+
+bool WBExecutorGroupIsCancelled(WBExecutorGroupRef group) {
+  return atomic_load(&group->cancelled);
+}
@@ -0,0 +1,141 @@
+/*
+ *  WBExecutor.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#if !defined(__WB_EXECUTOR_H)
+#define __WB_EXECUTOR_H 1
+
+#include <WonderBox/WBBase.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*!
+ @header WBExecutor
+ @abstract Work stealing thread pool.
+ @discussion The executor runs a fixed number of pthread workers. Each worker owns a deque per priority.
+ A worker pops its own operations in LIFO order, and steals the oldest operations of the other workers
+ when it has nothing left to do.
+ Lanes are FIFO queues mapped on the pool, without dedicated thread. A lane runs at most 'width' operations
+ at once (1 for a serial lane). A barrier operation waits the completion of the running operations of its
+ lane, and runs alone.
+ Only pthread is required, so the executor can be used on any POSIX system.
+ Functions that return an int return 0 on success, or an errno value.
+ */
+
+__BEGIN_DECLS
+
+typedef struct __WBExecutor *WBExecutorRef;
+typedef struct __WBExecutorLane *WBExecutorLaneRef;
+typedef struct __WBExecutorGroup *WBExecutorGroupRef;
+
+typedef void (*WBExecutorFunction)(void *ctxt);
+
+typedef enum {
+  kWBExecutorPriorityHigh = 0,
+  kWBExecutorPriorityDefault = 1,
+  kWBExecutorPriorityLow = 2,
+} WBExecutorPriority;
+
+typedef struct {
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t cancelled;
+  /* operations taken from an other worker deque (executor only) */
+  uint64_t stolen;
+  /* pending operations (queued or running) */
+  uint64_t depth;
+  uint64_t maxDepth;
+  /* time between submission and execution, in nanoseconds */
+  uint64_t totalLatency;
+  uint64_t maxLatency;
+} WBExecutorStatistics;
+
+// MARK: Executor
+/* workers: 0 to use the number of active CPUs */
+WB_EXPORT
+WBExecutorRef WBExecutorCreate(size_t workers);
+/* Wait the completion of all pending operations, and join the workers.
+ Nothing must be submitted once this function is called. */
+WB_EXPORT
+void WBExecutorDestroy(WBExecutorRef executor);
+
+/* Shared executor. Never destroyed. */
+WB_EXPORT
+WBExecutorRef WBExecutorGetDefault(void);
+
+WB_EXPORT
+size_t WBExecutorGetCountOfWorkers(WBExecutorRef executor);
+
+/* group can be NULL */
+WB_EXPORT
+int WBExecutorAsync(WBExecutorRef executor, WBExecutorGroupRef group, WBExecutorPriority priority,
+                    WBExecutorFunction function, void *ctxt);
+
+WB_EXPORT
+void WBExecutorGetStatistics(WBExecutorRef executor, WBExecutorStatistics *stats);
+
+// MARK: Lanes
+/* width: maximum number of concurrent operations. 1 for a serial lane, 0 for no limit. */
+WB_EXPORT
+WBExecutorLaneRef WBExecutorLaneCreate(WBExecutorRef executor, const char *name, WBExecutorPriority priority, size_t width);
+
+/* pending operations retain the lane */
+WB_EXPORT
+WBExecutorLaneRef WBExecutorLaneRetain(WBExecutorLaneRef lane);
+WB_EXPORT
+void WBExecutorLaneRelease(WBExecutorLaneRef lane);
+
+WB_EXPORT
+const char *WBExecutorLaneGetName(WBExecutorLaneRef lane);
+
+/* Called with the context of each discarded operation, so it can be released. */
+WB_EXPORT
+void WBExecutorLaneSetCancelFunction(WBExecutorLaneRef lane, WBExecutorFunction function);
+
+WB_EXPORT
+int WBExecutorLaneAsync(WBExecutorLaneRef lane, WBExecutorGroupRef group, WBExecutorFunction function, void *ctxt);
+WB_EXPORT
+int WBExecutorLaneBarrierAsync(WBExecutorLaneRef lane, WBExecutorGroupRef group, WBExecutorFunction function, void *ctxt);
+
+/* Run the function on the calling thread when the lane is idle.
+ Must not be called from an operation of the same lane. */
+WB_EXPORT
+int WBExecutorLaneSync(WBExecutorLaneRef lane, WBExecutorFunction function, void *ctxt);
+WB_EXPORT
+int WBExecutorLaneBarrierSync(WBExecutorLaneRef lane, WBExecutorFunction function, void *ctxt);
+
+/* Discard the operations not started yet. Their group is left as if they were performed. */
+WB_EXPORT
+void WBExecutorLaneCancel(WBExecutorLaneRef lane);
+
+WB_EXPORT
+void WBExecutorLaneGetStatistics(WBExecutorLaneRef lane, WBExecutorStatistics *stats);
+
+// MARK: Groups
+WB_EXPORT
+WBExecutorGroupRef WBExecutorGroupCreate(void);
+/* the group must not have pending operations */
+WB_EXPORT
+void WBExecutorGroupFree(WBExecutorGroupRef group);
+
+/* timeout in nanoseconds, 0 to wait forever. Returns false if the timeout expired. */
+WB_EXPORT
+bool WBExecutorGroupWait(WBExecutorGroupRef group, uint64_t timeout);
+
+/* Discard the group operations not started yet, and the ones submitted later. */
+WB_EXPORT
+void WBExecutorGroupCancel(WBExecutorGroupRef group);
+WB_EXPORT
+bool WBExecutorGroupIsCancelled(WBExecutorGroupRef group);
+
+__END_DECLS
+
+#endif /* __WB_EXECUTOR_H */
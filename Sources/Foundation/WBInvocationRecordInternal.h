@@ -0,0 +1,88 @@
+/*
+ *  WBInvocationRecordInternal.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <WonderBox/WBBase.h>
+
+#import <Foundation/Foundation.h>
+
+#include <stdatomic.h>
+#include <dispatch/dispatch.h>
+
+/* Fixed size invocation records, used by WBThreadPort and WBSerialQueue.
+ Records are recycled using a free list per thread. A record can be disposed
+ by any thread, and is then returned to the pool of the thread that created it. */
+typedef struct _WBInvocationRecord WBInvocationRecord;
+
+struct _WBInvocationRecord {
+  WBInvocationRecord *next;
+  struct _WBInvocationPool *pool;
+
+  /* payload (retained): an invocation, a function, or a target/action/argument call */
+  void *invocation;
+  void (*function)(void *ctxt);
+  void *context;
+  void *target;
+  SEL action;
+  void *argument;
+
+  /* owner defined */
+  void *owner;
+  uint32_t generation;
+
+  /* synchronous call */
+  void *exception;
+  dispatch_semaphore_t semaphore;
+  _Atomic(bool) done;
+  _Atomic(int32_t) refcnt;
+};
+
+/* returns a cleared record, with a refcnt of 1 */
+WB_PRIVATE
+WBInvocationRecord *WBInvocationRecordCreate(void);
+
+/* release the payload and recycle the record if refcnt drops to 0 */
+WB_PRIVATE
+void WBInvocationRecordRelease(WBInvocationRecord *record);
+
+WB_INLINE
+WBInvocationRecord *WBInvocationRecordCreateWithInvocation(NSInvocation *anInvocation) {
+  WBInvocationRecord *record = WBInvocationRecordCreate();
+  record->invocation = (__bridge void *)spx_retain(anInvocation);
+  return record;
+}
+
+WB_INLINE
+WBInvocationRecord *WBInvocationRecordCreateWithSelector(SEL anAction, id aTarget, id anArgument) {
+  WBInvocationRecord *record = WBInvocationRecordCreate();
+  record->target = (__bridge void *)spx_retain(aTarget);
+  record->action = anAction;
+  record->argument = (__bridge void *)spx_retain(anArgument);
+  return record;
+}
+
+WB_INLINE
+WBInvocationRecord *WBInvocationRecordCreateWithFunction(void (*function)(void *), void *ctxt) {
+  WBInvocationRecord *record = WBInvocationRecordCreate();
+  record->function = function;
+  record->context = ctxt;
+  return record;
+}
+
+/* Performs the record payload. Does not catch exceptions. */
+WB_PRIVATE
+void WBInvocationRecordInvoke(WBInvocationRecord *record);
+
+/* Returns a retained exception, or nil. */
+WB_PRIVATE
+id WBInvocationRecordInvokeAndCatch(WBInvocationRecord *record);
+
+/* for logging purpose */
+WB_PRIVATE
+NSString *WBInvocationRecordGetDescription(WBInvocationRecord *record);
@@ -0,0 +1,197 @@
+/*
+ *  WBInvocationRecordInternal.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import "WBInvocationRecordInternal.h"
+
+#include <pthread.h>
+#include <objc/message.h>
+
+/* maximum number of cached records per thread */
+#define kWBInvocationPoolMaxCount 1024
+
+/* the remote list is closed when the owner thread exits */
+#define kWBInvocationPoolClosed ((WBInvocationRecord *)(intptr_t)1)
+
+typedef struct _WBInvocationPool {
+  /* owner thread only */
+  WBInvocationRecord *free;
+  size_t count;
+  /* records disposed by other threads */
+  _Atomic(WBInvocationRecord *) remote;
+  /* owner thread + allocated records */
+  _Atomic(intptr_t) refcnt;
+} WBInvocationPool;
+
+static pthread_key_t sInvocationPoolKey;
+static pthread_once_t sInvocationPoolOnce = PTHREAD_ONCE_INIT;
+
+static
+void _WBInvocationPoolRelease(WBInvocationPool *pool) {
+  if (1 == atomic_fetch_sub_explicit(&pool->refcnt, 1, memory_order_acq_rel))
+    free(pool);
+}
+
+static
+void _WBInvocationPoolDeallocate(WBInvocationRecord *record) {
+  WBInvocationPool *pool = record->pool;
+  free(record);
+  _WBInvocationPoolRelease(pool);
+}
+
+static
+void _WBInvocationPoolDestructor(void *ptr) {
+  WBInvocationPool *pool = (WBInvocationPool *)ptr;
+  /* close the remote list: records disposed later are freed by the disposing thread */
+  WBInvocationRecord *record = atomic_exchange_explicit(&pool->remote, kWBInvocationPoolClosed, memory_order_acquire);
+  while (record) {
+    WBInvocationRecord *next = record->next;
+    _WBInvocationPoolDeallocate(record);
+    record = next;
+  }
+  record = pool->free;
+  while (record) {
+    WBInvocationRecord *next = record->next;
+    _WBInvocationPoolDeallocate(record);
+    record = next;
+  }
+  _WBInvocationPoolRelease(pool);
+}
+
+static
+void _WBInvocationPoolInitialize(void) {
+  verify(0 == pthread_key_create(&sInvocationPoolKey, _WBInvocationPoolDestructor));
+}
+
+static
+WBInvocationPool *_WBInvocationPoolGetCurrent(void) {
+  WBInvocationPool *pool = pthread_getspecific(sInvocationPoolKey);
+  if (!pool) {
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+      return NULL;
+    atomic_init(&pool->refcnt, 1);
+    if (0 != pthread_setspecific(sInvocationPoolKey, pool)) {
+      spx_debug("pthread_setspecific error");
+      free(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+WBInvocationRecord *WBInvocationRecordCreate(void) {
+  pthread_once(&sInvocationPoolOnce, _WBInvocationPoolInitialize);
+  WBInvocationPool *pool = _WBInvocationPoolGetCurrent();
+  if (!pool)
+    SPXThrowException(NSMallocException, @"cannot allocate invocation pool");
+
+  WBInvocationRecord *record = pool->free;
+  if (!record) {
+    /* take back the records disposed by other threads */
+    record = atomic_exchange_explicit(&pool->remote, NULL, memory_order_acquire);
+    pool->count = 0;
+    for (WBInvocationRecord *iter = record; iter; iter = iter->next)
+      pool->count++;
+  }
+  if (record) {
+    pool->free = record->next;
+    pool->count--;
+  } else {
+    record = malloc(sizeof(*record));
+    if (!record)
+      SPXThrowException(NSMallocException, @"cannot allocate invocation record");
+    atomic_fetch_add_explicit(&pool->refcnt, 1, memory_order_relaxed);
+  }
+  memset(record, 0, sizeof(*record));
+  record->pool = pool;
+  atomic_init(&record->refcnt, 1);
+  return record;
+}
+
+static
+void _WBInvocationRecordRecycle(WBInvocationRecord *record) {
+  WBInvocationPool *pool = record->pool;
+  if (pool == pthread_getspecific(sInvocationPoolKey)) {
+    if (pool->count >= kWBInvocationPoolMaxCount) {
+      _WBInvocationPoolDeallocate(record);
+    } else {
+      record->next = pool->free;
+      pool->free = record;
+      pool->count++;
+    }
+  } else {
+    WBInvocationRecord *head = atomic_load_explicit(&pool->remote, memory_order_relaxed);
+    do {
+      if (head == kWBInvocationPoolClosed) {
+        _WBInvocationPoolDeallocate(record);
+        return;
+      }
+      record->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->remote, &head, record,
+                                                    memory_order_release, memory_order_relaxed));
+  }
+}
+
+void WBInvocationRecordRelease(WBInvocationRecord *record) {
+  if (1 != atomic_fetch_sub_explicit(&record->refcnt, 1, memory_order_acq_rel))
+    return;
+
+  if (record->invocation) {
+    NSInvocation *invocation = (__bridge_transfer NSInvocation *)record->invocation;
+    spx_release(invocation);
+  }
+  if (record->target) {
+    id target = (__bridge_transfer id)record->target;
+    spx_release(target);
+  }
+  if (record->argument) {
+    id argument = (__bridge_transfer id)record->argument;
+    spx_release(argument);
+  }
+  if (record->exception) {
+    id exception = (__bridge_transfer id)record->exception;
+    spx_release(exception);
+  }
+  if (record->semaphore)
+    dispatch_release(record->semaphore);
+  _WBInvocationRecordRecycle(record);
+}
+
+void WBInvocationRecordInvoke(WBInvocationRecord *record) {
+  if (record->invocation)
+    [(__bridge NSInvocation *)record->invocation invoke];
+  else if (record->function)
+    record->function(record->context);
+  else
+    ((void (*)(id, SEL, id))objc_msgSend)((__bridge id)record->target, record->action, (__bridge id)record->argument);
+}
+
+id WBInvocationRecordInvokeAndCatch(WBInvocationRecord *record) {
+  id error = nil;
+  @autoreleasepool {
+    @try {
+      WBInvocationRecordInvoke(record);
+    } @catch (id exception) {
+      // Note: we are in a local autorelease pool => must retain error
+      error = spx_retain(exception);
+    }
+  }
+  return error;
+}
+
+NSString *WBInvocationRecordGetDescription(WBInvocationRecord *record) {
+  if (record->invocation) {
+    NSInvocation *invocation = (__bridge NSInvocation *)record->invocation;
+    return [NSString stringWithFormat:@"[%@ %@]", [[invocation target] class], NSStringFromSelector([invocation selector])];
+  }
+  if (record->function)
+    return [NSString stringWithFormat:@"function %p(%p)", record->function, record->context];
+  return [NSString stringWithFormat:@"[%@ %@]", [(__bridge id)record->target class], NSStringFromSelector(record->action)];
+}
@@ -12,16 +12,34 @@
 
 #import <Foundation/Foundation.h>
 
+#include <WonderBox/WBExecutor.h>
+
 WB_OBJC_EXPORT
 @interface WBSerialQueue : NSObject {
 @private
 
 }
 
+/* Default queue uses GCD */
+- (id)init;
+/* Lane on an executor (the default executor if NULL). Does not create any thread. */
+- (id)initWithName:(NSString *)name executor:(WBExecutorRef)executor priority:(WBExecutorPriority)priority;
+
 //- (void)addOperation:(NSOperation *)op;
 //- (void)addOperation:(NSOperation *)op waitUntilFinished:(BOOL)shouldWait;
 
 - (void)addOperationWithTarget:(id)target selector:(SEL)sel object:(id)arg;
 - (void)addOperationWithTarget:(id)target selector:(SEL)sel object:(id)arg waitUntilFinished:(BOOL)shouldWait;
 
+/* Fast path: ctxt is not retained. */
+- (void)addOperationWithFunction:(void (*)(void *ctxt))function context:(void *)ctxt;
+- (void)addOperationWithFunction:(void (*)(void *ctxt))function context:(void *)ctxt waitUntilFinished:(BOOL)shouldWait;
+
+/* Discard the operations not started yet */
+- (void)cancelAllOperations;
+- (void)waitUntilAllOperationsAreFinished;
+
+/* Only executor based queues maintain statistics. Returns NO for GCD queues. */
+- (BOOL)getStatistics:(WBExecutorStatistics *)stats;
+
 @end
@@ -9,15 +9,27 @@
  */
 
 #import "WBSerialQueue.h"
+#import "WBInvocationRecordInternal.h"
 
 #include <dispatch/dispatch.h>
+#include <libkern/OSAtomic.h>
 
 @interface _WBGCDSerialQueue : WBSerialQueue {
 @private
   dispatch_queue_t wb_queue;
+  /* queue context: lives until the pending operations are done */
+  volatile int32_t *wb_generation;
 }
 
 - (void)addOperationWithTarget:(id)target selector:(SEL)sel object:(id)arg waitUntilFinished:(BOOL)shouldWait;
+- (void)addOperationWithFunction:(void (*)(void *))function context:(void *)ctxt waitUntilFinished:(BOOL)shouldWait;
+
+@end
+
+@interface _WBExecutorSerialQueue : WBSerialQueue {
+@private
+  WBExecutorLaneRef wb_lane;
+}
 
 @end
 
@@ -30,6 +42,14 @@
   return [super allocWithZone:zone];
 }
 
+- (id)initWithName:(NSString *)name executor:(WBExecutorRef)executor priority:(WBExecutorPriority)priority {
+  if ([self class] != [_WBExecutorSerialQueue class]) {
+    spx_release(self);
+    return [[_WBExecutorSerialQueue alloc] initWithName:name executor:executor priority:priority];
+  }
+  return [super init];
+}
+
 - (void)addOperationWithTarget:(id)target selector:(SEL)sel object:(id)arg {
   [self addOperationWithTarget:target selector:sel object:arg waitUntilFinished:NO];
 }
@@ -38,27 +58,40 @@
   SPXAbstractMethodException();
 }
 
-@end
+- (void)addOperationWithFunction:(void (*)(void *))function context:(void *)ctxt {
+  [self addOperationWithFunction:function context:ctxt waitUntilFinished:NO];
+}
 
-#pragma mark GCD
-@interface _WBSerialQueueBlock : NSObject {
-@private
-  id wb_target;
-  SEL wb_action;
-  id wb_argument;
+- (void)addOperationWithFunction:(void (*)(void *))function context:(void *)ctxt waitUntilFinished:(BOOL)shouldWait {
+  SPXAbstractMethodException();
 }
 
-@property(nonatomic) SEL action;
-@property(nonatomic, retain) id target;
-@property(nonatomic, retain) id argument;
+- (void)cancelAllOperations {
+  SPXAbstractMethodException();
+}
+
+static
+void wb_noop(void *ctxt) {}
+
+- (void)waitUntilAllOperationsAreFinished {
+  [self addOperationWithFunction:wb_noop context:NULL waitUntilFinished:YES];
+}
+
+- (BOOL)getStatistics:(WBExecutorStatistics *)stats {
+  return NO;
+}
 
 @end
 
+#pragma mark GCD
 @implementation _WBGCDSerialQueue
 
 - (id)init {
   if (self = [super init]) {
     wb_queue = dispatch_queue_create("org.shadowlab.serial-queue", NULL);
+    wb_generation = calloc(1, sizeof(*wb_generation));
+    dispatch_set_context(wb_queue, (void *)wb_generation);
+    dispatch_set_finalizer_f(wb_queue, free);
   }
   return self;
 }
@@ -71,40 +104,106 @@
 
 static
 void wb_dispatch_execute(void *ctxt) {
-  _WBSerialQueueBlock *block = (__bridge_transfer _WBSerialQueueBlock *)ctxt;
-  @try {
-    [block.target performSelector:block.action withObject:block.argument];
-  } @catch (id exception) {
-    SPXLogException(exception);
+  WBInvocationRecord *record = (WBInvocationRecord *)ctxt;
+  /* owner is set for GCD queues only: operation cancelled if generation changed */
+  volatile int32_t *generation = record->owner;
+  if (!generation || record->generation == (uint32_t)*generation) {
+    @try {
+      WBInvocationRecordInvoke(record);
+    } @catch (id exception) {
+      SPXLogException(exception);
+    }
   }
-  spx_release(block);
+  WBInvocationRecordRelease(record);
 }
 
-- (void)addOperationWithTarget:(id)target selector:(SEL)sel object:(id)arg waitUntilFinished:(BOOL)shouldWait {
-  _WBSerialQueueBlock *block = [[_WBSerialQueueBlock alloc] init]; // leak: released in wb_dispatch_execute
-  block.target = target;
-  block.argument = arg;
-  block.action = sel;
+static
+void wb_dispatch_cancel(void *ctxt) {
+  /* barriers of waitUntilAllOperationsAreFinished have no record */
+  if (ctxt)
+    WBInvocationRecordRelease((WBInvocationRecord *)ctxt);
+}
+
+- (void)wb_dispatchRecord:(WBInvocationRecord *)record waitUntilFinished:(BOOL)shouldWait {
+  // leak: released in wb_dispatch_execute
+  record->owner = (void *)wb_generation;
+  record->generation = (uint32_t)*wb_generation;
   if (shouldWait) {
-    dispatch_sync_f(wb_queue, (__bridge_retained void *)block, wb_dispatch_execute);
+    dispatch_sync_f(wb_queue, record, wb_dispatch_execute);
   } else {
-    dispatch_async_f(wb_queue, (__bridge_retained void *)block, wb_dispatch_execute);
+    dispatch_async_f(wb_queue, record, wb_dispatch_execute);
   }
 }
 
+- (void)addOperationWithTarget:(id)target selector:(SEL)sel object:(id)arg waitUntilFinished:(BOOL)shouldWait {
+  [self wb_dispatchRecord:WBInvocationRecordCreateWithSelector(sel, target, arg) waitUntilFinished:shouldWait];
+}
+
+- (void)addOperationWithFunction:(void (*)(void *))function context:(void *)ctxt waitUntilFinished:(BOOL)shouldWait {
+  [self wb_dispatchRecord:WBInvocationRecordCreateWithFunction(function, ctxt) waitUntilFinished:shouldWait];
+}
+
+- (void)cancelAllOperations {
+  OSAtomicIncrement32Barrier(wb_generation);
+}
+
 @end
 
-@implementation _WBSerialQueueBlock
+#pragma mark Executor
+@implementation _WBExecutorSerialQueue
+
+- (id)initWithName:(NSString *)name executor:(WBExecutorRef)executor priority:(WBExecutorPriority)priority {
+  if (self = [super initWithName:name executor:executor priority:priority]) {
+    wb_lane = WBExecutorLaneCreate(executor ? : WBExecutorGetDefault(), [name UTF8String], priority, 1);
+    if (!wb_lane) {
+      spx_release(self);
+      return nil;
+    }
+    WBExecutorLaneSetCancelFunction(wb_lane, wb_dispatch_cancel);
+  }
+  return self;
+}
 
-@synthesize target = wb_target;
-@synthesize action = wb_action;
-@synthesize argument = wb_argument;
+- (id)init {
+  return [self initWithName:nil executor:NULL priority:kWBExecutorPriorityDefault];
+}
 
 - (void)dealloc {
-  spx_release(wb_argument);
-  spx_release(wb_target);
+  /* pending operations retain the lane */
+  if (wb_lane)
+    WBExecutorLaneRelease(wb_lane);
   [super dealloc];
 }
 
+- (void)wb_executeRecord:(WBInvocationRecord *)record waitUntilFinished:(BOOL)shouldWait {
+  int err = shouldWait ? WBExecutorLaneSync(wb_lane, wb_dispatch_execute, record) :
+                         WBExecutorLaneAsync(wb_lane, NULL, wb_dispatch_execute, record);
+  if (0 != err) {
+    WBInvocationRecordRelease(record);
+    SPXThrowException(NSInternalInconsistencyException, @"cannot add operation: %s", strerror(err));
+  }
+}
+
+- (void)addOperationWithTarget:(id)target selector:(SEL)sel object:(id)arg waitUntilFinished:(BOOL)shouldWait {
+  [self wb_executeRecord:WBInvocationRecordCreateWithSelector(sel, target, arg) waitUntilFinished:shouldWait];
+}
+
+- (void)addOperationWithFunction:(void (*)(void *))function context:(void *)ctxt waitUntilFinished:(BOOL)shouldWait {
+  [self wb_executeRecord:WBInvocationRecordCreateWithFunction(function, ctxt) waitUntilFinished:shouldWait];
+}
+
+- (void)cancelAllOperations {
+  WBExecutorLaneCancel(wb_lane);
+}
+
+- (void)waitUntilAllOperationsAreFinished {
+  /* a barrier waits all the operations submitted before */
+  WBExecutorLaneBarrierSync(wb_lane, wb_noop, NULL);
+}
+
+- (BOOL)getStatistics:(WBExecutorStatistics *)stats {
+  WBExecutorLaneGetStatistics(wb_lane, stats);
+  return YES;
+}
 
 @end
@@ -19,6 +19,15 @@ enum {
   kWBThreadPortWaitIfReturns = -1,
 };
 
+/* Invocation transport */
+enum {
+  /* Lock free queue. The target run loop is woken up once per batch,
+   and synchronous callers wait on a per thread semaphore. */
+  kWBThreadPortQueueTransport = 0,
+  /* one Mach message per invocation, and one per reply */
+  kWBThreadPortMachTransport = 1,
+};
+
 WB_OBJC_EXPORT
 WB_DEPRECATED("Use GCD")
 @interface WBThreadPort : NSObject {
@@ -26,7 +35,13 @@ WB_DEPRECATED("Use GCD")
   NSThread *wb_thread;
   CFMachPortRef wb_port;
 
+  /* invocation queue */
+  void *wb_queue;
+  CFRunLoopRef wb_runloop;
+  CFRunLoopSourceRef wb_source;
+
   mach_msg_timeout_t wb_timeout;
+  int32_t wb_transport;
 }
 
 + (WBThreadPort *)currentPort;
@@ -46,9 +61,16 @@ WB_DEPRECATED("Use GCD")
 - (void)performSelector:(SEL)anAction target:(id)aTarget argument:(id)anObject waitUntilDone:(BOOL)waitDone;
 - (void)performSelector:(SEL)anAction target:(id)aTarget argument:(id)anObject waitUntilDone:(NSInteger)sync timeout:(uint32_t)timeout;
 
+/* Fast path: no NSInvocation is created. ctxt is not retained. */
+- (void)performFunction:(void (*)(void *ctxt))function context:(void *)ctxt waitUntilDone:(BOOL)waitDone timeout:(uint32_t)timeout;
+
 - (uint32_t)timeout;
 - (void)setTimeout:(uint32_t)timeout;
 
+/* default is kWBThreadPortQueueTransport */
+- (NSInteger)transport;
+- (void)setTransport:(NSInteger)transport;
+
 /*!
 @method
  @abstract Create a proxy object for the calling thread
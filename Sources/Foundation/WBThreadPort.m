@@ -10,6 +10,8 @@
 
 #import <WonderBox/WBThreadPort.h>
 
+#import "WBInvocationRecordInternal.h"
+
 #include <pthread.h>
 #include <libkern/OSAtomic.h>
 
@@ -26,24 +28,6 @@
 
 @end
 
-@interface _WBSimpleInvocation : NSObject {
-@private
-  id wb_target;
-  SEL wb_action;
-
-  id wb_argument; // argument and result
-}
-
-- (id)initWithAction:(SEL)anAction target:(id)aTarget argument:(id)anArgument;
-
-- (id)target;
-- (void)invoke;
-- (SEL)selector;
-
-- (void)retainArguments;
-
-@end
-
 @interface _WBRecorderProxy : NSProxy {
 @private
   id wb_target;
@@ -69,12 +53,17 @@
 - (void)invalidate;
 + (void)willBecomeMultiThreaded:(NSNotification *)aNotification;
 
+- (void)wb_performQueue;
+- (void)wb_performRecord:(WBInvocationRecord *)record synchronous:(bool)synch timeout:(uint32_t)timeout;
+- (void)wb_sendRecord:(WBInvocationRecord *)record synchronous:(bool)synch timeout:(uint32_t)timeout;
+- (void)wb_queueRecord:(WBInvocationRecord *)record synchronous:(bool)synch timeout:(uint32_t)timeout;
+
 @end
 
 #pragma mark Mach types
 typedef struct {
   mach_msg_header_t header;
-  intptr_t invocation;
+  intptr_t record;
   bool async;
 } wbinvoke_msg;
 
@@ -93,11 +82,80 @@ void _WBTPMachMessageCallBack(CFMachPortRef port, void *msg, CFIndex size, void
   [(__bridge id)info handleMachMessage:msg];
 }
 
+#pragma mark Invocation Queue
+/* Multi-producers, single consumer queue.
+ Producers push records on a lock free stack, and the target thread takes the whole
+ stack at once (and reverses it). The run loop source is signaled only when a producer
+ pushes on an empty stack, so a single wake up is used for all the records pushed
+ until the consumer takes them. */
+typedef struct _WBInvocationQueue {
+  _Atomic(WBInvocationRecord *) head;
+  _Atomic(bool) invalid;
+} _WBInvocationQueue;
+
+/* returns true if the queue was empty */
+static
+bool _WBInvocationQueuePush(_WBInvocationQueue *queue, WBInvocationRecord *record) {
+  WBInvocationRecord *head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  do {
+    record->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&queue->head, &head, record,
+                                                  memory_order_release, memory_order_relaxed));
+  return head == NULL;
+}
+
+/* take all pending records, in FIFO order */
+static
+WBInvocationRecord *_WBInvocationQueueTake(_WBInvocationQueue *queue) {
+  WBInvocationRecord *head = atomic_exchange_explicit(&queue->head, NULL, memory_order_acquire);
+  WBInvocationRecord *fifo = NULL;
+  while (head) {
+    WBInvocationRecord *next = head->next;
+    head->next = fifo;
+    fifo = head;
+    head = next;
+  }
+  return fifo;
+}
+
+/* take ownership of exception */
+static
+void _WBInvocationRecordComplete(WBInvocationRecord *record, id exception) {
+  if (record->semaphore) {
+    record->exception = (__bridge_retained void *)exception;
+    atomic_store_explicit(&record->done, true, memory_order_release);
+    dispatch_semaphore_signal(record->semaphore);
+  } else {
+    spx_release(exception);
+  }
+  WBInvocationRecordRelease(record);
+}
+
+/* fail all pending records. Can be called by any thread once the queue is invalid. */
+static
+void _WBInvocationQueueAbort(_WBInvocationQueue *queue) {
+  WBInvocationRecord *record = _WBInvocationQueueTake(queue);
+  while (record) {
+    WBInvocationRecord *next = record->next;
+    NSException *error = nil;
+    if (record->semaphore)
+      error = spx_retain([NSException exceptionWithName:NSPortSendException reason:@"port invalidated" userInfo:nil]);
+    _WBInvocationRecordComplete(record, error);
+    record = next;
+  }
+}
+
+static
+void _WBTPQueuePerformCallBack(void *info) {
+  [(__bridge id)info wb_performQueue];
+}
+
 #pragma mark Thread Specific
 /* Each thread can have a send port (mach_port_t) and a receive port (WBThreadPort *) */
 static pthread_key_t sThreadRecorderKey;
 static pthread_key_t sThreadSendPortKey;
 static pthread_key_t sThreadReceivePortKey;
+static pthread_key_t sThreadSemaphoreKey;
 
 static
 mach_port_t _WBThreadGetSendPort(void) {
@@ -117,6 +175,29 @@ mach_port_t _WBThreadGetSendPort(void) {
   return port;
 }
 
+static
+dispatch_semaphore_t _WBThreadGetSemaphore(void) {
+  /* Semaphore used by the current thread to wait queued invocations */
+  dispatch_semaphore_t semaphore = (dispatch_semaphore_t)pthread_getspecific(sThreadSemaphoreKey);
+  if (!semaphore) {
+    semaphore = dispatch_semaphore_create(0);
+    if (0 != pthread_setspecific(sThreadSemaphoreKey, (void *)semaphore)) {
+      spx_debug("pthread_setspecific error");
+      dispatch_release(semaphore);
+      semaphore = NULL;
+    }
+  }
+  return semaphore;
+}
+
+static
+void _WBThreadSemaphoreDestructor(void *ptr) {
+  /* pending records retain the semaphore */
+  dispatch_semaphore_t semaphore = (dispatch_semaphore_t)ptr;
+  if (semaphore)
+    dispatch_release(semaphore);
+}
+
 static
 _WBRecorderProxy *_WBThreadGetRecorder(void) {
   _WBRecorderProxy *proxy = (__bridge _WBRecorderProxy *)pthread_getspecific(sThreadRecorderKey);
@@ -184,6 +265,7 @@ void _WBThreadReceivePortDestructor(void *ptr) {
     verify(0 == pthread_key_create(&sThreadRecorderKey, _WBThreadRecorderDestructor));
     verify(0 == pthread_key_create(&sThreadSendPortKey, _WBThreadSendPortDestructor));
     verify(0 == pthread_key_create(&sThreadReceivePortKey, _WBThreadReceivePortDestructor));
+    verify(0 == pthread_key_create(&sThreadSemaphoreKey, _WBThreadSemaphoreDestructor));
   }
 }
 
@@ -217,7 +299,20 @@ void _WBThreadReceivePortDestructor(void *ptr) {
       CFRelease(src);
     }
 
+    // register invocation queue.
+    CFRunLoopSourceContext qctxt = { 0, (__bridge void *)self, NULL, NULL, NULL, NULL, NULL, NULL, NULL, _WBTPQueuePerformCallBack };
+    wb_source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &qctxt);
+    if (!wb_source) {
+      SPXDebug(@"Error while creating runloop source");
+      spx_release(self);
+      return nil;
+    }
+    wb_queue = calloc(1, sizeof(_WBInvocationQueue));
+    wb_runloop = (CFRunLoopRef)CFRetain(CFRunLoopGetCurrent());
+    CFRunLoopAddSource(wb_runloop, wb_source, kCFRunLoopCommonModes);
+
     wb_timeout = MACH_MSG_TIMEOUT_NONE;
+    wb_transport = kWBThreadPortQueueTransport;
     wb_thread = spx_retain([NSThread currentThread]);
   }
   return self;
@@ -245,11 +340,20 @@ void _WBThreadReceivePortDestructor(void *ptr) {
 
 - (void)dealloc {
   [self invalidate];
+  if (wb_source)
+    CFRelease(wb_source);
+  if (wb_runloop)
+    CFRelease(wb_runloop);
+  free(wb_queue);
   [super dealloc];
 }
 
 - (void)invalidate {
   @synchronized(self) {
+    if (wb_queue && !atomic_exchange(&((_WBInvocationQueue *)wb_queue)->invalid, true)) {
+      CFRunLoopSourceInvalidate(wb_source);
+      _WBInvocationQueueAbort(wb_queue);
+    }
     if (wb_port) {
       CFMachPortInvalidate(wb_port);
       CFRelease(wb_port);
@@ -268,6 +372,12 @@ void _WBThreadReceivePortDestructor(void *ptr) {
 - (void)setTimeout:(uint32_t)timeout {
   wb_timeout = timeout;
 }
+- (NSInteger)transport {
+  return wb_transport;
+}
+- (void)setTransport:(NSInteger)transport {
+  wb_transport = (int32_t)transport;
+}
 - (NSThread *)targetThread {
   return wb_thread;
 }
@@ -293,6 +403,75 @@ void _WBThreadReceivePortDestructor(void *ptr) {
   if (!synch && anInvocation)
     [anInvocation retainArguments];
 
+  [self wb_performRecord:WBInvocationRecordCreateWithInvocation(anInvocation) synchronous:synch timeout:timeout];
+}
+
+/* take ownership of record */
+- (void)wb_performRecord:(WBInvocationRecord *)record synchronous:(bool)synch timeout:(uint32_t)timeout {
+  if (kWBThreadPortMachTransport == wb_transport)
+    [self wb_sendRecord:record synchronous:synch timeout:timeout];
+  else
+    [self wb_queueRecord:record synchronous:synch timeout:timeout];
+}
+
+- (void)wb_queueRecord:(WBInvocationRecord *)record synchronous:(bool)synch timeout:(uint32_t)timeout {
+  _WBInvocationQueue *queue = wb_queue;
+  if (atomic_load_explicit(&queue->invalid, memory_order_relaxed)) {
+    WBInvocationRecordRelease(record);
+    SPXThrowException(NSPortSendException, @"port invalidated");
+  }
+
+  if (synch) {
+    record->semaphore = _WBThreadGetSemaphore();
+    if (!record->semaphore) {
+      WBInvocationRecordRelease(record);
+      SPXThrowException(NSPortSendException, @"cannot create thread semaphore");
+    }
+    dispatch_retain(record->semaphore);
+    /* the caller and the target thread */
+    atomic_store_explicit(&record->refcnt, 2, memory_order_relaxed);
+  }
+
+  /* wake up the target only if the queue was empty */
+  if (_WBInvocationQueuePush(queue, record)) {
+    CFRunLoopSourceSignal(wb_source);
+    CFRunLoopWakeUp(wb_runloop);
+  }
+  /* the port may have been invalidated while pushing */
+  if (atomic_load(&queue->invalid))
+    _WBInvocationQueueAbort(queue);
+
+  if (!synch)
+    return;
+
+  dispatch_time_t deadline = DISPATCH_TIME_FOREVER;
+  if (timeout != MACH_MSG_TIMEOUT_NONE)
+    deadline = dispatch_time(DISPATCH_TIME_NOW, (int64_t)timeout * NSEC_PER_MSEC);
+  /* the semaphore can be signaled by an invocation that previously timed out => check done. */
+  while (!atomic_load_explicit(&record->done, memory_order_acquire)) {
+    if (0 != dispatch_semaphore_wait(record->semaphore, deadline) &&
+        !atomic_load_explicit(&record->done, memory_order_acquire)) {
+      /* as with the Mach transport, the invocation will still be performed */
+      WBInvocationRecordRelease(record);
+      SPXThrowException(NSPortTimeoutException, @"timeout occured while waiting response");
+    }
+  }
+  id exception = nil;
+  if (record->exception) {
+    exception = (__bridge_transfer id)record->exception;
+    record->exception = NULL;
+  }
+  WBInvocationRecordRelease(record);
+  if (exception)
+    @throw spx_autorelease(exception);
+}
+
+- (void)wb_sendRecord:(WBInvocationRecord *)record synchronous:(bool)synch timeout:(uint32_t)timeout {
+  if (!wb_port) {
+    WBInvocationRecordRelease(record);
+    SPXThrowException(NSPortSendException, @"port invalidated");
+  }
+
   wbinvoke_msg msg = {};
   mach_msg_header_t *send_hdr = &msg.header;
   send_hdr->msgh_bits = MACH_MSGH_BITS_REMOTE(MACH_MSG_TYPE_COPY_SEND);
@@ -306,7 +485,7 @@ void _WBThreadReceivePortDestructor(void *ptr) {
     send_hdr->msgh_local_port = _WBThreadGetSendPort();
   }
   msg.async = !synch;
-  msg.invocation = (intptr_t)spx_retain(anInvocation);
+  msg.record = (intptr_t)record;
 
   /* Send invocation to target thread */
   mach_msg_option_t opts = MACH_SEND_MSG;
@@ -314,9 +493,9 @@ void _WBThreadReceivePortDestructor(void *ptr) {
   mach_error_t err = mach_msg(send_hdr, opts, send_hdr->msgh_size, 0, MACH_PORT_NULL, timeout, MACH_PORT_NULL);
   /* handle result */
   if (MACH_MSG_SUCCESS != err) {
-    /* invocation is released by the target thread,
+    /* record is released by the target thread,
      so if an error occured, it is not released */
-    spx_release(anInvocation);
+    WBInvocationRecordRelease(record);
     switch (err) {
       case MACH_SEND_TIMED_OUT:
         SPXThrowException(NSPortTimeoutException, @"timeout occured while sending invocation");
@@ -364,12 +543,27 @@ void _WBThreadReceivePortDestructor(void *ptr) {
 }
 
 - (void)performSelector:(SEL)anAction target:(id)aTarget argument:(id)anObject waitUntilDone:(NSInteger)synch timeout:(uint32_t)timeout {
-  _WBSimpleInvocation *invok = [[_WBSimpleInvocation alloc] initWithAction:anAction target:aTarget argument:anObject];
-  @try {
-    [self performInvocation:(id)invok waitUntilDone:synch timeout:timeout];
-  } @finally {
-    spx_release(invok);
+  if (!aTarget)
+    SPXThrowException(NSInvalidArgumentException, @"The invocation MUST contains a valid target");
+
+  if ([wb_thread isEqual:[NSThread currentThread]]) {
+    SPXLogWarning(@"caller thread is the target thread. You should not use 'thread port' to send intra-thread messages.");
+    [aTarget performSelector:anAction withObject:anObject];
+    return;
+  }
+  /* the action returns an object => kWBThreadPortWaitIfReturns means wait */
+  [self wb_performRecord:WBInvocationRecordCreateWithSelector(anAction, aTarget, anObject) synchronous:synch != 0 timeout:timeout];
+}
+
+- (void)performFunction:(void (*)(void *))function context:(void *)ctxt waitUntilDone:(BOOL)waitDone timeout:(uint32_t)timeout {
+  if (!function)
+    SPXThrowException(NSInvalidArgumentException, @"function MUST not be NULL");
+
+  if ([wb_thread isEqual:[NSThread currentThread]]) {
+    function(ctxt);
+    return;
   }
+  [self wb_performRecord:WBInvocationRecordCreateWithFunction(function, ctxt) synchronous:waitDone timeout:timeout];
 }
 
 #pragma mark Automatic forwarding
@@ -420,19 +614,33 @@ void _WBThreadReceivePortDestructor(void *ptr) {
 //}
 
 #pragma mark Message handler
+static
+void _WBThreadPortLogAsyncException(WBInvocationRecord *record, id error) {
+  SPXLogWarning(@"exception occured during asynchronous call to %@: %@: %@",
+               WBInvocationRecordGetDescription(record),
+               [error respondsToSelector:@selector(name)] ? [error name] : error,
+               [error respondsToSelector:@selector(reason)] ? [error reason] : @"undefined reason");
+}
+
+- (void)wb_performQueue {
+  /* Pending records are handled in a single pass. Records pushed meanwhile
+   signal the source again, as the queue is empty once taken. */
+  WBInvocationRecord *record = _WBInvocationQueueTake(wb_queue);
+  while (record) {
+    WBInvocationRecord *next = record->next;
+    id error = WBInvocationRecordInvokeAndCatch(record);
+    if (error && !record->semaphore)
+      _WBThreadPortLogAsyncException(record, error);
+    _WBInvocationRecordComplete(record, error);
+    record = next;
+  }
+}
+
 - (void)handleMachMessage:(void *)machMessage {
   wbinvoke_msg *msg = (wbinvoke_msg *)machMessage;
 
-  id error = nil;
-  NSInvocation *invocation = (__bridge_transfer NSInvocation *)(void *)msg->invocation;
-  @autoreleasepool {
-    @try {
-      [invocation invoke];
-    } @catch (id exception) {
-      // Note: we are in a local autorelease pool => must retain error
-      error = spx_retain(exception);
-    }
-  }
+  WBInvocationRecord *record = (WBInvocationRecord *)msg->record;
+  id error = WBInvocationRecordInvokeAndCatch(record);
   if (!msg->async) {
     wbreply_msg reply_msg = {};
 
@@ -454,13 +662,10 @@ void _WBThreadReceivePortDestructor(void *ptr) {
       spx_log_warning("mach_msg(reply) : %s", mach_error_string(err));
     }
   } else if (error) {
-    SPXLogWarning(@"exception occured during asynchronous call to [%@ %@]: %@: %@",
-                 [[invocation target] class], NSStringFromSelector([invocation selector]),
-                 [error respondsToSelector:@selector(name)] ? [error name] : error,
-                 [error respondsToSelector:@selector(reason)] ? [error reason] : @"undefined reason");
+    _WBThreadPortLogAsyncException(record, error);
   }
   spx_release(error);
-  spx_release(invocation);
+  WBInvocationRecordRelease(record);
 }
 
 #pragma mark -
@@ -680,28 +885,3 @@ void _WBThreadReceivePortDestructor(void *ptr) {
 - (void)setPort:(WBThreadPort *)aPort { wb_port = aPort; }
 
 @end
-
-@implementation _WBSimpleInvocation
-
-- (id)initWithAction:(SEL)anAction target:(id)aTarget argument:(id)anArgument {
-  if (self = [super init]) {
-    wb_action = anAction;
-    wb_target = spx_retain(aTarget);
-    wb_argument = spx_retain(anArgument);
-  }
-  return self;
-}
-
-- (void)dealloc {
-  spx_release(wb_argument);
-  spx_release(wb_target);
-  [super dealloc];
-}
-
-- (id)target { return wb_target; }
-- (void)invoke { [wb_target performSelector:wb_action withObject:wb_argument]; }
-- (SEL)selector { return wb_action; }
-
-- (void)retainArguments {}
-
-@end
@@ -0,0 +1,1488 @@
+/*
+ *  WBXMLStreamWriter.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include <WonderBox/WBXMLStreamWriter.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#if defined(__SSSE3__)
+  #include <tmmintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+
+/* States mirror the libxml2 xmlTextWriter states, so the output is the same */
+enum {
+  kWBXMLStateNone = 0,
+  kWBXMLStateName,
+  kWBXMLStateAttribute,
+  kWBXMLStateText,
+  kWBXMLStatePI,
+  kWBXMLStatePIText,
+  kWBXMLStateCDATA,
+  kWBXMLStateDTD,
+  kWBXMLStateDTDText,
+  kWBXMLStateComment,
+};
+
+typedef struct _WBXMLNode {
+  uint8_t state;
+  size_t name; // offset in names arena
+  size_t length;
+} WBXMLNode;
+
+typedef struct _WBXMLNamespace {
+  char *prefix; // "xmlns" or "xmlns:prefix"
+  char *uri;
+  size_t elem; // depth of the declaring element
+} WBXMLNamespace;
+
+struct __WBXMLStreamWriter {
+  /* Output */
+  uint8_t *buffer;
+  size_t length;
+  size_t capacity;
+  uint64_t total;
+  WBXMLStreamWriterOutputFunction output;
+  WBXMLStreamWriterCloseFunction close;
+  void *ctxt;
+  bool error;
+
+  /* Formatting */
+  bool encoding; // document declares an encoding
+  bool indent;
+  bool doindent;
+  char *ichar;
+  size_t ilength;
+
+  /* Nodes stack (names are stored in a single arena) */
+  WBXMLNode *nodes;
+  size_t depth, ncapacity;
+  char *names;
+  size_t nlength, ncapacity2;
+
+  /* Pending namespaces declarations */
+  WBXMLNamespace *nsstack;
+  size_t nscount, nscapacity;
+};
+
+#define kWBXMLDefaultBufferSize (256 * 1024)
+
+// MARK: Output
+static
+intptr_t _WBXMLFileDescriptorOutput(const void *bytes, size_t length, void *ctxt) {
+  int fd = (int)(intptr_t)ctxt;
+  const uint8_t *cursor = bytes;
+  size_t left = length;
+  while (left > 0) {
+    ssize_t count = write(fd, cursor, left);
+    if (count < 0) {
+      if (EINTR == errno) continue;
+      return -1;
+    }
+    cursor += count;
+    left -= count;
+  }
+  return (intptr_t)length;
+}
+
+static
+void _WBXMLFileDescriptorClose(void *ctxt) {
+  close((int)(intptr_t)ctxt);
+}
+
+static
+intptr_t _WBXMLDrain(WBXMLStreamWriterRef writer) {
+  if (writer->error) return -1;
+  if (writer->length > 0) {
+    if (writer->output(writer->buffer, writer->length, writer->ctxt) < 0) {
+      writer->error = true;
+      return -1;
+    }
+  }
+  intptr_t count = (intptr_t)writer->length;
+  writer->length = 0;
+  return count;
+}
+
+/* Returns a pointer to at least 'length' free bytes in the output buffer (length <= capacity) */
+static inline
+uint8_t *_WBXMLReserve(WBXMLStreamWriterRef writer, size_t length) {
+  if (writer->capacity - writer->length < length && _WBXMLDrain(writer) < 0)
+    return NULL;
+  return writer->buffer + writer->length;
+}
+
+static inline
+void _WBXMLCommit(WBXMLStreamWriterRef writer, size_t length) {
+  writer->length += length;
+  writer->total += length;
+}
+
+static
+intptr_t _WBXMLWrite(WBXMLStreamWriterRef writer, const void *bytes, size_t length) {
+  if (writer->error) return -1;
+  if (length <= writer->capacity - writer->length) {
+    memcpy(writer->buffer + writer->length, bytes, length);
+  } else {
+    if (_WBXMLDrain(writer) < 0)
+      return -1;
+    /* too large to fit: bypass the buffer */
+    if (length >= writer->capacity) {
+      if (writer->output(bytes, length, writer->ctxt) < 0) {
+        writer->error = true;
+        return -1;
+      }
+      writer->total += length;
+      return (intptr_t)length;
+    }
+    memcpy(writer->buffer, bytes, length);
+  }
+  _WBXMLCommit(writer, length);
+  return (intptr_t)length;
+}
+
+static inline
+intptr_t _WBXMLWriteString(WBXMLStreamWriterRef writer, const char *str) {
+  return _WBXMLWrite(writer, str, strlen(str));
+}
+
+static inline
+intptr_t _WBXMLWriteChar(WBXMLStreamWriterRef writer, char c) {
+  if (writer->error) return -1;
+  if (writer->length == writer->capacity && _WBXMLDrain(writer) < 0)
+    return -1;
+  writer->buffer[writer->length] = (uint8_t)c;
+  _WBXMLCommit(writer, 1);
+  return 1;
+}
+
+// MARK: Escaping
+enum {
+  kWBXMLEscapeText = 1 << 0,
+  kWBXMLEscapeAttribute = 1 << 1,
+  /* libxml2 serializes non ASCII characters as char ref in attributes
+   when the document does not declare an encoding */
+  kWBXMLEscapeNonASCII = 1 << 2,
+};
+
+static const uint8_t sWBXMLEscapeTable[256] = {
+  ['\t'] = kWBXMLEscapeAttribute,
+  ['\n'] = kWBXMLEscapeAttribute,
+  ['\r'] = kWBXMLEscapeText | kWBXMLEscapeAttribute,
+  ['"'] = kWBXMLEscapeText | kWBXMLEscapeAttribute,
+  ['&'] = kWBXMLEscapeText | kWBXMLEscapeAttribute,
+  ['<'] = kWBXMLEscapeText | kWBXMLEscapeAttribute,
+  ['>'] = kWBXMLEscapeText | kWBXMLEscapeAttribute,
+  [0x80 ... 0xff] = kWBXMLEscapeNonASCII,
+};
+
+/* Returns the first byte in [str, end) that must be escaped, or end */
+static
+const uint8_t *_WBXMLScan(const uint8_t *str, const uint8_t *end, uint8_t mode) {
+#if defined(__SSE2__)
+  const __m128i amp = _mm_set1_epi8('&'), lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+  const __m128i quot = _mm_set1_epi8('"'), cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n'), tab = _mm_set1_epi8('\t');
+  while (end - str >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)str);
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_or_si128(_mm_cmpeq_epi8(v, quot), _mm_cmpeq_epi8(v, cr))));
+    if (mode & kWBXMLEscapeAttribute)
+      m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, tab)));
+    int mask = _mm_movemask_epi8(m);
+    if (mode & kWBXMLEscapeNonASCII)
+      mask |= _mm_movemask_epi8(v); // high bit set => non ASCII
+    if (mask)
+      return str + __builtin_ctz(mask);
+    str += 16;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t amp = vdupq_n_u8('&'), lt = vdupq_n_u8('<'), gt = vdupq_n_u8('>');
+  const uint8x16_t quot = vdupq_n_u8('"'), cr = vdupq_n_u8('\r');
+  const uint8x16_t lf = vdupq_n_u8('\n'), tab = vdupq_n_u8('\t');
+  while (end - str >= 16) {
+    uint8x16_t v = vld1q_u8(str);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, amp), vceqq_u8(v, lt)),
+                            vorrq_u8(vceqq_u8(v, gt), vorrq_u8(vceqq_u8(v, quot), vceqq_u8(v, cr))));
+    if (mode & kWBXMLEscapeAttribute)
+      m = vorrq_u8(m, vorrq_u8(vceqq_u8(v, lf), vceqq_u8(v, tab)));
+    if (mode & kWBXMLEscapeNonASCII)
+      m = vorrq_u8(m, vcgeq_u8(v, vdupq_n_u8(0x80)));
+    if (vmaxvq_u8(m))
+      break; // locate it using the scalar loop
+    str += 16;
+  }
+#endif
+  while (str < end && !(sWBXMLEscapeTable[*str] & mode))
+    str++;
+  return str;
+}
+
+/* Same format than libxml2 xmlSerializeHexCharRef */
+static
+size_t _WBXMLHexCharRef(char buffer[12], uint32_t value) {
+  static const char sHex[] = "0123456789ABCDEF";
+  char digits[8];
+  size_t count = 0;
+  do {
+    digits[count++] = sHex[value & 0xf];
+    value >>= 4;
+  } while (value);
+  size_t length = 0;
+  buffer[length++] = '&';
+  buffer[length++] = '#';
+  buffer[length++] = 'x';
+  while (count > 0)
+    buffer[length++] = digits[--count];
+  buffer[length++] = ';';
+  return length;
+}
+
+WB_INLINE
+bool _WBXMLIsChar(uint32_t c) {
+  return (c >= 0x20 && c <= 0xd7ff) || c == 0x9 || c == 0xa || c == 0xd ||
+    (c >= 0xe000 && c <= 0xfffd) || (c >= 0x10000 && c <= 0x10ffff);
+}
+
+static
+intptr_t _WBXMLWriteEscaped(WBXMLStreamWriterRef writer, const char *content, size_t length, uint8_t mode) {
+  intptr_t sum = 0;
+  const uint8_t *str = (const uint8_t *)content;
+  const uint8_t *end = str + length;
+  while (str < end) {
+    const uint8_t *special = _WBXMLScan(str, end, mode);
+    if (special > str) {
+      if (_WBXMLWrite(writer, str, special - str) < 0)
+        return -1;
+      sum += special - str;
+    }
+    if (special == end)
+      break;
+
+    const char *escape = NULL;
+    char ref[12];
+    size_t elen = 0, consumed = 1;
+    switch (*special) {
+      case '<': escape = "&lt;"; break;
+      case '>': escape = "&gt;"; break;
+      case '&': escape = "&amp;"; break;
+      case '"': escape = "&quot;"; break;
+      case '\r': escape = "&#13;"; break;
+      case '\n': escape = "&#10;"; break;
+      case '\t': escape = "&#9;"; break;
+      default: {
+        /* non ASCII in attribute: UTF-8 decoding as done by xmlBufAttrSerializeTxtContent() */
+        const uint8_t *cur = special;
+        size_t left = end - cur;
+        uint32_t value = 0;
+        size_t l = 1;
+        if (left < 2) {
+          /* libxml2 copies a trailing byte as is */
+          ref[0] = (char)*cur;
+          elen = 1;
+          break;
+        }
+        if (cur[0] < 0xc0) {
+          l = 1;
+        } else if (cur[0] < 0xe0) {
+          value = ((cur[0] & 0x1f) << 6) | (cur[1] & 0x3f);
+          l = 2;
+        } else if (cur[0] < 0xf0 && left >= 3) {
+          value = ((cur[0] & 0x0f) << 12) | ((cur[1] & 0x3f) << 6) | (cur[2] & 0x3f);
+          l = 3;
+        } else if (cur[0] < 0xf8 && left >= 4) {
+          value = ((cur[0] & 0x07) << 18) | ((cur[1] & 0x3f) << 12) | ((cur[2] & 0x3f) << 6) | (cur[3] & 0x3f);
+          l = 4;
+        }
+        if (l == 1 || !_WBXMLIsChar(value)) {
+          elen = _WBXMLHexCharRef(ref, cur[0]);
+        } else {
+          elen = _WBXMLHexCharRef(ref, value);
+          consumed = l;
+        }
+      }
+        break;
+    }
+    if (escape) {
+      if (_WBXMLWriteString(writer, escape) < 0)
+        return -1;
+      sum += strlen(escape);
+    } else {
+      if (_WBXMLWrite(writer, ref, elen) < 0)
+        return -1;
+      sum += elen;
+    }
+    str = special + consumed;
+  }
+  return sum;
+}
+
+// MARK: Stack
+WB_INLINE
+WBXMLNode *_WBXMLTop(WBXMLStreamWriterRef writer) {
+  return writer->depth > 0 ? &writer->nodes[writer->depth - 1] : NULL;
+}
+
+static
+WBXMLNode *_WBXMLPush(WBXMLStreamWriterRef writer, uint8_t state, const char *name) {
+  if (writer->depth == writer->ncapacity) {
+    size_t capacity = writer->ncapacity ? writer->ncapacity * 2 : 32;
+    WBXMLNode *nodes = realloc(writer->nodes, capacity * sizeof(*nodes));
+    if (!nodes) return NULL;
+    writer->nodes = nodes;
+    writer->ncapacity = capacity;
+  }
+  size_t length = name ? strlen(name) : 0;
+  if (writer->nlength + length > writer->ncapacity2) {
+    size_t capacity = writer->ncapacity2 ? writer->ncapacity2 : 1024;
+    while (capacity < writer->nlength + length)
+      capacity *= 2;
+    char *names = realloc(writer->names, capacity);
+    if (!names) return NULL;
+    writer->names = names;
+    writer->ncapacity2 = capacity;
+  }
+  WBXMLNode *node = &writer->nodes[writer->depth++];
+  node->state = state;
+  node->name = writer->nlength;
+  node->length = length;
+  if (length) {
+    memcpy(writer->names + writer->nlength, name, length);
+    writer->nlength += length;
+  }
+  return node;
+}
+
+static
+void _WBXMLPop(WBXMLStreamWriterRef writer) {
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (node) {
+    writer->nlength = node->name;
+    writer->depth--;
+  }
+}
+
+static
+intptr_t _WBXMLWriteIndent(WBXMLStreamWriterRef writer) {
+  if (writer->depth < 1) return -1;
+  intptr_t sum = 0;
+  for (size_t idx = 0; idx < writer->depth - 1; idx++) {
+    if (_WBXMLWrite(writer, writer->ichar, writer->ilength) < 0)
+      return -1;
+    sum += writer->ilength;
+  }
+  return sum;
+}
+
+// MARK: Namespaces
+static
+bool _WBXMLPushNamespace(WBXMLStreamWriterRef writer, const char *prefix, const char *uri) {
+  if (writer->nscount == writer->nscapacity) {
+    size_t capacity = writer->nscapacity ? writer->nscapacity * 2 : 8;
+    WBXMLNamespace *stack = realloc(writer->nsstack, capacity * sizeof(*stack));
+    if (!stack) return false;
+    writer->nsstack = stack;
+    writer->nscapacity = capacity;
+  }
+  size_t plen = prefix ? strlen(prefix) : 0;
+  char *decl = malloc(plen + 7);
+  if (!decl) return false;
+  memcpy(decl, "xmlns", 5);
+  if (prefix) {
+    decl[5] = ':';
+    memcpy(decl + 6, prefix, plen + 1);
+  } else {
+    decl[5] = '\0';
+  }
+  WBXMLNamespace *ns = &writer->nsstack[writer->nscount++];
+  ns->prefix = decl;
+  ns->uri = strdup(uri);
+  ns->elem = writer->depth;
+  return true;
+}
+
+static intptr_t _WBXMLWriteAttributeInternal(WBXMLStreamWriterRef writer, const char *name, const char *content);
+
+/* xmlTextWriterOutputNSDecl: declarations are output in reverse order of registration */
+static
+intptr_t _WBXMLOutputNSDecl(WBXMLStreamWriterRef writer) {
+  intptr_t sum = 0;
+  while (writer->nscount > 0) {
+    WBXMLNamespace ns = writer->nsstack[--writer->nscount];
+    intptr_t count = _WBXMLWriteAttributeInternal(writer, ns.prefix, ns.uri);
+    free(ns.prefix);
+    free(ns.uri);
+    if (count < 0) {
+      while (writer->nscount > 0) {
+        writer->nscount--;
+        free(writer->nsstack[writer->nscount].prefix);
+        free(writer->nsstack[writer->nscount].uri);
+      }
+      return -1;
+    }
+    sum += count;
+  }
+  return sum;
+}
+
+/* close the start tag if needed (xmlTextWriterHandleStateDependencies) */
+static
+intptr_t _WBXMLHandleStateDependencies(WBXMLStreamWriterRef writer, WBXMLNode *node) {
+  char extra[3] = { 0, 0, 0 };
+  intptr_t sum = 0;
+  switch (node->state) {
+    case kWBXMLStateName:
+      sum = _WBXMLOutputNSDecl(writer);
+      if (sum < 0) return -1;
+      extra[0] = '>';
+      node = _WBXMLTop(writer);
+      node->state = kWBXMLStateText;
+      break;
+    case kWBXMLStatePI:
+      extra[0] = ' ';
+      node->state = kWBXMLStatePIText;
+      break;
+    case kWBXMLStateDTD:
+      extra[0] = ' ';
+      extra[1] = '[';
+      node->state = kWBXMLStateDTDText;
+      break;
+  }
+  if (extra[0]) {
+    intptr_t count = _WBXMLWriteString(writer, extra);
+    if (count < 0) return -1;
+    sum += count;
+  }
+  return sum;
+}
+
+// MARK: -
+WBXMLStreamWriterRef WBXMLStreamWriterCreate(WBXMLStreamWriterOutputFunction output,
+                                             WBXMLStreamWriterCloseFunction close,
+                                             void *ctxt, size_t bufferSize) {
+  if (!output) return NULL;
+  WBXMLStreamWriterRef writer = calloc(1, sizeof(*writer));
+  if (!writer) return NULL;
+
+  /* a base64 line must always fit in the buffer */
+  writer->capacity = bufferSize > 0 ? MAX(bufferSize, (size_t)256) : kWBXMLDefaultBufferSize;
+  writer->buffer = malloc(writer->capacity);
+  writer->ichar = strdup(" ");
+  if (!writer->buffer || !writer->ichar) {
+    free(writer->buffer);
+    free(writer->ichar);
+    free(writer);
+    return NULL;
+  }
+  writer->ilength = 1;
+  writer->doindent = true;
+  writer->output = output;
+  writer->close = close;
+  writer->ctxt = ctxt;
+  return writer;
+}
+
+WBXMLStreamWriterRef WBXMLStreamWriterCreateWithFileDescriptor(int fd, bool closeOnFree, size_t bufferSize) {
+  if (fd < 0) return NULL;
+  return WBXMLStreamWriterCreate(_WBXMLFileDescriptorOutput, closeOnFree ? _WBXMLFileDescriptorClose : NULL,
+                                 (void *)(intptr_t)fd, bufferSize);
+}
+
+void WBXMLStreamWriterFree(WBXMLStreamWriterRef writer) {
+  if (!writer) return;
+  _WBXMLDrain(writer);
+  if (writer->close)
+    writer->close(writer->ctxt);
+  while (writer->nscount > 0) {
+    writer->nscount--;
+    free(writer->nsstack[writer->nscount].prefix);
+    free(writer->nsstack[writer->nscount].uri);
+  }
+  free(writer->nsstack);
+  free(writer->names);
+  free(writer->nodes);
+  free(writer->ichar);
+  free(writer->buffer);
+  free(writer);
+}
+
+intptr_t WBXMLStreamWriterFlush(WBXMLStreamWriterRef writer) {
+  return _WBXMLDrain(writer);
+}
+
+uint64_t WBXMLStreamWriterGetLength(WBXMLStreamWriterRef writer) {
+  return writer->total;
+}
+
+intptr_t WBXMLStreamWriterOutputBytes(const void *bytes, size_t length, void *writer) {
+  return _WBXMLWrite((WBXMLStreamWriterRef)writer, bytes, length);
+}
+
+int WBXMLStreamWriterSetIndent(WBXMLStreamWriterRef writer, bool indent) {
+  writer->indent = indent;
+  writer->doindent = true;
+  return 0;
+}
+
+int WBXMLStreamWriterSetIndentString(WBXMLStreamWriterRef writer, const char *str) {
+  if (!str) return -1;
+  char *ichar = strdup(str);
+  if (!ichar) return -1;
+  free(writer->ichar);
+  writer->ichar = ichar;
+  writer->ilength = strlen(ichar);
+  return 0;
+}
+
+// MARK: Document
+intptr_t WBXMLStreamWriterStartDocument(WBXMLStreamWriterRef writer, const char *version, const char *encoding, const char *standalone) {
+  if (writer->depth > 0) return -1;
+  if (encoding && 0 != strcasecmp(encoding, "UTF-8") && 0 != strcasecmp(encoding, "UTF8"))
+    return -1;
+  writer->encoding = encoding != NULL;
+
+  intptr_t sum = 0, count;
+  if ((count = _WBXMLWriteString(writer, "<?xml version=\"")) < 0) return -1;
+  sum += count;
+  if ((count = _WBXMLWriteString(writer, version ? : "1.0")) < 0) return -1;
+  sum += count;
+  if ((count = _WBXMLWriteChar(writer, '"')) < 0) return -1;
+  sum += count;
+  if (encoding) {
+    if ((count = _WBXMLWriteString(writer, " encoding=\"")) < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteString(writer, encoding)) < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteChar(writer, '"')) < 0) return -1;
+    sum += count;
+  }
+  if (standalone) {
+    if ((count = _WBXMLWriteString(writer, " standalone=\"")) < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteString(writer, standalone)) < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteChar(writer, '"')) < 0) return -1;
+    sum += count;
+  }
+  if ((count = _WBXMLWriteString(writer, "?>\n")) < 0) return -1;
+  return sum + count;
+}
+
+static intptr_t _WBXMLEndPI(WBXMLStreamWriterRef writer);
+static intptr_t _WBXMLEndDTD(WBXMLStreamWriterRef writer);
+
+intptr_t WBXMLStreamWriterEndDocument(WBXMLStreamWriterRef writer) {
+  intptr_t sum = 0, count = 0;
+  WBXMLNode *node;
+  while ((node = _WBXMLTop(writer))) {
+    switch (node->state) {
+      case kWBXMLStateName:
+      case kWBXMLStateAttribute:
+      case kWBXMLStateText:
+        count = WBXMLStreamWriterEndElement(writer);
+        break;
+      case kWBXMLStatePI:
+      case kWBXMLStatePIText:
+        count = _WBXMLEndPI(writer);
+        break;
+      case kWBXMLStateCDATA:
+        count = WBXMLStreamWriterEndCDATA(writer);
+        break;
+      case kWBXMLStateDTD:
+      case kWBXMLStateDTDText:
+        count = _WBXMLEndDTD(writer);
+        break;
+      case kWBXMLStateComment:
+        count = WBXMLStreamWriterEndComment(writer);
+        break;
+      default:
+        count = -1;
+        break;
+    }
+    if (count < 0) return -1;
+    sum += count;
+  }
+  if (!writer->indent) {
+    if ((count = _WBXMLWriteChar(writer, '\n')) < 0) return -1;
+    sum += count;
+  }
+  if ((count = _WBXMLDrain(writer)) < 0) return -1;
+  return sum + count;
+}
+
+// MARK: Processing Instruction
+static
+intptr_t _WBXMLStartPI(WBXMLStreamWriterRef writer, const char *target) {
+  if (!target || !*target || 0 == strcasecmp(target, "xml"))
+    return -1;
+
+  intptr_t sum = 0, count;
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (node) {
+    switch (node->state) {
+      case kWBXMLStateAttribute:
+        if ((count = WBXMLStreamWriterEndAttribute(writer)) < 0) return -1;
+        sum += count;
+        // fall through
+      case kWBXMLStateName:
+        if ((count = _WBXMLOutputNSDecl(writer)) < 0) return -1;
+        sum += count;
+        if ((count = _WBXMLWriteChar(writer, '>')) < 0) return -1;
+        sum += count;
+        _WBXMLTop(writer)->state = kWBXMLStateText;
+        break;
+      case kWBXMLStateNone:
+      case kWBXMLStateText:
+      case kWBXMLStateDTD:
+        break;
+      case kWBXMLStatePI:
+      case kWBXMLStatePIText:
+        return -1;
+      default:
+        return -1;
+    }
+  }
+  if (!_WBXMLPush(writer, kWBXMLStatePI, target)) return -1;
+  if ((count = _WBXMLWriteString(writer, "<?")) < 0) return -1;
+  sum += count;
+  if ((count = _WBXMLWriteString(writer, target)) < 0) return -1;
+  return sum + count;
+}
+
+static
+intptr_t _WBXMLEndPI(WBXMLStreamWriterRef writer) {
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (!node) return 0;
+  intptr_t sum = 0, count;
+  switch (node->state) {
+    case kWBXMLStatePI:
+    case kWBXMLStatePIText:
+      if ((count = _WBXMLWriteString(writer, "?>")) < 0) return -1;
+      sum += count;
+      break;
+    default:
+      return -1;
+  }
+  if (writer->indent) {
+    if ((count = _WBXMLWriteChar(writer, '\n')) < 0) return -1;
+    sum += count;
+  }
+  _WBXMLPop(writer);
+  return sum;
+}
+
+intptr_t WBXMLStreamWriterWritePI(WBXMLStreamWriterRef writer, const char *target, const char *content) {
+  intptr_t sum, count;
+  if ((sum = _WBXMLStartPI(writer, target)) < 0) return -1;
+  if (content) {
+    if ((count = WBXMLStreamWriterWriteString(writer, content)) < 0) return -1;
+    sum += count;
+  }
+  if ((count = _WBXMLEndPI(writer)) < 0) return -1;
+  return sum + count;
+}
+
+// MARK: DTD
+static
+intptr_t _WBXMLEndDTD(WBXMLStreamWriterRef writer) {
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (!node) return -1;
+  intptr_t sum = 0, count;
+  switch (node->state) {
+    case kWBXMLStateDTDText:
+      if ((count = _WBXMLWriteChar(writer, ']')) < 0) return -1;
+      sum += count;
+      // fall through
+    case kWBXMLStateDTD:
+      if ((count = _WBXMLWriteChar(writer, '>')) < 0) return -1;
+      sum += count;
+      if (writer->indent) {
+        if ((count = _WBXMLWriteChar(writer, '\n')) < 0) return -1;
+        sum += count;
+      }
+      _WBXMLPop(writer);
+      break;
+    default:
+      return -1;
+  }
+  return sum;
+}
+
+intptr_t WBXMLStreamWriterWriteDTD(WBXMLStreamWriterRef writer, const char *name, const char *pubid, const char *sysid, const char *subset) {
+  /* DTD allowed only in prolog */
+  if (!name || !*name || writer->depth > 0) return -1;
+  if (pubid && !sysid) return -1;
+
+  intptr_t sum = 0, count;
+  if (!_WBXMLPush(writer, kWBXMLStateDTD, name)) return -1;
+  if ((count = _WBXMLWriteString(writer, "<!DOCTYPE ")) < 0) return -1;
+  sum += count;
+  if ((count = _WBXMLWriteString(writer, name)) < 0) return -1;
+  sum += count;
+
+  if (pubid) {
+    if ((count = _WBXMLWriteString(writer, writer->indent ? "\n" : " ")) < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteString(writer, "PUBLIC \"")) < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteString(writer, pubid)) < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteChar(writer, '"')) < 0) return -1;
+    sum += count;
+  }
+  if (sysid) {
+    if (!pubid)
+      count = _WBXMLWriteString(writer, writer->indent ? "\nSYSTEM " : " SYSTEM ");
+    else
+      count = _WBXMLWriteString(writer, writer->indent ? "\n       " : " ");
+    if (count < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteChar(writer, '"')) < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteString(writer, sysid)) < 0) return -1;
+    sum += count;
+    if ((count = _WBXMLWriteChar(writer, '"')) < 0) return -1;
+    sum += count;
+  }
+  if (subset) {
+    if ((count = WBXMLStreamWriterWriteString(writer, subset)) < 0) return -1;
+    sum += count;
+  }
+  if ((count = _WBXMLEndDTD(writer)) < 0) return -1;
+  return sum + count;
+}
+
+// MARK: Comment
+intptr_t WBXMLStreamWriterStartComment(WBXMLStreamWriterRef writer) {
+  intptr_t sum = 0, count;
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (node) {
+    switch (node->state) {
+      case kWBXMLStateText:
+      case kWBXMLStateNone:
+        break;
+      case kWBXMLStateName:
+        if ((count = _WBXMLOutputNSDecl(writer)) < 0) return -1;
+        sum += count;
+        if ((count = _WBXMLWriteChar(writer, '>')) < 0) return -1;
+        sum += count;
+        if (writer->indent) {
+          if ((count = _WBXMLWriteChar(writer, '\n')) < 0) return -1;
+          sum += count;
+        }
+        _WBXMLTop(writer)->state = kWBXMLStateText;
+        break;
+      default:
+        return -1;
+    }
+  }
+  if (!_WBXMLPush(writer, kWBXMLStateComment, NULL)) return -1;
+  if (writer->indent) {
+    if ((count = _WBXMLWriteIndent(writer)) < 0) return -1;
+    sum += count;
+  }
+  if ((count = _WBXMLWriteString(writer, "<!--")) < 0) return -1;
+  return sum + count;
+}
+
+intptr_t WBXMLStreamWriterEndComment(WBXMLStreamWriterRef writer) {
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (!node || node->state != kWBXMLStateComment) return -1;
+  intptr_t sum, count;
+  if ((sum = _WBXMLWriteString(writer, "-->")) < 0) return -1;
+  if (writer->indent) {
+    if ((count = _WBXMLWriteChar(writer, '\n')) < 0) return -1;
+    sum += count;
+  }
+  _WBXMLPop(writer);
+  return sum;
+}
+
+intptr_t WBXMLStreamWriterWriteComment(WBXMLStreamWriterRef writer, const char *content) {
+  intptr_t sum, count;
+  if ((sum = WBXMLStreamWriterStartComment(writer)) < 0) return -1;
+  if ((count = WBXMLStreamWriterWriteString(writer, content)) < 0) return -1;
+  sum += count;
+  if ((count = WBXMLStreamWriterEndComment(writer)) < 0) return -1;
+  return sum + count;
+}
+
+// MARK: Element
+intptr_t WBXMLStreamWriterStartElement(WBXMLStreamWriterRef writer, const char *name) {
+  if (!name || !*name) return -1;
+
+  intptr_t sum = 0, count;
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (node) {
+    switch (node->state) {
+      case kWBXMLStatePI:
+      case kWBXMLStatePIText:
+        return -1;
+      case kWBXMLStateAttribute:
+        if ((count = WBXMLStreamWriterEndAttribute(writer)) < 0) return -1;
+        sum += count;
+        // fall through
+      case kWBXMLStateName:
+        if ((count = _WBXMLOutputNSDecl(writer)) < 0) return -1;
+        sum += count;
+        if ((count = _WBXMLWriteChar(writer, '>')) < 0) return -1;
+        sum += count;
+        if (writer->indent) {
+          if ((count = _WBXMLWriteChar(writer, '\n')) < 0) return -1;
+          sum += count;
+        }
+        _WBXMLTop(writer)->state = kWBXMLStateText;
+        break;
+      default:
+        break;
+    }
+  }
+  if (!_WBXMLPush(writer, kWBXMLStateName, name)) return -1;
+  if (writer->indent) {
+    if ((count = _WBXMLWriteIndent(writer)) > 0)
+      sum += count;
+  }
+  if ((count = _WBXMLWriteChar(writer, '<')) < 0) return -1;
+  sum += count;
+  if ((count = _WBXMLWriteString(writer, name)) < 0) return -1;
+  return sum + count;
+}
+
+intptr_t WBXMLStreamWriterStartElementNS(WBXMLStreamWriterRef writer, const char *prefix, const char *name, const char *uri) {
+  if (!name || !*name) return -1;
+
+  intptr_t count;
+  if (prefix) {
+    size_t plen = strlen(prefix), nlen = strlen(name);
+    char stackbuf[256];
+    char *qname = plen + nlen + 2 <= sizeof(stackbuf) ? stackbuf : malloc(plen + nlen + 2);
+    if (!qname) return -1;
+    memcpy(qname, prefix, plen);
+    qname[plen] = ':';
+    memcpy(qname + plen + 1, name, nlen + 1);
+    count = WBXMLStreamWriterStartElement(writer, qname);
+    if (qname != stackbuf) free(qname);
+  } else {
+    count = WBXMLStreamWriterStartElement(writer, name);
+  }
+  if (count < 0) return -1;
+
+  if (uri && !_WBXMLPushNamespace(writer, prefix, uri))
+    return -1;
+  return count;
+}
+
+static
+intptr_t _WBXMLWriteEndTag(WBXMLStreamWriterRef writer, WBXMLNode *node) {
+  intptr_t sum = 0, count;
+  if (writer->indent && writer->doindent) {
+    if ((count = _WBXMLWriteIndent(writer)) < 0) return -1;
+    sum += count;
+  }
+  writer->doindent = true;
+  if ((count = _WBXMLWrite(writer, "</", 2)) < 0) return -1;
+  sum += count;
+  if ((count = _WBXMLWrite(writer, writer->names + node->name, node->length)) < 0) return -1;
+  sum += count;
+  if ((count = _WBXMLWriteChar(writer, '>')) < 0) return -1;
+  return sum + count;
+}
+
+intptr_t WBXMLStreamWriterEndElement(WBXMLStreamWriterRef writer) {
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (!node) return -1;
+
+  intptr_t sum = 0, count;
+  switch (node->state) {
+    case kWBXMLStateAttribute:
+      if ((count = WBXMLStreamWriterEndAttribute(writer)) < 0) return -1;
+      sum += count;
+      // fall through
+    case kWBXMLStateName:
+      if ((count = _WBXMLOutputNSDecl(writer)) < 0) return -1;
+      sum += count;
+      /* next element needs indent */
+      if (writer->indent)
+        writer->doindent = true;
+      if ((count = _WBXMLWrite(writer, "/>", 2)) < 0) return -1;
+      sum += count;
+      break;
+    case kWBXMLStateText:
+      if ((count = _WBXMLWriteEndTag(writer, _WBXMLTop(writer))) < 0) return -1;
+      sum += count;
+      break;
+    default:
+      return -1;
+  }
+  if (writer->indent) {
+    if ((count = _WBXMLWriteChar(writer, '\n')) < 0) return -1;
+    sum += count;
+  }
+  _WBXMLPop(writer);
+  return sum;
+}
+
+intptr_t WBXMLStreamWriterFullEndElement(WBXMLStreamWriterRef writer) {
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (!node) return -1;
+
+  intptr_t sum = 0, count;
+  switch (node->state) {
+    case kWBXMLStateAttribute:
+      if ((count = WBXMLStreamWriterEndAttribute(writer)) < 0) return -1;
+      sum += count;
+      // fall through
+    case kWBXMLStateName:
+      if ((count = _WBXMLOutputNSDecl(writer)) < 0) return -1;
+      sum += count;
+      if ((count = _WBXMLWriteChar(writer, '>')) < 0) return -1;
+      sum += count;
+      if (writer->indent)
+        writer->doindent = false;
+      // fall through
+    case kWBXMLStateText:
+      if ((count = _WBXMLWriteEndTag(writer, _WBXMLTop(writer))) < 0) return -1;
+      sum += count;
+      break;
+    default:
+      return -1;
+  }
+  if (writer->indent) {
+    if ((count = _WBXMLWriteChar(writer, '\n')) < 0) return -1;
+    sum += count;
+  }
+  _WBXMLPop(writer);
+  return sum;
+}
+
+intptr_t WBXMLStreamWriterWriteElement(WBXMLStreamWriterRef writer, const char *name, const char *content) {
+  intptr_t sum, count;
+  if ((sum = WBXMLStreamWriterStartElement(writer, name)) < 0) return -1;
+  if (content) {
+    if ((count = WBXMLStreamWriterWriteString(writer, content)) < 0) return -1;
+    sum += count;
+  }
+  if ((count = WBXMLStreamWriterEndElement(writer)) < 0) return -1;
+  return sum + count;
+}
+
+intptr_t WBXMLStreamWriterWriteElementNS(WBXMLStreamWriterRef writer, const char *prefix, const char *name, const char *uri, const char *content) {
+  intptr_t sum, count;
+  if ((sum = WBXMLStreamWriterStartElementNS(writer, prefix, name, uri)) < 0) return -1;
+  if ((count = WBXMLStreamWriterWriteString(writer, content)) < 0) return -1;
+  sum += count;
+  if ((count = WBXMLStreamWriterEndElement(writer)) < 0) return -1;
+  return sum + count;
+}
+
+// MARK: Attribute
+intptr_t WBXMLStreamWriterStartAttribute(WBXMLStreamWriterRef writer, const char *name) {
+  if (!name || !*name) return -1;
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (!node) return -1;
+
+  intptr_t sum = 0, count;
+  switch (node->state) {
+    case kWBXMLStateAttribute:
+      if ((count = WBXMLStreamWriterEndAttribute(writer)) < 0) return -1;
+      sum += count;
+      // fall through
+    case kWBXMLStateName:
+      if ((count = _WBXMLWriteChar(writer, ' ')) < 0) return -1;
+      sum += count;
+      if ((count = _WBXMLWriteString(writer, name)) < 0) return -1;
+      sum += count;
+      if ((count = _WBXMLWrite(writer, "=\"", 2)) < 0) return -1;
+      sum += count;
+      node->state = kWBXMLStateAttribute;
+      break;
+    default:
+      return -1;
+  }
+  return sum;
+}
+
+intptr_t WBXMLStreamWriterStartAttributeNS(WBXMLStreamWriterRef writer, const char *prefix, const char *name, const char *uri) {
+  if (!name || !*name) return -1;
+  /* Check the state before registering the namespace */
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (!node || (node->state != kWBXMLStateName && node->state != kWBXMLStateAttribute)) return -1;
+
+  bool pushed = false;
+  if (uri) {
+    bool declared = false;
+    size_t plen = prefix ? strlen(prefix) : 0;
+    for (size_t idx = 0; idx < writer->nscount; idx++) {
+      WBXMLNamespace *ns = &writer->nsstack[idx];
+      /* xmlns:<prefix> declared on the same element */
+      if (ns->elem == writer->depth && 0 == strncmp(ns->prefix, "xmlns:", 6) &&
+          0 == strncmp(ns->prefix + 6, prefix ? : "", plen + 1)) {
+        if (0 != strcmp(ns->uri, uri))
+          return -1; // prefix mismatch
+        declared = true;
+        break;
+      }
+    }
+    if (!declared) {
+      if (!_WBXMLPushNamespace(writer, prefix ? : "", uri))
+        return -1;
+      pushed = true;
+    }
+  }
+
+  intptr_t count;
+  if (prefix) {
+    size_t plen = strlen(prefix), nlen = strlen(name);
+    char stackbuf[256];
+    char *qname = plen + nlen + 2 <= sizeof(stackbuf) ? stackbuf : malloc(plen + nlen + 2);
+    if (qname) {
+      memcpy(qname, prefix, plen);
+      qname[plen] = ':';
+      memcpy(qname + plen + 1, name, nlen + 1);
+      count = WBXMLStreamWriterStartAttribute(writer, qname);
+      if (qname != stackbuf) free(qname);
+    } else {
+      count = -1;
+    }
+  } else {
+    count = WBXMLStreamWriterStartAttribute(writer, name);
+  }
+  /* do not leave a declaration without attribute */
+  if (count < 0 && pushed) {
+    writer->nscount--;
+    free(writer->nsstack[writer->nscount].prefix);
+    free(writer->nsstack[writer->nscount].uri);
+  }
+  return count;
+}
+
+intptr_t WBXMLStreamWriterEndAttribute(WBXMLStreamWriterRef writer) {
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (!node || node->state != kWBXMLStateAttribute) return -1;
+  node->state = kWBXMLStateName;
+  return _WBXMLWriteChar(writer, '"');
+}
+
+static
+intptr_t _WBXMLWriteAttributeInternal(WBXMLStreamWriterRef writer, const char *name, const char *content) {
+  intptr_t sum, count;
+  if ((sum = WBXMLStreamWriterStartAttribute(writer, name)) < 0) return -1;
+  if ((count = WBXMLStreamWriterWriteString(writer, content)) < 0) return -1;
+  sum += count;
+  if ((count = WBXMLStreamWriterEndAttribute(writer)) < 0) return -1;
+  return sum + count;
+}
+
+intptr_t WBXMLStreamWriterWriteAttribute(WBXMLStreamWriterRef writer, const char *name, const char *content) {
+  return _WBXMLWriteAttributeInternal(writer, name, content);
+}
+
+intptr_t WBXMLStreamWriterWriteAttributeNS(WBXMLStreamWriterRef writer, const char *prefix, const char *name, const char *uri, const char *content) {
+  intptr_t sum, count;
+  if ((sum = WBXMLStreamWriterStartAttributeNS(writer, prefix, name, uri)) < 0) return -1;
+  if ((count = WBXMLStreamWriterWriteString(writer, content)) < 0) return -1;
+  sum += count;
+  if ((count = WBXMLStreamWriterEndAttribute(writer)) < 0) return -1;
+  return sum + count;
+}
+
+// MARK: Content
+intptr_t WBXMLStreamWriterWriteRaw(WBXMLStreamWriterRef writer, const char *content, size_t length) {
+  if (!content) return -1;
+  intptr_t sum = 0, count;
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (node) {
+    if ((count = _WBXMLHandleStateDependencies(writer, node)) < 0) return -1;
+    sum += count;
+  }
+  if (writer->indent)
+    writer->doindent = false;
+  if ((count = _WBXMLWrite(writer, content, length)) < 0) return -1;
+  return sum + count;
+}
+
+intptr_t WBXMLStreamWriterWriteStringBytes(WBXMLStreamWriterRef writer, const char *content, size_t length) {
+  if (!content) return -1;
+
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (node) {
+    switch (node->state) {
+      case kWBXMLStateName:
+      case kWBXMLStateText: {
+        intptr_t sum = 0, count;
+        if ((count = _WBXMLHandleStateDependencies(writer, node)) < 0) return -1;
+        sum += count;
+        if (writer->indent)
+          writer->doindent = false;
+        if ((count = _WBXMLWriteEscaped(writer, content, length, kWBXMLEscapeText)) < 0) return -1;
+        return sum + count;
+      }
+      case kWBXMLStateAttribute:
+        /* libxml2 does not handle state nor indent for attributes content */
+        return _WBXMLWriteEscaped(writer, content, length,
+                                  writer->encoding ? kWBXMLEscapeAttribute : kWBXMLEscapeAttribute | kWBXMLEscapeNonASCII);
+      default:
+        break;
+    }
+  }
+  return WBXMLStreamWriterWriteRaw(writer, content, length);
+}
+
+intptr_t WBXMLStreamWriterWriteString(WBXMLStreamWriterRef writer, const char *content) {
+  if (!content) return -1;
+  return WBXMLStreamWriterWriteStringBytes(writer, content, strlen(content));
+}
+
+intptr_t WBXMLStreamWriterWriteVFormatString(WBXMLStreamWriterRef writer, const char *format, va_list args) {
+  char *str = NULL;
+  if (vasprintf(&str, format, args) < 0 || !str)
+    return -1;
+  intptr_t count = WBXMLStreamWriterWriteString(writer, str);
+  free(str);
+  return count;
+}
+
+// MARK: CDATA
+intptr_t WBXMLStreamWriterStartCDATA(WBXMLStreamWriterRef writer) {
+  intptr_t sum = 0, count;
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (node) {
+    switch (node->state) {
+      case kWBXMLStateNone:
+      case kWBXMLStateText:
+      case kWBXMLStatePI:
+      case kWBXMLStatePIText:
+        break;
+      case kWBXMLStateAttribute:
+        if ((count = WBXMLStreamWriterEndAttribute(writer)) < 0) return -1;
+        sum += count;
+        // fall through
+      case kWBXMLStateName:
+        if ((count = _WBXMLOutputNSDecl(writer)) < 0) return -1;
+        sum += count;
+        if ((count = _WBXMLWriteChar(writer, '>')) < 0) return -1;
+        sum += count;
+        _WBXMLTop(writer)->state = kWBXMLStateText;
+        break;
+      case kWBXMLStateCDATA:
+        /* CDATA not allowed in this context */
+        return -1;
+      default:
+        return -1;
+    }
+  }
+  if (!_WBXMLPush(writer, kWBXMLStateCDATA, NULL)) return -1;
+  if ((count = _WBXMLWriteString(writer, "<![CDATA[")) < 0) return -1;
+  return sum + count;
+}
+
+intptr_t WBXMLStreamWriterEndCDATA(WBXMLStreamWriterRef writer) {
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (!node || node->state != kWBXMLStateCDATA) return -1;
+  intptr_t count = _WBXMLWrite(writer, "]]>", 3);
+  if (count < 0) return -1;
+  _WBXMLPop(writer);
+  return count;
+}
+
+intptr_t WBXMLStreamWriterWriteCDATA(WBXMLStreamWriterRef writer, const char *content) {
+  intptr_t sum, count;
+  if ((sum = WBXMLStreamWriterStartCDATA(writer)) < 0) return -1;
+  if (content) {
+    if ((count = WBXMLStreamWriterWriteString(writer, content)) < 0) return -1;
+    sum += count;
+  }
+  if ((count = WBXMLStreamWriterEndCDATA(writer)) < 0) return -1;
+  return sum + count;
+}
+
+// MARK: Binary
+static const char sWBXMLBase64Table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char sWBXMLHexTable[] = "0123456789ABCDEF";
+
+/* Same line breaking than libxml2 (CRLF every 72 chars) */
+#define kWBXMLBase64LineLength 72
+/* Streaming read size. Multiple of 3, so only the last chunk has to be padded. */
+#define kWBXMLBinaryChunkSize (54 * 1024)
+/* Mapped files are encoded by segments, and the consumed pages released */
+#define kWBXMLBinaryMapSegment (3 * 1024 * 1024)
+
+/* Encodes 'count' 3 bytes groups. 'end' is the end of the readable source (vector loads may read past the last group). */
+static
+uint8_t *_WBXMLBase64EncodeGroups(uint8_t *dst, const uint8_t *src, const uint8_t *end, size_t count) {
+#if defined(__SSSE3__)
+  /* 12 bytes -> 16 chars (W. Mula's pshufb encoder) */
+  const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                      '/' - 63, 'A', 0, 0);
+  while (count >= 4 && end - src >= 16) {
+    __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), shuffle);
+    __m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+    __m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(hi, lo);
+    /* map each 6 bits index to the offset to add to get its ASCII value */
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+    _mm_storeu_si128((__m128i *)dst, _mm_add_epi8(_mm_shuffle_epi8(shift, range), indices));
+    src += 12;
+    dst += 16;
+    count -= 4;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  /* 48 bytes -> 64 chars */
+  const uint8x16x4_t table = { { vld1q_u8((const uint8_t *)sWBXMLBase64Table), vld1q_u8((const uint8_t *)sWBXMLBase64Table + 16),
+    vld1q_u8((const uint8_t *)sWBXMLBase64Table + 32), vld1q_u8((const uint8_t *)sWBXMLBase64Table + 48) } };
+  const uint8x16_t mask = vdupq_n_u8(0x3f);
+  while (count >= 16) {
+    uint8x16x3_t in = vld3q_u8(src);
+    uint8x16x4_t out;
+    out.val[0] = vqtbl4q_u8(table, vshrq_n_u8(in.val[0], 2));
+    out.val[1] = vqtbl4q_u8(table, vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask));
+    out.val[2] = vqtbl4q_u8(table, vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask));
+    out.val[3] = vqtbl4q_u8(table, vandq_u8(in.val[2], mask));
+    vst4q_u8(dst, out);
+    src += 48;
+    dst += 64;
+    count -= 16;
+  }
+  (void)end;
+#else
+  (void)end;
+#endif
+  while (count-- > 0) {
+    uint32_t group = ((uint32_t)src[0] << 16) | ((uint32_t)src[1] << 8) | src[2];
+    *dst++ = sWBXMLBase64Table[(group >> 18) & 0x3f];
+    *dst++ = sWBXMLBase64Table[(group >> 12) & 0x3f];
+    *dst++ = sWBXMLBase64Table[(group >> 6) & 0x3f];
+    *dst++ = sWBXMLBase64Table[group & 0x3f];
+    src += 3;
+  }
+  return dst;
+}
+
+/* Encodes straight into the output buffer, one line at a time.
+ 'linelen' is the line state, so a payload can be encoded in many calls.
+ If length is not a multiple of 3, the last group is padded (and it must be the last call). */
+static
+intptr_t _WBXMLEncodeBase64(WBXMLStreamWriterRef writer, const uint8_t *src, size_t length, size_t *linelen) {
+  intptr_t sum = 0;
+  const uint8_t *end = src + length;
+  while (src < end) {
+    uint8_t *dst = _WBXMLReserve(writer, kWBXMLBase64LineLength + 2);
+    if (!dst) return -1;
+    uint8_t *start = dst;
+    if (*linelen >= kWBXMLBase64LineLength) {
+      *dst++ = '\r';
+      *dst++ = '\n';
+      *linelen = 0;
+    }
+    size_t groups = MIN((size_t)(end - src) / 3, (kWBXMLBase64LineLength - *linelen) / 4);
+    dst = _WBXMLBase64EncodeGroups(dst, src, end, groups);
+    src += groups * 3;
+    *linelen += groups * 4;
+
+    size_t left = (size_t)(end - src);
+    if (left > 0 && left < 3 && *linelen < kWBXMLBase64LineLength) {
+      uint32_t group = (uint32_t)src[0] << 16;
+      if (left > 1) group |= (uint32_t)src[1] << 8;
+      *dst++ = sWBXMLBase64Table[(group >> 18) & 0x3f];
+      *dst++ = sWBXMLBase64Table[(group >> 12) & 0x3f];
+      *dst++ = left > 1 ? sWBXMLBase64Table[(group >> 6) & 0x3f] : '=';
+      *dst++ = '=';
+      src = end;
+      *linelen += 4;
+    }
+    _WBXMLCommit(writer, dst - start);
+    sum += dst - start;
+  }
+  return sum;
+}
+
+static
+void _WBXMLHexEncodeBytes(uint8_t *dst, const uint8_t *src, size_t length) {
+#if defined(__SSE2__)
+  const __m128i nibble = _mm_set1_epi8(0x0f), nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0'), letter = _mm_set1_epi8('A' - '0' - 10);
+  for (; length >= 16; length -= 16, src += 16, dst += 32) {
+    __m128i v = _mm_loadu_si128((const __m128i *)src);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    __m128i lo = _mm_and_si128(v, nibble);
+    __m128i first = _mm_unpacklo_epi8(hi, lo), second = _mm_unpackhi_epi8(hi, lo);
+    first = _mm_add_epi8(_mm_add_epi8(first, zero), _mm_and_si128(_mm_cmpgt_epi8(first, nine), letter));
+    second = _mm_add_epi8(_mm_add_epi8(second, zero), _mm_and_si128(_mm_cmpgt_epi8(second, nine), letter));
+    _mm_storeu_si128((__m128i *)dst, first);
+    _mm_storeu_si128((__m128i *)(dst + 16), second);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t table = vld1q_u8((const uint8_t *)sWBXMLHexTable);
+  for (; length >= 16; length -= 16, src += 16, dst += 32) {
+    uint8x16_t v = vld1q_u8(src);
+    uint8x16x2_t out = { { vqtbl1q_u8(table, vshrq_n_u8(v, 4)), vqtbl1q_u8(table, vandq_u8(v, vdupq_n_u8(0x0f))) } };
+    vst2q_u8(dst, out);
+  }
+#endif
+  while (length-- > 0) {
+    *dst++ = sWBXMLHexTable[*src >> 4];
+    *dst++ = sWBXMLHexTable[*src & 0xf];
+    src++;
+  }
+}
+
+static
+intptr_t _WBXMLEncodeBinHex(WBXMLStreamWriterRef writer, const uint8_t *src, size_t length) {
+  intptr_t sum = 0;
+  while (length > 0) {
+    size_t chunk = MIN(length, writer->capacity / 2);
+    uint8_t *dst = _WBXMLReserve(writer, chunk * 2);
+    if (!dst) return -1;
+    _WBXMLHexEncodeBytes(dst, src, chunk);
+    _WBXMLCommit(writer, chunk * 2);
+    sum += chunk * 2;
+    src += chunk;
+    length -= chunk;
+  }
+  return sum;
+}
+
+static
+intptr_t _WBXMLStartBinary(WBXMLStreamWriterRef writer) {
+  intptr_t count = 0;
+  WBXMLNode *node = _WBXMLTop(writer);
+  if (node && (count = _WBXMLHandleStateDependencies(writer, node)) < 0)
+    return -1;
+  if (writer->indent)
+    writer->doindent = false;
+  return count;
+}
+
+intptr_t WBXMLStreamWriterWriteBase64(WBXMLStreamWriterRef writer, const void *bytes, size_t length) {
+  if (!bytes && length) return -1;
+  intptr_t sum, count;
+  if ((sum = _WBXMLStartBinary(writer)) < 0) return -1;
+  size_t linelen = 0;
+  if ((count = _WBXMLEncodeBase64(writer, bytes, length, &linelen)) < 0) return -1;
+  return sum + count;
+}
+
+intptr_t WBXMLStreamWriterWriteBinHex(WBXMLStreamWriterRef writer, const void *bytes, size_t length) {
+  if (!bytes && length) return -1;
+  intptr_t sum, count;
+  if ((sum = _WBXMLStartBinary(writer)) < 0) return -1;
+  if ((count = _WBXMLEncodeBinHex(writer, bytes, length)) < 0) return -1;
+  return sum + count;
+}
+
+// MARK: Binary Streaming
+static
+intptr_t _WBXMLFileDescriptorRead(void *buffer, size_t length, void *ctxt) {
+  ssize_t count;
+  do {
+    count = read((int)(intptr_t)ctxt, buffer, length);
+  } while (count < 0 && EINTR == errno);
+  return count;
+}
+
+static
+intptr_t _WBXMLWriteBinaryWithFunction(WBXMLStreamWriterRef writer, bool base64, WBXMLStreamWriterReadFunction reader, void *ctxt) {
+  if (!reader) return -1;
+  intptr_t sum = _WBXMLStartBinary(writer);
+  if (sum < 0) return -1;
+
+  uint8_t *chunk = malloc(kWBXMLBinaryChunkSize);
+  if (!chunk) return -1;
+  intptr_t count;
+  size_t linelen = 0, pending = 0;
+  do {
+    count = reader(chunk + pending, kWBXMLBinaryChunkSize - pending, ctxt);
+    if (count < 0) break;
+    /* keep the incomplete base64 group for the next read */
+    size_t avail = pending + (size_t)count;
+    size_t length = (count == 0 || !base64) ? avail : avail - avail % 3;
+    if (length > 0) {
+      intptr_t written = base64 ? _WBXMLEncodeBase64(writer, chunk, length, &linelen) : _WBXMLEncodeBinHex(writer, chunk, length);
+      if (written < 0) {
+        count = -1;
+        break;
+      }
+      sum += written;
+    }
+    pending = avail - length;
+    if (pending > 0)
+      memmove(chunk, chunk + length, pending);
+  } while (count > 0);
+  free(chunk);
+  return count < 0 ? -1 : sum;
+}
+
+/* Regular files are mapped and encoded without intermediate copy */
+static
+intptr_t _WBXMLWriteBinaryWithFileDescriptor(WBXMLStreamWriterRef writer, bool base64, int fd) {
+  struct stat st;
+  off_t offset;
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (offset = lseek(fd, 0, SEEK_CUR)) < 0 ||
+      st.st_size <= offset || (uint64_t)(st.st_size - offset) > SIZE_MAX / 2)
+    return _WBXMLWriteBinaryWithFunction(writer, base64, _WBXMLFileDescriptorRead, (void *)(intptr_t)fd);
+
+  off_t base = offset - offset % (off_t)sysconf(_SC_PAGESIZE);
+  size_t mapsize = (size_t)(st.st_size - base);
+  uint8_t *map = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, fd, base);
+  if (MAP_FAILED == map)
+    return _WBXMLWriteBinaryWithFunction(writer, base64, _WBXMLFileDescriptorRead, (void *)(intptr_t)fd);
+  madvise(map, mapsize, MADV_SEQUENTIAL);
+
+  intptr_t sum = _WBXMLStartBinary(writer);
+  size_t linelen = 0;
+  const uint8_t *src = map + (offset - base), *end = map + mapsize;
+  const size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+  while (sum >= 0 && src < end) {
+    size_t length = MIN((size_t)(end - src), (size_t)kWBXMLBinaryMapSegment);
+    intptr_t count = base64 ? _WBXMLEncodeBase64(writer, src, length, &linelen) : _WBXMLEncodeBinHex(writer, src, length);
+    src += length;
+    sum = count < 0 ? -1 : sum + count;
+    /* keep the resident size bounded */
+    size_t consumed = (size_t)(src - map) - (size_t)(src - map) % pagesize;
+    if (consumed > 0)
+      madvise(map, consumed, MADV_DONTNEED);
+  }
+  munmap(map, mapsize);
+  /* leave the file offset as a read loop would */
+  if (sum >= 0)
+    lseek(fd, st.st_size, SEEK_SET);
+  return sum;
+}
+
+intptr_t WBXMLStreamWriterWriteBase64WithFunction(WBXMLStreamWriterRef writer, WBXMLStreamWriterReadFunction reader, void *ctxt) {
+  return _WBXMLWriteBinaryWithFunction(writer, true, reader, ctxt);
+}
+
+intptr_t WBXMLStreamWriterWriteBase64WithFileDescriptor(WBXMLStreamWriterRef writer, int fd) {
+  return _WBXMLWriteBinaryWithFileDescriptor(writer, true, fd);
+}
+
+intptr_t WBXMLStreamWriterWriteBinHexWithFunction(WBXMLStreamWriterRef writer, WBXMLStreamWriterReadFunction reader, void *ctxt) {
+  return _WBXMLWriteBinaryWithFunction(writer, false, reader, ctxt);
+}
+
+intptr_t WBXMLStreamWriterWriteBinHexWithFileDescriptor(WBXMLStreamWriterRef writer, int fd) {
+  return _WBXMLWriteBinaryWithFileDescriptor(writer, false, fd);
+}
@@ -0,0 +1,159 @@
+/*
+ *  WBXMLStreamWriter.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#if !defined(__WB_XML_STREAM_WRITER_H)
+#define __WB_XML_STREAM_WRITER_H 1
+
+#include <WonderBox/WBBase.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*!
+ @header WBXMLStreamWriter
+ @abstract Native UTF-8 XML writer.
+ @discussion This writer produces the exact same output than the libxml2 xmlTextWriter
+ API, but avoid most of its per call overhead. Output is accumulated in a single reusable
+ buffer that is flushed to the output function (or file descriptor) when full.
+ All strings are expected to be UTF-8 encoded.
+ All functions return the number of bytes written, or -1 on error.
+ */
+
+__BEGIN_DECLS
+
+typedef struct __WBXMLStreamWriter *WBXMLStreamWriterRef;
+
+/* must write all bytes, and return -1 on error */
+typedef intptr_t (*WBXMLStreamWriterOutputFunction)(const void *bytes, size_t length, void *ctxt);
+typedef void (*WBXMLStreamWriterCloseFunction)(void *ctxt);
+
+/* bufferSize: 0 to use the default (256 KB). */
+WB_EXPORT
+WBXMLStreamWriterRef WBXMLStreamWriterCreate(WBXMLStreamWriterOutputFunction output,
+                                             WBXMLStreamWriterCloseFunction close,
+                                             void *ctxt, size_t bufferSize);
+WB_EXPORT
+WBXMLStreamWriterRef WBXMLStreamWriterCreateWithFileDescriptor(int fd, bool closeOnFree, size_t bufferSize);
+
+/* flush the pending output and release the writer */
+WB_EXPORT
+void WBXMLStreamWriterFree(WBXMLStreamWriterRef writer);
+
+WB_EXPORT
+intptr_t WBXMLStreamWriterFlush(WBXMLStreamWriterRef writer);
+
+/* total number of bytes generated (including not yet flushed bytes) */
+WB_EXPORT
+uint64_t WBXMLStreamWriterGetLength(WBXMLStreamWriterRef writer);
+
+/* Raw output. Can be used to stack an other writer on top of this one. */
+WB_EXPORT
+intptr_t WBXMLStreamWriterOutputBytes(const void *bytes, size_t length, void *writer);
+
+WB_EXPORT
+int WBXMLStreamWriterSetIndent(WBXMLStreamWriterRef writer, bool indent);
+WB_EXPORT
+int WBXMLStreamWriterSetIndentString(WBXMLStreamWriterRef writer, const char *str);
+
+// MARK: Document
+/* Only UTF-8 output is supported. Returns -1 if encoding is not UTF-8. */
+WB_EXPORT
+intptr_t WBXMLStreamWriterStartDocument(WBXMLStreamWriterRef writer, const char *version, const char *encoding, const char *standalone);
+WB_EXPORT
+intptr_t WBXMLStreamWriterEndDocument(WBXMLStreamWriterRef writer);
+
+WB_EXPORT
+intptr_t WBXMLStreamWriterWritePI(WBXMLStreamWriterRef writer, const char *target, const char *content);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteDTD(WBXMLStreamWriterRef writer, const char *name, const char *pubid, const char *sysid, const char *subset);
+
+// MARK: Comment
+WB_EXPORT
+intptr_t WBXMLStreamWriterStartComment(WBXMLStreamWriterRef writer);
+WB_EXPORT
+intptr_t WBXMLStreamWriterEndComment(WBXMLStreamWriterRef writer);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteComment(WBXMLStreamWriterRef writer, const char *content);
+
+// MARK: Element
+WB_EXPORT
+intptr_t WBXMLStreamWriterStartElement(WBXMLStreamWriterRef writer, const char *name);
+WB_EXPORT
+intptr_t WBXMLStreamWriterStartElementNS(WBXMLStreamWriterRef writer, const char *prefix, const char *name, const char *uri);
+WB_EXPORT
+intptr_t WBXMLStreamWriterEndElement(WBXMLStreamWriterRef writer);
+WB_EXPORT
+intptr_t WBXMLStreamWriterFullEndElement(WBXMLStreamWriterRef writer);
+
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteElement(WBXMLStreamWriterRef writer, const char *name, const char *content);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteElementNS(WBXMLStreamWriterRef writer, const char *prefix, const char *name, const char *uri, const char *content);
+
+// MARK: Attribute
+WB_EXPORT
+intptr_t WBXMLStreamWriterStartAttribute(WBXMLStreamWriterRef writer, const char *name);
+WB_EXPORT
+intptr_t WBXMLStreamWriterStartAttributeNS(WBXMLStreamWriterRef writer, const char *prefix, const char *name, const char *uri);
+WB_EXPORT
+intptr_t WBXMLStreamWriterEndAttribute(WBXMLStreamWriterRef writer);
+
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteAttribute(WBXMLStreamWriterRef writer, const char *name, const char *content);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteAttributeNS(WBXMLStreamWriterRef writer, const char *prefix, const char *name, const char *uri, const char *content);
+
+// MARK: Content
+/* escape content according to the current state */
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteString(WBXMLStreamWriterRef writer, const char *content);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteStringBytes(WBXMLStreamWriterRef writer, const char *content, size_t length);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteVFormatString(WBXMLStreamWriterRef writer, const char *format, va_list args) WB_FORMAT(2, 0);
+
+WB_EXPORT
+intptr_t WBXMLStreamWriterStartCDATA(WBXMLStreamWriterRef writer);
+WB_EXPORT
+intptr_t WBXMLStreamWriterEndCDATA(WBXMLStreamWriterRef writer);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteCDATA(WBXMLStreamWriterRef writer, const char *content);
+
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteBase64(WBXMLStreamWriterRef writer, const void *bytes, size_t length);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteBinHex(WBXMLStreamWriterRef writer, const void *bytes, size_t length);
+
+/* Streaming binary content.
+ The source is read by chunks and encoded straight into the output buffer, so memory usage
+ does not depend on the payload size. The output is the same than a single WriteBase64 or
+ WriteBinHex call with the whole content. Regular files are mapped instead of read. */
+
+/* returns the number of bytes read, 0 at end of stream, or -1 on error */
+typedef intptr_t (*WBXMLStreamWriterReadFunction)(void *buffer, size_t length, void *ctxt);
+
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteBase64WithFunction(WBXMLStreamWriterRef writer, WBXMLStreamWriterReadFunction reader, void *ctxt);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteBase64WithFileDescriptor(WBXMLStreamWriterRef writer, int fd);
+
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteBinHexWithFunction(WBXMLStreamWriterRef writer, WBXMLStreamWriterReadFunction reader, void *ctxt);
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteBinHexWithFileDescriptor(WBXMLStreamWriterRef writer, int fd);
+
+WB_EXPORT
+intptr_t WBXMLStreamWriterWriteRaw(WBXMLStreamWriterRef writer, const char *content, size_t length);
+
+__END_DECLS
+
+#endif /* __WB_XML_STREAM_WRITER_H */
@@ -9,6 +9,7 @@
  */
 
 #import <WonderBox/WBBase.h>
+#import <WonderBox/WBXMLStreamWriter.h>
 
 #import <Foundation/Foundation.h>
 
@@ -16,12 +17,23 @@ WB_OBJC_EXPORT
 @interface WBXMLWriter : NSObject {
 @private
   bool wb_indent;
-  void *wb_pwriter;
+  void *wb_pwriter; // libxml2 writer
+  void *wb_stream; // WBXMLStreamWriter
+  CFMutableDictionaryRef wb_names;
+  CFMutableDictionaryRef wb_retired;
+  char *wb_scratch;
+  size_t wb_scratchSize;
+  id wb_output;
+  NSString *wb_indentString;
 }
 
+/* File URLs and data use the native UTF-8 writer (see WBXMLStreamWriter.h).
+ libxml2 is used if the document declares an other encoding. */
 - (id)initWithURL:(NSURL *)anURL;
 - (id)initWithData:(NSMutableData *)data;
+- (id)initWithFileDescriptor:(int)fd closeOnDealloc:(BOOL)closeOnDealloc;
 
+/* libxml2 xmlTextWriterPtr */
 - (id)initWithNativeWriter:(void *)aWriter;
 
 #pragma mark -
@@ -99,6 +111,16 @@ WB_OBJC_EXPORT
 - (NSInteger)writeBinHexData:(NSData *)aData range:(NSRange)aRange;
 - (NSInteger)writeBinHexBytes:(const void *)bytes range:(NSRange)aRange;
 
+/* Streaming variants: the source is encoded by chunks, so memory usage is bounded whatever the payload size.
+ The stream must be opened. It is read until the end, but not closed. */
+- (NSInteger)writeBase64Stream:(CFReadStreamRef)aStream;
+- (NSInteger)writeBase64FileDescriptor:(int)fd;
+- (NSInteger)writeBase64WithFunction:(WBXMLStreamWriterReadFunction)reader context:(void *)ctxt;
+
+- (NSInteger)writeBinHexStream:(CFReadStreamRef)aStream;
+- (NSInteger)writeBinHexFileDescriptor:(int)fd;
+- (NSInteger)writeBinHexWithFunction:(WBXMLStreamWriterReadFunction)reader context:(void *)ctxt;
+
 #pragma mark Raw
 - (NSInteger)writeRawString:(NSString *)aString;
 - (NSInteger)writeRawUTF8String:(const char *)str;
@@ -9,48 +9,184 @@
  */
 
 #import <WonderBox/WBXMLWriter.h>
+#import <WonderBox/WBXMLStreamWriter.h>
 
+#include <fcntl.h>
+#include <unistd.h>
 #include <libxml/xmlwriter.h>
 
 #define wb_writer (xmlTextWriterPtr)wb_pwriter
+#define wb_native (WBXMLStreamWriterRef)wb_stream
 #define XSTR(str) (const xmlChar *)(str)
 
 static
-int _WBNSDataXMLOutputWrite(void *context, const char * buffer, int len) {
-  NSMutableData *data = (NSMutableData *)context;
-  [data appendBytes:buffer length:len];
-  return len;
+intptr_t _WBNSDataStreamOutput(const void *bytes, size_t length, void *ctxt) {
+  [(NSMutableData *)ctxt appendBytes:bytes length:length];
+  return (intptr_t)length;
 }
 
+/* used to stack a libxml2 writer on top of the native writer output */
 static
-int _WBNSDataXMLOutputClose(void *context) {
-  [(id)context release];
-  return 0;
+int _WBStreamXMLOutputWrite(void *context, const char *buffer, int len) {
+  return (int)WBXMLStreamWriterOutputBytes(buffer, len, context);
+}
+
+static
+bool _WBIsUTF8Encoding(NSString *encoding) {
+  return !encoding || NSOrderedSame == [encoding caseInsensitiveCompare:@"UTF-8"] ||
+    NSOrderedSame == [encoding caseInsensitiveCompare:@"UTF8"];
+}
+
+static
+intptr_t _WBCFReadStreamRead(void *buffer, size_t length, void *ctxt) {
+  return CFReadStreamRead((CFReadStreamRef)ctxt, buffer, (CFIndex)MIN(length, (size_t)LONG_MAX));
+}
+
+static
+intptr_t _WBFileDescriptorRead(void *buffer, size_t length, void *ctxt) {
+  ssize_t count;
+  do {
+    count = read((int)(intptr_t)ctxt, buffer, length);
+  } while (count < 0 && EINTR == errno);
+  return count;
+}
+
+/* libxml2 does not support streaming: write the content by chunks.
+ Chunks are multiple of 3, so only the last base64 group is padded. */
+#define kWBXMLWriterChunkSize (54 * 1024)
+
+static
+NSInteger _WBXMLTextWriterWriteBinary(xmlTextWriterPtr writer, bool base64, WBXMLStreamWriterReadFunction reader, void *ctxt) {
+  char *chunk = malloc(kWBXMLWriterChunkSize);
+  if (!chunk) return -1;
+  intptr_t count;
+  NSInteger sum = 0;
+  size_t pending = 0;
+  do {
+    count = reader(chunk + pending, kWBXMLWriterChunkSize - pending, ctxt);
+    if (count < 0) break;
+    size_t avail = pending + (size_t)count;
+    size_t length = (count == 0 || !base64) ? avail : avail - avail % 3;
+    if (length > 0) {
+      int written = base64 ? xmlTextWriterWriteBase64(writer, chunk, 0, (int)length) : xmlTextWriterWriteBinHex(writer, chunk, 0, (int)length);
+      if (written < 0) {
+        count = -1;
+        break;
+      }
+      sum += written;
+    }
+    pending = avail - length;
+    if (pending > 0)
+      memmove(chunk, chunk + length, pending);
+  } while (count > 0);
+  free(chunk);
+  return count < 0 ? -1 : sum;
+}
+
+#pragma mark Strings
+static
+void _WBNameRelease(CFAllocatorRef allocator, const void *value) {
+  free((void *)value);
 }
 
+/* Element and attribute names are usually a small set of strings: keep the UTF-8 version around */
+#define kWBXMLWriterMaxNames 1024
+
 static
-xmlOutputBufferPtr _WBXMLCreateNSDataOutputBuffer(NSMutableData *data, xmlCharEncodingHandlerPtr encoder) {
-  NSCParameterAssert(data);
-  xmlOutputBufferPtr output = xmlOutputBufferCreateIO(_WBNSDataXMLOutputWrite, _WBNSDataXMLOutputClose, data, encoder);
-  if (output) [data retain]; // closing the buffer will release the data.
-  return output;
+const char *_WBXMLWriterName(WBXMLWriter *self, NSString *name) {
+  if (!name) return NULL;
+  const char *str = CFStringGetCStringPtr(SPXNSToCFString(name), kCFStringEncodingUTF8);
+  if (str) return str;
+
+  if (!self->wb_names) {
+    CFDictionaryValueCallBacks values = { 0, NULL, _WBNameRelease, NULL, NULL };
+    self->wb_names = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &values);
+  } else if ((str = CFDictionaryGetValue(self->wb_names, SPXNSToCFString(name)))) {
+    return str;
+  } else if (self->wb_retired && (str = CFDictionaryGetValue(self->wb_retired, SPXNSToCFString(name)))) {
+    return str;
+  }
+  /* A method can look up several names: the strings returned before a flush must stay valid.
+   The full table is retired, and released on the next flush, kWBXMLWriterMaxNames lookups later. */
+  if (CFDictionaryGetCount(self->wb_names) >= kWBXMLWriterMaxNames) {
+    SPXCFRelease(self->wb_retired);
+    self->wb_retired = self->wb_names;
+    CFDictionaryValueCallBacks values = { 0, NULL, _WBNameRelease, NULL, NULL };
+    self->wb_names = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &values);
+  }
+
+  str = strdup([name UTF8String]);
+  if (str) {
+    CFStringRef key = CFStringCreateCopy(kCFAllocatorDefault, SPXNSToCFString(name));
+    CFDictionarySetValue(self->wb_names, key, str);
+    CFRelease(key);
+  }
+  return str;
+}
+
+/* Convert content into a reusable buffer instead of creating an autoreleased C string */
+static
+const char *_WBXMLWriterString(WBXMLWriter *self, NSString *string) {
+  if (!string) return NULL;
+  CFStringRef str = SPXNSToCFString(string);
+  const char *cstr = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+  if (cstr) return cstr;
+
+  CFIndex length = CFStringGetLength(str);
+  CFIndex size = CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8) + 1;
+  if ((size_t)size > self->wb_scratchSize) {
+    char *scratch = realloc(self->wb_scratch, size);
+    if (!scratch) return [string UTF8String];
+    self->wb_scratch = scratch;
+    self->wb_scratchSize = size;
+  }
+  CFIndex used = 0;
+  CFStringGetBytes(str, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, false, (UInt8 *)self->wb_scratch, size - 1, &used);
+  self->wb_scratch[used] = '\0';
+  return self->wb_scratch;
 }
 
 @implementation WBXMLWriter
 
 - (id)initWithURL:(NSURL *)anURL {
+  if ([anURL isFileURL]) {
+    int fd = open([[anURL path] fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      [self release];
+      return nil;
+    }
+    return [self initWithFileDescriptor:fd closeOnDealloc:YES];
+  }
   return [self initWithNativeWriter:xmlNewTextWriterFilename([[anURL absoluteString] UTF8String], 0)];
 }
 
 - (id)initWithData:(NSMutableData *)data {
-  xmlOutputBufferPtr output = _WBXMLCreateNSDataOutputBuffer(data, NULL);
-  if (output) {
-    self = [self initWithNativeWriter:xmlNewTextWriter(output)];
-    if (!self)
-      xmlOutputBufferClose(output);
+  NSParameterAssert(data);
+  WBXMLStreamWriterRef stream = WBXMLStreamWriterCreate(_WBNSDataStreamOutput, NULL, data, 0);
+  if (!stream) {
+    [self release];
+    return nil;
+  }
+  if (self = [super init]) {
+    wb_stream = stream;
+    wb_output = [data retain];
   } else {
+    WBXMLStreamWriterFree(stream);
+  }
+  return self;
+}
+
+- (id)initWithFileDescriptor:(int)fd closeOnDealloc:(BOOL)closeOnDealloc {
+  WBXMLStreamWriterRef stream = WBXMLStreamWriterCreateWithFileDescriptor(fd, closeOnDealloc, 0);
+  if (!stream) {
+    if (closeOnDealloc && fd >= 0) close(fd);
     [self release];
-    self = nil;
+    return nil;
+  }
+  if (self = [super init]) {
+    wb_stream = stream;
+  } else {
+    WBXMLStreamWriterFree(stream);
   }
   return self;
 }
@@ -67,6 +203,10 @@ xmlOutputBufferPtr _WBXMLCreateNSDataOutputBuffer(NSMutableData *data, xmlCharEn
 
 - (void)dealloc {
   [self close];
+  SPXCFRelease(wb_names);
+  SPXCFRelease(wb_retired);
+  [wb_indentString release];
+  free(wb_scratch);
   [super dealloc];
 }
 
@@ -74,6 +214,8 @@ xmlOutputBufferPtr _WBXMLCreateNSDataOutputBuffer(NSMutableData *data, xmlCharEn
 - (NSInteger)flush {
   if (wb_pwriter)
     return xmlTextWriterFlush(wb_writer);
+  if (wb_stream)
+    return WBXMLStreamWriterFlush(wb_native);
   return 0;
 }
 - (void)close {
@@ -82,79 +224,144 @@ xmlOutputBufferPtr _WBXMLCreateNSDataOutputBuffer(NSMutableData *data, xmlCharEn
     xmlFreeTextWriter(wb_writer);
     wb_pwriter = NULL;
   }
+  if (wb_stream) {
+    WBXMLStreamWriterFree(wb_native);
+    wb_stream = NULL;
+  }
+  SPXSetterRetain(wb_output, nil);
 }
 
 - (BOOL)indent {
   return wb_indent;
 }
 - (void)setIndent:(BOOL)indent {
-  if (0 == xmlTextWriterSetIndent(wb_writer, indent ? 1 : 0))
+  if (wb_pwriter) {
+    if (0 == xmlTextWriterSetIndent(wb_writer, indent ? 1 : 0))
+      wb_indent = indent;
+  } else if (0 == WBXMLStreamWriterSetIndent(wb_native, indent)) {
     wb_indent = indent;
+  }
 }
 - (void)setIndentString:(NSString *)str {
-  xmlTextWriterSetIndentString(wb_writer, XSTR([str UTF8String]));
+  /* applied again if the libxml2 writer is created later */
+  SPXSetterCopy(wb_indentString, str);
+  if (wb_pwriter)
+    xmlTextWriterSetIndentString(wb_writer, XSTR([str UTF8String]));
+  else
+    WBXMLStreamWriterSetIndentString(wb_native, [str UTF8String]);
 }
 
 #pragma mark Document
 - (NSInteger)startDocument:(NSString *)version encoding:(NSString *)encoding standalone:(NSString *)standalone {
-  return xmlTextWriterStartDocument(wb_writer, [version UTF8String], [encoding UTF8String], [standalone UTF8String]);
+  /* the native writer only outputs UTF-8. Fall back to libxml2 for other encodings. */
+  if (!wb_pwriter && !_WBIsUTF8Encoding(encoding)) {
+    if (WBXMLStreamWriterGetLength(wb_native) > 0)
+      return -1;
+    xmlOutputBufferPtr output = xmlOutputBufferCreateIO(_WBStreamXMLOutputWrite, NULL, wb_stream, NULL);
+    if (!output) return -1;
+    wb_pwriter = xmlNewTextWriter(output);
+    if (!wb_pwriter) {
+      xmlOutputBufferClose(output);
+      return -1;
+    }
+    if (wb_indent)
+      xmlTextWriterSetIndent(wb_writer, 1);
+    if (wb_indentString)
+      xmlTextWriterSetIndentString(wb_writer, XSTR([wb_indentString UTF8String]));
+  }
+  if (wb_pwriter)
+    return xmlTextWriterStartDocument(wb_writer, [version UTF8String], [encoding UTF8String], [standalone UTF8String]);
+  return WBXMLStreamWriterStartDocument(wb_native, [version UTF8String], [encoding UTF8String], [standalone UTF8String]);
 }
 
 - (NSInteger)endDocument {
-  return xmlTextWriterEndDocument(wb_writer);
+  if (wb_pwriter)
+    return xmlTextWriterEndDocument(wb_writer);
+  return WBXMLStreamWriterEndDocument(wb_native);
 }
 
 - (NSInteger)writeProcessingInstruction:(NSString *)target content:(NSString *)content {
-  return xmlTextWriterWritePI(wb_writer, XSTR([target UTF8String]), XSTR([content UTF8String]));
+  if (wb_pwriter)
+    return xmlTextWriterWritePI(wb_writer, XSTR([target UTF8String]), XSTR([content UTF8String]));
+  return WBXMLStreamWriterWritePI(wb_native, [target UTF8String], _WBXMLWriterString(self, content));
 }
 
 - (NSInteger)writeDocType:(NSString *)name publicID:(NSString *)pub systemID:(NSString *)sys subset:(NSString *)subset {
-  return xmlTextWriterWriteDTD(wb_writer, XSTR([name UTF8String]), XSTR([pub UTF8String]), XSTR([sys UTF8String]), XSTR([subset UTF8String]));
+  if (wb_pwriter)
+    return xmlTextWriterWriteDTD(wb_writer, XSTR([name UTF8String]), XSTR([pub UTF8String]), XSTR([sys UTF8String]), XSTR([subset UTF8String]));
+  return WBXMLStreamWriterWriteDTD(wb_native, [name UTF8String], [pub UTF8String], [sys UTF8String], [subset UTF8String]);
 }
 
 #pragma mark Comment
 - (NSInteger)startComment {
-  return xmlTextWriterStartComment(wb_writer);
+  if (wb_pwriter)
+    return xmlTextWriterStartComment(wb_writer);
+  return WBXMLStreamWriterStartComment(wb_native);
 }
 - (NSInteger)endComment {
-  return xmlTextWriterEndComment(wb_writer);
+  if (wb_pwriter)
+    return xmlTextWriterEndComment(wb_writer);
+  return WBXMLStreamWriterEndComment(wb_native);
 }
 - (NSInteger)writeCommentString:(NSString *)aComment {
-  return [self writeCommentUTF8String:[aComment UTF8String]];
+  return [self writeCommentUTF8String:_WBXMLWriterString(self, aComment)];
 }
 - (NSInteger)writeCommentUTF8String:(const char *)aComment {
-  return xmlTextWriterWriteComment(wb_writer, XSTR(aComment));
+  if (wb_pwriter)
+    return xmlTextWriterWriteComment(wb_writer, XSTR(aComment));
+  return WBXMLStreamWriterWriteComment(wb_native, aComment);
 }
 - (NSInteger)writeCommentWithFormat:(const char *)format, ... {
   va_list args;
   va_start(args, format);
-  NSInteger count = xmlTextWriterWriteVFormatComment(wb_writer, format, args);
+  NSInteger count = -1;
+  if (wb_pwriter) {
+    count = xmlTextWriterWriteVFormatComment(wb_writer, format, args);
+  } else {
+    char *str = NULL;
+    if (vasprintf(&str, format, args) >= 0) {
+      count = WBXMLStreamWriterWriteComment(wb_native, str);
+      free(str);
+    }
+  }
   va_end(args);
   return count;
 }
 
 #pragma mark Element
 - (NSInteger)startElement:(NSString *)name {
-  return xmlTextWriterStartElement(wb_writer, XSTR([name UTF8String]));
+  if (wb_pwriter)
+    return xmlTextWriterStartElement(wb_writer, XSTR(_WBXMLWriterName(self, name)));
+  return WBXMLStreamWriterStartElement(wb_native, _WBXMLWriterName(self, name));
 }
 
 - (NSInteger)startElement:(NSString *)name prefix:(NSString *)prefix namespace:(NSString *)namespaceURI {
-  return xmlTextWriterStartElementNS(wb_writer, XSTR([prefix UTF8String]), XSTR([name UTF8String]), XSTR([namespaceURI UTF8String]));
+  const char *cname = _WBXMLWriterName(self, name), *cprefix = _WBXMLWriterName(self, prefix);
+  const char *curi = _WBXMLWriterName(self, namespaceURI);
+  if (wb_pwriter)
+    return xmlTextWriterStartElementNS(wb_writer, XSTR(cprefix), XSTR(cname), XSTR(curi));
+  return WBXMLStreamWriterStartElementNS(wb_native, cprefix, cname, curi);
 }
 - (NSInteger)endElement {
-  return xmlTextWriterEndElement(wb_writer);
+  if (wb_pwriter)
+    return xmlTextWriterEndElement(wb_writer);
+  return WBXMLStreamWriterEndElement(wb_native);
 }
 - (NSInteger)endElement:(BOOL)full {
-  if (full) return xmlTextWriterFullEndElement(wb_writer);
-  return xmlTextWriterEndElement(wb_writer);
+  if (!full) return [self endElement];
+  if (wb_pwriter)
+    return xmlTextWriterFullEndElement(wb_writer);
+  return WBXMLStreamWriterFullEndElement(wb_native);
 }
 
 - (NSInteger)writeElement:(NSString *)name string:(NSString *)content {
-  return [self writeElement:name UTF8String:[content UTF8String]];
+  return [self writeElement:name UTF8String:_WBXMLWriterString(self, content)];
 }
 - (NSInteger)writeElement:(NSString *)name UTF8String:(const char *)content {
   if (!content) return [self writeEmptyElement:name];
-  return xmlTextWriterWriteElement(wb_writer, XSTR([name UTF8String]), XSTR(content));
+  if (wb_pwriter)
+    return xmlTextWriterWriteElement(wb_writer, XSTR(_WBXMLWriterName(self, name)), XSTR(content));
+  return WBXMLStreamWriterWriteElement(wb_native, _WBXMLWriterName(self, name), content);
 }
 - (NSInteger)writeEmptyElement:(NSString *)name {
   NSInteger cnt = [self startElement:name];
@@ -168,23 +375,47 @@ xmlOutputBufferPtr _WBXMLCreateNSDataOutputBuffer(NSMutableData *data, xmlCharEn
 - (NSInteger)writeElement:(NSString *)name format:(const char *)format, ... {
   va_list args;
   va_start(args, format);
-  NSInteger count = xmlTextWriterWriteVFormatElement(wb_writer, XSTR([name UTF8String]), format, args);
+  NSInteger count = -1;
+  if (wb_pwriter) {
+    count = xmlTextWriterWriteVFormatElement(wb_writer, XSTR(_WBXMLWriterName(self, name)), format, args);
+  } else {
+    char *str = NULL;
+    if (vasprintf(&str, format, args) >= 0) {
+      count = WBXMLStreamWriterWriteElement(wb_native, _WBXMLWriterName(self, name), str);
+      free(str);
+    }
+  }
   va_end(args);
   return count;
 }
 
 - (NSInteger)writeElement:(NSString *)name prefix:(NSString *)prefix namespace:(NSString *)namespaceURI string:(NSString *)content {
-  return [self writeElement:name prefix:prefix namespace:namespaceURI UTF8String:[content UTF8String]];
+  return [self writeElement:name prefix:prefix namespace:namespaceURI UTF8String:_WBXMLWriterString(self, content)];
 }
 - (NSInteger)writeElement:(NSString *)name prefix:(NSString *)prefix namespace:(NSString *)namespaceURI UTF8String:(const char *)content {
   if (!content) return [self writeEmptyElement:name prefix:prefix namespace:namespaceURI];
-  return xmlTextWriterWriteElementNS(wb_writer, XSTR([prefix UTF8String]), XSTR([name UTF8String]), XSTR([namespaceURI UTF8String]), XSTR(content));
+  const char *cname = _WBXMLWriterName(self, name), *cprefix = _WBXMLWriterName(self, prefix);
+  const char *curi = _WBXMLWriterName(self, namespaceURI);
+  if (wb_pwriter)
+    return xmlTextWriterWriteElementNS(wb_writer, XSTR(cprefix), XSTR(cname), XSTR(curi), XSTR(content));
+  return WBXMLStreamWriterWriteElementNS(wb_native, cprefix, cname, curi, content);
 }
 
 - (NSInteger)writeElement:(NSString *)name prefix:(NSString *)prefix namespace:(NSString *)namespaceURI format:(const char *)format, ... {
+  const char *cname = _WBXMLWriterName(self, name), *cprefix = _WBXMLWriterName(self, prefix);
+  const char *curi = _WBXMLWriterName(self, namespaceURI);
   va_list args;
   va_start(args, format);
-  NSInteger count = xmlTextWriterWriteVFormatElementNS(wb_writer, XSTR([prefix UTF8String]), XSTR([name UTF8String]), XSTR([namespaceURI UTF8String]), format, args);
+  NSInteger count = -1;
+  if (wb_pwriter) {
+    count = xmlTextWriterWriteVFormatElementNS(wb_writer, XSTR(cprefix), XSTR(cname), XSTR(curi), format, args);
+  } else {
+    char *str = NULL;
+    if (vasprintf(&str, format, args) >= 0) {
+      count = WBXMLStreamWriterWriteElementNS(wb_native, cprefix, cname, curi, str);
+      free(str);
+    }
+  }
   va_end(args);
   return count;
 }
@@ -200,121 +431,222 @@ xmlOutputBufferPtr _WBXMLCreateNSDataOutputBuffer(NSMutableData *data, xmlCharEn
 
 #pragma mark Attribute
 - (NSInteger)startAttribute:(NSString *)name {
-  return xmlTextWriterStartAttribute(wb_writer, XSTR([name UTF8String]));
+  if (wb_pwriter)
+    return xmlTextWriterStartAttribute(wb_writer, XSTR(_WBXMLWriterName(self, name)));
+  return WBXMLStreamWriterStartAttribute(wb_native, _WBXMLWriterName(self, name));
 }
 - (NSInteger)startAttribute:(NSString *)name prefix:(NSString *)prefix namespace:(NSString *)namespaceURI {
-  return xmlTextWriterStartAttributeNS(wb_writer, XSTR([prefix UTF8String]), XSTR([name UTF8String]), XSTR([namespaceURI UTF8String]));
+  const char *cname = _WBXMLWriterName(self, name), *cprefix = _WBXMLWriterName(self, prefix);
+  const char *curi = _WBXMLWriterName(self, namespaceURI);
+  if (wb_pwriter)
+    return xmlTextWriterStartAttributeNS(wb_writer, XSTR(cprefix), XSTR(cname), XSTR(curi));
+  return WBXMLStreamWriterStartAttributeNS(wb_native, cprefix, cname, curi);
 }
 - (NSInteger)endAtttribute {
-  return xmlTextWriterEndAttribute(wb_writer);
+  if (wb_pwriter)
+    return xmlTextWriterEndAttribute(wb_writer);
+  return WBXMLStreamWriterEndAttribute(wb_native);
 }
 
 - (NSInteger)writeAttribute:(NSString *)name string:(NSString *)content {
-  return [self writeAttribute:name UTF8String:[content UTF8String]];
+  return [self writeAttribute:name UTF8String:_WBXMLWriterString(self, content)];
 }
 - (NSInteger)writeAttribute:(NSString *)name UTF8String:(const char *)content {
-  return xmlTextWriterWriteAttribute(wb_writer, XSTR([name UTF8String]), XSTR(content));
+  if (wb_pwriter)
+    return xmlTextWriterWriteAttribute(wb_writer, XSTR(_WBXMLWriterName(self, name)), XSTR(content));
+  return WBXMLStreamWriterWriteAttribute(wb_native, _WBXMLWriterName(self, name), content);
 }
 
 - (NSInteger)writeAttribute:(NSString *)name format:(const char *)format, ... {
   va_list args;
   va_start(args, format);
-  NSInteger count = xmlTextWriterWriteVFormatAttribute(wb_writer, XSTR([name UTF8String]), format, args);
+  NSInteger count = -1;
+  if (wb_pwriter) {
+    count = xmlTextWriterWriteVFormatAttribute(wb_writer, XSTR(_WBXMLWriterName(self, name)), format, args);
+  } else {
+    char *str = NULL;
+    if (vasprintf(&str, format, args) >= 0) {
+      count = WBXMLStreamWriterWriteAttribute(wb_native, _WBXMLWriterName(self, name), str);
+      free(str);
+    }
+  }
   va_end(args);
   return count;
 }
 
 - (NSInteger)writeAttribute:(NSString *)name prefix:(NSString *)prefix namespace:(NSString *)namespaceURI string:(NSString *)content {
-  return [self writeAttribute:name prefix:prefix namespace:namespaceURI UTF8String:[content UTF8String]];
+  return [self writeAttribute:name prefix:prefix namespace:namespaceURI UTF8String:_WBXMLWriterString(self, content)];
 }
 - (NSInteger)writeAttribute:(NSString *)name prefix:(NSString *)prefix namespace:(NSString *)namespaceURI UTF8String:(const char *)content {
-  return xmlTextWriterWriteAttributeNS(wb_writer, XSTR([prefix UTF8String]), XSTR([name UTF8String]), XSTR([namespaceURI UTF8String]), XSTR(content));
+  const char *cname = _WBXMLWriterName(self, name), *cprefix = _WBXMLWriterName(self, prefix);
+  const char *curi = _WBXMLWriterName(self, namespaceURI);
+  if (wb_pwriter)
+    return xmlTextWriterWriteAttributeNS(wb_writer, XSTR(cprefix), XSTR(cname), XSTR(curi), XSTR(content));
+  return WBXMLStreamWriterWriteAttributeNS(wb_native, cprefix, cname, curi, content);
 }
 
 - (NSInteger)writeAttribute:(NSString *)name prefix:(NSString *)prefix namespace:(NSString *)namespaceURI format:(const char *)format, ... {
+  const char *cname = _WBXMLWriterName(self, name), *cprefix = _WBXMLWriterName(self, prefix);
+  const char *curi = _WBXMLWriterName(self, namespaceURI);
   va_list args;
   va_start(args, format);
-  NSInteger count = xmlTextWriterWriteVFormatAttributeNS(wb_writer, XSTR([prefix UTF8String]), XSTR([name UTF8String]), XSTR([namespaceURI UTF8String]), format, args);
+  NSInteger count = -1;
+  if (wb_pwriter) {
+    count = xmlTextWriterWriteVFormatAttributeNS(wb_writer, XSTR(cprefix), XSTR(cname), XSTR(curi), format, args);
+  } else {
+    char *str = NULL;
+    if (vasprintf(&str, format, args) >= 0) {
+      count = WBXMLStreamWriterWriteAttributeNS(wb_native, cprefix, cname, curi, str);
+      free(str);
+    }
+  }
   va_end(args);
   return count;
 }
 
 #pragma mark String
 - (NSInteger)writeString:(NSString *)aString {
-  return [self writeUTF8String:[aString UTF8String]];
+  return [self writeUTF8String:_WBXMLWriterString(self, aString)];
 }
 - (NSInteger)writeUTF8String:(const char *)str {
-  return xmlTextWriterWriteString(wb_writer, XSTR(str));
+  if (wb_pwriter)
+    return xmlTextWriterWriteString(wb_writer, XSTR(str));
+  return WBXMLStreamWriterWriteString(wb_native, str);
 }
 - (NSInteger)writeFormat:(const char *)format, ... {
   va_list args;
   va_start(args, format);
-  NSInteger count = xmlTextWriterWriteVFormatString(wb_writer, format, args);
+  NSInteger count;
+  if (wb_pwriter)
+    count = xmlTextWriterWriteVFormatString(wb_writer, format, args);
+  else
+    count = WBXMLStreamWriterWriteVFormatString(wb_native, format, args);
   va_end(args);
   return count;
 }
 
 #pragma mark CDATA
 - (NSInteger)startCDATA {
-  return xmlTextWriterStartCDATA(wb_writer);
+  if (wb_pwriter)
+    return xmlTextWriterStartCDATA(wb_writer);
+  return WBXMLStreamWriterStartCDATA(wb_native);
 }
 - (NSInteger)endCDATA {
-  return xmlTextWriterEndCDATA(wb_writer);
+  if (wb_pwriter)
+    return xmlTextWriterEndCDATA(wb_writer);
+  return WBXMLStreamWriterEndCDATA(wb_native);
 }
 
 - (NSInteger)writeCDATA:(NSString *)cdata {
-  return [self writeUTF8CDATA:[cdata UTF8String]];
+  return [self writeUTF8CDATA:_WBXMLWriterString(self, cdata)];
 }
 - (NSInteger)writeUTF8CDATA:(const char *)cdata {
-  return xmlTextWriterWriteCDATA(wb_writer, XSTR(cdata));
+  if (wb_pwriter)
+    return xmlTextWriterWriteCDATA(wb_writer, XSTR(cdata));
+  return WBXMLStreamWriterWriteCDATA(wb_native, cdata);
 }
 - (NSInteger)writeCDATAFormat:(const char *)format, ... {
   va_list args;
   va_start(args, format);
-  NSInteger count = xmlTextWriterWriteVFormatCDATA(wb_writer, format, args);
+  NSInteger count = -1;
+  if (wb_pwriter) {
+    count = xmlTextWriterWriteVFormatCDATA(wb_writer, format, args);
+  } else {
+    char *str = NULL;
+    if (vasprintf(&str, format, args) >= 0) {
+      count = WBXMLStreamWriterWriteCDATA(wb_native, str);
+      free(str);
+    }
+  }
   va_end(args);
   return count;
 }
 
 #pragma mark Data
 - (NSInteger)writeBase64Data:(NSData *)aData {
-  return xmlTextWriterWriteBase64(wb_writer, [aData bytes], 0, [aData length]);
+  return [self writeBase64Bytes:[aData bytes] range:NSMakeRange(0, [aData length])];
 }
 - (NSInteger)writeBase64Data:(NSData *)aData range:(NSRange)aRange {
   /* should check range */
-  return xmlTextWriterWriteBase64(wb_writer, [aData bytes], aRange.location, aRange.length);
+  return [self writeBase64Bytes:[aData bytes] range:aRange];
 }
 - (NSInteger)writeBase64Bytes:(const void *)bytes range:(NSRange)aRange {
-  return xmlTextWriterWriteBase64(wb_writer, bytes, aRange.location, aRange.length);
+  if (wb_pwriter)
+    return xmlTextWriterWriteBase64(wb_writer, bytes, (int)aRange.location, (int)aRange.length);
+  return WBXMLStreamWriterWriteBase64(wb_native, (const uint8_t *)bytes + aRange.location, aRange.length);
 }
 
 - (NSInteger)writeBinHexData:(NSData *)aData {
-  return xmlTextWriterWriteBinHex(wb_writer, [aData bytes], 0, [aData length]);
+  return [self writeBinHexBytes:[aData bytes] range:NSMakeRange(0, [aData length])];
 }
 - (NSInteger)writeBinHexData:(NSData *)aData range:(NSRange)aRange {
   /* should check range */
-  return xmlTextWriterWriteBinHex(wb_writer, [aData bytes], aRange.location, aRange.length);
+  return [self writeBinHexBytes:[aData bytes] range:aRange];
 }
 - (NSInteger)writeBinHexBytes:(const void *)bytes range:(NSRange)aRange {
-  return xmlTextWriterWriteBinHex(wb_writer, bytes, aRange.location, aRange.length);
+  if (wb_pwriter)
+    return xmlTextWriterWriteBinHex(wb_writer, bytes, (int)aRange.location, (int)aRange.length);
+  return WBXMLStreamWriterWriteBinHex(wb_native, (const uint8_t *)bytes + aRange.location, aRange.length);
+}
+
+- (NSInteger)writeBase64Stream:(CFReadStreamRef)aStream {
+  return [self writeBase64WithFunction:_WBCFReadStreamRead context:(void *)aStream];
+}
+- (NSInteger)writeBase64FileDescriptor:(int)fd {
+  if (wb_pwriter)
+    return _WBXMLTextWriterWriteBinary(wb_writer, true, _WBFileDescriptorRead, (void *)(intptr_t)fd);
+  return WBXMLStreamWriterWriteBase64WithFileDescriptor(wb_native, fd);
+}
+- (NSInteger)writeBase64WithFunction:(WBXMLStreamWriterReadFunction)reader context:(void *)ctxt {
+  if (wb_pwriter)
+    return _WBXMLTextWriterWriteBinary(wb_writer, true, reader, ctxt);
+  return WBXMLStreamWriterWriteBase64WithFunction(wb_native, reader, ctxt);
+}
+
+- (NSInteger)writeBinHexStream:(CFReadStreamRef)aStream {
+  return [self writeBinHexWithFunction:_WBCFReadStreamRead context:(void *)aStream];
+}
+- (NSInteger)writeBinHexFileDescriptor:(int)fd {
+  if (wb_pwriter)
+    return _WBXMLTextWriterWriteBinary(wb_writer, false, _WBFileDescriptorRead, (void *)(intptr_t)fd);
+  return WBXMLStreamWriterWriteBinHexWithFileDescriptor(wb_native, fd);
+}
+- (NSInteger)writeBinHexWithFunction:(WBXMLStreamWriterReadFunction)reader context:(void *)ctxt {
+  if (wb_pwriter)
+    return _WBXMLTextWriterWriteBinary(wb_writer, false, reader, ctxt);
+  return WBXMLStreamWriterWriteBinHexWithFunction(wb_native, reader, ctxt);
 }
 
 #pragma mark Raw
 - (NSInteger)writeRawString:(NSString *)aString {
-  return [self writeRawUTF8String:[aString UTF8String]];
+  return [self writeRawUTF8String:_WBXMLWriterString(self, aString)];
 }
 - (NSInteger)writeRawUTF8String:(const char *)str {
-  return xmlTextWriterWriteRaw(wb_writer, XSTR(str));
+  if (wb_pwriter)
+    return xmlTextWriterWriteRaw(wb_writer, XSTR(str));
+  return str ? WBXMLStreamWriterWriteRaw(wb_native, str, strlen(str)) : -1;
 }
 - (NSInteger)writeRawFormat:(const char *)format, ... {
   va_list args;
   va_start(args, format);
-  NSInteger count = xmlTextWriterWriteVFormatRaw(wb_writer, format, args);
+  NSInteger count = -1;
+  if (wb_pwriter) {
+    count = xmlTextWriterWriteVFormatRaw(wb_writer, format, args);
+  } else {
+    char *str = NULL;
+    int length = vasprintf(&str, format, args);
+    if (length >= 0) {
+      count = WBXMLStreamWriterWriteRaw(wb_native, str, length);
+      free(str);
+    }
+  }
   va_end(args);
   return count;
 }
 - (NSInteger)writeRawUTF8String:(const char *)bytes range:(NSRange)range {
-  return xmlTextWriterWriteRawLen(wb_writer, XSTR(bytes + range.location), range.length);
+  if (wb_pwriter)
+    return xmlTextWriterWriteRawLen(wb_writer, XSTR(bytes + range.location), (int)range.length);
+  return WBXMLStreamWriterWriteRaw(wb_native, bytes + range.location, range.length);
 }
 
 
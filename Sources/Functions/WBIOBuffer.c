@@ -0,0 +1,208 @@
+/*
+ *  WBIOBuffer.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include <WonderBox/WBIOBuffer.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+struct __WBIOBuffer {
+  int fd;
+  uint8_t *bytes;
+  /* capacity - 1 */
+  size_t mask;
+  /* offset of the first buffered byte */
+  size_t head;
+  size_t length;
+};
+
+WBIOBufferRef WBIOBufferCreate(int fd, size_t capacity) {
+  size_t size = 64;
+  while (size < capacity && size <= SIZE_MAX / 2)
+    size <<= 1;
+
+  WBIOBufferRef buffer = calloc(1, sizeof(*buffer));
+  if (!buffer)
+    return NULL;
+  buffer->bytes = malloc(size);
+  if (!buffer->bytes) {
+    free(buffer);
+    return NULL;
+  }
+  buffer->fd = fd;
+  buffer->mask = size - 1;
+  return buffer;
+}
+
+void WBIOBufferFree(WBIOBufferRef buffer) {
+  if (!buffer)
+    return;
+  free(buffer->bytes);
+  free(buffer);
+}
+
+int WBIOBufferGetDescriptor(WBIOBufferRef buffer) {
+  return buffer->fd;
+}
+
+size_t WBIOBufferGetCapacity(WBIOBufferRef buffer) {
+  return buffer->mask + 1;
+}
+
+size_t WBIOBufferGetLength(WBIOBufferRef buffer) {
+  return buffer->length;
+}
+
+// MARK: Segments
+static
+int _WBIOBufferSegments(WBIOBufferRef buffer, size_t offset, size_t length, struct iovec iov[2]) {
+  if (0 == length)
+    return 0;
+  size_t capacity = buffer->mask + 1;
+  size_t start = offset & buffer->mask;
+  size_t first = capacity - start;
+  iov[0].iov_base = buffer->bytes + start;
+  if (length <= first) {
+    iov[0].iov_len = length;
+    return 1;
+  }
+  iov[0].iov_len = first;
+  iov[1].iov_base = buffer->bytes;
+  iov[1].iov_len = length - first;
+  return 2;
+}
+
+int WBIOBufferPeek(WBIOBufferRef buffer, struct iovec iov[2]) {
+  return _WBIOBufferSegments(buffer, buffer->head, buffer->length, iov);
+}
+
+int WBIOBufferReserve(WBIOBufferRef buffer, struct iovec iov[2]) {
+  return _WBIOBufferSegments(buffer, buffer->head + buffer->length, buffer->mask + 1 - buffer->length, iov);
+}
+
+// MARK: Reader
+void WBIOBufferConsume(WBIOBufferRef buffer, size_t length) {
+  check(length <= buffer->length);
+  if (length >= buffer->length) {
+    /* restart at the beginning to maximize the contiguous free space */
+    buffer->head = 0;
+    buffer->length = 0;
+  } else {
+    buffer->head = (buffer->head + length) & buffer->mask;
+    buffer->length -= length;
+  }
+}
+
+const void *WBIOBufferPeekContiguous(WBIOBufferRef buffer, size_t length) {
+  if (length > buffer->length)
+    return NULL;
+
+  size_t first = buffer->mask + 1 - buffer->head;
+  if (length <= first)
+    return buffer->bytes + buffer->head;
+
+  /* the buffered bytes wrap: move them to the beginning, saving the smallest part */
+  size_t second = buffer->length - first;
+  if (first <= second) {
+    uint8_t *tmp = malloc(first);
+    if (!tmp)
+      return NULL;
+    memcpy(tmp, buffer->bytes + buffer->head, first);
+    memmove(buffer->bytes + first, buffer->bytes, second);
+    memcpy(buffer->bytes, tmp, first);
+    free(tmp);
+  } else {
+    uint8_t *tmp = malloc(second);
+    if (!tmp)
+      return NULL;
+    memcpy(tmp, buffer->bytes, second);
+    memmove(buffer->bytes, buffer->bytes + buffer->head, first);
+    memcpy(buffer->bytes + first, tmp, second);
+    free(tmp);
+  }
+  buffer->head = 0;
+  return buffer->bytes;
+}
+
+size_t WBIOBufferRead(WBIOBufferRef buffer, void *data, size_t length) {
+  struct iovec iov[2];
+  size_t done = 0;
+  int count = _WBIOBufferSegments(buffer, buffer->head, MIN(length, buffer->length), iov);
+  for (int idx = 0; idx < count; idx++) {
+    memcpy((uint8_t *)data + done, iov[idx].iov_base, iov[idx].iov_len);
+    done += iov[idx].iov_len;
+  }
+  WBIOBufferConsume(buffer, done);
+  return done;
+}
+
+int WBIOBufferFill(WBIOBufferRef buffer, size_t *bytesRead) {
+  struct iovec iov[2];
+  int err = 0;
+  ssize_t count = 0;
+  int segments = WBIOBufferReserve(buffer, iov);
+  if (0 == segments) {
+    err = ENOBUFS;
+  } else {
+    do {
+      count = readv(buffer->fd, iov, segments);
+    } while (count < 0 && errno == EINTR);
+    if (count > 0)
+      buffer->length += (size_t)count;
+    else
+      err = count < 0 ? errno : EOF;
+  }
+  if (bytesRead)
+    *bytesRead = count > 0 ? (size_t)count : 0;
+  return err;
+}
+
+// MARK: Writer
+void WBIOBufferCommit(WBIOBufferRef buffer, size_t length) {
+  check(length <= buffer->mask + 1 - buffer->length);
+  buffer->length += length;
+}
+
+size_t WBIOBufferWrite(WBIOBufferRef buffer, const void *data, size_t length) {
+  struct iovec iov[2];
+  size_t done = 0;
+  int count = _WBIOBufferSegments(buffer, buffer->head + buffer->length,
+                                  MIN(length, buffer->mask + 1 - buffer->length), iov);
+  for (int idx = 0; idx < count; idx++) {
+    memcpy(iov[idx].iov_base, (const uint8_t *)data + done, iov[idx].iov_len);
+    done += iov[idx].iov_len;
+  }
+  buffer->length += done;
+  return done;
+}
+
+int WBIOBufferFlush(WBIOBufferRef buffer, size_t *bytesWritten) {
+  struct iovec iov[2];
+  int err = 0;
+  ssize_t count = 0;
+  int segments = WBIOBufferPeek(buffer, iov);
+  if (segments > 0) {
+    do {
+      count = writev(buffer->fd, iov, segments);
+    } while (count < 0 && errno == EINTR);
+    if (count > 0)
+      WBIOBufferConsume(buffer, (size_t)count);
+    else if (count < 0)
+      err = errno;
+  }
+  if (bytesWritten)
+    *bytesWritten = count > 0 ? (size_t)count : 0;
+  return err;
+}
@@ -0,0 +1,88 @@
+/*
+ *  WBIOBuffer.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#if !defined(__WB_IO_BUFFER_H)
+#define __WB_IO_BUFFER_H 1
+
+#include <WonderBox/WBBase.h>
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*!
+ @header WBIOBuffer
+ @abstract Ring buffer attached to a file descriptor.
+ @discussion Used as a reader, the buffer is filled from the descriptor and the client peeks and
+ consumes the buffered bytes. Used as a writer, the client appends bytes and flushes them to the
+ descriptor. The free and used space can be accessed without copy, as one or two segments, and each
+ fill or flush is a single readv()/writev() call.
+ A buffer is not thread safe, and does not own its descriptor.
+ */
+
+__BEGIN_DECLS
+
+typedef struct __WBIOBuffer *WBIOBufferRef;
+
+/* capacity is rounded up to a power of two. NULL on failure. */
+WB_EXPORT
+WBIOBufferRef WBIOBufferCreate(int fd, size_t capacity);
+WB_EXPORT
+void WBIOBufferFree(WBIOBufferRef buffer);
+
+WB_EXPORT
+int WBIOBufferGetDescriptor(WBIOBufferRef buffer);
+
+WB_EXPORT
+size_t WBIOBufferGetCapacity(WBIOBufferRef buffer);
+/* number of buffered bytes */
+WB_EXPORT
+size_t WBIOBufferGetLength(WBIOBufferRef buffer);
+
+// MARK: Reader
+/* Read as much as possible in the free space. Returns 0, EOF at end of file, or an errno value
+ (ENOBUFS if the buffer is full, EAGAIN if a non-blocking descriptor has no data). */
+WB_EXPORT
+int WBIOBufferFill(WBIOBufferRef buffer, size_t *bytesRead);
+
+/* Buffered bytes. Returns the number of segments (0, 1 or 2). */
+WB_EXPORT
+int WBIOBufferPeek(WBIOBufferRef buffer, struct iovec iov[2]);
+
+/* Returns the first length bytes as a contiguous range, or NULL if less bytes are buffered.
+ The bytes are only moved if they wrap around the end of the ring. */
+WB_EXPORT
+const void *WBIOBufferPeekContiguous(WBIOBufferRef buffer, size_t length);
+
+WB_EXPORT
+void WBIOBufferConsume(WBIOBufferRef buffer, size_t length);
+
+/* Copy and consume up to length bytes. Returns the number of bytes copied. */
+WB_EXPORT
+size_t WBIOBufferRead(WBIOBufferRef buffer, void *data, size_t length);
+
+// MARK: Writer
+/* Free space. Returns the number of segments (0, 1 or 2).
+ Bytes written in the segments are appended with WBIOBufferCommit(). */
+WB_EXPORT
+int WBIOBufferReserve(WBIOBufferRef buffer, struct iovec iov[2]);
+WB_EXPORT
+void WBIOBufferCommit(WBIOBufferRef buffer, size_t length);
+
+/* Append up to length bytes. Returns the number of bytes appended. */
+WB_EXPORT
+size_t WBIOBufferWrite(WBIOBufferRef buffer, const void *data, size_t length);
+
+/* Write the buffered bytes with a single writev() call. Returns 0 or an errno value. */
+WB_EXPORT
+int WBIOBufferFlush(WBIOBufferRef buffer, size_t *bytesWritten);
+
+__END_DECLS
+
+#endif /* __WB_IO_BUFFER_H */
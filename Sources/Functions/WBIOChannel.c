@@ -0,0 +1,351 @@
+/*
+ *  WBIOChannel.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include <WonderBox/WBIOChannel.h>
+#include <WonderBox/WBUnixFunctions.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+
+/* chunks sent per writev() */
+#define WB_IO_CHANNEL_IOV_MAX 64
+#define WB_IO_CHANNEL_CHUNK_SIZE (16 * 1024)
+
+typedef struct _WBIOChunk {
+  struct _WBIOChunk *next;
+  /* [start, end) bytes are pending */
+  size_t start, end;
+  size_t capacity;
+  uint8_t bytes[];
+} WBIOChunk;
+
+struct __WBIOChannel {
+  int fd;
+  bool socket;
+  WBIOReactorRef reactor;
+  WBIOChannelCallBacks callbacks;
+  void *ctxt;
+
+  WBIOBufferRef input;
+  WBIOChunk *head, *tail;
+  size_t pending;
+  size_t high, low;
+
+  /* events registered in the reactor */
+  uint32_t events;
+  /* pending bytes exceeded the high watermark */
+  bool overloaded;
+  bool paused;
+  /* read buffer full */
+  bool full;
+  /* false once closed, or after an error */
+  bool active;
+  /* closed from a callback: released when the callback returns */
+  bool released;
+  int busy;
+};
+
+static
+void _WBIOChannelUpdate(WBIOChannelRef channel) {
+  if (!channel->active)
+    return;
+  uint32_t events = 0;
+  if (!channel->paused && !channel->full)
+    events |= kWBIOReactorRead;
+  if (channel->pending > 0)
+    events |= kWBIOReactorWrite;
+  if (events != channel->events && 0 == WBIOReactorModify(channel->reactor, channel->fd, events))
+    channel->events = events;
+}
+
+static
+void _WBIOChannelFail(WBIOChannelRef channel, int error) {
+  if (!channel->active)
+    return;
+  channel->active = false;
+  WBIOReactorRemove(channel->reactor, channel->fd);
+  if (channel->callbacks.closed)
+    channel->callbacks.closed(channel, error, channel->ctxt);
+}
+
+// MARK: Write Queue
+static
+void _WBIOChannelFreeChunks(WBIOChannelRef channel) {
+  WBIOChunk *chunk = channel->head;
+  while (chunk) {
+    WBIOChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  channel->head = channel->tail = NULL;
+  channel->pending = 0;
+}
+
+static
+ssize_t _WBIOChannelWritev(WBIOChannelRef channel, struct iovec *iov, int count) {
+#if defined(MSG_NOSIGNAL)
+  /* avoid SIGPIPE when the peer is gone */
+  if (channel->socket) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+    return sendmsg(channel->fd, &msg, MSG_NOSIGNAL);
+  }
+#endif
+  return writev(channel->fd, iov, count);
+}
+
+static
+void _WBIOChannelFlush(WBIOChannelRef channel) {
+  while (channel->active && channel->head) {
+    int count = 0;
+    struct iovec iov[WB_IO_CHANNEL_IOV_MAX];
+    for (WBIOChunk *chunk = channel->head; chunk && count < WB_IO_CHANNEL_IOV_MAX; chunk = chunk->next) {
+      iov[count].iov_base = chunk->bytes + chunk->start;
+      iov[count].iov_len = chunk->end - chunk->start;
+      count++;
+    }
+
+    ssize_t written = _WBIOChannelWritev(channel, iov, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        _WBIOChannelFail(channel, errno);
+      break;
+    }
+
+    channel->pending -= (size_t)written;
+    while (written > 0) {
+      WBIOChunk *chunk = channel->head;
+      size_t length = MIN((size_t)written, chunk->end - chunk->start);
+      chunk->start += length;
+      written -= length;
+      if (chunk->start == chunk->end) {
+        channel->head = chunk->next;
+        if (!channel->head)
+          channel->tail = NULL;
+        free(chunk);
+      }
+    }
+  }
+
+  if (channel->active && channel->overloaded && channel->pending <= channel->low) {
+    channel->overloaded = false;
+    if (channel->callbacks.writable)
+      channel->callbacks.writable(channel, channel->ctxt);
+  }
+}
+
+bool WBIOChannelWrite(WBIOChannelRef channel, const void *data, size_t length) {
+  if (!channel->active) {
+    errno = EPIPE;
+    return false;
+  }
+
+  const uint8_t *bytes = data;
+  /* small writes are appended to the last chunk */
+  WBIOChunk *tail = channel->tail;
+  if (tail && tail->end < tail->capacity) {
+    size_t count = MIN(length, tail->capacity - tail->end);
+    memcpy(tail->bytes + tail->end, bytes, count);
+    tail->end += count;
+    channel->pending += count;
+    bytes += count;
+    length -= count;
+  }
+  if (length > 0) {
+    size_t capacity = MAX(length, (size_t)WB_IO_CHANNEL_CHUNK_SIZE);
+    WBIOChunk *chunk = malloc(sizeof(*chunk) + capacity);
+    if (!chunk) {
+      errno = ENOMEM;
+      return false;
+    }
+    chunk->next = NULL;
+    chunk->start = 0;
+    chunk->end = length;
+    chunk->capacity = capacity;
+    memcpy(chunk->bytes, bytes, length);
+    if (channel->tail)
+      channel->tail->next = chunk;
+    else
+      channel->head = chunk;
+    channel->tail = chunk;
+    channel->pending += length;
+  }
+
+  /* the bytes are sent when the reactor reports the descriptor writable */
+  if (!(channel->events & kWBIOReactorWrite))
+    _WBIOChannelUpdate(channel);
+
+  if (channel->pending > channel->high) {
+    channel->overloaded = true;
+    return false;
+  }
+  return true;
+}
+
+size_t WBIOChannelGetPendingLength(WBIOChannelRef channel) {
+  return channel->pending;
+}
+
+// MARK: Events
+static
+void _WBIOChannelRead(WBIOChannelRef channel) {
+  int err = WBIOBufferFill(channel->input, NULL);
+  switch (err) {
+    case 0:
+      channel->callbacks.read(channel, channel->input, channel->ctxt);
+      if (channel->active && WBIOBufferGetLength(channel->input) == WBIOBufferGetCapacity(channel->input))
+        channel->full = true;
+      break;
+    case ENOBUFS:
+      channel->full = true;
+      break;
+    case EINTR:
+    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+    case EWOULDBLOCK:
+#endif
+      break;
+    case EOF:
+      _WBIOChannelFail(channel, 0);
+      break;
+    default:
+      _WBIOChannelFail(channel, err);
+      break;
+  }
+}
+
+static
+void _WBIOChannelRelease(WBIOChannelRef channel) {
+  _WBIOChannelFreeChunks(channel);
+  WBIOBufferFree(channel->input);
+  free(channel);
+}
+
+static
+void _WBIOChannelCallBack(WBIOReactorRef reactor, int fd, uint32_t events, void *ctxt) {
+  WBIOChannelRef channel = (WBIOChannelRef)ctxt;
+  channel->busy++;
+  if (events & (kWBIOReactorWrite | kWBIOReactorError))
+    _WBIOChannelFlush(channel);
+  bool reading = channel->active && (events & (kWBIOReactorRead | kWBIOReactorError)) && !channel->paused && !channel->full;
+  if (reading)
+    _WBIOChannelRead(channel);
+  /* the error is reported by read() (level-triggered), unless reading is paused */
+  if (channel->active && !reading && (events & kWBIOReactorError)) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (channel->socket)
+      getsockopt(channel->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    _WBIOChannelFail(channel, error);
+  }
+  channel->busy--;
+
+  if (channel->released) {
+    if (0 == channel->busy)
+      _WBIOChannelRelease(channel);
+  } else {
+    _WBIOChannelUpdate(channel);
+  }
+}
+
+// MARK: Channel
+WBIOChannelRef WBIOChannelCreate(WBIOReactorRef reactor, int fd, size_t bufferSize,
+                                 const WBIOChannelCallBacks *callbacks, void *ctxt) {
+  if (fd < 0 || !callbacks || !callbacks->read) {
+    errno = EINVAL;
+    return NULL;
+  }
+  int err = WBIOSetNonBlocking(fd);
+  if (err) {
+    errno = err;
+    return NULL;
+  }
+
+  WBIOChannelRef channel = calloc(1, sizeof(*channel));
+  if (!channel)
+    return NULL;
+  channel->input = WBIOBufferCreate(fd, bufferSize);
+  if (!channel->input) {
+    free(channel);
+    return NULL;
+  }
+
+  struct stat st;
+  channel->socket = 0 == fstat(fd, &st) && S_ISSOCK(st.st_mode);
+#if defined(SO_NOSIGPIPE)
+  if (channel->socket) {
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+  }
+#endif
+  channel->fd = fd;
+  channel->reactor = reactor;
+  channel->callbacks = *callbacks;
+  channel->ctxt = ctxt;
+  channel->high = 64 * 1024;
+  channel->low = 16 * 1024;
+  channel->events = kWBIOReactorRead;
+
+  err = WBIOReactorAdd(reactor, fd, channel->events, _WBIOChannelCallBack, channel);
+  if (err) {
+    _WBIOChannelRelease(channel);
+    errno = err;
+    return NULL;
+  }
+  channel->active = true;
+  return channel;
+}
+
+void WBIOChannelClose(WBIOChannelRef channel) {
+  if (!channel)
+    return;
+  if (channel->active) {
+    channel->active = false;
+    WBIOReactorRemove(channel->reactor, channel->fd);
+  }
+  if (channel->fd >= 0) {
+    close(channel->fd);
+    channel->fd = -1;
+  }
+  if (channel->busy)
+    channel->released = true;
+  else
+    _WBIOChannelRelease(channel);
+}
+
+int WBIOChannelGetDescriptor(WBIOChannelRef channel) {
+  return channel->fd;
+}
+
+void WBIOChannelSetWatermarks(WBIOChannelRef channel, size_t high, size_t low) {
+  channel->high = high;
+  channel->low = MIN(low, high);
+}
+
+void WBIOChannelPauseReading(WBIOChannelRef channel) {
+  channel->paused = true;
+  if (!channel->busy)
+    _WBIOChannelUpdate(channel);
+}
+
+void WBIOChannelResumeReading(WBIOChannelRef channel) {
+  channel->paused = false;
+  channel->full = false;
+  if (!channel->busy)
+    _WBIOChannelUpdate(channel);
+}
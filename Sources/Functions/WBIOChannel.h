@@ -0,0 +1,78 @@
+/*
+ *  WBIOChannel.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#if !defined(__WB_IO_CHANNEL_H)
+#define __WB_IO_CHANNEL_H 1
+
+#include <WonderBox/WBIOBuffer.h>
+#include <WonderBox/WBIOReactor.h>
+
+#include <stdbool.h>
+
+/*!
+ @header WBIOChannel
+ @abstract Buffered non-blocking descriptor driven by a WBIOReactor.
+ @discussion Received bytes are accumulated in a read buffer, and the read callback consumes them.
+ When the read buffer is full and the callback does not consume anything, reading is paused until
+ WBIOChannelResumeReading() is called.
+ Writes are queued and sent when the descriptor is writable, so all the writes issued during a reactor
+ iteration are coalesced in a single writev() call.
+ When the pending bytes exceed the high watermark, WBIOChannelWrite() returns false, and the writable
+ callback is called once they drop below the low watermark.
+ Channels must be used on the reactor thread.
+ */
+
+__BEGIN_DECLS
+
+typedef struct __WBIOChannel *WBIOChannelRef;
+
+typedef struct {
+  /* New bytes in buffer. The callback consumes the bytes it processes. */
+  void (*read)(WBIOChannelRef channel, WBIOBufferRef buffer, void *ctxt);
+  /* (optional) The pending bytes dropped below the low watermark. */
+  void (*writable)(WBIOChannelRef channel, void *ctxt);
+  /* End of file (error is 0) or I/O error. The channel is inactive, and must be closed. */
+  void (*closed)(WBIOChannelRef channel, int error, void *ctxt);
+} WBIOChannelCallBacks;
+
+/* The channel owns fd and makes it non-blocking. NULL on error (errno is set, fd is not closed). */
+WB_EXPORT
+WBIOChannelRef WBIOChannelCreate(WBIOReactorRef reactor, int fd, size_t bufferSize,
+                                 const WBIOChannelCallBacks *callbacks, void *ctxt);
+
+/* Close the descriptor, drop the pending bytes, and release the channel.
+ Can be called from the channel callbacks. */
+WB_EXPORT
+void WBIOChannelClose(WBIOChannelRef channel);
+
+WB_EXPORT
+int WBIOChannelGetDescriptor(WBIOChannelRef channel);
+
+/* Default: 64 KB and 16 KB */
+WB_EXPORT
+void WBIOChannelSetWatermarks(WBIOChannelRef channel, size_t high, size_t low);
+
+/* Queue a copy of data. Returns false if the pending bytes exceed the high watermark (the bytes are queued
+ anyway), or if the channel is inactive (errno is set). */
+WB_EXPORT
+bool WBIOChannelWrite(WBIOChannelRef channel, const void *data, size_t length);
+
+/* number of bytes waiting to be written */
+WB_EXPORT
+size_t WBIOChannelGetPendingLength(WBIOChannelRef channel);
+
+WB_EXPORT
+void WBIOChannelPauseReading(WBIOChannelRef channel);
+WB_EXPORT
+void WBIOChannelResumeReading(WBIOChannelRef channel);
+
+__END_DECLS
+
+#endif /* __WB_IO_CHANNEL_H */
@@ -0,0 +1,370 @@
+/*
+ *  WBIOReactor.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include <WonderBox/WBIOReactor.h>
+
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#if defined(__linux__)
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+#else
+  #include <sys/event.h>
+#endif
+
+/* events retrieved per system call */
+#define WB_IO_REACTOR_BATCH 256
+
+typedef struct {
+  WBIOReactorCallBack callback;
+  void *ctxt;
+  uint32_t events;
+  /* 0 if the descriptor is not registered */
+  uint32_t generation;
+} WBIOReactorSource;
+
+struct __WBIOReactor {
+  int fd;
+  /* indexed by descriptor */
+  WBIOReactorSource *sources;
+  size_t capacity;
+  /* detects events of a descriptor removed (and maybe reused) during a dispatch */
+  uint32_t generation;
+  _Atomic(bool) stopping;
+#if defined(__linux__)
+  int wakeup;
+#endif
+#if defined(__APPLE__)
+  CFFileDescriptorRef descriptor;
+  CFRunLoopSourceRef source;
+#endif
+};
+
+static inline
+uint64_t _WBIOReactorToken(int fd, uint32_t generation) {
+  return ((uint64_t)generation << 32) | (uint32_t)fd;
+}
+
+static
+WBIOReactorSource *_WBIOReactorGetSource(WBIOReactorRef reactor, int fd) {
+  if (fd < 0 || (size_t)fd >= reactor->capacity || 0 == reactor->sources[fd].generation)
+    return NULL;
+  return &reactor->sources[fd];
+}
+
+// MARK: Backends
+#if defined(__linux__)
+static
+int _WBIOReactorBackendInit(WBIOReactorRef reactor) {
+  reactor->fd = epoll_create1(EPOLL_CLOEXEC);
+  if (reactor->fd < 0)
+    return errno;
+  reactor->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (reactor->wakeup < 0)
+    return errno;
+  struct epoll_event event = { .events = EPOLLIN, .data.u64 = UINT64_MAX };
+  return epoll_ctl(reactor->fd, EPOLL_CTL_ADD, reactor->wakeup, &event) < 0 ? errno : 0;
+}
+
+static
+void _WBIOReactorBackendDestroy(WBIOReactorRef reactor) {
+  if (reactor->wakeup >= 0)
+    close(reactor->wakeup);
+}
+
+static
+int _WBIOReactorBackendUpdate(WBIOReactorRef reactor, int fd, uint32_t previous, uint32_t events, uint64_t token) {
+  struct epoll_event event = { .data.u64 = token };
+  if (events & kWBIOReactorRead)
+    event.events |= EPOLLIN | EPOLLRDHUP;
+  if (events & kWBIOReactorWrite)
+    event.events |= EPOLLOUT;
+  int op = previous == UINT32_MAX ? EPOLL_CTL_ADD : (events == UINT32_MAX ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+  return epoll_ctl(reactor->fd, op, fd, &event) < 0 ? errno : 0;
+}
+
+static
+void _WBIOReactorBackendWakeup(WBIOReactorRef reactor) {
+  uint64_t value = 1;
+  ssize_t junk = write(reactor->wakeup, &value, sizeof(value));
+  (void)junk;
+}
+
+typedef struct epoll_event WBIOReactorEvent;
+
+static
+int _WBIOReactorBackendWait(WBIOReactorRef reactor, WBIOReactorEvent *events, int count, double timeout) {
+  int ms = timeout < 0 ? -1 : (int)fmin(ceil(timeout * 1e3), (double)INT32_MAX);
+  return epoll_wait(reactor->fd, events, count, ms);
+}
+
+/* Returns false for the wakeup event */
+static
+bool _WBIOReactorBackendDecode(WBIOReactorRef reactor, const WBIOReactorEvent *event, uint64_t *token, uint32_t *events) {
+  if (event->data.u64 == UINT64_MAX) {
+    uint64_t value;
+    ssize_t junk = read(reactor->wakeup, &value, sizeof(value));
+    (void)junk;
+    return false;
+  }
+  *token = event->data.u64;
+  *events = 0;
+  if (event->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+    *events |= kWBIOReactorRead;
+  if (event->events & EPOLLOUT)
+    *events |= kWBIOReactorWrite;
+  if (event->events & (EPOLLERR | EPOLLHUP))
+    *events |= kWBIOReactorError;
+  return true;
+}
+
+#else
+static
+int _WBIOReactorBackendInit(WBIOReactorRef reactor) {
+  reactor->fd = kqueue();
+  if (reactor->fd < 0)
+    return errno;
+  fcntl(reactor->fd, F_SETFD, FD_CLOEXEC);
+  struct kevent event;
+  EV_SET(&event, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+  return kevent(reactor->fd, &event, 1, NULL, 0, NULL) < 0 ? errno : 0;
+}
+
+static
+void _WBIOReactorBackendDestroy(WBIOReactorRef reactor) {}
+
+static
+int _WBIOReactorBackendUpdate(WBIOReactorRef reactor, int fd, uint32_t previous, uint32_t events, uint64_t token) {
+  int count = 0;
+  struct kevent changes[2];
+  if (previous == UINT32_MAX) previous = 0;
+  if (events == UINT32_MAX) events = 0;
+  const struct { int16_t filter; uint32_t flag; } filters[] = {
+    { EVFILT_READ, kWBIOReactorRead }, { EVFILT_WRITE, kWBIOReactorWrite },
+  };
+  for (size_t idx = 0; idx < 2; idx++) {
+    if (events & filters[idx].flag)
+      EV_SET(&changes[count++], fd, filters[idx].filter, EV_ADD | EV_ENABLE, 0, 0, (void *)(uintptr_t)token);
+    else if (previous & filters[idx].flag)
+      EV_SET(&changes[count++], fd, filters[idx].filter, EV_DELETE, 0, 0, NULL);
+  }
+  if (count > 0 && kevent(reactor->fd, changes, count, NULL, 0, NULL) < 0)
+    return errno;
+  return 0;
+}
+
+static
+void _WBIOReactorBackendWakeup(WBIOReactorRef reactor) {
+  struct kevent event;
+  EV_SET(&event, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+  kevent(reactor->fd, &event, 1, NULL, 0, NULL);
+}
+
+typedef struct kevent WBIOReactorEvent;
+
+static
+int _WBIOReactorBackendWait(WBIOReactorRef reactor, WBIOReactorEvent *events, int count, double timeout) {
+  struct timespec ts, *pts = NULL;
+  if (timeout >= 0) {
+    ts.tv_sec = (time_t)timeout;
+    ts.tv_nsec = (long)((timeout - (double)ts.tv_sec) * 1e9);
+    pts = &ts;
+  }
+  return kevent(reactor->fd, NULL, 0, events, count, pts);
+}
+
+static
+bool _WBIOReactorBackendDecode(WBIOReactorRef reactor, const WBIOReactorEvent *event, uint64_t *token, uint32_t *events) {
+  if (event->filter == EVFILT_USER)
+    return false;
+  *token = (uint64_t)(uintptr_t)event->udata;
+  *events = event->filter == EVFILT_READ ? kWBIOReactorRead : kWBIOReactorWrite;
+  /* EV_EOF on a read filter is a regular end of file, reported by read() */
+  if ((event->flags & EV_ERROR) || (event->filter == EVFILT_WRITE && (event->flags & EV_EOF)))
+    *events |= kWBIOReactorError;
+  return true;
+}
+#endif
+
+// MARK: Reactor
+WBIOReactorRef WBIOReactorCreate(void) {
+  WBIOReactorRef reactor = calloc(1, sizeof(*reactor));
+  if (!reactor)
+    return NULL;
+  reactor->fd = -1;
+#if defined(__linux__)
+  reactor->wakeup = -1;
+#endif
+  int err = _WBIOReactorBackendInit(reactor);
+  if (err) {
+    WBIOReactorFree(reactor);
+    errno = err;
+    return NULL;
+  }
+  return reactor;
+}
+
+void WBIOReactorFree(WBIOReactorRef reactor) {
+  if (!reactor)
+    return;
+#if defined(__APPLE__)
+  if (reactor->source) {
+    CFRunLoopSourceInvalidate(reactor->source);
+    CFRelease(reactor->source);
+  }
+  if (reactor->descriptor) {
+    CFFileDescriptorInvalidate(reactor->descriptor);
+    CFRelease(reactor->descriptor);
+  }
+#endif
+  _WBIOReactorBackendDestroy(reactor);
+  if (reactor->fd >= 0)
+    close(reactor->fd);
+  free(reactor->sources);
+  free(reactor);
+}
+
+int WBIOReactorGetDescriptor(WBIOReactorRef reactor) {
+  return reactor->fd;
+}
+
+int WBIOReactorAdd(WBIOReactorRef reactor, int fd, uint32_t events, WBIOReactorCallBack callback, void *ctxt) {
+  if (fd < 0 || !callback)
+    return EINVAL;
+  if (_WBIOReactorGetSource(reactor, fd))
+    return EEXIST;
+
+  if ((size_t)fd >= reactor->capacity) {
+    size_t capacity = reactor->capacity ? reactor->capacity : 64;
+    while (capacity <= (size_t)fd)
+      capacity *= 2;
+    WBIOReactorSource *sources = realloc(reactor->sources, capacity * sizeof(*sources));
+    if (!sources)
+      return ENOMEM;
+    memset(sources + reactor->capacity, 0, (capacity - reactor->capacity) * sizeof(*sources));
+    reactor->sources = sources;
+    reactor->capacity = capacity;
+  }
+
+  if (0 == ++reactor->generation)
+    reactor->generation = 1;
+  events &= kWBIOReactorRead | kWBIOReactorWrite;
+  int err = _WBIOReactorBackendUpdate(reactor, fd, UINT32_MAX, events, _WBIOReactorToken(fd, reactor->generation));
+  if (0 == err) {
+    WBIOReactorSource *source = &reactor->sources[fd];
+    source->callback = callback;
+    source->ctxt = ctxt;
+    source->events = events;
+    source->generation = reactor->generation;
+  }
+  return err;
+}
+
+int WBIOReactorModify(WBIOReactorRef reactor, int fd, uint32_t events) {
+  WBIOReactorSource *source = _WBIOReactorGetSource(reactor, fd);
+  if (!source)
+    return ENOENT;
+  events &= kWBIOReactorRead | kWBIOReactorWrite;
+  if (events == source->events)
+    return 0;
+  int err = _WBIOReactorBackendUpdate(reactor, fd, source->events, events, _WBIOReactorToken(fd, source->generation));
+  if (0 == err)
+    source->events = events;
+  return err;
+}
+
+int WBIOReactorRemove(WBIOReactorRef reactor, int fd) {
+  WBIOReactorSource *source = _WBIOReactorGetSource(reactor, fd);
+  if (!source)
+    return ENOENT;
+  int err = _WBIOReactorBackendUpdate(reactor, fd, source->events, UINT32_MAX, 0);
+  memset(source, 0, sizeof(*source));
+  return err;
+}
+
+int WBIOReactorRunOnce(WBIOReactorRef reactor, double timeout) {
+  WBIOReactorEvent events[WB_IO_REACTOR_BATCH];
+  int count = _WBIOReactorBackendWait(reactor, events, WB_IO_REACTOR_BATCH, timeout);
+  if (count < 0)
+    return errno == EINTR ? 0 : -1;
+
+  int dispatched = 0;
+  for (int idx = 0; idx < count; idx++) {
+    uint64_t token;
+    uint32_t flags;
+    if (!_WBIOReactorBackendDecode(reactor, &events[idx], &token, &flags))
+      continue;
+    int fd = (int)(uint32_t)token;
+    WBIOReactorSource *source = _WBIOReactorGetSource(reactor, fd);
+    /* removed by a previous callback */
+    if (!source || source->generation != (uint32_t)(token >> 32))
+      continue;
+    /* an error is reported to the registered events */
+    flags &= source->events | kWBIOReactorError;
+    if (flags) {
+      dispatched++;
+      source->callback(reactor, fd, flags, source->ctxt);
+    }
+  }
+  return dispatched;
+}
+
+int WBIOReactorRun(WBIOReactorRef reactor) {
+  int err = 0;
+  while (0 == err && !atomic_load(&reactor->stopping)) {
+    if (WBIOReactorRunOnce(reactor, -1) < 0)
+      err = errno;
+  }
+  atomic_store(&reactor->stopping, false);
+  return err;
+}
+
+void WBIOReactorStop(WBIOReactorRef reactor) {
+  atomic_store(&reactor->stopping, true);
+  _WBIOReactorBackendWakeup(reactor);
+}
+
+// MARK: Run Loop
+#if defined(__APPLE__)
+static
+void _WBIOReactorCallBack(CFFileDescriptorRef descriptor, CFOptionFlags types, void *info) {
+  WBIOReactorRunOnce((WBIOReactorRef)info, 0);
+  /* callbacks are one-shot */
+  CFFileDescriptorEnableCallBacks(descriptor, kCFFileDescriptorReadCallBack);
+}
+
+int WBIOReactorScheduleInRunLoop(WBIOReactorRef reactor, CFRunLoopRef runLoop, CFStringRef mode) {
+  if (!reactor->source) {
+    CFFileDescriptorContext ctxt = { 0, reactor, NULL, NULL, NULL };
+    reactor->descriptor = CFFileDescriptorCreate(kCFAllocatorDefault, reactor->fd, false, _WBIOReactorCallBack, &ctxt);
+    if (!reactor->descriptor)
+      return ENOMEM;
+    CFFileDescriptorEnableCallBacks(reactor->descriptor, kCFFileDescriptorReadCallBack);
+    reactor->source = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, reactor->descriptor, 0);
+    if (!reactor->source)
+      return ENOMEM;
+  }
+  CFRunLoopAddSource(runLoop, reactor->source, mode);
+  return 0;
+}
+
+void WBIOReactorUnscheduleFromRunLoop(WBIOReactorRef reactor, CFRunLoopRef runLoop, CFStringRef mode) {
+  if (reactor->source)
+    CFRunLoopRemoveSource(runLoop, reactor->source, mode);
+}
+#endif
@@ -0,0 +1,85 @@
+/*
+ *  WBIOReactor.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#if !defined(__WB_IO_REACTOR_H)
+#define __WB_IO_REACTOR_H 1
+
+#include <WonderBox/WBBase.h>
+
+#include <stdint.h>
+
+#if defined(__APPLE__)
+  #include <CoreFoundation/CoreFoundation.h>
+#endif
+
+/*!
+ @header WBIOReactor
+ @abstract Descriptor readiness notifications.
+ @discussion A reactor watches any number of descriptors using kqueue (Darwin, BSD) or epoll (Linux),
+ and calls their callback when they are readable or writable. Notifications are level-triggered.
+ A reactor runs on a single thread. Only WBIOReactorStop() can be called from other threads.
+ Descriptors can be added and removed from callbacks. Once removed, a descriptor callback is not called.
+ */
+
+__BEGIN_DECLS
+
+typedef struct __WBIOReactor *WBIOReactorRef;
+
+enum {
+  kWBIOReactorRead = 1 << 0,
+  kWBIOReactorWrite = 1 << 1,
+  /* reported only: hang up or error condition */
+  kWBIOReactorError = 1 << 2,
+};
+
+typedef void (*WBIOReactorCallBack)(WBIOReactorRef reactor, int fd, uint32_t events, void *ctxt);
+
+/* NULL on error (errno is set) */
+WB_EXPORT
+WBIOReactorRef WBIOReactorCreate(void);
+/* Registered descriptors are not closed */
+WB_EXPORT
+void WBIOReactorFree(WBIOReactorRef reactor);
+
+/* Returns 0 or an errno value (EEXIST if fd is already registered) */
+WB_EXPORT
+int WBIOReactorAdd(WBIOReactorRef reactor, int fd, uint32_t events, WBIOReactorCallBack callback, void *ctxt);
+WB_EXPORT
+int WBIOReactorModify(WBIOReactorRef reactor, int fd, uint32_t events);
+/* Must be called before closing fd */
+WB_EXPORT
+int WBIOReactorRemove(WBIOReactorRef reactor, int fd);
+
+/* Wait at most timeout seconds (negative for no timeout) and call the callbacks.
+ Returns the number of events dispatched, or -1 (errno is set). */
+WB_EXPORT
+int WBIOReactorRunOnce(WBIOReactorRef reactor, double timeout);
+
+/* Returns 0 once stopped, or an errno value */
+WB_EXPORT
+int WBIOReactorRun(WBIOReactorRef reactor);
+WB_EXPORT
+void WBIOReactorStop(WBIOReactorRef reactor);
+
+/* kqueue or epoll descriptor, readable when events are pending */
+WB_EXPORT
+int WBIOReactorGetDescriptor(WBIOReactorRef reactor);
+
+#if defined(__APPLE__)
+/* Dispatch the events from a run loop, instead of WBIOReactorRun(). Returns 0 or an errno value. */
+WB_EXPORT
+int WBIOReactorScheduleInRunLoop(WBIOReactorRef reactor, CFRunLoopRef runLoop, CFStringRef mode);
+WB_EXPORT
+void WBIOReactorUnscheduleFromRunLoop(WBIOReactorRef reactor, CFRunLoopRef runLoop, CFStringRef mode);
+#endif
+
+__END_DECLS
+
+#endif /* __WB_IO_REACTOR_H */
@@ -10,7 +10,9 @@
 
 #include <WonderBox/WBProcessFunctions.h>
 
+#include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/sysctl.h>
 #include <ApplicationServices/ApplicationServices.h>
 
@@ -141,7 +143,8 @@ OSStatus sysctlbyname_with_pid(const char *name, pid_t pid,  void *oldp, size_t
   return noErr;
 }
 
-Boolean WBProcessIsNative(pid_t pid) {
+static
+Boolean _WBProcessIsNative(pid_t pid) {
   int ret = FALSE;
   size_t sz = sizeof(ret);
 
@@ -156,12 +159,8 @@ Boolean WBProcessIsNative(pid_t pid) {
   return ret ? TRUE : FALSE;
 }
 
-CFStringRef WBProcessCopyNameForPID(pid_t pid) {
-  /* if current process */
-  if (pid == getpid()) {
-    spx_assert(getprogname(), "progname required");
-    return CFStringCreateWithCString(kCFAllocatorDefault, getprogname(), kCFStringEncodingUTF8);
-  }
+static
+CFStringRef _WBProcessCopyNameForPID(pid_t pid) {
   /* try to use carbon process manager */
 //  ProcessSerialNumber psn;
 //  if (noErr == GetProcessForPID(pid, &psn)) {
@@ -191,6 +190,255 @@ CFStringRef WBProcessCopyNameForPID(pid_t pid) {
   return name;
 }
 
+#pragma mark Process Cache
+/* Direct-mapped cache: a pid evicts the entry of its slot. An entry is valid as long as the process
+ start time and command name (updated by exec) match. */
+typedef struct {
+  pid_t pid;
+  bool valid;
+  struct timeval start;
+  char comm[MAXCOMLEN + 1];
+  /* NULL until requested */
+  CFStringRef name;
+  /* -1 until requested */
+  int8_t native;
+} WBProcessCacheEntry;
+
+typedef struct {
+  struct timeval start;
+  char comm[MAXCOMLEN + 1];
+} WBProcessIdentity;
+
+static pthread_mutex_t sProcessCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static WBProcessCacheEntry *sProcessCache = NULL;
+static CFIndex sProcessCacheSize = 256;
+
+static
+void _WBProcessCacheClear(void) {
+  if (!sProcessCache)
+    return;
+  for (CFIndex idx = 0; idx < sProcessCacheSize; idx++)
+    SPXCFRelease(sProcessCache[idx].name);
+  free(sProcessCache);
+  sProcessCache = NULL;
+}
+
+static
+bool _WBProcessGetIdentity(pid_t pid, WBProcessIdentity *identity) {
+  struct kinfo_proc info;
+  size_t length = sizeof(info);
+  int mib[] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, pid };
+  /* the call succeeds with an empty result if the process does not exist */
+  if (sysctl(mib, 4, &info, &length, NULL, 0) < 0 || 0 == length)
+    return false;
+  identity->start = info.kp_proc.p_starttime;
+  strlcpy(identity->comm, info.kp_proc.p_comm, sizeof(identity->comm));
+  return true;
+}
+
+/* Returns the entry of pid, reset if it describes another process. Must be called with the lock held.
+ NULL if the cache is disabled. */
+static
+WBProcessCacheEntry *_WBProcessCacheGetEntry(pid_t pid, const WBProcessIdentity *identity) {
+  if (sProcessCacheSize <= 0)
+    return NULL;
+  if (!sProcessCache) {
+    sProcessCache = calloc((size_t)sProcessCacheSize, sizeof(*sProcessCache));
+    if (!sProcessCache)
+      return NULL;
+  }
+  WBProcessCacheEntry *entry = &sProcessCache[((uint32_t)pid * 2654435761U) & (uint32_t)(sProcessCacheSize - 1)];
+  if (!entry->valid || entry->pid != pid || timercmp(&entry->start, &identity->start, !=) ||
+      strcmp(entry->comm, identity->comm) != 0) {
+    SPXCFRelease(entry->name);
+    entry->name = NULL;
+    entry->native = -1;
+    entry->pid = pid;
+    entry->start = identity->start;
+    strlcpy(entry->comm, identity->comm, sizeof(entry->comm));
+    entry->valid = true;
+  }
+  return entry;
+}
+
+static
+CFStringRef _WBProcessCopyCachedName(pid_t pid, const WBProcessIdentity *identity) {
+  CFStringRef name = NULL;
+  pthread_mutex_lock(&sProcessCacheLock);
+  WBProcessCacheEntry *entry = _WBProcessCacheGetEntry(pid, identity);
+  if (entry && entry->name)
+    name = CFRetain(entry->name);
+  pthread_mutex_unlock(&sProcessCacheLock);
+  if (name)
+    return name;
+
+  /* slow path outside of the lock */
+  name = _WBProcessCopyNameForPID(pid);
+  if (name) {
+    pthread_mutex_lock(&sProcessCacheLock);
+    entry = _WBProcessCacheGetEntry(pid, identity);
+    if (entry && !entry->name)
+      entry->name = CFRetain(name);
+    pthread_mutex_unlock(&sProcessCacheLock);
+  }
+  return name;
+}
+
+void WBProcessSetCacheSize(CFIndex size) {
+  CFIndex slots = 0;
+  if (size > 0) {
+    slots = 1;
+    while (slots < size)
+      slots <<= 1;
+  }
+  pthread_mutex_lock(&sProcessCacheLock);
+  _WBProcessCacheClear();
+  sProcessCacheSize = slots;
+  pthread_mutex_unlock(&sProcessCacheLock);
+}
+
+void WBProcessFlushCache(void) {
+  pthread_mutex_lock(&sProcessCacheLock);
+  _WBProcessCacheClear();
+  pthread_mutex_unlock(&sProcessCacheLock);
+}
+
+static
+Boolean _WBProcessGetCachedNative(pid_t pid, const WBProcessIdentity *identity) {
+  int8_t native = -1;
+  pthread_mutex_lock(&sProcessCacheLock);
+  WBProcessCacheEntry *entry = _WBProcessCacheGetEntry(pid, identity);
+  if (entry)
+    native = entry->native;
+  pthread_mutex_unlock(&sProcessCacheLock);
+  if (native >= 0)
+    return native ? TRUE : FALSE;
+
+  Boolean result = _WBProcessIsNative(pid);
+  pthread_mutex_lock(&sProcessCacheLock);
+  entry = _WBProcessCacheGetEntry(pid, identity);
+  if (entry)
+    entry->native = result ? 1 : 0;
+  pthread_mutex_unlock(&sProcessCacheLock);
+  return result;
+}
+
+Boolean WBProcessIsNative(pid_t pid) {
+  WBProcessIdentity identity;
+  if (!_WBProcessGetIdentity(pid, &identity))
+    return _WBProcessIsNative(pid);
+  return _WBProcessGetCachedNative(pid, &identity);
+}
+
+CFStringRef WBProcessCopyNameForPID(pid_t pid) {
+  /* if current process */
+  if (pid == getpid()) {
+    spx_assert(getprogname(), "progname required");
+    return CFStringCreateWithCString(kCFAllocatorDefault, getprogname(), kCFStringEncodingUTF8);
+  }
+  WBProcessIdentity identity;
+  if (!_WBProcessGetIdentity(pid, &identity))
+    return NULL;
+  return _WBProcessCopyCachedName(pid, &identity);
+}
+
+#pragma mark Batch Lookup
+static
+int _WBProcessComparePID(const void *a, const void *b) {
+  pid_t p1 = ((const struct kinfo_proc *)a)->kp_proc.p_pid;
+  pid_t p2 = ((const struct kinfo_proc *)b)->kp_proc.p_pid;
+  return p1 < p2 ? -1 : (p1 > p2 ? 1 : 0);
+}
+
+/* All the processes, sorted by pid. A single sysctl validates all the cached entries. */
+static
+int _WBProcessCopyTable(struct kinfo_proc **outProcs, size_t *outCount) {
+  size_t length = 0;
+  struct kinfo_proc *procs = NULL;
+  int mib[] = { CTL_KERN, KERN_PROC, KERN_PROC_ALL };
+  int err;
+  do {
+    free(procs);
+    procs = NULL;
+    if (sysctl(mib, 3, NULL, &length, NULL, 0) < 0)
+      return errno;
+    /* room for new processes */
+    length += length / 8;
+    procs = malloc(length);
+    if (!procs)
+      return ENOMEM;
+    err = sysctl(mib, 3, procs, &length, NULL, 0) < 0 ? errno : 0;
+  } while (ENOMEM == err);
+  if (err) {
+    free(procs);
+    return err;
+  }
+
+  *outCount = length / sizeof(struct kinfo_proc);
+  qsort(procs, *outCount, sizeof(*procs), _WBProcessComparePID);
+  *outProcs = procs;
+  return 0;
+}
+
+static
+bool _WBProcessTableGetIdentity(const struct kinfo_proc *procs, size_t count, pid_t pid, WBProcessIdentity *identity) {
+  struct kinfo_proc key;
+  key.kp_proc.p_pid = pid;
+  const struct kinfo_proc *proc = bsearch(&key, procs, count, sizeof(*procs), _WBProcessComparePID);
+  if (!proc)
+    return false;
+  identity->start = proc->kp_proc.p_starttime;
+  strlcpy(identity->comm, proc->kp_proc.p_comm, sizeof(identity->comm));
+  return true;
+}
+
+int WBProcessCopyNamesForPIDs(const pid_t *pids, CFIndex count, CFStringRef *names) {
+  if (count <= 0)
+    return 0;
+  if (!pids || !names)
+    return EINVAL;
+
+  size_t total = 0;
+  struct kinfo_proc *procs = NULL;
+  int err = _WBProcessCopyTable(&procs, &total);
+  if (err)
+    return err;
+
+  WBProcessIdentity identity;
+  for (CFIndex idx = 0; idx < count; idx++) {
+    names[idx] = NULL;
+    if (pids[idx] == getpid())
+      names[idx] = WBProcessCopyNameForPID(pids[idx]);
+    else if (_WBProcessTableGetIdentity(procs, total, pids[idx], &identity))
+      names[idx] = _WBProcessCopyCachedName(pids[idx], &identity);
+  }
+  free(procs);
+  return 0;
+}
+
+int WBProcessGetNativeFlagsForPIDs(const pid_t *pids, CFIndex count, Boolean *natives) {
+  if (count <= 0)
+    return 0;
+  if (!pids || !natives)
+    return EINVAL;
+
+  size_t total = 0;
+  struct kinfo_proc *procs = NULL;
+  int err = _WBProcessCopyTable(&procs, &total);
+  if (err)
+    return err;
+
+  WBProcessIdentity identity;
+  for (CFIndex idx = 0; idx < count; idx++) {
+    if (_WBProcessTableGetIdentity(procs, total, pids[idx], &identity))
+      natives[idx] = _WBProcessGetCachedNative(pids[idx], &identity);
+    else
+      natives[idx] = FALSE;
+  }
+  free(procs);
+  return 0;
+}
+
 int WBProcessIterate(bool (*callback)(struct kinfo_proc *info, void *ctxt), void *ctxt) {
   // --- Checking input arguments for validity --- //
   if (!callback)
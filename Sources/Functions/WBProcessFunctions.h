@@ -40,12 +40,30 @@ WB_EXPORT
 ProcessSerialNumber WBProcessGetProcessWithProperty(CFStringRef property, CFPropertyListRef value) WB_DEPRECATED("ProcessSerialNumber is obsolete");
 
 #pragma mark BSD
+/* WBProcessIsNative() and WBProcessCopyNameForPID() results are cached by pid. A cached result is
+ used while the process start time and command name match, so pid reuse and exec are detected. */
 WB_EXPORT
 Boolean WBProcessIsNative(pid_t pid);
 
 WB_EXPORT
 CFStringRef WBProcessCopyNameForPID(pid_t pid);
 
+/* Same as WBProcessCopyNameForPID() for each pid. names[idx] is NULL if the process does not exist.
+ The processes are validated with a single sysctl. Returns 0 or an errno value. */
+WB_EXPORT
+int WBProcessCopyNamesForPIDs(const pid_t *pids, CFIndex count, CFStringRef *names);
+/* Same as WBProcessIsNative() for each pid, validated with a single sysctl. natives[idx] is FALSE if the process
+ does not exist. Returns 0 or an errno value. */
+WB_EXPORT
+int WBProcessGetNativeFlagsForPIDs(const pid_t *pids, CFIndex count, Boolean *natives);
+
+/* Number of cached processes, rounded to a power of two (default 256). 0 disables the cache. */
+WB_EXPORT
+void WBProcessSetCacheSize(CFIndex size);
+WB_EXPORT
+void WBProcessFlushCache(void);
+
+/* WBProcessSnapshot.h reports the processes started and exited between two calls */
 struct kinfo_proc;
 WB_EXPORT
 int WBProcessIterate(bool (*callback)(struct kinfo_proc *info, void *ctxt), void *ctxt);
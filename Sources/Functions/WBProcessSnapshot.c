@@ -0,0 +1,314 @@
+/*
+ *  WBProcessSnapshot.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include <WonderBox/WBProcessSnapshot.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__APPLE__)
+  #include <sys/sysctl.h>
+#elif defined(__linux__)
+  #include <fcntl.h>
+  #include <dirent.h>
+  #include <unistd.h>
+  #include <sys/stat.h>
+#endif
+
+typedef struct {
+  WBProcessInfo *processes;
+  size_t count;
+  size_t capacity;
+  /* pid index (open addressing): process index + 1, 0 for empty slots */
+  uint32_t *index;
+  size_t mask;
+} WBProcessTable;
+
+struct __WBProcessSnapshot {
+  /* last update, and buffer for the next one */
+  WBProcessTable tables[2];
+  int current;
+  /* processes of the previous update found in the new one */
+  bool *seen;
+  size_t seenCapacity;
+#if defined(__APPLE__)
+  struct kinfo_proc *raw;
+  size_t rawSize;
+#endif
+};
+
+// MARK: Process Table
+static
+WBProcessInfo *_WBProcessTableAppend(WBProcessTable *table) {
+  if (table->count == table->capacity) {
+    size_t capacity = table->capacity ? table->capacity * 2 : 256;
+    WBProcessInfo *processes = realloc(table->processes, capacity * sizeof(*processes));
+    if (!processes)
+      return NULL;
+    table->processes = processes;
+    table->capacity = capacity;
+  }
+  WBProcessInfo *info = &table->processes[table->count++];
+  memset(info, 0, sizeof(*info));
+  return info;
+}
+
+static inline
+size_t _WBProcessTableHash(pid_t pid) {
+  return (uint32_t)pid * 2654435761U;
+}
+
+static
+int _WBProcessTableIndex(WBProcessTable *table) {
+  /* load factor <= 0.5 */
+  size_t size = 64;
+  while (size < table->count * 2)
+    size *= 2;
+  if (size != table->mask + 1) {
+    uint32_t *index = realloc(table->index, size * sizeof(*index));
+    if (!index)
+      return ENOMEM;
+    table->index = index;
+    table->mask = size - 1;
+  }
+  memset(table->index, 0, size * sizeof(*table->index));
+  for (size_t idx = 0; idx < table->count; idx++) {
+    size_t slot = _WBProcessTableHash(table->processes[idx].pid) & table->mask;
+    while (table->index[slot])
+      slot = (slot + 1) & table->mask;
+    table->index[slot] = (uint32_t)idx + 1;
+  }
+  return 0;
+}
+
+static
+const WBProcessInfo *_WBProcessTableLookup(const WBProcessTable *table, pid_t pid, size_t *position) {
+  if (!table->index)
+    return NULL;
+  size_t slot = _WBProcessTableHash(pid) & table->mask;
+  while (table->index[slot]) {
+    size_t idx = table->index[slot] - 1;
+    if (table->processes[idx].pid == pid) {
+      if (position)
+        *position = idx;
+      return &table->processes[idx];
+    }
+    slot = (slot + 1) & table->mask;
+  }
+  return NULL;
+}
+
+// MARK: Backends
+#if defined(__APPLE__)
+static
+int _WBProcessSnapshotFetch(WBProcessSnapshotRef snapshot, WBProcessTable *table) {
+  int mib[3] = { CTL_KERN, KERN_PROC, KERN_PROC_ALL };
+  size_t size;
+  for (;;) {
+    /* try with the previous buffer first */
+    size = snapshot->rawSize;
+    if (size > 0 && 0 == sysctl(mib, 3, snapshot->raw, &size, NULL, 0))
+      break;
+    if (size > 0 && errno != ENOMEM)
+      return errno;
+
+    size = 0;
+    if (sysctl(mib, 3, NULL, &size, NULL, 0) < 0)
+      return errno;
+    /* room for new processes */
+    size += size / 4;
+    struct kinfo_proc *raw = realloc(snapshot->raw, size);
+    if (!raw)
+      return ENOMEM;
+    snapshot->raw = raw;
+    snapshot->rawSize = size;
+  }
+
+  size_t count = size / sizeof(struct kinfo_proc);
+  for (size_t idx = 0; idx < count; idx++) {
+    const struct kinfo_proc *proc = &snapshot->raw[idx];
+    WBProcessInfo *info = _WBProcessTableAppend(table);
+    if (!info)
+      return ENOMEM;
+    info->pid = proc->kp_proc.p_pid;
+    info->ppid = proc->kp_eproc.e_ppid;
+    info->uid = proc->kp_eproc.e_ucred.cr_uid;
+    info->start = (uint64_t)proc->kp_proc.p_starttime.tv_sec * 1000000 + (uint64_t)proc->kp_proc.p_starttime.tv_usec;
+    strlcpy(info->name, proc->kp_proc.p_comm, sizeof(info->name));
+  }
+  return 0;
+}
+
+#elif defined(__linux__)
+/* Parse /proc/<pid>/stat. Returns false if the process exited. */
+static
+bool _WBProcessSnapshotReadStat(int procfd, const char *pid, long ticks, WBProcessInfo *info) {
+  char path[64];
+  snprintf(path, sizeof(path), "%s/stat", pid);
+  int fd = openat(procfd, path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  char buffer[1024];
+  struct stat st;
+  ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+  /* /proc/<pid> files belong to the process effective user */
+  bool ok = length > 0 && 0 == fstat(fd, &st);
+  close(fd);
+  if (!ok)
+    return false;
+  buffer[length] = '\0';
+
+  /* the name can contain spaces and parentheses */
+  char *first = strchr(buffer, '(');
+  char *last = strrchr(buffer, ')');
+  if (!first || !last || last < first)
+    return false;
+  size_t nameLength = (size_t)(last - first - 1);
+  if (nameLength >= sizeof(info->name))
+    nameLength = sizeof(info->name) - 1;
+  memcpy(info->name, first + 1, nameLength);
+  info->name[nameLength] = '\0';
+
+  int ppid = 0;
+  unsigned long long starttime = 0;
+  /* fields 3 (state) to 22 (starttime), see proc(5) */
+  if (2 != sscanf(last + 1, " %*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                  &ppid, &starttime))
+    return false;
+
+  info->pid = (pid_t)strtol(pid, NULL, 10);
+  info->ppid = ppid;
+  info->uid = st.st_uid;
+  info->start = starttime * 1000000ULL / (unsigned long long)ticks;
+  return true;
+}
+
+static
+int _WBProcessSnapshotFetch(WBProcessSnapshotRef snapshot, WBProcessTable *table) {
+  DIR *proc = opendir("/proc");
+  if (!proc)
+    return errno;
+
+  int err = 0;
+  long ticks = sysconf(_SC_CLK_TCK);
+  if (ticks <= 0)
+    ticks = 100;
+  WBProcessInfo info;
+  struct dirent *entry;
+  while (0 == err && (entry = readdir(proc))) {
+    if (entry->d_name[0] < '1' || entry->d_name[0] > '9')
+      continue;
+    memset(&info, 0, sizeof(info));
+    if (!_WBProcessSnapshotReadStat(dirfd(proc), entry->d_name, ticks, &info))
+      continue;
+    WBProcessInfo *slot = _WBProcessTableAppend(table);
+    if (slot)
+      *slot = info;
+    else
+      err = ENOMEM;
+  }
+  closedir(proc);
+  return err;
+}
+
+#else
+static
+int _WBProcessSnapshotFetch(WBProcessSnapshotRef snapshot, WBProcessTable *table) {
+  return ENOTSUP;
+}
+#endif
+
+// MARK: Snapshot
+WBProcessSnapshotRef WBProcessSnapshotCreate(void) {
+  return calloc(1, sizeof(struct __WBProcessSnapshot));
+}
+
+void WBProcessSnapshotFree(WBProcessSnapshotRef snapshot) {
+  if (!snapshot)
+    return;
+  for (size_t idx = 0; idx < 2; idx++) {
+    free(snapshot->tables[idx].processes);
+    free(snapshot->tables[idx].index);
+  }
+  free(snapshot->seen);
+#if defined(__APPLE__)
+  free(snapshot->raw);
+#endif
+  free(snapshot);
+}
+
+static inline
+bool _WBProcessInfoChanged(const WBProcessInfo *previous, const WBProcessInfo *info) {
+  return previous->ppid != info->ppid || previous->uid != info->uid || strcmp(previous->name, info->name) != 0;
+}
+
+int WBProcessSnapshotUpdate(WBProcessSnapshotRef snapshot, WBProcessSnapshotCallBack callback, void *ctxt) {
+  WBProcessTable *previous = &snapshot->tables[snapshot->current];
+  WBProcessTable *table = &snapshot->tables[!snapshot->current];
+  table->count = 0;
+  int err = _WBProcessSnapshotFetch(snapshot, table);
+  if (0 == err)
+    err = _WBProcessTableIndex(table);
+  if (0 == err && callback && snapshot->seenCapacity < previous->count) {
+    bool *seen = realloc(snapshot->seen, previous->count * sizeof(*seen));
+    if (seen) {
+      snapshot->seen = seen;
+      snapshot->seenCapacity = previous->count;
+    } else {
+      err = ENOMEM;
+    }
+  }
+  if (err)
+    return err;
+
+  if (callback) {
+    size_t position;
+    if (previous->count > 0)
+      memset(snapshot->seen, 0, previous->count * sizeof(*snapshot->seen));
+    for (size_t idx = 0; idx < table->count; idx++) {
+      const WBProcessInfo *info = &table->processes[idx];
+      const WBProcessInfo *old = _WBProcessTableLookup(previous, info->pid, &position);
+      if (old && old->start == info->start)
+        snapshot->seen[position] = true;
+    }
+    /* exited processes first, so a reused pid is reported removed before being added */
+    for (size_t idx = 0; idx < previous->count; idx++) {
+      if (!snapshot->seen[idx])
+        callback(kWBProcessRemoved, &previous->processes[idx], ctxt);
+    }
+    for (size_t idx = 0; idx < table->count; idx++) {
+      const WBProcessInfo *info = &table->processes[idx];
+      const WBProcessInfo *old = _WBProcessTableLookup(previous, info->pid, NULL);
+      if (!old || old->start != info->start)
+        callback(kWBProcessAdded, info, ctxt);
+      else if (_WBProcessInfoChanged(old, info))
+        callback(kWBProcessChanged, info, ctxt);
+    }
+  }
+  snapshot->current = !snapshot->current;
+  return 0;
+}
+
+size_t WBProcessSnapshotGetCount(WBProcessSnapshotRef snapshot) {
+  return snapshot->tables[snapshot->current].count;
+}
+
+const WBProcessInfo *WBProcessSnapshotGetProcessAtIndex(WBProcessSnapshotRef snapshot, size_t idx) {
+  const WBProcessTable *table = &snapshot->tables[snapshot->current];
+  return idx < table->count ? &table->processes[idx] : NULL;
+}
+
+const WBProcessInfo *WBProcessSnapshotGetProcess(WBProcessSnapshotRef snapshot, pid_t pid) {
+  return _WBProcessTableLookup(&snapshot->tables[snapshot->current], pid, NULL);
+}
@@ -0,0 +1,79 @@
+/*
+ *  WBProcessSnapshot.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#if !defined(__WB_PROCESS_SNAPSHOT_H)
+#define __WB_PROCESS_SNAPSHOT_H 1
+
+#include <WonderBox/WBBase.h>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*!
+ @header WBProcessSnapshot
+ @abstract Process table snapshot, refreshed incrementally.
+ @discussion Each update fetches the process table (sysctl KERN_PROC_ALL on Darwin, /proc on Linux),
+ and reports the processes started, exited and changed since the previous update.
+ The buffers and the pid index are reused between updates.
+ A pid reused by a new process is reported as a removed and an added process.
+ */
+
+__BEGIN_DECLS
+
+typedef struct __WBProcessSnapshot *WBProcessSnapshotRef;
+
+#define WB_PROCESS_NAME_MAX 32
+
+typedef struct {
+  pid_t pid;
+  pid_t ppid;
+  uid_t uid;
+  /* start time in microseconds. Only meaningful to compare processes (since the epoch on Darwin,
+   since boot on Linux). */
+  uint64_t start;
+  /* executable name, truncated by the system (16 characters on Linux) */
+  char name[WB_PROCESS_NAME_MAX];
+} WBProcessInfo;
+
+typedef enum {
+  kWBProcessAdded,
+  kWBProcessRemoved,
+  /* parent, user or name changed (exec) */
+  kWBProcessChanged,
+} WBProcessChange;
+
+typedef void (*WBProcessSnapshotCallBack)(WBProcessChange change, const WBProcessInfo *info, void *ctxt);
+
+/* NULL on error */
+WB_EXPORT
+WBProcessSnapshotRef WBProcessSnapshotCreate(void);
+WB_EXPORT
+void WBProcessSnapshotFree(WBProcessSnapshotRef snapshot);
+
+/*!
+ @abstract Refresh the snapshot.
+ @param callback (optional) called for each change. The first update reports all processes as added.
+ @result 0 or an errno value (ENOTSUP if the platform is not supported). The snapshot is unchanged on error.
+ */
+WB_EXPORT
+int WBProcessSnapshotUpdate(WBProcessSnapshotRef snapshot, WBProcessSnapshotCallBack callback, void *ctxt);
+
+WB_EXPORT
+size_t WBProcessSnapshotGetCount(WBProcessSnapshotRef snapshot);
+WB_EXPORT
+const WBProcessInfo *WBProcessSnapshotGetProcessAtIndex(WBProcessSnapshotRef snapshot, size_t idx);
+
+/* NULL if pid is not in the snapshot */
+WB_EXPORT
+const WBProcessInfo *WBProcessSnapshotGetProcess(WBProcessSnapshotRef snapshot, pid_t pid);
+
+__END_DECLS
+
+#endif /* __WB_PROCESS_SNAPSHOT_H */
@@ -0,0 +1,411 @@
+/*
+ *  WBSignalDispatcher.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include <WonderBox/WBSignalDispatcher.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#if !defined(WB_SIGNAL_KQUEUE) && !defined(WB_SIGNAL_SIGNALFD) && !defined(WB_SIGNAL_PIPE)
+  #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+    #define WB_SIGNAL_KQUEUE 1
+  #elif defined(__linux__)
+    #define WB_SIGNAL_SIGNALFD 1
+  #else
+    #define WB_SIGNAL_PIPE 1
+  #endif
+#endif
+
+#if defined(WB_SIGNAL_KQUEUE)
+  #include <sys/event.h>
+#elif defined(WB_SIGNAL_SIGNALFD)
+  #include <sys/signalfd.h>
+#endif
+
+typedef struct _WBSignalHandler {
+  int token;
+  int signo;
+  /* NULL once removed */
+  WBSignalDispatcherCallBack callback;
+  void *ctxt;
+  struct _WBSignalHandler *next;
+} WBSignalHandler;
+
+static struct {
+  pthread_mutex_t lock;
+  /* kqueue, signalfd or pipe read end */
+  int fd;
+  int error;
+  int tokens;
+  WBSignalHandler *handlers;
+  /* handlers are unlinked after the dispatch loop */
+  int dispatching;
+  bool garbage;
+  /* number of handlers per signal */
+  size_t counts[NSIG];
+  struct sigaction previous[NSIG];
+#if defined(WB_SIGNAL_SIGNALFD)
+  sigset_t mask;
+#elif defined(WB_SIGNAL_PIPE)
+  int sink;
+  _Atomic(uint32_t) pending[NSIG];
+#endif
+#if defined(__APPLE__)
+  CFFileDescriptorRef descriptor;
+  CFRunLoopSourceRef source;
+#endif
+} sDispatcher = { .fd = -1 };
+
+static pthread_once_t sDispatcherOnce = PTHREAD_ONCE_INIT;
+
+#if !defined(WB_SIGNAL_SIGNALFD)
+static
+int _WBSignalSetCloseOnExec(int fd) {
+  return fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ? errno : 0;
+}
+#endif
+
+// MARK: kqueue
+#if defined(WB_SIGNAL_KQUEUE)
+/* EVFILT_SIGNAL records the signal even if it is handled. A handler avoids the default action,
+ without the side effects of SIG_IGN (child reaping for SIGCHLD). */
+static
+void _WBSignalIgnore(int signo) {}
+
+static
+int _WBSignalBackendInit(void) {
+  sDispatcher.fd = kqueue();
+  if (sDispatcher.fd < 0)
+    return errno;
+  return _WBSignalSetCloseOnExec(sDispatcher.fd);
+}
+
+static
+int _WBSignalBackendEnable(int signo) {
+  struct sigaction action = { .sa_handler = _WBSignalIgnore, .sa_flags = SA_RESTART };
+  sigemptyset(&action.sa_mask);
+  if (sigaction(signo, &action, &sDispatcher.previous[signo]) < 0)
+    return errno;
+
+  struct kevent event;
+  EV_SET(&event, signo, EVFILT_SIGNAL, EV_ADD | EV_ENABLE, 0, 0, NULL);
+  if (kevent(sDispatcher.fd, &event, 1, NULL, 0, NULL) < 0) {
+    int err = errno;
+    sigaction(signo, &sDispatcher.previous[signo], NULL);
+    return err;
+  }
+  return 0;
+}
+
+static
+void _WBSignalBackendDisable(int signo) {
+  struct kevent event;
+  EV_SET(&event, signo, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
+  kevent(sDispatcher.fd, &event, 1, NULL, 0, NULL);
+  sigaction(signo, &sDispatcher.previous[signo], NULL);
+}
+
+static
+void _WBSignalBackendRead(uint64_t counts[NSIG]) {
+  struct kevent events[16];
+  const struct timespec timeout = { 0, 0 };
+  int count;
+  do {
+    count = kevent(sDispatcher.fd, NULL, 0, events, 16, &timeout);
+    for (int idx = 0; idx < count; idx++) {
+      /* data is the number of signals since the last retrieval */
+      if (events[idx].filter == EVFILT_SIGNAL && events[idx].ident < NSIG)
+        counts[events[idx].ident] += (uint64_t)events[idx].data;
+    }
+  } while (count == 16);
+}
+
+// MARK: signalfd
+#elif defined(WB_SIGNAL_SIGNALFD)
+static
+int _WBSignalBackendInit(void) {
+  sigemptyset(&sDispatcher.mask);
+  sDispatcher.fd = signalfd(-1, &sDispatcher.mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  return sDispatcher.fd < 0 ? errno : 0;
+}
+
+static
+int _WBSignalBackendEnable(int signo) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, signo);
+  /* signals must be blocked to be read from the signalfd */
+  int err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+  if (err)
+    return err;
+
+  sigaddset(&sDispatcher.mask, signo);
+  if (signalfd(sDispatcher.fd, &sDispatcher.mask, 0) < 0) {
+    err = errno;
+    sigdelset(&sDispatcher.mask, signo);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+  }
+  return err;
+}
+
+static
+void _WBSignalBackendDisable(int signo) {
+  sigdelset(&sDispatcher.mask, signo);
+  signalfd(sDispatcher.fd, &sDispatcher.mask, 0);
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, signo);
+  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+}
+
+static
+void _WBSignalBackendRead(uint64_t counts[NSIG]) {
+  struct signalfd_siginfo infos[16];
+  ssize_t length;
+  do {
+    length = read(sDispatcher.fd, infos, sizeof(infos));
+    for (ssize_t idx = 0; idx < length / (ssize_t)sizeof(*infos); idx++) {
+      if (infos[idx].ssi_signo < NSIG)
+        counts[infos[idx].ssi_signo]++;
+    }
+  } while (length == sizeof(infos) || (length < 0 && errno == EINTR));
+}
+
+// MARK: Self-Pipe
+#else
+static
+void _WBSignalToPipeHandler(int signo) {
+  /* only the first signal since the last dispatch wakes up the reader */
+  if (0 == atomic_fetch_add_explicit(&sDispatcher.pending[signo], 1, memory_order_relaxed)) {
+    int err = errno;
+    const char c = (char)signo;
+    /* a full pipe means a dispatch is already pending */
+    ssize_t junk = write(sDispatcher.sink, &c, 1);
+    (void)junk;
+    errno = err;
+  }
+}
+
+static
+int _WBSignalBackendInit(void) {
+  int fds[2];
+  if (pipe(fds) < 0)
+    return errno;
+  for (int idx = 0; idx < 2; idx++) {
+    int flags = fcntl(fds[idx], F_GETFL);
+    fcntl(fds[idx], F_SETFL, flags | O_NONBLOCK);
+    _WBSignalSetCloseOnExec(fds[idx]);
+  }
+  sDispatcher.fd = fds[0];
+  sDispatcher.sink = fds[1];
+  return 0;
+}
+
+static
+int _WBSignalBackendEnable(int signo) {
+  struct sigaction action = { .sa_handler = _WBSignalToPipeHandler, .sa_flags = SA_RESTART };
+  sigemptyset(&action.sa_mask);
+  return sigaction(signo, &action, &sDispatcher.previous[signo]) < 0 ? errno : 0;
+}
+
+static
+void _WBSignalBackendDisable(int signo) {
+  sigaction(signo, &sDispatcher.previous[signo], NULL);
+  atomic_store(&sDispatcher.pending[signo], 0);
+}
+
+static
+void _WBSignalBackendRead(uint64_t counts[NSIG]) {
+  /* drain the pipe first, so a signal received from now wakes up the reader again */
+  char buffer[64];
+  while (read(sDispatcher.fd, buffer, sizeof(buffer)) > 0)
+    continue;
+  for (int signo = 1; signo < NSIG; signo++)
+    counts[signo] += atomic_exchange_explicit(&sDispatcher.pending[signo], 0, memory_order_relaxed);
+}
+#endif
+
+// MARK: Dispatcher
+static
+void _WBSignalDispatcherInitialize(void) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  /* handlers can add and remove handlers */
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&sDispatcher.lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  sDispatcher.error = _WBSignalBackendInit();
+  if (sDispatcher.error)
+    spx_log_warning("cannot create signal dispatcher: %s", strerror(sDispatcher.error));
+}
+
+static
+int _WBSignalDispatcherLock(void) {
+  pthread_once(&sDispatcherOnce, _WBSignalDispatcherInitialize);
+  if (sDispatcher.error)
+    return sDispatcher.error;
+  pthread_mutex_lock(&sDispatcher.lock);
+  return 0;
+}
+
+static
+void _WBSignalDispatcherCollect(void) {
+  WBSignalHandler **prev = &sDispatcher.handlers;
+  while (*prev) {
+    WBSignalHandler *handler = *prev;
+    if (!handler->callback) {
+      *prev = handler->next;
+      free(handler);
+    } else {
+      prev = &handler->next;
+    }
+  }
+  sDispatcher.garbage = false;
+}
+
+int WBSignalDispatcherAddHandler(int signo, WBSignalDispatcherCallBack callback, void *ctxt) {
+  if (signo <= 0 || signo >= NSIG || signo == SIGKILL || signo == SIGSTOP || !callback) {
+    errno = EINVAL;
+    return -1;
+  }
+  int err = _WBSignalDispatcherLock();
+  if (err) {
+    errno = err;
+    return -1;
+  }
+
+  int token = -1;
+  WBSignalHandler *handler = calloc(1, sizeof(*handler));
+  if (!handler) {
+    err = ENOMEM;
+  } else if (0 == sDispatcher.counts[signo]) {
+    err = _WBSignalBackendEnable(signo);
+  }
+
+  if (0 == err) {
+    sDispatcher.counts[signo]++;
+    handler->token = token = ++sDispatcher.tokens;
+    handler->signo = signo;
+    handler->callback = callback;
+    handler->ctxt = ctxt;
+    /* append, so handlers are called in registration order */
+    WBSignalHandler **last = &sDispatcher.handlers;
+    while (*last)
+      last = &(*last)->next;
+    *last = handler;
+  } else {
+    free(handler);
+  }
+  pthread_mutex_unlock(&sDispatcher.lock);
+
+  if (err)
+    errno = err;
+  return token;
+}
+
+void WBSignalDispatcherRemoveHandler(int token) {
+  if (token <= 0 || _WBSignalDispatcherLock())
+    return;
+
+  WBSignalHandler **prev = &sDispatcher.handlers;
+  while (*prev && ((*prev)->token != token || !(*prev)->callback))
+    prev = &(*prev)->next;
+
+  WBSignalHandler *handler = *prev;
+  if (handler) {
+    if (0 == --sDispatcher.counts[handler->signo])
+      _WBSignalBackendDisable(handler->signo);
+    if (sDispatcher.dispatching) {
+      handler->callback = NULL;
+      sDispatcher.garbage = true;
+    } else {
+      *prev = handler->next;
+      free(handler);
+    }
+  }
+  pthread_mutex_unlock(&sDispatcher.lock);
+}
+
+int WBSignalDispatcherGetDescriptor(void) {
+  pthread_once(&sDispatcherOnce, _WBSignalDispatcherInitialize);
+  return sDispatcher.fd;
+}
+
+uint64_t WBSignalDispatcherDispatch(void) {
+  if (_WBSignalDispatcherLock())
+    return 0;
+
+  uint64_t counts[NSIG] = {};
+  _WBSignalBackendRead(counts);
+
+  uint64_t total = 0;
+  sDispatcher.dispatching++;
+  for (int signo = 1; signo < NSIG; signo++) {
+    if (!counts[signo])
+      continue;
+    total += counts[signo];
+    for (WBSignalHandler *handler = sDispatcher.handlers; handler; handler = handler->next) {
+      if (handler->signo == signo && handler->callback)
+        handler->callback(signo, counts[signo], handler->ctxt);
+    }
+  }
+  if (0 == --sDispatcher.dispatching && sDispatcher.garbage)
+    _WBSignalDispatcherCollect();
+
+  pthread_mutex_unlock(&sDispatcher.lock);
+  return total;
+}
+
+// MARK: Run Loop
+#if defined(__APPLE__)
+static
+void _WBSignalDispatcherCallBack(CFFileDescriptorRef descriptor, CFOptionFlags types, void *info) {
+  WBSignalDispatcherDispatch();
+  /* callbacks are one-shot */
+  CFFileDescriptorEnableCallBacks(descriptor, kCFFileDescriptorReadCallBack);
+}
+
+int WBSignalDispatcherScheduleInRunLoop(CFRunLoopRef runLoop, CFStringRef mode) {
+  int err = _WBSignalDispatcherLock();
+  if (err)
+    return err;
+
+  if (!sDispatcher.source) {
+    sDispatcher.descriptor = CFFileDescriptorCreate(kCFAllocatorDefault, sDispatcher.fd, false, _WBSignalDispatcherCallBack, NULL);
+    if (sDispatcher.descriptor) {
+      CFFileDescriptorEnableCallBacks(sDispatcher.descriptor, kCFFileDescriptorReadCallBack);
+      sDispatcher.source = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, sDispatcher.descriptor, 0);
+    }
+  }
+  if (sDispatcher.source)
+    CFRunLoopAddSource(runLoop, sDispatcher.source, mode);
+  else
+    err = ENOMEM;
+  pthread_mutex_unlock(&sDispatcher.lock);
+  return err;
+}
+
+void WBSignalDispatcherUnscheduleFromRunLoop(CFRunLoopRef runLoop, CFStringRef mode) {
+  if (_WBSignalDispatcherLock())
+    return;
+  if (sDispatcher.source)
+    CFRunLoopRemoveSource(runLoop, sDispatcher.source, mode);
+  pthread_mutex_unlock(&sDispatcher.lock);
+}
+#endif
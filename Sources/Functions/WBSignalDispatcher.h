@@ -0,0 +1,69 @@
+/*
+ *  WBSignalDispatcher.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#if !defined(__WB_SIGNAL_DISPATCHER_H)
+#define __WB_SIGNAL_DISPATCHER_H 1
+
+#include <WonderBox/WBBase.h>
+
+#include <stdint.h>
+
+#if defined(__APPLE__)
+  #include <CoreFoundation/CoreFoundation.h>
+#endif
+
+/*!
+ @header WBSignalDispatcher
+ @abstract Process wide signal dispatcher.
+ @discussion Signals are delivered outside of the signal handler context, from the thread that calls
+ WBSignalDispatcherDispatch() (or from a run loop). Any number of handlers can be registered for a signal,
+ and removed at any time.
+ Repeated signals are coalesced: each handler is called once per dispatch with the number of signals
+ received since the previous dispatch.
+ The dispatcher uses kqueue (EVFILT_SIGNAL) when available, signalfd on Linux, and a self-pipe
+ elsewhere. With signalfd, the signals are blocked in the calling thread, so handlers should be added
+ before creating other threads (which inherit the signal mask).
+ While a signal has handlers, its previous disposition is replaced, and it is restored when the last
+ handler is removed.
+ */
+
+__BEGIN_DECLS
+
+typedef void (*WBSignalDispatcherCallBack)(int signo, uint64_t count, void *ctxt);
+
+/* Returns a registration token (> 0), or -1 (errno is set) */
+WB_EXPORT
+int WBSignalDispatcherAddHandler(int signo, WBSignalDispatcherCallBack callback, void *ctxt);
+
+/* The handler is not called once this function returns (unless it is called from another thread
+ while the handler is running). Can be called from a handler. */
+WB_EXPORT
+void WBSignalDispatcherRemoveHandler(int token);
+
+/* Descriptor readable when signals are pending, to integrate the dispatcher in an event loop
+ (poll, select, epoll, kqueue, …). -1 on error. */
+WB_EXPORT
+int WBSignalDispatcherGetDescriptor(void);
+
+/* Call the handlers of the pending signals. Returns the number of signals received. */
+WB_EXPORT
+uint64_t WBSignalDispatcherDispatch(void);
+
+#if defined(__APPLE__)
+/* Dispatch the signals from a run loop. Returns 0 or an errno value. */
+WB_EXPORT
+int WBSignalDispatcherScheduleInRunLoop(CFRunLoopRef runLoop, CFStringRef mode);
+WB_EXPORT
+void WBSignalDispatcherUnscheduleFromRunLoop(CFRunLoopRef runLoop, CFStringRef mode);
+#endif
+
+__END_DECLS
+
+#endif /* __WB_SIGNAL_DISPATCHER_H */
@@ -10,55 +10,765 @@
 
 #include <WonderBox/WBTextFunctions.h>
 
+#include <errno.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  #include <arm_neon.h>
+#endif
+
+// MARK: Line Scanner
+WB_INLINE
+bool _WBTextIsLineTerminator(UniChar ch) {
+  return kWBNewlineCharacter == ch || kWBCarriageReturnCharacter == ch || 0x0085 == ch ||
+    kWBLineSeparatorCharacter == ch || kWBParagraphSeparatorCharacter == ch;
+}
+
+/* Returns the index of the first line terminator in chars[idx, length), or length */
+static
+CFIndex _WBTextFindLineTerminator(const UniChar *chars, CFIndex idx, CFIndex length) {
+#if defined(__SSE2__)
+  const __m128i lf = _mm_set1_epi16(kWBNewlineCharacter), cr = _mm_set1_epi16(kWBCarriageReturnCharacter);
+  const __m128i nel = _mm_set1_epi16(0x0085), ps = _mm_set1_epi16(kWBParagraphSeparatorCharacter), one = _mm_set1_epi16(1);
+  while (length - idx >= 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(chars + idx));
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(v, lf), _mm_cmpeq_epi16(v, cr)),
+                             _mm_or_si128(_mm_cmpeq_epi16(v, nel), _mm_cmpeq_epi16(_mm_or_si128(v, one), ps)));
+    int mask = _mm_movemask_epi8(m);
+    if (mask)
+      return idx + __builtin_ctz(mask) / 2;
+    idx += 8;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint16x8_t lf = vdupq_n_u16(kWBNewlineCharacter), cr = vdupq_n_u16(kWBCarriageReturnCharacter);
+  const uint16x8_t nel = vdupq_n_u16(0x0085), ps = vdupq_n_u16(kWBParagraphSeparatorCharacter), one = vdupq_n_u16(1);
+  while (length - idx >= 8) {
+    uint16x8_t v = vld1q_u16(chars + idx);
+    uint16x8_t m = vorrq_u16(vorrq_u16(vceqq_u16(v, lf), vceqq_u16(v, cr)),
+                             vorrq_u16(vceqq_u16(v, nel), vceqq_u16(vorrq_u16(v, one), ps)));
+    if (vmaxvq_u16(m))
+      break;
+    idx += 8;
+  }
+#endif
+  for (; idx < length; idx++) {
+    if (_WBTextIsLineTerminator(chars[idx]))
+      return idx;
+  }
+  return length;
+}
+
+/* called for each line start (the location following a line terminator). Returns false to stop the scan. */
+typedef bool (*_WBTextLineStartFunction)(CFIndex start, void *ctxt);
+
+/* Scan str in range. CR at the end of range are resolved using the following character.
+ Returns false if the function stopped the scan. */
+static
+bool _WBTextScanLines(CFStringRef str, CFRange range, _WBTextLineStartFunction function, void *ctxt) {
+  UniChar buffer[4096];
+  bool cr = false; // the previous chunk ended with a CR
+  const UniChar *ptr = CFStringGetCharactersPtr(str);
+  CFIndex location = range.location, end = range.location + range.length;
+  while (location < end) {
+    const UniChar *chars;
+    CFIndex length = end - location;
+    if (ptr) {
+      chars = ptr + location;
+    } else {
+      if (length > (CFIndex)(sizeof(buffer) / sizeof(*buffer)))
+        length = sizeof(buffer) / sizeof(*buffer);
+      CFStringGetCharacters(str, CFRangeMake(location, length), buffer);
+      chars = buffer;
+    }
+
+    CFIndex idx = 0;
+    if (cr) {
+      cr = false;
+      if (kWBNewlineCharacter == chars[0])
+        idx++;
+      if (!function(location + idx, ctxt))
+        return false;
+    }
+    while ((idx = _WBTextFindLineTerminator(chars, idx, length)) < length) {
+      if (kWBCarriageReturnCharacter == chars[idx++]) {
+        if (idx == length) {
+          cr = true;
+          break;
+        }
+        if (kWBNewlineCharacter == chars[idx])
+          idx++;
+      }
+      if (!function(location + idx, ctxt))
+        return false;
+    }
+    location += length;
+  }
+  if (cr) {
+    if (end < CFStringGetLength(str) && kWBNewlineCharacter == CFStringGetCharacterAtIndex(str, end))
+      end++;
+    return function(end, ctxt);
+  }
+  return true;
+}
+
+static
+bool _WBTextCountLineStart(CFIndex start, void *ctxt) {
+  CFIndex *count = (CFIndex *)ctxt;
+  *count += 1;
+  return true;
+}
+
 CFIndex WBTextGetCountOfLines(CFStringRef str) {
-  CFIndex lines = 0;
+  CFIndex starts = 0;
+  CFIndex length = CFStringGetLength(str);
+  if (0 == length)
+    return 0;
 
-  CFIndex stringLength = CFStringGetLength(str);
-  for (CFIndex idx = 0; idx < stringLength; lines++)
-    CFStringGetLineBounds(str, CFRangeMake(idx, 0), NULL, &idx, NULL);
+  _WBTextScanLines(str, CFRangeMake(0, length), _WBTextCountLineStart, &starts);
+  /* the first line, and a trailing terminator does not start a new line */
+  if (_WBTextIsLineTerminator(CFStringGetCharacterAtIndex(str, length - 1)))
+    starts--;
+  return starts + 1;
+}
 
-  return lines;
+typedef struct _WBTextLineLookup {
+  CFIndex line;
+  CFIndex current;
+  CFIndex start, end;
+} _WBTextLineLookup;
+
+static
+bool _WBTextLookupLineStart(CFIndex start, void *ctxt) {
+  _WBTextLineLookup *lookup = (_WBTextLineLookup *)ctxt;
+  if (++lookup->current == lookup->line) {
+    lookup->start = start;
+  } else if (lookup->current > lookup->line) {
+    lookup->end = start;
+    return false;
+  }
+  return true;
 }
 
-CFIndex WBTextConvertLineEnding(CFMutableStringRef str, CFStringRef endOfLine) {
-  CFIndex position = 0, idx = 0, count = 0;
+CFRange WBTextGetRangeOfLine(CFStringRef str, CFIndex line) {
+  CFIndex length = CFStringGetLength(str);
+  _WBTextLineLookup lookup = { line, 0, 0 == line ? 0 : kCFNotFound, length };
+  if (line >= 0)
+    _WBTextScanLines(str, CFRangeMake(0, length), _WBTextLookupLineStart, &lookup);
+  if (kCFNotFound == lookup.start || lookup.start >= length)
+    return CFRangeMake(kCFNotFound, 0);
+  return CFRangeMake(lookup.start, lookup.end - lookup.start);
+}
+
+// MARK: Line Ending Conversion
+typedef struct _WBTextCharacters {
+  UniChar *chars;
+  CFIndex length, size;
+} _WBTextCharacters;
+
+static
+void _WBTextCharactersAppend(_WBTextCharacters *buffer, const UniChar *chars, CFIndex length) {
+  if (buffer->length + length > buffer->size) {
+    buffer->size = MAX(buffer->length + length, buffer->size + buffer->size / 2);
+    buffer->chars = realloc(buffer->chars, buffer->size * sizeof(*buffer->chars));
+  }
+  memcpy(buffer->chars + buffer->length, chars, length * sizeof(*chars));
+  buffer->length += length;
+}
 
-  CFIndex eol = CFStringGetLength(endOfLine);
+/* Terminators converted: CR, LF, CRLF, U+2028 and U+2029 */
+CFStringRef WBTextCreateStringByConvertingLineEnding(CFAllocatorRef allocator, CFStringRef str, CFStringRef endOfLine, CFIndex *count) {
+  CFIndex converted = 0;
   CFIndex length = CFStringGetLength(str);
+  CFIndex eolLength = CFStringGetLength(endOfLine);
+  UniChar *eol = malloc(MAX(eolLength, 1) * sizeof(*eol));
+  CFStringGetCharacters(endOfLine, CFRangeMake(0, eolLength), eol);
 
-  UniChar ch;
-  CFStringInlineBuffer buffer;
-  CFStringInitInlineBuffer(str, &buffer, CFRangeMake(0, length));
-
-  while ((ch = CFStringGetCharacterFromInlineBuffer(&buffer, idx))) {
-    CFRange range = CFRangeMake(kCFNotFound, 0);
-    if (kWBCarriageReturnCharacter == ch) {
-      range.length = 1;
-      range.location = idx;
-      ch = CFStringGetCharacterFromInlineBuffer(&buffer, idx + 1);
-      if (kWBNewlineCharacter == ch) {
+  _WBTextCharacters output = { NULL, 0, 0 };
+  output.size = length + length / 8 + 16;
+  output.chars = malloc(output.size * sizeof(*output.chars));
+
+  UniChar buffer[4096];
+  const UniChar *ptr = CFStringGetCharactersPtr(str);
+  CFIndex location = 0;
+  while (location < length) {
+    const UniChar *chars;
+    CFIndex chunk = length - location;
+    if (ptr) {
+      chars = ptr + location;
+    } else {
+      if (chunk > (CFIndex)(sizeof(buffer) / sizeof(*buffer)))
+        chunk = sizeof(buffer) / sizeof(*buffer);
+      CFStringGetCharacters(str, CFRangeMake(location, chunk), buffer);
+      chars = buffer;
+    }
+
+    CFIndex idx = 0, segment = 0;
+    while ((idx = _WBTextFindLineTerminator(chars, idx, chunk)) < chunk) {
+      CFIndex skip = 1;
+      if (0x0085 == chars[idx]) {
         idx++;
-        range.length = 2;
+        continue;
+      }
+      if (kWBCarriageReturnCharacter == chars[idx]) {
+        /* the LF may be the first character of the next chunk */
+        if (idx + 1 < chunk)
+          skip = kWBNewlineCharacter == chars[idx + 1] ? 2 : 1;
+        else if (location + chunk < length)
+          skip = kWBNewlineCharacter == CFStringGetCharacterAtIndex(str, location + chunk) ? 2 : 1;
       }
-    } else if (kWBNewlineCharacter == ch || kWBLineSeparatorCharacter == ch || kWBParagraphSeparatorCharacter == ch) {
-      range.length = 1;
-      range.location = idx;
+      _WBTextCharactersAppend(&output, chars + segment, idx - segment);
+      _WBTextCharactersAppend(&output, eol, eolLength);
+      converted++;
+      idx += skip;
+      segment = idx;
     }
-    idx++;
-    if (range.location != kCFNotFound) {
-      count++;
-      range.location += position;
-      CFIndex delta = eol - range.length;
-      CFStringReplace(str, range, endOfLine);
-      if (delta != 0) {
-        idx += delta;
-        length += delta;
-        position += idx;
-        CFStringInitInlineBuffer(str, &buffer, CFRangeMake(position, length - position));
-        idx = 0;
+    if (segment < chunk)
+      _WBTextCharactersAppend(&output, chars + segment, chunk - segment);
+    location += MAX(segment, chunk);
+  }
+  free(eol);
+
+  if (count) *count = converted;
+  CFStringRef result = CFStringCreateWithCharactersNoCopy(allocator, output.chars, output.length, kCFAllocatorMalloc);
+  if (!result)
+    free(output.chars);
+  return result;
+}
+
+CFIndex WBTextConvertLineEnding(CFMutableStringRef str, CFStringRef endOfLine) {
+  CFIndex count = 0;
+  CFStringRef converted = WBTextCreateStringByConvertingLineEnding(kCFAllocatorDefault, str, endOfLine, &count);
+  if (converted) {
+    if (count > 0)
+      CFStringReplaceAll(str, converted);
+    CFRelease(converted);
+  }
+  return count;
+}
+
+/* Returns the index of the first LF, CR or 0xE2 (U+2028 and U+2029 lead byte) in bytes[idx, length), or length */
+static
+size_t _WBTextFindUTF8LineTerminator(const uint8_t *bytes, size_t idx, size_t length) {
+#if defined(__SSE2__)
+  const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'), ls = _mm_set1_epi8((char)0xe2);
+  while (length - idx >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(bytes + idx));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)), _mm_cmpeq_epi8(v, ls)));
+    if (mask)
+      return idx + __builtin_ctz(mask);
+    idx += 16;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t lf = vdupq_n_u8('\n'), cr = vdupq_n_u8('\r'), ls = vdupq_n_u8(0xe2);
+  while (length - idx >= 16) {
+    uint8x16_t v = vld1q_u8(bytes + idx);
+    if (vmaxvq_u8(vorrq_u8(vorrq_u8(vceqq_u8(v, lf), vceqq_u8(v, cr)), vceqq_u8(v, ls))))
+      break;
+    idx += 16;
+  }
+#endif
+  for (; idx < length; idx++) {
+    if ('\n' == bytes[idx] || '\r' == bytes[idx] || 0xe2 == bytes[idx])
+      return idx;
+  }
+  return length;
+}
+
+#define kWBTextConverterBufferSize (64 * 1024)
+
+struct __WBTextLineEndingConverter {
+  WBTextOutputFunction output;
+  void *ctxt;
+  char *eol;
+  size_t eolLength;
+  /* incomplete terminator at the end of the previous input */
+  uint8_t carry[2];
+  size_t carryLength;
+  CFIndex count;
+  bool error;
+  size_t length;
+  uint8_t buffer[kWBTextConverterBufferSize];
+};
+
+static
+bool _WBTextConverterFlush(WBTextLineEndingConverterRef converter) {
+  if (converter->length > 0 && !converter->error) {
+    if (converter->output(converter->buffer, converter->length, converter->ctxt) < 0)
+      converter->error = true;
+  }
+  converter->length = 0;
+  return !converter->error;
+}
+
+static
+void _WBTextConverterAppend(WBTextLineEndingConverterRef converter, const void *bytes, size_t length) {
+  if (converter->length + length > kWBTextConverterBufferSize) {
+    if (!_WBTextConverterFlush(converter))
+      return;
+    /* large segments are not copied */
+    if (length >= kWBTextConverterBufferSize) {
+      if (converter->output(bytes, length, converter->ctxt) < 0)
+        converter->error = true;
+      return;
+    }
+  }
+  memcpy(converter->buffer + converter->length, bytes, length);
+  converter->length += length;
+}
+
+/* Returns the number of bytes consumed. If final is false, an incomplete terminator at the end is left. */
+static
+size_t _WBTextConverterConvert(WBTextLineEndingConverterRef converter, const uint8_t *bytes, size_t length, bool final) {
+  size_t idx = 0, segment = 0;
+  while ((idx = _WBTextFindUTF8LineTerminator(bytes, idx, length)) < length) {
+    size_t skip = 1;
+    if ('\r' == bytes[idx]) {
+      if (idx + 1 == length && !final)
+        break;
+      if (idx + 1 < length && '\n' == bytes[idx + 1])
+        skip = 2;
+    } else if (0xe2 == bytes[idx]) {
+      size_t avail = length - idx;
+      if (avail < 3) {
+        if (!final && (1 == avail || 0x80 == bytes[idx + 1]))
+          break;
+        idx++;
+        continue;
+      }
+      if (0x80 != bytes[idx + 1] || (0xa8 != bytes[idx + 2] && 0xa9 != bytes[idx + 2])) {
+        idx++;
+        continue;
       }
+      skip = 3;
+    }
+    _WBTextConverterAppend(converter, bytes + segment, idx - segment);
+    _WBTextConverterAppend(converter, converter->eol, converter->eolLength);
+    converter->count++;
+    idx += skip;
+    segment = idx;
+  }
+  _WBTextConverterAppend(converter, bytes + segment, idx - segment);
+  return idx;
+}
+
+WBTextLineEndingConverterRef WBTextLineEndingConverterCreate(const char *endOfLine, WBTextOutputFunction output, void *ctxt) {
+  if (!endOfLine || !output) return NULL;
+  WBTextLineEndingConverterRef converter = malloc(sizeof(*converter));
+  if (!converter) return NULL;
+  converter->output = output;
+  converter->ctxt = ctxt;
+  converter->eol = strdup(endOfLine);
+  converter->eolLength = strlen(endOfLine);
+  converter->carryLength = 0;
+  converter->count = 0;
+  converter->error = false;
+  converter->length = 0;
+  return converter;
+}
+
+void WBTextLineEndingConverterFree(WBTextLineEndingConverterRef converter) {
+  if (!converter) return;
+  free(converter->eol);
+  free(converter);
+}
+
+intptr_t WBTextLineEndingConverterConvertBytes(WBTextLineEndingConverterRef converter, const void *bytes, size_t length) {
+  const uint8_t *src = bytes;
+  size_t left = length;
+  /* complete the pending terminator with the first bytes */
+  while (converter->carryLength > 0 && left > 0) {
+    uint8_t tmp[4];
+    size_t extra = MIN(left, (size_t)2);
+    memcpy(tmp, converter->carry, converter->carryLength);
+    memcpy(tmp + converter->carryLength, src, extra);
+    size_t total = converter->carryLength + extra;
+    size_t consumed = _WBTextConverterConvert(converter, tmp, total, false);
+    converter->carryLength = total - consumed;
+    memcpy(converter->carry, tmp + consumed, converter->carryLength);
+    src += extra;
+    left -= extra;
+  }
+  if (left > 0) {
+    size_t consumed = _WBTextConverterConvert(converter, src, left, false);
+    converter->carryLength = left - consumed;
+    memcpy(converter->carry, src + consumed, converter->carryLength);
+  }
+  return converter->error ? -1 : (intptr_t)length;
+}
+
+CFIndex WBTextLineEndingConverterFinish(WBTextLineEndingConverterRef converter) {
+  _WBTextConverterConvert(converter, converter->carry, converter->carryLength, true);
+  converter->carryLength = 0;
+  if (!_WBTextConverterFlush(converter))
+    return -1;
+  return converter->count;
+}
+
+static
+intptr_t _WBTextFileDescriptorOutput(const void *bytes, size_t length, void *ctxt) {
+  int fd = (int)(intptr_t)ctxt;
+  const uint8_t *cursor = bytes;
+  size_t left = length;
+  while (left > 0) {
+    ssize_t count = write(fd, cursor, left);
+    if (count < 0) {
+      if (EINTR == errno) continue;
+      return -1;
     }
+    cursor += count;
+    left -= count;
+  }
+  return (intptr_t)length;
+}
+
+#define kWBTextMapSegment (4 * 1024 * 1024)
+
+CFIndex WBTextConvertLineEndingWithFileDescriptors(int input, int output, const char *endOfLine) {
+  WBTextLineEndingConverterRef converter = WBTextLineEndingConverterCreate(endOfLine, _WBTextFileDescriptorOutput, (void *)(intptr_t)output);
+  if (!converter) return -1;
+
+  bool ok = true;
+  struct stat st;
+  off_t offset;
+  uint8_t *map = MAP_FAILED;
+  size_t mapsize = 0;
+  off_t base = 0;
+  /* regular files are mapped, and released as they are consumed */
+  if (fstat(input, &st) == 0 && S_ISREG(st.st_mode) && (offset = lseek(input, 0, SEEK_CUR)) >= 0 &&
+      st.st_size > offset && (uint64_t)(st.st_size - offset) <= SIZE_MAX / 2) {
+    base = offset - offset % (off_t)sysconf(_SC_PAGESIZE);
+    mapsize = (size_t)(st.st_size - base);
+    map = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, input, base);
   }
+  if (MAP_FAILED != map) {
+    madvise(map, mapsize, MADV_SEQUENTIAL);
+    const size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    const uint8_t *src = map + (offset - base), *end = map + mapsize;
+    while (ok && src < end) {
+      size_t length = MIN((size_t)(end - src), (size_t)kWBTextMapSegment);
+      ok = WBTextLineEndingConverterConvertBytes(converter, src, length) >= 0;
+      src += length;
+      size_t consumed = (size_t)(src - map) - (size_t)(src - map) % pagesize;
+      if (consumed > 0)
+        madvise(map, consumed, MADV_DONTNEED);
+    }
+    munmap(map, mapsize);
+    if (ok)
+      lseek(input, st.st_size, SEEK_SET);
+  } else {
+    uint8_t *buffer = malloc(kWBTextConverterBufferSize);
+    ssize_t count;
+    do {
+      count = read(input, buffer, kWBTextConverterBufferSize);
+      if (count > 0)
+        ok = WBTextLineEndingConverterConvertBytes(converter, buffer, count) >= 0;
+      else if (count < 0 && EINTR == errno)
+        count = 1;
+      else if (count < 0)
+        ok = false;
+    } while (ok && count > 0);
+    free(buffer);
+  }
+
+  CFIndex count = ok ? WBTextLineEndingConverterFinish(converter) : -1;
+  WBTextLineEndingConverterFree(converter);
   return count;
 }
 
+// MARK: Collation Keys
+/* Characters are stored as big endian UTF-16. A digits run is stored as 0x00 0x30 (so it sorts
+ like a digit against other characters), the number of significant digits (1 byte, or 0xff and 4 bytes),
+ and the digits. Longer numbers are greater, and numbers of the same length compare digit by digit. */
+CFDataRef WBTextCreateCollationKey(CFAllocatorRef allocator, CFStringRef str, CFStringCompareFlags options) {
+  CFStringRef source = str;
+  CFMutableStringRef folded = NULL;
+  if (options & (kCFCompareCaseInsensitive | kCFCompareNonliteral)) {
+    folded = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, str);
+    if (!folded) return NULL;
+    if (options & kCFCompareCaseInsensitive)
+      CFStringFold(folded, kCFCompareCaseInsensitive, NULL);
+    if (options & kCFCompareNonliteral)
+      CFStringNormalize(folded, kCFStringNormalizationFormD);
+    source = folded;
+  }
+
+  UniChar *buffer = NULL;
+  CFIndex length = CFStringGetLength(source);
+  const UniChar *chars = CFStringGetCharactersPtr(source);
+  if (!chars) {
+    buffer = malloc(MAX(length, 1) * sizeof(*buffer));
+    CFStringGetCharacters(source, CFRangeMake(0, length), buffer);
+    chars = buffer;
+  }
+
+  /* a digit uses at most 4 bytes (a single digit number) */
+  size_t size = 0;
+  uint8_t *key = malloc(length * 4 + 8);
+  for (CFIndex idx = 0; idx < length; ) {
+    UniChar ch = chars[idx];
+    if ((options & kCFCompareNumerically) && ch >= '0' && ch <= '9') {
+      CFIndex end = idx + 1;
+      while (end < length && chars[end] >= '0' && chars[end] <= '9')
+        end++;
+      /* leading zeros are not significant */
+      while (idx < end - 1 && '0' == chars[idx])
+        idx++;
+      size_t digits = (size_t)(end - idx);
+      key[size++] = 0;
+      key[size++] = '0';
+      if (digits < 0xff) {
+        key[size++] = (uint8_t)digits;
+      } else {
+        uint32_t count = digits > UINT32_MAX ? UINT32_MAX : (uint32_t)digits;
+        key[size++] = 0xff;
+        key[size++] = (uint8_t)(count >> 24);
+        key[size++] = (uint8_t)(count >> 16);
+        key[size++] = (uint8_t)(count >> 8);
+        key[size++] = (uint8_t)count;
+      }
+      for (; idx < end; idx++)
+        key[size++] = (uint8_t)chars[idx];
+    } else {
+      key[size++] = (uint8_t)(ch >> 8);
+      key[size++] = (uint8_t)ch;
+      idx++;
+    }
+  }
+  free(buffer);
+  if (folded)
+    CFRelease(folded);
+
+  CFDataRef data = CFDataCreateWithBytesNoCopy(allocator, key, size, kCFAllocatorMalloc);
+  if (!data)
+    free(key);
+  return data;
+}
+
+// MARK: Line Index
+/* Line starts are stored by blocks, so an edit only rewrites the blocks it touches,
+ and updates the location of the following blocks. */
+#define kWBTextLineBlockSize 512
+
+typedef struct _WBTextLineBlock {
+  CFIndex line;   // number of the first line
+  CFIndex offset; // location of the first line
+  CFIndex count;
+  CFIndex starts[kWBTextLineBlockSize]; // relative to offset
+} _WBTextLineBlock;
+
+struct __WBTextLineIndex {
+  CFIndex length; // text length
+  CFIndex count;  // number of line starts (including a trailing empty line)
+  CFIndex blockCount, blockSize;
+  _WBTextLineBlock **blocks;
+};
+
+/* growable list of absolute line starts */
+typedef struct _WBTextLineStarts {
+  CFIndex *starts;
+  CFIndex count, size;
+  CFIndex min, max; // accepted range
+} _WBTextLineStarts;
+
+static
+void _WBTextLineStartsAppend(_WBTextLineStarts *list, CFIndex start) {
+  if (list->count == list->size) {
+    list->size = list->size ? list->size * 2 : 64;
+    list->starts = realloc(list->starts, list->size * sizeof(*list->starts));
+  }
+  list->starts[list->count++] = start;
+}
+
+static
+bool _WBTextCollectLineStart(CFIndex start, void *ctxt) {
+  _WBTextLineStarts *list = (_WBTextLineStarts *)ctxt;
+  if (start > list->max)
+    return false;
+  if (start >= list->min)
+    _WBTextLineStartsAppend(list, start);
+  return true;
+}
+
+static
+void _WBTextLineIndexInsertBlocks(WBTextLineIndexRef index, CFIndex position, CFIndex count) {
+  if (index->blockCount + count > index->blockSize) {
+    while (index->blockCount + count > index->blockSize)
+      index->blockSize = index->blockSize ? index->blockSize * 2 : 16;
+    index->blocks = realloc(index->blocks, index->blockSize * sizeof(*index->blocks));
+  }
+  memmove(index->blocks + position + count, index->blocks + position, (index->blockCount - position) * sizeof(*index->blocks));
+  index->blockCount += count;
+}
+
+/* Store starts in new blocks, inserted at position. Blocks are 3/4 full, so small edits do not split them. */
+static
+CFIndex _WBTextLineIndexStoreStarts(WBTextLineIndexRef index, CFIndex position, const CFIndex *starts, CFIndex count) {
+  const CFIndex fill = kWBTextLineBlockSize * 3 / 4;
+  CFIndex blocks = count <= kWBTextLineBlockSize ? (count ? 1 : 0) : (count + fill - 1) / fill;
+  if (!blocks)
+    return 0;
+
+  _WBTextLineIndexInsertBlocks(index, position, blocks);
+  for (CFIndex idx = 0; idx < blocks; idx++) {
+    CFIndex first = count * idx / blocks, last = count * (idx + 1) / blocks;
+    _WBTextLineBlock *block = malloc(sizeof(*block));
+    block->offset = starts[first];
+    block->count = last - first;
+    for (CFIndex line = 0; line < block->count; line++)
+      block->starts[line] = starts[first + line] - block->offset;
+    index->blocks[position + idx] = block;
+  }
+  return blocks;
+}
+
+static
+void _WBTextLineIndexUpdateLines(WBTextLineIndexRef index, CFIndex position) {
+  CFIndex line = 0;
+  if (position > 0)
+    line = index->blocks[position - 1]->line + index->blocks[position - 1]->count;
+  for (CFIndex idx = position; idx < index->blockCount; idx++) {
+    index->blocks[idx]->line = line;
+    line += index->blocks[idx]->count;
+  }
+  index->count = line;
+}
+
+/* last block whose first line start is <= offset */
+static
+CFIndex _WBTextLineIndexFindBlockForOffset(WBTextLineIndexRef index, CFIndex offset) {
+  CFIndex low = 0, high = index->blockCount - 1;
+  while (low < high) {
+    CFIndex mid = (low + high + 1) / 2;
+    if (index->blocks[mid]->offset <= offset)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+  return low;
+}
+
+static
+CFIndex _WBTextLineIndexFindBlockForLine(WBTextLineIndexRef index, CFIndex line) {
+  CFIndex low = 0, high = index->blockCount - 1;
+  while (low < high) {
+    CFIndex mid = (low + high + 1) / 2;
+    if (index->blocks[mid]->line <= line)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+  return low;
+}
+
+static
+CFIndex _WBTextLineIndexGetStart(WBTextLineIndexRef index, CFIndex line) {
+  _WBTextLineBlock *block = index->blocks[_WBTextLineIndexFindBlockForLine(index, line)];
+  return block->offset + block->starts[line - block->line];
+}
+
+WBTextLineIndexRef WBTextLineIndexCreate(CFStringRef str) {
+  WBTextLineIndexRef index = calloc(1, sizeof(*index));
+  index->length = CFStringGetLength(str);
+
+  _WBTextLineStarts list = { .min = 0, .max = index->length };
+  _WBTextLineStartsAppend(&list, 0);
+  _WBTextScanLines(str, CFRangeMake(0, index->length), _WBTextCollectLineStart, &list);
+  _WBTextLineIndexStoreStarts(index, 0, list.starts, list.count);
+  _WBTextLineIndexUpdateLines(index, 0);
+  free(list.starts);
+  return index;
+}
+
+void WBTextLineIndexFree(WBTextLineIndexRef index) {
+  if (!index) return;
+  for (CFIndex idx = 0; idx < index->blockCount; idx++)
+    free(index->blocks[idx]);
+  free(index->blocks);
+  free(index);
+}
+
+CFIndex WBTextLineIndexGetCountOfLines(WBTextLineIndexRef index) {
+  /* a trailing line start is not a line */
+  if (_WBTextLineIndexGetStart(index, index->count - 1) == index->length)
+    return index->count - 1;
+  return index->count;
+}
+
+CFRange WBTextLineIndexGetRangeOfLine(WBTextLineIndexRef index, CFIndex line) {
+  if (line < 0 || line >= WBTextLineIndexGetCountOfLines(index))
+    return CFRangeMake(kCFNotFound, 0);
+
+  CFIndex start = _WBTextLineIndexGetStart(index, line);
+  CFIndex end = line + 1 < index->count ? _WBTextLineIndexGetStart(index, line + 1) : index->length;
+  return CFRangeMake(start, end - start);
+}
+
+CFIndex WBTextLineIndexGetLineForOffset(WBTextLineIndexRef index, CFIndex offset) {
+  if (offset < 0 || offset > index->length)
+    return kCFNotFound;
+
+  _WBTextLineBlock *block = index->blocks[_WBTextLineIndexFindBlockForOffset(index, offset)];
+  CFIndex relative = offset - block->offset;
+  CFIndex low = 0, high = block->count - 1;
+  while (low < high) {
+    CFIndex mid = (low + high + 1) / 2;
+    if (block->starts[mid] <= relative)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+  CFIndex lines = WBTextLineIndexGetCountOfLines(index);
+  CFIndex line = block->line + low;
+  return line < lines ? line : (lines ? lines - 1 : 0);
+}
+
+void WBTextLineIndexReplaceCharacters(WBTextLineIndexRef index, CFStringRef str, CFRange range, CFIndex length) {
+  CFIndex location = range.location, delta = length - range.length;
+  assert(location >= 0 && location + range.length <= index->length);
+  assert(index->length + delta == CFStringGetLength(str));
+
+  /* A line start depends on the characters on both sides of it,
+   so the starts in [location, location + range.length] have to be computed again. */
+  CFIndex first = _WBTextLineIndexFindBlockForOffset(index, location);
+  CFIndex last = _WBTextLineIndexFindBlockForOffset(index, location + range.length);
+
+  _WBTextLineStarts list = { .min = location, .max = location + length };
+  _WBTextLineBlock *block = index->blocks[first];
+  for (CFIndex idx = 0; idx < block->count && block->offset + block->starts[idx] < location; idx++)
+    _WBTextLineStartsAppend(&list, block->offset + block->starts[idx]);
+
+  if (0 == location) {
+    _WBTextLineStartsAppend(&list, 0);
+    _WBTextScanLines(str, CFRangeMake(0, length), _WBTextCollectLineStart, &list);
+  } else {
+    _WBTextScanLines(str, CFRangeMake(location - 1, length + 1), _WBTextCollectLineStart, &list);
+  }
+
+  block = index->blocks[last];
+  for (CFIndex idx = 0; idx < block->count; idx++) {
+    CFIndex start = block->offset + block->starts[idx];
+    if (start > location + range.length)
+      _WBTextLineStartsAppend(&list, start + delta);
+  }
+
+  /* replace the edited blocks */
+  for (CFIndex idx = first; idx <= last; idx++)
+    free(index->blocks[idx]);
+  memmove(index->blocks + first, index->blocks + last + 1, (index->blockCount - last - 1) * sizeof(*index->blocks));
+  index->blockCount -= last - first + 1;
+  CFIndex blocks = _WBTextLineIndexStoreStarts(index, first, list.starts, list.count);
+  free(list.starts);
+
+  for (CFIndex idx = first + blocks; idx < index->blockCount; idx++)
+    index->blocks[idx]->offset += delta;
+  index->length += delta;
+  _WBTextLineIndexUpdateLines(index, first);
+}
@@ -30,12 +30,94 @@ enum {
   kWBDeleteCharacter = 0x007f
 };
 
+/* Line terminators are CR, LF, CRLF, NEL (U+0085), U+2028 and U+2029 (same as CFStringGetLineBounds).
+ A terminator at the end of the text does not start a new line. */
 WB_EXPORT
 CFIndex WBTextGetCountOfLines(CFStringRef str);
 
+/* Range of the line (including its terminator), or {kCFNotFound, 0}. line is 0 based. */
+WB_EXPORT
+CFRange WBTextGetRangeOfLine(CFStringRef str, CFIndex line);
+
+// MARK: Line Ending Conversion
+/* Converted terminators are CR, LF, CRLF, U+2028 and U+2029.
+ Conversion is done in a single pass into a new buffer. count (optional) is set to the number
+ of converted line endings. */
+WB_EXPORT
+CFStringRef WBTextCreateStringByConvertingLineEnding(CFAllocatorRef allocator, CFStringRef str, CFStringRef endOfLine, CFIndex *count);
+
+/* Returns the number of converted line endings. */
 WB_EXPORT
 CFIndex WBTextConvertLineEnding(CFMutableStringRef str, CFStringRef endOfLine);
 
+/* UTF-8 streaming converter.
+ Input can be split anywhere, including in the middle of a CRLF or of a multi-byte sequence.
+ Output is buffered, and passed to the output function when the buffer is full. */
+typedef struct __WBTextLineEndingConverter *WBTextLineEndingConverterRef;
+
+/* must write all bytes, and return -1 on error */
+typedef intptr_t (*WBTextOutputFunction)(const void *bytes, size_t length, void *ctxt);
+
+WB_EXPORT
+WBTextLineEndingConverterRef WBTextLineEndingConverterCreate(const char *endOfLine, WBTextOutputFunction output, void *ctxt);
+WB_EXPORT
+void WBTextLineEndingConverterFree(WBTextLineEndingConverterRef converter);
+
+/* returns length, or -1 if the output function failed */
+WB_EXPORT
+intptr_t WBTextLineEndingConverterConvertBytes(WBTextLineEndingConverterRef converter, const void *bytes, size_t length);
+/* Flush the pending output. Returns the number of converted line endings, or -1 on error. */
+WB_EXPORT
+CFIndex WBTextLineEndingConverterFinish(WBTextLineEndingConverterRef converter);
+
+/* Convert an UTF-8 file from the current offset of input to output, using a bounded amount of memory.
+ Regular files are mapped. Returns the number of converted line endings, or -1 on error. */
+WB_EXPORT
+CFIndex WBTextConvertLineEndingWithFileDescriptors(int input, int output, const char *endOfLine);
+
+// MARK: Collation Keys
+/*!
+ @abstract Binary sort key.
+ @discussion memcmp() on two keys (shorter key first when one is a prefix of the other) orders
+ the strings like CFStringCompare() with the same options. Supported options are kCFCompareCaseInsensitive,
+ kCFCompareNonliteral and kCFCompareNumerically (ASCII digits only). Other options are ignored.
+ Computing the key once per string is much cheaper than comparing the strings n log n times.
+ */
+WB_EXPORT
+CFDataRef WBTextCreateCollationKey(CFAllocatorRef allocator, CFStringRef str, CFStringCompareFlags options);
+
+// MARK: Line Index
+/*!
+ @abstract Line starts table for random access to the lines of a large text.
+ @discussion The index is built in a single pass, and answers line and offset queries in O(log n).
+ It does not retain the string. When the string is edited, call WBTextLineIndexReplaceCharacters()
+ to update it: only the edited lines are scanned again.
+ */
+typedef struct __WBTextLineIndex *WBTextLineIndexRef;
+
+WB_EXPORT
+WBTextLineIndexRef WBTextLineIndexCreate(CFStringRef str);
+WB_EXPORT
+void WBTextLineIndexFree(WBTextLineIndexRef index);
+
+/* same value than WBTextGetCountOfLines() */
+WB_EXPORT
+CFIndex WBTextLineIndexGetCountOfLines(WBTextLineIndexRef index);
+
+/* same value than WBTextGetRangeOfLine() */
+WB_EXPORT
+CFRange WBTextLineIndexGetRangeOfLine(WBTextLineIndexRef index, CFIndex line);
+
+/* Line containing the character at offset. The text length maps to the last line.
+ Returns kCFNotFound if offset is out of bounds. */
+WB_EXPORT
+CFIndex WBTextLineIndexGetLineForOffset(WBTextLineIndexRef index, CFIndex offset);
+
+/* str is the edited string. range is the replaced range (in the previous text),
+ and length is the length of the replacement text. */
+WB_EXPORT
+void WBTextLineIndexReplaceCharacters(WBTextLineIndexRef index, CFStringRef str, CFRange range, CFIndex length);
+
 __END_DECLS
 
 #endif /* __WB_TEXT_FUNCTIONS_H */
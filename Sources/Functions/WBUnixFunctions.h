@@ -13,6 +13,8 @@
 
 #include <WonderBox/WBBase.h>
 
+#include <sys/uio.h>
+
 // MARK: File Descriptor Functions
 WB_EXPORT
 int WBIOSetNonBlocking(int fd);
@@ -23,11 +25,58 @@ size_t WBIORead(int fd, uint8_t *buffer, size_t length, size_t *bytesRead);
 WB_EXPORT
 size_t WBIOWrite(int fd, const uint8_t *buffer, size_t length, size_t *bytesWritten);
 
+/*!
+ @abstract Vectored full transfer. Loops until the vector is fully transferred, using as few
+ readv()/writev() calls as possible. Interrupted calls are restarted.
+ @param iov updated to describe the remaining bytes.
+ @param bytesRead, bytesWritten (optional) number of bytes transferred, even on failure.
+ @result 0, EOF at end of file, or an errno value (EAGAIN for a non-blocking descriptor).
+ */
+WB_EXPORT
+int WBIOReadv(int fd, struct iovec *iov, int iovcnt, size_t *bytesRead);
+WB_EXPORT
+int WBIOWritev(int fd, struct iovec *iov, int iovcnt, size_t *bytesWritten);
+
+/*!
+ @abstract Send length bytes of the file fd starting at offset to the descriptor out, without copying
+ the data in user space when the system supports it (sendfile() on Darwin and Linux, splice() on Linux
+ when fd is a pipe). Falls back to pread()/write() otherwise.
+ @param offset ignored if fd is not a regular file.
+ @param length 0 to send up to the end of the file.
+ @param bytesSent (optional) number of bytes sent, even on failure.
+ @result 0 or an errno value.
+ */
+WB_EXPORT
+int WBIOSendFile(int out, int fd, off_t offset, size_t length, size_t *bytesSent);
+
 WB_EXPORT
 ssize_t WBIOSendFileDescriptor(int sockfd, int fd);
 WB_EXPORT
 ssize_t WBIOReceiveFileDescriptor(int sockfd, int *fd);
 
+/* Maximum number of descriptors passed in a single message (Linux SCM_MAX_FD) */
+#define WB_IO_MAX_DESCRIPTORS 253
+
+/*!
+ @abstract Send count descriptors (at most WB_IO_MAX_DESCRIPTORS) and a payload in a single message.
+ @discussion An empty payload is sent as a single null byte, as stream sockets cannot carry
+ a control message alone.
+ @result 0 or an errno value.
+ */
+WB_EXPORT
+int WBIOSendFileDescriptors(int sockfd, const int *fds, size_t count, const void *data, size_t length);
+
+/*!
+ @abstract Receive a message sent by WBIOSendFileDescriptors().
+ @param fds array of *count entries. On return, *count is the number of descriptors received.
+ The descriptors are close-on-exec.
+ @param data (optional) payload buffer of *length bytes. On return, *length is the payload size.
+ @result 0, EOF if the peer closed the connection, or an errno value. If the message does not fit in
+ the buffers (EMSGSIZE), or contains unexpected control data (EBADMSG), the received descriptors are closed.
+ */
+WB_EXPORT
+int WBIOReceiveFileDescriptors(int sockfd, int *fds, size_t *count, void *data, size_t *length);
+
 /* Debug function */
 WB_EXPORT
 void WBIODumpDescriptorTable(FILE *f);
@@ -65,6 +114,7 @@ typedef void (*WBSignalHandlerCallBack)(const siginfo_t *sigInfo, void *refCon);
  @discussion You can only call this routine once for any given application;
  you must register all of the signals you're interested in at that
  time. There is no way to deregister.
+ WBSignalDispatcher.h supports multiple handlers per signal and deregistration.
  */
 WB_EXPORT
 int WBSignalInstallHandler(CFRunLoopRef runLoop,
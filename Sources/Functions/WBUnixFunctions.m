@@ -17,6 +17,11 @@
 #include <netdb.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+  #include <sys/sendfile.h>
+#endif
 
 int WBIOSetNonBlocking(int fd) {
   // According to the man page, F_GETFL can't error!
@@ -78,6 +83,144 @@ size_t WBIOWrite(int fd, const uint8_t *buffer, size_t length, size_t *bytesWrit
   return done;
 }
 
+// MARK: Vectored I/O
+/* consume 'count' bytes from the vector. Returns the new start of the vector. */
+static
+struct iovec *_WBIOVectorAdvance(struct iovec *iov, int *iovcnt, size_t count) {
+  while (*iovcnt > 0 && count >= iov->iov_len) {
+    count -= iov->iov_len;
+    iov->iov_len = 0;
+    iov++;
+    (*iovcnt)--;
+  }
+  if (*iovcnt > 0) {
+    iov->iov_base = (uint8_t *)iov->iov_base + count;
+    iov->iov_len -= count;
+  }
+  return iov;
+}
+
+static
+int _WBIOTransferv(int fd, struct iovec *iov, int iovcnt, size_t *bytesTransferred, bool isWrite) {
+  check(fd >= 0);
+  check(iovcnt >= 0);
+
+  int err = 0;
+  size_t done = 0;
+  /* skip leading empty buffers */
+  iov = _WBIOVectorAdvance(iov, &iovcnt, 0);
+  while (0 == err && iovcnt > 0) {
+    int count = MIN(iovcnt, IOV_MAX);
+    ssize_t bytesThisTime = isWrite ? writev(fd, iov, count) : readv(fd, iov, count);
+    if (bytesThisTime > 0) {
+      done += bytesThisTime;
+      iov = _WBIOVectorAdvance(iov, &iovcnt, (size_t)bytesThisTime);
+    } else if (0 == bytesThisTime) {
+      err = isWrite ? EIO : EOF;
+    } else if (errno != EINTR) {
+      err = errno;
+    }
+  }
+  if (bytesTransferred)
+    *bytesTransferred = done;
+  return err;
+}
+
+int WBIOReadv(int fd, struct iovec *iov, int iovcnt, size_t *bytesRead) {
+  return _WBIOTransferv(fd, iov, iovcnt, bytesRead, false);
+}
+
+int WBIOWritev(int fd, struct iovec *iov, int iovcnt, size_t *bytesWritten) {
+  return _WBIOTransferv(fd, iov, iovcnt, bytesWritten, true);
+}
+
+// MARK: Send File
+/* copy through user space */
+static
+int _WBIOSendFileCopy(int out, int fd, off_t offset, bool seekable, size_t length, size_t *done) {
+  int err = 0;
+  uint8_t buffer[64 * 1024];
+  while (0 == err && *done < length) {
+    size_t size = MIN(sizeof(buffer), length - *done);
+    ssize_t count = seekable ? pread(fd, buffer, size, offset + (off_t)*done) : read(fd, buffer, size);
+    if (count > 0) {
+      struct iovec iov = { buffer, (size_t)count };
+      size_t written = 0;
+      err = WBIOWritev(out, &iov, 1, &written);
+      *done += written;
+    } else if (0 == count) {
+      break; // end of file
+    } else if (errno != EINTR) {
+      err = errno;
+    }
+  }
+  return err;
+}
+
+int WBIOSendFile(int out, int fd, off_t offset, size_t length, size_t *bytesSent) {
+  size_t done = 0;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int err = errno;
+    if (bytesSent)
+      *bytesSent = 0;
+    return err;
+  }
+  bool regular = S_ISREG(st.st_mode);
+  if (0 == length)
+    length = !regular ? SIZE_MAX : (st.st_size > offset ? (size_t)(st.st_size - offset) : 0);
+
+  int err = 0;
+#if defined(__APPLE__)
+  /* sendfile() requires a regular file and a stream socket */
+  bool zeroCopy = regular;
+  while (zeroCopy && 0 == err && done < length) {
+    off_t count = (off_t)(length - done);
+    int result = sendfile(fd, out, offset + (off_t)done, &count, NULL, 0);
+    /* count is set even if the call is interrupted */
+    done += (size_t)count;
+    if (0 == result) {
+      if (0 == count)
+        break; // end of file
+    } else if (0 == done && (errno == ENOTSOCK || errno == EOPNOTSUPP || errno == ENOTSUP)) {
+      zeroCopy = false;
+    } else if (errno != EINTR) {
+      err = errno;
+    }
+  }
+#elif defined(__linux__)
+  /* splice() requires a pipe on one side, and pipes have no offset.
+   Other non-seekable sources (sockets, devices) are read from their current position, as in the copy fallback. */
+  bool zeroCopy = true, pipe = S_ISFIFO(st.st_mode);
+  while (zeroCopy && 0 == err && done < length) {
+    ssize_t count;
+    if (pipe) {
+      count = splice(fd, NULL, out, NULL, length - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+    } else {
+      off_t position = offset + (off_t)done;
+      count = sendfile(out, fd, regular ? &position : NULL, length - done);
+    }
+    if (count > 0) {
+      done += (size_t)count;
+    } else if (0 == count) {
+      break; // end of file
+    } else if (0 == done && (errno == EINVAL || errno == ENOSYS || errno == ESPIPE)) {
+      zeroCopy = false;
+    } else if (errno != EINTR) {
+      err = errno;
+    }
+  }
+#else
+  bool zeroCopy = false;
+#endif
+  if (!zeroCopy && 0 == err)
+    err = _WBIOSendFileCopy(out, fd, offset, regular, length, &done);
+
+  if (bytesSent)
+    *bytesSent = done;
+  return err;
+}
+
 // MARK: File Descriptor Passing
 typedef union {
   struct cmsghdr cmsghdr;
@@ -173,6 +316,126 @@ ssize_t WBIOReceiveFileDescriptor(int sockfd, int *fd) {
   return ret;
 }
 
+typedef union {
+  struct cmsghdr cmsghdr;
+  u_char msg_control[CMSG_SPACE(WB_IO_MAX_DESCRIPTORS * sizeof(int))];
+} cmsghdr_msg_control_batch_t;
+
+int WBIOSendFileDescriptors(int sockfd, const int *fds, size_t count, const void *data, size_t length) {
+  if (count > WB_IO_MAX_DESCRIPTORS)
+    return EINVAL;
+
+  struct iovec iovec[1];
+  if (length > 0) {
+    iovec[0].iov_base = (void *)data;
+    iovec[0].iov_len = length;
+  } else {
+    iovec[0].iov_base = (char *)"";
+    iovec[0].iov_len = 1;
+  }
+
+  cmsghdr_msg_control_batch_t control;
+  struct msghdr msg = { .msg_iov = iovec, .msg_iovlen = 1 };
+  if (count > 0) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.msg_control;
+    msg.msg_controllen = (socklen_t)CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr *cmsghdrp = CMSG_FIRSTHDR(&msg);
+    cmsghdrp->cmsg_len = (socklen_t)CMSG_LEN(count * sizeof(int));
+    cmsghdrp->cmsg_level = SOL_SOCKET;
+    cmsghdrp->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsghdrp), fds, count * sizeof(int));
+  }
+
+  ssize_t ret;
+  do {
+    ret = sendmsg(sockfd, &msg, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    spx_debug("sendmsg: %s", strerror(errno));
+    return errno;
+  }
+  /* the descriptors are sent with the first byte */
+  if ((size_t)ret < iovec[0].iov_len) {
+    size_t written = 0;
+    struct iovec remaining = { (uint8_t *)iovec[0].iov_base + ret, iovec[0].iov_len - (size_t)ret };
+    return WBIOWritev(sockfd, &remaining, 1, &written);
+  }
+  return 0;
+}
+
+int WBIOReceiveFileDescriptors(int sockfd, int *fds, size_t *count, void *data, size_t *length) {
+  u_char c;
+  size_t capacity = MIN(*count, (size_t)WB_IO_MAX_DESCRIPTORS);
+  struct iovec iovec[1];
+  if (data && length && *length > 0) {
+    iovec[0].iov_base = data;
+    iovec[0].iov_len = *length;
+  } else {
+    iovec[0].iov_base = &c;
+    iovec[0].iov_len = 1;
+  }
+
+  cmsghdr_msg_control_batch_t control;
+  struct msghdr msg = { .msg_iov = iovec, .msg_iovlen = 1 };
+  msg.msg_control = control.msg_control;
+  /* the system discards the descriptors that do not fit, and reports truncated control data */
+  msg.msg_controllen = (socklen_t)CMSG_SPACE(capacity * sizeof(int));
+
+  int flags = 0;
+#if defined(MSG_CMSG_CLOEXEC)
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+  ssize_t ret;
+  do {
+    ret = recvmsg(sockfd, &msg, flags);
+  } while (ret < 0 && errno == EINTR);
+
+  *count = 0;
+  if (length)
+    *length = 0;
+  if (ret <= 0) {
+    if (ret < 0)
+      spx_debug("recvmsg: %s", strerror(errno));
+    return ret < 0 ? errno : EOF;
+  }
+
+  int err = 0;
+  for (struct cmsghdr *cmsghdrp = CMSG_FIRSTHDR(&msg); cmsghdrp; cmsghdrp = CMSG_NXTHDR(&msg, cmsghdrp)) {
+    if (cmsghdrp->cmsg_level != SOL_SOCKET || cmsghdrp->cmsg_type != SCM_RIGHTS) {
+      err = EBADMSG;
+      continue;
+    }
+    size_t received = (cmsghdrp->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const u_char *cursor = CMSG_DATA(cmsghdrp);
+    for (size_t idx = 0; idx < received; idx++) {
+      int fd;
+      memcpy(&fd, cursor + idx * sizeof(int), sizeof(int));
+      if (*count < capacity) {
+        fds[(*count)++] = fd;
+#if !defined(MSG_CMSG_CLOEXEC)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+      } else {
+        close(fd);
+        err = EMSGSIZE;
+      }
+    }
+  }
+  if (msg.msg_flags & (MSG_CTRUNC | MSG_TRUNC))
+    err = EMSGSIZE;
+
+  if (err) {
+    spx_debug("invalid descriptors message: %s", strerror(err));
+    for (size_t idx = 0; idx < *count; idx++)
+      close(fds[idx]);
+    *count = 0;
+  } else if (length && iovec[0].iov_base == data) {
+    *length = (size_t)ret;
+  }
+  return err;
+}
+
 // MARK: Dump Descriptors
 
 // Gets either the socket name or the peer name from the socket
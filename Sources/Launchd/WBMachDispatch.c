@@ -9,11 +9,213 @@
 
 #include <WonderBox/WBMachDispatch.h>
 
-/* Copy from XNU sources */
-mach_msg_return_t
-WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *, void *ctxt),
-                    mach_msg_size_t max_size, mach_port_t rcv_name, mach_msg_options_t options, void *ctxt)
-{
+#include <errno.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <mach/mach_time.h>
+
+/* private message used to wake up the workers on stop ('wbst') */
+#define kWBMachMessageServerStopID 0x77627374
+#define kWBMachMessageServerStatsCount 128
+
+typedef struct {
+  mach_msg_header_t header;
+  uint32_t generation;
+} _WBMachServerStopMessage;
+
+typedef struct {
+  /* unsigned msgid + 1 (never 0, even for msgid -1), 0 for free slots */
+  _Atomic(int64_t) key;
+  _Atomic(uint64_t) count;
+  _Atomic(uint64_t) wait, maxWait;
+  _Atomic(uint64_t) handler, maxHandler;
+} _WBMachServerCounters;
+
+struct __WBMachMessageServer {
+  WBMachMessageDemux demux;
+  void *ctxt;
+  mach_port_t port;
+  mach_msg_size_t max_size;
+  mach_msg_options_t options;
+
+  /* run state */
+  _Atomic(bool) stopping;
+  _Atomic(uint32_t) generation;
+  _Atomic(size_t) running;
+  mach_port_t control; // stop messages destination
+  bool ownsControl;
+  pthread_mutex_t lock;
+  mach_msg_return_t error;
+
+  /* demux cap */
+  size_t maxDemux, demuxing;
+  pthread_cond_t slot;
+
+  mach_timebase_info_data_t timebase;
+  _WBMachServerCounters counters[kWBMachMessageServerStatsCount];
+  /* message IDs that do not fit in the table */
+  _WBMachServerCounters others;
+};
+
+// MARK: Statistics
+static inline
+uint64_t _WBMachServerNanoseconds(WBMachMessageServerRef server, uint64_t delta) {
+  return delta * server->timebase.numer / server->timebase.denom;
+}
+
+static inline
+void _WBMachServerAtomicMax(_Atomic(uint64_t) *value, uint64_t candidate) {
+  uint64_t current = atomic_load_explicit(value, memory_order_relaxed);
+  while (candidate > current &&
+         !atomic_compare_exchange_weak_explicit(value, &current, candidate, memory_order_relaxed, memory_order_relaxed))
+    continue;
+}
+
+static inline
+int64_t _WBMachServerCountersKey(mach_msg_id_t msgid) {
+  return (int64_t)(uint32_t)msgid + 1;
+}
+
+static
+_WBMachServerCounters *_WBMachServerGetCounters(WBMachMessageServerRef server, mach_msg_id_t msgid) {
+  int64_t key = _WBMachServerCountersKey(msgid);
+  size_t hash = ((uint32_t)msgid * 2654435761u) % kWBMachMessageServerStatsCount;
+  for (size_t idx = 0; idx < kWBMachMessageServerStatsCount; idx++) {
+    _WBMachServerCounters *counters = &server->counters[(hash + idx) % kWBMachMessageServerStatsCount];
+    int64_t current = atomic_load_explicit(&counters->key, memory_order_acquire);
+    if (current == key)
+      return counters;
+    if (0 == current) {
+      if (atomic_compare_exchange_strong(&counters->key, &current, key) || current == key)
+        return counters;
+    }
+  }
+  return &server->others;
+}
+
+static
+void _WBMachServerRecord(WBMachMessageServerRef server, mach_msg_id_t msgid, uint64_t received, uint64_t started, uint64_t done) {
+  _WBMachServerCounters *counters = _WBMachServerGetCounters(server, msgid);
+  uint64_t wait = _WBMachServerNanoseconds(server, started - received);
+  uint64_t handler = _WBMachServerNanoseconds(server, done - started);
+  atomic_fetch_add_explicit(&counters->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&counters->wait, wait, memory_order_relaxed);
+  atomic_fetch_add_explicit(&counters->handler, handler, memory_order_relaxed);
+  _WBMachServerAtomicMax(&counters->maxWait, wait);
+  _WBMachServerAtomicMax(&counters->maxHandler, handler);
+}
+
+static
+void _WBMachServerGetCountersStatistics(_WBMachServerCounters *counters, mach_msg_id_t msgid, WBMachMessageServerStatistics *stats) {
+  stats->msgid = msgid;
+  stats->count = atomic_load_explicit(&counters->count, memory_order_relaxed);
+  stats->waitTime = atomic_load_explicit(&counters->wait, memory_order_relaxed);
+  stats->maxWaitTime = atomic_load_explicit(&counters->maxWait, memory_order_relaxed);
+  stats->handlerTime = atomic_load_explicit(&counters->handler, memory_order_relaxed);
+  stats->maxHandlerTime = atomic_load_explicit(&counters->maxHandler, memory_order_relaxed);
+}
+
+size_t WBMachMessageServerGetStatistics(WBMachMessageServerRef server, WBMachMessageServerStatistics *stats, size_t count) {
+  size_t total = 0;
+  for (size_t idx = 0; idx < kWBMachMessageServerStatsCount; idx++) {
+    int64_t key = atomic_load_explicit(&server->counters[idx].key, memory_order_acquire);
+    if (key) {
+      if (total < count)
+        _WBMachServerGetCountersStatistics(&server->counters[idx], (mach_msg_id_t)(uint32_t)(key - 1), &stats[total]);
+      total++;
+    }
+  }
+  /* overflow entry uses msgid 0 */
+  if (atomic_load_explicit(&server->others.count, memory_order_relaxed) > 0) {
+    if (total < count)
+      _WBMachServerGetCountersStatistics(&server->others, 0, &stats[total]);
+    total++;
+  }
+  return total;
+}
+
+// MARK: Stop
+static
+void _WBMachServerSendStop(WBMachMessageServerRef server) {
+  _WBMachServerStopMessage msg = {};
+  msg.header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_MAKE_SEND, 0);
+  msg.header.msgh_size = (mach_msg_size_t)sizeof(msg);
+  msg.header.msgh_remote_port = server->control;
+  msg.header.msgh_id = kWBMachMessageServerStopID;
+  msg.generation = atomic_load(&server->generation);
+  /* if the queue is full, the workers are awake and will drain it anyway */
+  mach_msg_return_t mr = mach_msg(&msg.header, MACH_SEND_MSG | MACH_SEND_TIMEOUT, msg.header.msgh_size, 0,
+                                  MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+  if (MACH_MSG_SUCCESS != mr && MACH_SEND_TIMED_OUT != mr)
+    spx_log_warning("mach_msg(stop): %s", mach_error_string(mr));
+}
+
+/* returns true if the message is a stop message (stale stop messages included) */
+static
+bool _WBMachServerIsStopMessage(WBMachMessageServerRef server, mach_msg_header_t *msg) {
+  if (msg->msgh_id != kWBMachMessageServerStopID || msg->msgh_local_port != server->control ||
+      msg->msgh_size < sizeof(_WBMachServerStopMessage))
+    return false;
+  return true;
+}
+
+void WBMachMessageServerStop(WBMachMessageServerRef server) {
+  pthread_mutex_lock(&server->lock);
+  if (atomic_load(&server->running) > 0 && !atomic_exchange(&server->stopping, true)) {
+    if (!server->control) {
+      mach_port_type_t type = 0;
+      if (KERN_SUCCESS == mach_port_type(mach_task_self(), server->port, &type) && (type & MACH_PORT_TYPE_PORT_SET)) {
+        /* cannot send to a port set: add a private port to the set */
+        mach_port_t port = MACH_PORT_NULL;
+        if (KERN_SUCCESS == mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port)) {
+          if (KERN_SUCCESS == mach_port_move_member(mach_task_self(), port, server->port)) {
+            server->control = port;
+            server->ownsControl = true;
+          } else {
+            mach_port_mod_refs(mach_task_self(), port, MACH_PORT_RIGHT_RECEIVE, -1);
+          }
+        }
+      } else {
+        server->control = server->port;
+      }
+    }
+    if (server->control)
+      _WBMachServerSendStop(server);
+  }
+  pthread_mutex_unlock(&server->lock);
+}
+
+// MARK: Worker
+static
+void _WBMachServerDemux(WBMachMessageServerRef server, mig_reply_error_t *bufRequest, mig_reply_error_t *bufReply) {
+  uint64_t received = mach_absolute_time();
+  bool capped = server->maxDemux > 0;
+  if (capped) {
+    pthread_mutex_lock(&server->lock);
+    while (server->demuxing >= server->maxDemux)
+      pthread_cond_wait(&server->slot, &server->lock);
+    server->demuxing++;
+    pthread_mutex_unlock(&server->lock);
+  }
+  uint64_t started = mach_absolute_time();
+  (void) (*server->demux)(&bufRequest->Head, &bufReply->Head, server->ctxt);
+  uint64_t done = mach_absolute_time();
+  if (capped) {
+    pthread_mutex_lock(&server->lock);
+    server->demuxing--;
+    pthread_cond_signal(&server->slot);
+    pthread_mutex_unlock(&server->lock);
+  }
+  _WBMachServerRecord(server, bufRequest->Head.msgh_id, received, started, done);
+}
+
+/* Receive loop. Copy from XNU sources (mach_msg_server) */
+static
+mach_msg_return_t _WBMachServerWorker(WBMachMessageServerRef server) {
   mig_reply_error_t *bufRequest, *bufReply;
   mach_msg_size_t request_size;
   mach_msg_size_t new_request_alloc;
@@ -23,8 +225,11 @@ WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *,
   mach_msg_return_t mr;
   kern_return_t kr;
   mach_port_t self = mach_task_self();
-
-  options &= ~(MACH_SEND_MSG|MACH_RCV_MSG|MACH_RCV_OVERWRITE);
+  mach_port_t rcv_name = server->port;
+  mach_msg_size_t max_size = server->max_size;
+  mach_msg_options_t options = server->options;
+  /* once stopping, the queue is drained without blocking */
+#define RCV_OPTIONS() (atomic_load_explicit(&server->stopping, memory_order_relaxed) ? options | MACH_RCV_TIMEOUT : options)
 
   reply_alloc = round_page((options & MACH_SEND_TRAILER) ?
                            (max_size + MAX_TRAILER_SIZE) : max_size);
@@ -58,14 +263,32 @@ WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *,
       }
     }
 
-    mr = mach_msg(&bufRequest->Head, MACH_RCV_MSG|options,
+    mr = mach_msg(&bufRequest->Head, MACH_RCV_MSG|RCV_OPTIONS(),
                   0, request_size, rcv_name,
                   MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
 
     while (mr == MACH_MSG_SUCCESS) {
+      if (_WBMachServerIsStopMessage(server, &bufRequest->Head)) {
+        _WBMachServerStopMessage *stop = (_WBMachServerStopMessage *)&bufRequest->Head;
+        bool current = stop->generation == atomic_load(&server->generation) && atomic_load(&server->stopping);
+        /* a forged message can carry a reply right and descriptors */
+        mach_msg_destroy(&bufRequest->Head);
+        if (current) {
+          /* pass the stop message to the next worker */
+          if (atomic_load(&server->running) > 1)
+            _WBMachServerSendStop(server);
+          mr = MACH_RCV_TIMED_OUT;
+          break;
+        }
+        /* stale stop message */
+        mr = mach_msg(&bufRequest->Head, MACH_RCV_MSG|RCV_OPTIONS(),
+                      0, request_size, rcv_name,
+                      MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+        continue;
+      }
       /* we have another request message */
 
-      (void) (*demux)(&bufRequest->Head, &bufReply->Head, ctxt);
+      _WBMachServerDemux(server, bufRequest, bufReply);
 
       if (!(bufReply->Head.msgh_bits & MACH_MSGH_BITS_COMPLEX)) {
         if (bufReply->RetCode == MIG_NO_REPLY)
@@ -95,8 +318,8 @@ WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *,
                         &bufReply->Head,
                         (MACH_MSGH_BITS_REMOTE(bufReply->Head.msgh_bits) ==
                          MACH_MSG_TYPE_MOVE_SEND_ONCE) ?
-                        MACH_SEND_MSG|MACH_RCV_MSG|options :
-                        MACH_SEND_MSG|MACH_RCV_MSG|MACH_SEND_TIMEOUT|options,
+                        MACH_SEND_MSG|MACH_RCV_MSG|RCV_OPTIONS() :
+                        MACH_SEND_MSG|MACH_RCV_MSG|MACH_SEND_TIMEOUT|RCV_OPTIONS(),
                         bufReply->Head.msgh_size, request_size, rcv_name,
                         MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
 
@@ -110,8 +333,8 @@ WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *,
                                   &bufReply->Head,
                                   (MACH_MSGH_BITS_REMOTE(bufReply->Head.msgh_bits) ==
                                    MACH_MSG_TYPE_MOVE_SEND_ONCE) ?
-                                  MACH_SEND_MSG|MACH_RCV_MSG|options :
-                                  MACH_SEND_MSG|MACH_RCV_MSG|MACH_SEND_TIMEOUT|options,
+                                  MACH_SEND_MSG|MACH_RCV_MSG|RCV_OPTIONS() :
+                                  MACH_SEND_MSG|MACH_RCV_MSG|MACH_SEND_TIMEOUT|RCV_OPTIONS(),
                                   bufReply->Head.msgh_size, request_size, rcv_name,
                                   MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL,
                                   &bufRequest->Head, 0);
@@ -124,7 +347,7 @@ WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *,
       if (bufReply->Head.msgh_bits & MACH_MSGH_BITS_COMPLEX)
         mach_msg_destroy(&bufReply->Head);
 
-      mr = mach_msg(&bufRequest->Head, MACH_RCV_MSG|options,
+      mr = mach_msg(&bufRequest->Head, MACH_RCV_MSG|RCV_OPTIONS(),
                     0, request_size, rcv_name,
                     MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
 
@@ -143,6 +366,7 @@ WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *,
     break;
 
   } /* for(;;) */
+#undef RCV_OPTIONS
 
   (void)vm_deallocate(self,
                       (vm_address_t) bufRequest,
@@ -150,6 +374,158 @@ WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *,
   (void)vm_deallocate(self,
                       (vm_address_t) bufReply,
                       reply_alloc);
+
+  /* the queue is drained */
+  if (mr == MACH_RCV_TIMED_OUT && atomic_load(&server->stopping))
+    mr = MACH_MSG_SUCCESS;
   return mr;
 }
 
+static
+void *_WBMachServerWorkerMain(void *arg) {
+  WBMachMessageServerRef server = (WBMachMessageServerRef)arg;
+  mach_msg_return_t mr = _WBMachServerWorker(server);
+  pthread_mutex_lock(&server->lock);
+  if (MACH_MSG_SUCCESS != mr && MACH_MSG_SUCCESS == server->error)
+    server->error = mr;
+  pthread_mutex_unlock(&server->lock);
+  /* a worker failed: stop the others */
+  if (MACH_MSG_SUCCESS != mr)
+    WBMachMessageServerStop(server);
+  atomic_fetch_sub(&server->running, 1);
+  return NULL;
+}
+
+// MARK: Server
+WBMachMessageServerRef WBMachMessageServerCreate(WBMachMessageDemux demux, mach_msg_size_t max_size,
+                                                 mach_port_t rcv_name, mach_msg_options_t options, void *ctxt) {
+  if (!demux || !MACH_PORT_VALID(rcv_name))
+    return NULL;
+
+  WBMachMessageServerRef server = calloc(1, sizeof(*server));
+  if (!server)
+    return NULL;
+
+  server->demux = demux;
+  server->ctxt = ctxt;
+  server->port = rcv_name;
+  server->max_size = max_size;
+  server->options = options & ~(MACH_SEND_MSG|MACH_RCV_MSG|MACH_RCV_OVERWRITE);
+  mach_timebase_info(&server->timebase);
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->slot, NULL);
+  return server;
+}
+
+void WBMachMessageServerFree(WBMachMessageServerRef server) {
+  if (!server)
+    return;
+  assert(0 == atomic_load(&server->running) && "server is running");
+  pthread_cond_destroy(&server->slot);
+  pthread_mutex_destroy(&server->lock);
+  free(server);
+}
+
+void WBMachMessageServerSetMaxConcurrentDemux(WBMachMessageServerRef server, size_t count) {
+  pthread_mutex_lock(&server->lock);
+  server->maxDemux = count;
+  pthread_cond_broadcast(&server->slot);
+  pthread_mutex_unlock(&server->lock);
+}
+
+mach_msg_return_t WBMachMessageServerRun(WBMachMessageServerRef server, size_t workers) {
+  if (0 == workers) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = ncpu > 0 ? (size_t)ncpu : 1;
+  }
+
+  pthread_mutex_lock(&server->lock);
+  if (atomic_load(&server->running) > 0) {
+    pthread_mutex_unlock(&server->lock);
+    return KERN_FAILURE;
+  }
+  server->error = MACH_MSG_SUCCESS;
+  atomic_store(&server->stopping, false);
+  /* invalidate stop messages of the previous run */
+  atomic_fetch_add(&server->generation, 1);
+  atomic_store(&server->running, workers);
+  pthread_mutex_unlock(&server->lock);
+
+  pthread_t *threads = workers > 1 ? calloc(workers - 1, sizeof(*threads)) : NULL;
+  size_t started = 0;
+  if (threads) {
+    for (; started < workers - 1; started++) {
+      /* pthread_create() returns the error, and does not set errno */
+      int err = pthread_create(&threads[started], NULL, _WBMachServerWorkerMain, server);
+      if (0 != err) {
+        spx_log_warning("pthread_create: %s", strerror(err));
+        break;
+      }
+    }
+  }
+  /* workers that could not be started */
+  atomic_fetch_sub(&server->running, workers - 1 - started);
+
+  _WBMachServerWorkerMain(server);
+  for (size_t idx = 0; idx < started; idx++)
+    pthread_join(threads[idx], NULL);
+  free(threads);
+
+  pthread_mutex_lock(&server->lock);
+  if (server->ownsControl) {
+    mach_port_mod_refs(mach_task_self(), server->control, MACH_PORT_RIGHT_RECEIVE, -1);
+    server->ownsControl = false;
+  }
+  server->control = MACH_PORT_NULL;
+  mach_msg_return_t mr = server->error;
+  pthread_mutex_unlock(&server->lock);
+  return mr;
+}
+
+mach_msg_return_t
+WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *, void *ctxt),
+                    mach_msg_size_t max_size, mach_port_t rcv_name, mach_msg_options_t options, void *ctxt)
+{
+  WBMachMessageServerRef server = WBMachMessageServerCreate(demux, max_size, rcv_name, options, ctxt);
+  if (!server)
+    return KERN_INVALID_ARGUMENT;
+  mach_msg_return_t mr = WBMachMessageServerRun(server, 1);
+  WBMachMessageServerFree(server);
+  return mr;
+}
+
+// MARK: Out-of-line Payloads
+void WBMachMessageInitOOL(mach_msg_header_t *header, mach_msg_id_t msgid,
+                          const void *address, mach_msg_size_t size, boolean_t deallocate) {
+  WBMachOOLMessage *msg = (WBMachOOLMessage *)header;
+  msg->header.msgh_bits |= MACH_MSGH_BITS_COMPLEX;
+  msg->header.msgh_size = (mach_msg_size_t)sizeof(*msg);
+  msg->header.msgh_id = msgid;
+  msg->body.msgh_descriptor_count = 1;
+  msg->data.address = (void *)address;
+  msg->data.size = size;
+  msg->data.deallocate = deallocate;
+  /* pages are remapped, not copied */
+  msg->data.copy = MACH_MSG_VIRTUAL_COPY;
+  msg->data.type = MACH_MSG_OOL_DESCRIPTOR;
+}
+
+void WBMachMessageInitOOLReply(const mach_msg_header_t *request, mach_msg_header_t *reply,
+                               const void *address, mach_msg_size_t size, boolean_t deallocate) {
+  reply->msgh_bits = MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(request->msgh_bits), 0);
+  reply->msgh_remote_port = request->msgh_remote_port;
+  reply->msgh_local_port = MACH_PORT_NULL;
+  reply->msgh_reserved = 0;
+  WBMachMessageInitOOL(reply, request->msgh_id + 100, address, size, deallocate);
+}
+
+bool WBMachMessageGetOOLBuffer(const mach_msg_header_t *msg, void **address, mach_msg_size_t *size) {
+  if (!(msg->msgh_bits & MACH_MSGH_BITS_COMPLEX) || msg->msgh_size < sizeof(WBMachOOLMessage))
+    return false;
+  const WBMachOOLMessage *ool = (const WBMachOOLMessage *)msg;
+  if (ool->body.msgh_descriptor_count != 1 || ool->data.type != MACH_MSG_OOL_DESCRIPTOR)
+    return false;
+  if (address) *address = ool->data.address;
+  if (size) *size = ool->data.size;
+  return true;
+}
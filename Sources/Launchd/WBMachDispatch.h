@@ -14,9 +14,81 @@
 
 #include <mach/mach.h>
 
+typedef boolean_t (*WBMachMessageDemux)(mach_msg_header_t *request, mach_msg_header_t *reply, void *ctxt);
+
 WB_EXPORT
 mach_msg_return_t WBMachMessageServer(boolean_t (*demux)(mach_msg_header_t *, mach_msg_header_t *, void *ctxt),
                                       mach_msg_size_t max_size, mach_port_t rcv_name, mach_msg_options_t options, void *ctxt);
 
+/*!
+ @abstract Multi-threaded message server.
+ @discussion All workers receive on the same port (or port set). Each worker has its own request and
+ reply buffers. The demux function must be thread safe when more than one worker is used.
+ */
+typedef struct __WBMachMessageServer *WBMachMessageServerRef;
+
+WB_EXPORT
+WBMachMessageServerRef WBMachMessageServerCreate(WBMachMessageDemux demux, mach_msg_size_t max_size,
+                                                 mach_port_t rcv_name, mach_msg_options_t options, void *ctxt);
+/* the server must not be running */
+WB_EXPORT
+void WBMachMessageServerFree(WBMachMessageServerRef server);
+
+/* Maximum number of concurrent demux calls. 0 (default) means one per worker. */
+WB_EXPORT
+void WBMachMessageServerSetMaxConcurrentDemux(WBMachMessageServerRef server, size_t count);
+
+/* Run 'workers' receive loops (0 to use the number of active CPUs). The calling thread is one of them.
+ Returns when the server is stopped (KERN_SUCCESS), or on receive error. */
+WB_EXPORT
+mach_msg_return_t WBMachMessageServerRun(WBMachMessageServerRef server, size_t workers);
+
+/* Graceful stop: can be called from any thread, including from the demux function.
+ Requests already queued are handled, then the workers exit. */
+WB_EXPORT
+void WBMachMessageServerStop(WBMachMessageServerRef server);
+
+/* Per message ID counters. Times are in nanoseconds.
+ wait: time between the reception and the demux call (includes the wait for a demux slot). */
+typedef struct {
+  mach_msg_id_t msgid;
+  uint64_t count;
+  uint64_t waitTime;
+  uint64_t maxWaitTime;
+  uint64_t handlerTime;
+  uint64_t maxHandlerTime;
+} WBMachMessageServerStatistics;
+
+/* Fill at most count entries, and returns the number of message IDs */
+WB_EXPORT
+size_t WBMachMessageServerGetStatistics(WBMachMessageServerRef server, WBMachMessageServerStatistics *stats, size_t count);
+
+// MARK: Out-of-line Payloads
+/* Message with a single out-of-line memory region */
+typedef struct {
+  mach_msg_header_t header;
+  mach_msg_body_t body;
+  mach_msg_ool_descriptor_t data;
+} WBMachOOLMessage;
+
+/* Set the id, size and body of msg. The caller sets the ports and their dispositions in the header. */
+WB_EXPORT
+void WBMachMessageInitOOL(mach_msg_header_t *msg, mach_msg_id_t msgid,
+                          const void *address, mach_msg_size_t size, boolean_t deallocate);
+
+/*!
+ @abstract Build a reply carrying size bytes at address out-of-line (reply id is request id + 100).
+ @param reply must be at least sizeof(WBMachOOLMessage) bytes.
+ @param deallocate if true, the pages are moved to the client without copy and removed from the task
+ (address must be page aligned, as returned by vm_allocate). Else they are copied on write.
+ */
+WB_EXPORT
+void WBMachMessageInitOOLReply(const mach_msg_header_t *request, mach_msg_header_t *reply,
+                               const void *address, mach_msg_size_t size, boolean_t deallocate);
+
+/* Returns the out-of-line region of a message built with WBMachMessageInitOOL(), or false if the message
+ has not this layout. The receiver owns the region, and must vm_deallocate() it. */
+WB_EXPORT
+bool WBMachMessageGetOOLBuffer(const mach_msg_header_t *msg, void **address, mach_msg_size_t *size);
 
 #endif /* __WB_MACH_MESSAGE_SERVER_H */
@@ -0,0 +1,224 @@
+/*
+ *  WBMessageServer.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include "WBMessageServerInternal.h"
+
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#if !defined(__MACH__)
+  #include <sys/mman.h>
+#endif
+
+struct __WBMessageServer {
+  const WBMessageServerTransport *transport;
+  void *info;
+
+  WBMessageServerHandler handler;
+  void *ctxt;
+  size_t maxSize;
+
+  /* idle timeout (ns) */
+  uint64_t idle;
+  uint64_t deadline;
+  void *timeout_ctxt;
+  void (*timeout)(void *ctxt);
+
+  /* backpressure */
+  size_t highWater, lowWater;
+  uint32_t requests;
+  _Atomic(bool) overloaded;
+  void *overload_ctxt;
+  void (*overload)(bool overloaded, size_t depth, void *ctxt);
+
+  _Atomic(bool) running;
+  _Atomic(bool) stopping;
+};
+
+static inline
+uint64_t _WBMessageServerNow(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+WBMessageServerRef _WBMessageServerCreate(const WBMessageServerTransport *transport, void *info,
+                                          size_t maxSize, WBMessageServerHandler handler, void *ctxt) {
+  WBMessageServerRef server = calloc(1, sizeof(*server));
+  if (!server)
+    return NULL;
+
+  server->transport = transport;
+  server->info = info;
+  server->handler = handler;
+  server->ctxt = ctxt;
+  server->maxSize = maxSize;
+  return server;
+}
+
+void WBMessageServerFree(WBMessageServerRef server) {
+  if (!server)
+    return;
+  assert(!atomic_load(&server->running) && "server is running");
+  if (server->transport->free)
+    server->transport->free(server->info);
+  free(server);
+}
+
+const char *WBMessageServerGetTransportName(WBMessageServerRef server) {
+  return server->transport->name;
+}
+
+size_t WBMessageServerGetMaxMessageSize(WBMessageServerRef server) {
+  return server->maxSize;
+}
+
+void WBMessageServerSetIdleTimeout(WBMessageServerRef server, double idle) {
+  server->idle = idle > 0 ? (uint64_t)(idle * 1e9) : 0;
+  server->deadline = _WBMessageServerNow() + server->idle;
+}
+
+void WBMessageServerSetTimeoutCallBack(WBMessageServerRef server, void (*callback)(void *ctxt), void *ctxt) {
+  server->timeout = callback;
+  server->timeout_ctxt = ctxt;
+}
+
+void WBMessageServerSetBackpressure(WBMessageServerRef server, size_t highWater, size_t lowWater,
+                                    void (*callback)(bool overloaded, size_t depth, void *ctxt), void *ctxt) {
+  assert(!atomic_load(&server->running) && "server is running");
+  server->highWater = highWater;
+  server->lowWater = lowWater < highWater ? lowWater : (highWater > 0 ? highWater - 1 : 0);
+  server->overload = callback;
+  server->overload_ctxt = ctxt;
+}
+
+bool WBMessageServerIsOverloaded(WBMessageServerRef server) {
+  return atomic_load_explicit(&server->overloaded, memory_order_relaxed);
+}
+
+int WBMessageServerRun(WBMessageServerRef server) {
+  if (atomic_exchange(&server->running, true))
+    return EBUSY;
+
+  atomic_store(&server->stopping, false);
+  server->deadline = _WBMessageServerNow() + server->idle;
+  int err = server->transport->run(server, server->info);
+  atomic_store(&server->running, false);
+  return err;
+}
+
+void WBMessageServerStop(WBMessageServerRef server) {
+  if (!atomic_exchange(&server->stopping, true))
+    server->transport->wakeup(server->info);
+}
+
+// MARK: Buffers
+void *WBMessageAllocateBuffer(size_t length) {
+#if defined(__MACH__)
+  vm_address_t address = 0;
+  if (KERN_SUCCESS != vm_allocate(mach_task_self(), &address, length ? length : 1, VM_FLAGS_ANYWHERE))
+    return NULL;
+  return (void *)address;
+#else
+  void *buffer = mmap(NULL, length ? length : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return buffer != MAP_FAILED ? buffer : NULL;
+#endif
+}
+
+void WBMessageFreeBuffer(void *buffer, size_t length) {
+  if (!buffer)
+    return;
+#if defined(__MACH__)
+  vm_deallocate(mach_task_self(), (vm_address_t)buffer, length ? length : 1);
+#else
+  munmap(buffer, length ? length : 1);
+#endif
+}
+
+void WBMessageSetBuffer(WBMessage *message, void *buffer, size_t length) {
+  if (message->flags & kWBMessageOwnsBuffer)
+    WBMessageFreeBuffer(message->data, message->length);
+  message->data = buffer;
+  message->length = length;
+  message->flags |= kWBMessageOwnsBuffer;
+}
+
+// MARK: Transport Support
+bool _WBMessageServerIsStopping(WBMessageServerRef server) {
+  return atomic_load_explicit(&server->stopping, memory_order_relaxed);
+}
+
+int _WBMessageServerGetWaitTimeout(WBMessageServerRef server) {
+  if (!server->idle)
+    return -1;
+  uint64_t now = _WBMessageServerNow();
+  if (now >= server->deadline)
+    return 0;
+  /* round up to avoid waking up before the deadline */
+  uint64_t ms = (server->deadline - now + 999999) / 1000000;
+  return ms > INT32_MAX ? INT32_MAX : (int)ms;
+}
+
+void _WBMessageServerCheckIdle(WBMessageServerRef server) {
+  if (!server->idle || _WBMessageServerNow() < server->deadline)
+    return;
+
+  server->deadline = _WBMessageServerNow() + server->idle;
+  if (server->timeout)
+    server->timeout(server->timeout_ctxt);
+  else
+    WBMessageServerStop(server);
+}
+
+/* queue depth is sampled once every 16 requests */
+#define kWBMessageServerLoadSampleInterval 16
+
+static
+void _WBMessageServerCheckLoad(WBMessageServerRef server, size_t inflight) {
+  size_t depth = inflight + (server->transport->depth ? server->transport->depth(server->info) : 0);
+  if (depth >= server->highWater) {
+    if (!atomic_exchange(&server->overloaded, true))
+      server->overload(true, depth, server->overload_ctxt);
+  } else if (depth <= server->lowWater && atomic_exchange(&server->overloaded, false)) {
+    server->overload(false, depth, server->overload_ctxt);
+  }
+}
+
+bool _WBMessageServerHandle(WBMessageServerRef server, const WBMessage *request, WBMessage *reply) {
+  bool backpressure = server->overload && server->highWater;
+  if (backpressure && 0 == server->requests++ % kWBMessageServerLoadSampleInterval)
+    _WBMessageServerCheckLoad(server, 1);
+
+  size_t capacity = reply->length;
+  reply->fd = -1;
+  reply->flags = 0;
+  bool send = server->handler(request, reply, server->ctxt);
+  /* the server is not idle while handling a request */
+  if (server->idle)
+    server->deadline = _WBMessageServerNow() + server->idle;
+  /* while overloaded, check the queue after each request */
+  if (backpressure && atomic_load_explicit(&server->overloaded, memory_order_relaxed))
+    _WBMessageServerCheckLoad(server, 0);
+
+  if (!send) {
+    if (reply->flags & kWBMessageOwnsBuffer)
+      WBMessageFreeBuffer(reply->data, reply->length);
+    return false;
+  }
+
+  if (!(reply->flags & kWBMessageOwnsBuffer) && reply->length > capacity) {
+    spx_log_warning("reply too large (%zu bytes)", reply->length);
+    return false;
+  }
+  return true;
+}
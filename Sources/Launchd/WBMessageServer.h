@@ -0,0 +1,153 @@
+/*
+ *  WBMessageServer.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#if !defined(__WB_MESSAGE_SERVER_H)
+#define __WB_MESSAGE_SERVER_H 1
+
+#include <WonderBox/WBBase.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__MACH__)
+  #include <mach/mach.h>
+#endif
+
+/*!
+ @header WBMessageServer
+ @abstract Request/reply server independent of the transport.
+ @discussion A server receives requests, calls the handler, and sends the reply to the client.
+ It runs on the calling thread of WBMessageServerRun(), and supports the same idle timeout, timeout callback
+ and backpressure watermarks than WBService. WBService keeps the MIG message format and its worker threads,
+ as the Mach transport only accepts messages sent with WBMessageClientSendMachRequest().
+ Available transports:
+ - Mach: messages received on a Mach port. Descriptors are not passed.
+ - Unix: SOCK_SEQPACKET Unix domain socket. Messages are received and sent by batch, and a descriptor
+ can be passed with each request and reply (Linux only). Empty messages without descriptor are reserved
+ for the end of stream.
+ Large payloads can be sent without copy using WBMessageSetBuffer(). The Mach transport sends them
+ out-of-line (pages are remapped in the receiver). The Unix transport sends them from the buffer, and
+ their size is limited by the socket buffer size.
+ */
+
+__BEGIN_DECLS
+
+typedef struct __WBMessageServer *WBMessageServerRef;
+
+enum {
+  /* data was allocated with WBMessageAllocateBuffer() and belongs to the message */
+  kWBMessageOwnsBuffer = 1 << 0,
+};
+
+typedef struct {
+  void *data;
+  size_t length;
+  /* descriptor passed with the message, -1 if none */
+  int fd;
+  uint32_t flags;
+} WBMessage;
+
+/*!
+ @abstract Request handler.
+ @param request the handler owns request->fd.
+ @param reply reply->data is a buffer of reply->length bytes (the server maximum message size).
+ The handler sets reply->length to the reply size, and can set reply->fd (closed by the server once sent).
+ It can also use WBMessageSetBuffer() to reply with its own buffer (released by the server once sent).
+ @result true to send the reply.
+ */
+typedef bool (*WBMessageServerHandler)(const WBMessage *request, WBMessage *reply, void *ctxt);
+
+// MARK: Buffers
+/* Page aligned buffer. NULL on failure. */
+WB_EXPORT
+void *WBMessageAllocateBuffer(size_t length);
+WB_EXPORT
+void WBMessageFreeBuffer(void *buffer, size_t length);
+
+/* Attach a buffer allocated with WBMessageAllocateBuffer() to the message, which takes ownership.
+ A reply buffer can exceed the server maximum message size. */
+WB_EXPORT
+void WBMessageSetBuffer(WBMessage *message, void *buffer, size_t length);
+
+// MARK: Server
+/* Create a listening socket at path (an existing file is replaced). NULL on error (errno is set). */
+WB_EXPORT
+WBMessageServerRef WBMessageServerCreateUnix(const char *path, size_t maxSize, WBMessageServerHandler handler, void *ctxt);
+/* Use a listening SOCK_SEQPACKET socket (socket activation). The server owns the socket. */
+WB_EXPORT
+WBMessageServerRef WBMessageServerCreateUnixWithSocket(int sockfd, size_t maxSize, WBMessageServerHandler handler, void *ctxt);
+
+#if defined(__MACH__)
+/* The caller keeps the receive right of port, and must not free it before the server. */
+WB_EXPORT
+WBMessageServerRef WBMessageServerCreateMach(mach_port_t port, size_t maxSize, WBMessageServerHandler handler, void *ctxt);
+#endif
+
+/* the server must not be running */
+WB_EXPORT
+void WBMessageServerFree(WBMessageServerRef server);
+
+/* "mach" or "unix" */
+WB_EXPORT
+const char *WBMessageServerGetTransportName(WBMessageServerRef server);
+
+WB_EXPORT
+size_t WBMessageServerGetMaxMessageSize(WBMessageServerRef server);
+
+/* Called when no request is received during 'idle' seconds. 0 disables the timeout.
+ Must be called before running the server, or from the handler. */
+WB_EXPORT
+void WBMessageServerSetIdleTimeout(WBMessageServerRef server, double idle);
+/* Default callback stops the server */
+WB_EXPORT
+void WBMessageServerSetTimeoutCallBack(WBMessageServerRef server, void (*callback)(void *ctxt), void *ctxt);
+
+/* Must be called before running the server. The load (queued requests, plus the request being handled) is
+ sampled every 16 requests, and after each request while overloaded. callback is called with overloaded = true
+ when the load reaches highWater, and with false when it goes back to lowWater.
+ Only the Mach transport knows its queue depth. */
+WB_EXPORT
+void WBMessageServerSetBackpressure(WBMessageServerRef server, size_t highWater, size_t lowWater,
+                                    void (*callback)(bool overloaded, size_t depth, void *ctxt), void *ctxt);
+/* Can be used by the handler to reject requests while overloaded */
+WB_EXPORT
+bool WBMessageServerIsOverloaded(WBMessageServerRef server);
+
+/* Returns 0 when the server is stopped, or the transport error
+ (an errno value for Unix sockets, a mach_msg_return_t for Mach). */
+WB_EXPORT
+int WBMessageServerRun(WBMessageServerRef server);
+
+/* Can be called from any thread, including from the handler */
+WB_EXPORT
+void WBMessageServerStop(WBMessageServerRef server);
+
+// MARK: Client
+/* Returns the connected socket, or -1 (errno is set) */
+WB_EXPORT
+int WBMessageClientConnect(const char *path);
+
+/* Send the request and wait the reply. reply->length is the reply buffer size on input.
+ An owned request buffer is released.
+ Returns 0 or an errno value (EMSGSIZE if the reply does not fit in the buffer). */
+WB_EXPORT
+int WBMessageClientSendRequest(int sockfd, const WBMessage *request, WBMessage *reply);
+
+#if defined(__MACH__)
+/* Mach transport client. request->fd must be -1. Owned and large requests are sent out-of-line.
+ An out-of-line reply is returned in a new buffer (kWBMessageOwnsBuffer is set), whatever its size. */
+WB_EXPORT
+kern_return_t WBMessageClientSendMachRequest(mach_port_t port, const WBMessage *request, WBMessage *reply);
+#endif
+
+__END_DECLS
+
+#endif /* __WB_MESSAGE_SERVER_H */
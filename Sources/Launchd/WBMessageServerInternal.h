@@ -0,0 +1,50 @@
+/*
+ *  WBMessageServerInternal.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include <WonderBox/WBMessageServer.h>
+
+#include <stdint.h>
+
+__BEGIN_DECLS
+
+/* Transport callbacks. 'info' is the value passed to _WBMessageServerCreate(). */
+typedef struct {
+  const char *name;
+  /* receive loop: must return when _WBMessageServerIsStopping() becomes true */
+  int (*run)(WBMessageServerRef server, void *info);
+  /* interrupt the receive loop (called from any thread) */
+  void (*wakeup)(void *info);
+  void (*free)(void *info);
+  /* (optional) number of requests waiting to be received */
+  size_t (*depth)(void *info);
+} WBMessageServerTransport;
+
+WB_PRIVATE
+WBMessageServerRef _WBMessageServerCreate(const WBMessageServerTransport *transport, void *info,
+                                          size_t maxSize, WBMessageServerHandler handler, void *ctxt);
+
+WB_PRIVATE
+bool _WBMessageServerIsStopping(WBMessageServerRef server);
+
+/* Receive timeout in milliseconds, -1 if there is no idle timeout */
+WB_PRIVATE
+int _WBMessageServerGetWaitTimeout(WBMessageServerRef server);
+
+/* Invoke the timeout callback if the idle delay is elapsed */
+WB_PRIVATE
+void _WBMessageServerCheckIdle(WBMessageServerRef server);
+
+/* Reset the idle timer, call the handler, and sample the load. reply must be initialized with the reply buffer.
+ Returns true if the reply must be sent. The transport closes reply->fd in all cases, and releases an owned
+ reply buffer once sent. */
+WB_PRIVATE
+bool _WBMessageServerHandle(WBMessageServerRef server, const WBMessage *request, WBMessage *reply);
+
+__END_DECLS
@@ -0,0 +1,330 @@
+/*
+ *  WBMessageServerMach.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include "WBMessageServerInternal.h"
+
+#include <WonderBox/WBMachDispatch.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mach/mig.h>
+
+/* 'wbms' */
+#define kWBMachServerRequestID 0x77626d73
+/* MIG convention */
+#define kWBMachServerReplyID (kWBMachServerRequestID + 100)
+/* do not block the server if the reply queue of a client is full (ms) */
+#define kWBMachServerSendTimeout 1000
+/* client requests larger than this are sent out-of-line */
+#define kWBMachClientOOLThreshold (32 * 1024)
+
+typedef struct {
+  mach_msg_header_t header;
+  uint32_t length;
+} _WBMachMessage;
+
+static inline
+mach_msg_size_t _WBMachMessageSize(size_t length) {
+  return (mach_msg_size_t)(sizeof(_WBMachMessage) + ((length + 3) & ~(size_t)3));
+}
+
+/* buffer size for inline messages up to length, and out-of-line messages */
+static inline
+mach_msg_size_t _WBMachBufferSize(size_t length) {
+  mach_msg_size_t size = _WBMachMessageSize(length);
+  return size > sizeof(WBMachOOLMessage) ? size : (mach_msg_size_t)sizeof(WBMachOOLMessage);
+}
+
+/* Returns false if the message is not a valid inline or out-of-line message */
+static
+bool _WBMachMessageGetPayload(_WBMachMessage *msg, mach_msg_id_t msgid, WBMessage *payload) {
+  mach_msg_header_t *hdr = &msg->header;
+  if (hdr->msgh_id != msgid)
+    return false;
+
+  payload->fd = -1;
+  if (hdr->msgh_bits & MACH_MSGH_BITS_COMPLEX) {
+    void *address = NULL;
+    mach_msg_size_t size = 0;
+    if (!WBMachMessageGetOOLBuffer(hdr, &address, &size))
+      return false;
+    payload->data = address;
+    payload->length = size;
+    payload->flags = kWBMessageOwnsBuffer;
+    return true;
+  }
+  if (hdr->msgh_size < sizeof(_WBMachMessage) || msg->length > hdr->msgh_size - sizeof(_WBMachMessage))
+    return false;
+  payload->data = msg + 1;
+  payload->length = msg->length;
+  payload->flags = 0;
+  return true;
+}
+
+typedef struct {
+  mach_port_t port;
+  mach_port_t set;
+  mach_port_t wakeup;
+  size_t maxSize;
+  mach_msg_size_t rcvSize;
+  _WBMachMessage *request;
+  _WBMachMessage *reply;
+} _WBMachServer;
+
+static
+void _WBMachServerFree(void *info) {
+  _WBMachServer *ms = (_WBMachServer *)info;
+  if (ms->set) {
+    /* the caller keeps the service port */
+    if (ms->port)
+      mach_port_move_member(mach_task_self(), ms->port, MACH_PORT_NULL);
+    mach_port_mod_refs(mach_task_self(), ms->set, MACH_PORT_RIGHT_PORT_SET, -1);
+  }
+  if (ms->wakeup)
+    mach_port_mod_refs(mach_task_self(), ms->wakeup, MACH_PORT_RIGHT_RECEIVE, -1);
+  free(ms->request);
+  free(ms->reply);
+  free(ms);
+}
+
+static
+void _WBMachServerWakeup(void *info) {
+  _WBMachServer *ms = (_WBMachServer *)info;
+  mach_msg_header_t msg = {};
+  msg.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_MAKE_SEND, 0);
+  msg.msgh_size = (mach_msg_size_t)sizeof(msg);
+  msg.msgh_remote_port = ms->wakeup;
+  /* a full queue means a wakeup is already pending */
+  mach_msg_return_t mr = mach_msg(&msg, MACH_SEND_MSG | MACH_SEND_TIMEOUT, msg.msgh_size, 0,
+                                  MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+  if (MACH_MSG_SUCCESS != mr && MACH_SEND_TIMED_OUT != mr)
+    spx_log_warning("mach_msg(wakeup): %s", mach_error_string(mr));
+}
+
+static
+void _WBMachServerHandle(WBMessageServerRef server, _WBMachServer *ms) {
+  mach_msg_header_t *hdr = &ms->request->header;
+  WBMessage request;
+  if (!_WBMachMessageGetPayload(ms->request, kWBMachServerRequestID, &request)) {
+    spx_log_warning("discard invalid message (id: %d)", hdr->msgh_id);
+    mach_msg_destroy(hdr);
+    return;
+  }
+
+  WBMessage reply = { ms->reply + 1, ms->maxSize, -1, 0 };
+  bool send = _WBMessageServerHandle(server, &request, &reply);
+  /* out-of-line request memory was mapped by the kernel */
+  if (request.flags & kWBMessageOwnsBuffer)
+    WBMessageFreeBuffer(request.data, request.length);
+  /* descriptors are not supported by this transport */
+  if (reply.fd >= 0)
+    close(reply.fd);
+
+  if (send && (reply.flags & kWBMessageOwnsBuffer) && reply.length > UINT32_MAX) {
+    spx_log_warning("reply too large (%zu bytes)", reply.length);
+    WBMessageFreeBuffer(reply.data, reply.length);
+    send = false;
+  }
+
+  if (!MACH_PORT_VALID(hdr->msgh_remote_port)) {
+    if (send && (reply.flags & kWBMessageOwnsBuffer))
+      WBMessageFreeBuffer(reply.data, reply.length);
+    return;
+  }
+
+  if (send) {
+    mach_msg_header_t *rhdr = &ms->reply->header;
+    if (reply.flags & kWBMessageOwnsBuffer) {
+      /* move the pages to the client */
+      WBMachMessageInitOOLReply(hdr, rhdr, reply.data, (mach_msg_size_t)reply.length, TRUE);
+    } else {
+      rhdr->msgh_bits = MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(hdr->msgh_bits), 0);
+      rhdr->msgh_size = _WBMachMessageSize(reply.length);
+      rhdr->msgh_remote_port = hdr->msgh_remote_port;
+      rhdr->msgh_local_port = MACH_PORT_NULL;
+      rhdr->msgh_reserved = 0;
+      rhdr->msgh_id = kWBMachServerReplyID;
+      ms->reply->length = (uint32_t)reply.length;
+    }
+    mach_msg_return_t mr = mach_msg(rhdr, MACH_SEND_MSG | MACH_SEND_TIMEOUT, rhdr->msgh_size, 0,
+                                    MACH_PORT_NULL, kWBMachServerSendTimeout, MACH_PORT_NULL);
+    if (MACH_MSG_SUCCESS != mr) {
+      spx_log_warning("mach_msg(reply): %s", mach_error_string(mr));
+      /* release the out-of-line memory */
+      if (rhdr->msgh_bits & MACH_MSGH_BITS_COMPLEX)
+        mach_msg_destroy(rhdr);
+    }
+  } else {
+    /* release the reply right (out-of-line memory is already released) */
+    hdr->msgh_local_port = MACH_PORT_NULL;
+    hdr->msgh_bits &= ~MACH_MSGH_BITS_COMPLEX;
+    mach_msg_destroy(hdr);
+  }
+}
+
+static
+size_t _WBMachServerGetQueueDepth(void *info) {
+  _WBMachServer *ms = (_WBMachServer *)info;
+  mach_port_status_t status;
+  mach_msg_type_number_t count = MACH_PORT_RECEIVE_STATUS_COUNT;
+  if (KERN_SUCCESS != mach_port_get_attributes(mach_task_self(), ms->port, MACH_PORT_RECEIVE_STATUS,
+                                               (mach_port_info_t)&status, &count))
+    return 0;
+  return status.mps_msgcount;
+}
+
+static
+int _WBMachServerRun(WBMessageServerRef server, void *info) {
+  _WBMachServer *ms = (_WBMachServer *)info;
+  while (!_WBMessageServerIsStopping(server)) {
+    int timeout = _WBMessageServerGetWaitTimeout(server);
+    mach_msg_option_t options = MACH_RCV_MSG;
+    if (timeout >= 0)
+      options |= MACH_RCV_TIMEOUT;
+
+    mach_msg_return_t mr = mach_msg(&ms->request->header, options, 0, ms->rcvSize, ms->set,
+                                    timeout >= 0 ? (mach_msg_timeout_t)timeout : MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+    switch (mr) {
+      case MACH_MSG_SUCCESS:
+        if (ms->request->header.msgh_local_port == ms->wakeup)
+          mach_msg_destroy(&ms->request->header);
+        else
+          _WBMachServerHandle(server, ms);
+        break;
+      case MACH_RCV_TIMED_OUT:
+      case MACH_RCV_INTERRUPTED:
+        break;
+      case MACH_RCV_TOO_LARGE:
+        /* without MACH_RCV_LARGE, the message is destroyed */
+        spx_log_warning("discard message larger than %u bytes", ms->rcvSize);
+        break;
+      default:
+        return mr;
+    }
+    _WBMessageServerCheckIdle(server);
+  }
+  return 0;
+}
+
+static const WBMessageServerTransport sMachTransport = {
+  .name = "mach",
+  .run = _WBMachServerRun,
+  .wakeup = _WBMachServerWakeup,
+  .free = _WBMachServerFree,
+  .depth = _WBMachServerGetQueueDepth,
+};
+
+WBMessageServerRef WBMessageServerCreateMach(mach_port_t port, size_t maxSize, WBMessageServerHandler handler, void *ctxt) {
+  if (!MACH_PORT_VALID(port) || 0 == maxSize || maxSize > UINT32_MAX / 2 || !handler)
+    return NULL;
+
+  _WBMachServer *ms = calloc(1, sizeof(*ms));
+  if (!ms)
+    return NULL;
+
+  ms->maxSize = maxSize;
+  ms->rcvSize = _WBMachBufferSize(maxSize) + MAX_TRAILER_SIZE;
+  ms->request = malloc(ms->rcvSize);
+  ms->reply = malloc(_WBMachBufferSize(maxSize));
+  if (!ms->request || !ms->reply)
+    goto error;
+
+  mach_port_t self = mach_task_self();
+  if (KERN_SUCCESS != mach_port_allocate(self, MACH_PORT_RIGHT_PORT_SET, &ms->set))
+    goto error;
+  if (KERN_SUCCESS != mach_port_allocate(self, MACH_PORT_RIGHT_RECEIVE, &ms->wakeup) ||
+      KERN_SUCCESS != mach_port_move_member(self, ms->wakeup, ms->set))
+    goto error;
+  if (KERN_SUCCESS != mach_port_move_member(self, port, ms->set))
+    goto error;
+  ms->port = port;
+
+  WBMessageServerRef server = _WBMessageServerCreate(&sMachTransport, ms, maxSize, handler, ctxt);
+  if (server)
+    return server;
+
+error:
+  _WBMachServerFree(ms);
+  return NULL;
+}
+
+// MARK: Client
+kern_return_t WBMessageClientSendMachRequest(mach_port_t port, const WBMessage *request, WBMessage *reply) {
+  bool owned = (request->flags & kWBMessageOwnsBuffer) != 0;
+  if (request->fd >= 0 || request->length > UINT32_MAX / 2 || reply->length > UINT32_MAX / 2) {
+    if (owned)
+      WBMessageFreeBuffer(request->data, request->length);
+    return KERN_INVALID_ARGUMENT;
+  }
+
+  bool ool = owned || request->length > kWBMachClientOOLThreshold;
+  mach_msg_size_t size = ool ? (mach_msg_size_t)sizeof(WBMachOOLMessage) : _WBMachMessageSize(request->length);
+  mach_msg_size_t rcvSize = _WBMachBufferSize(reply->length) + MAX_TRAILER_SIZE;
+  _WBMachMessage *msg = malloc(size > rcvSize ? size : rcvSize);
+  if (!msg) {
+    if (owned)
+      WBMessageFreeBuffer(request->data, request->length);
+    return KERN_RESOURCE_SHORTAGE;
+  }
+
+  mach_port_t replyPort = mig_get_reply_port();
+  if (ool) {
+    msg->header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, MACH_MSG_TYPE_MAKE_SEND_ONCE);
+    msg->header.msgh_remote_port = port;
+    msg->header.msgh_local_port = replyPort;
+    msg->header.msgh_reserved = 0;
+    /* owned buffers are moved, others are copied on write */
+    WBMachMessageInitOOL(&msg->header, kWBMachServerRequestID, request->data, (mach_msg_size_t)request->length, owned);
+  } else {
+    msg->header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, MACH_MSG_TYPE_MAKE_SEND_ONCE);
+    msg->header.msgh_size = size;
+    msg->header.msgh_remote_port = port;
+    msg->header.msgh_local_port = replyPort;
+    msg->header.msgh_reserved = 0;
+    msg->header.msgh_id = kWBMachServerRequestID;
+    msg->length = (uint32_t)request->length;
+    if (request->length)
+      memcpy(msg + 1, request->data, request->length);
+  }
+
+  kern_return_t kr = mach_msg(&msg->header, MACH_SEND_MSG | MACH_RCV_MSG, size, rcvSize, replyPort,
+                              MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+  if (MACH_MSG_SUCCESS == kr) {
+    WBMessage payload;
+    if (!_WBMachMessageGetPayload(msg, kWBMachServerReplyID, &payload)) {
+      mach_msg_destroy(&msg->header);
+      kr = MIG_REPLY_MISMATCH;
+    } else if (payload.flags & kWBMessageOwnsBuffer) {
+      /* out-of-line reply: give the mapped pages to the caller */
+      *reply = payload;
+    } else if (payload.length > reply->length) {
+      kr = MIG_ARRAY_TOO_LARGE;
+    } else {
+      reply->length = payload.length;
+      reply->fd = -1;
+      reply->flags = 0;
+      if (payload.length)
+        memcpy(reply->data, payload.data, payload.length);
+    }
+  } else if (kr >= MACH_SEND_IN_PROGRESS && kr < MACH_RCV_IN_PROGRESS) {
+    /* the message was not sent */
+    if (owned)
+      WBMessageFreeBuffer(request->data, request->length);
+  } else if (MACH_RCV_TOO_LARGE == kr) {
+    kr = MIG_ARRAY_TOO_LARGE;
+  } else if (kr >= MACH_RCV_IN_PROGRESS && kr <= MACH_RCV_IN_PROGRESS_TIMED) {
+    /* the reply port state is unknown */
+    mig_dealloc_reply_port(replyPort);
+  }
+  free(msg);
+  return kr;
+}
@@ -0,0 +1,585 @@
+/*
+ *  WBMessageServerUnix.c
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#include "WBMessageServerInternal.h"
+
+#include <WonderBox/WBUnixFunctions.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#if defined(__linux__)
+  #include <sys/epoll.h>
+  #include <sys/eventfd.h>
+#endif
+
+/* a single descriptor per message */
+typedef union {
+  struct cmsghdr cmsghdr;
+  unsigned char control[CMSG_SPACE(sizeof(int))];
+} _WBMessageControl;
+
+static
+void _WBMessageSetDescriptor(struct msghdr *msg, _WBMessageControl *control, int fd) {
+  if (fd < 0) {
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+    return;
+  }
+  /* same encoding than WBIOSendFileDescriptor() */
+  msg->msg_control = control->control;
+  msg->msg_controllen = sizeof(control->control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+}
+
+static
+int _WBMessageGetDescriptor(struct msghdr *msg) {
+  int fd = -1;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len >= CMSG_LEN(sizeof(int))) {
+      int *fds = (int *)CMSG_DATA(cmsg);
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t idx = 0; idx < count; idx++) {
+        int value;
+        memcpy(&value, &fds[idx], sizeof(int));
+        /* keep the first one */
+        if (fd < 0)
+          fd = value;
+        else
+          close(value);
+      }
+    }
+  }
+  return fd;
+}
+
+#if defined(__linux__)
+
+// MARK: Unix Transport
+#define kWBUnixServerBatchSize 32
+#define kWBUnixServerMaxEvents 32
+
+/* reply waiting for the client socket to be writable */
+typedef struct {
+  void *data;
+  size_t length;
+  int fd;
+  /* owned reply buffer (WBMessageFreeBuffer()), or copy of the batch buffer (free()) */
+  bool owned;
+} _WBUnixReply;
+
+typedef struct {
+  int fd;
+  /* position in the server clients */
+  size_t index;
+  /* requests are not read while replies are pending */
+  _WBUnixReply *pending;
+  size_t count, capacity;
+} _WBUnixClient;
+
+typedef struct {
+  int sockfd;
+  int epollfd;
+  int eventfd;
+  char *path;
+  size_t maxSize;
+
+  /* connected clients */
+  _WBUnixClient **clients;
+  size_t count, capacity;
+
+  /* batch buffers */
+  uint8_t *requests;
+  uint8_t *replies;
+  /* descriptors and owned buffers are released once sent */
+  WBMessage sent[kWBUnixServerBatchSize];
+  struct mmsghdr rmsgs[kWBUnixServerBatchSize];
+  struct mmsghdr smsgs[kWBUnixServerBatchSize];
+  struct iovec riovs[kWBUnixServerBatchSize];
+  struct iovec siovs[kWBUnixServerBatchSize];
+  _WBMessageControl rcontrols[kWBUnixServerBatchSize];
+  _WBMessageControl scontrols[kWBUnixServerBatchSize];
+} _WBUnixServer;
+
+static
+void _WBUnixReplyRelease(_WBUnixReply *reply) {
+  if (reply->fd >= 0)
+    close(reply->fd);
+  if (reply->owned)
+    WBMessageFreeBuffer(reply->data, reply->length);
+  else
+    free(reply->data);
+}
+
+static
+void _WBUnixClientFree(_WBUnixClient *client) {
+  for (size_t idx = 0; idx < client->count; idx++)
+    _WBUnixReplyRelease(&client->pending[idx]);
+  free(client->pending);
+  /* also removes it from the epoll set */
+  close(client->fd);
+  free(client);
+}
+
+static
+void _WBUnixServerFree(void *info) {
+  _WBUnixServer *us = (_WBUnixServer *)info;
+  for (size_t idx = 0; idx < us->count; idx++)
+    _WBUnixClientFree(us->clients[idx]);
+  free(us->clients);
+  if (us->sockfd >= 0)
+    close(us->sockfd);
+  if (us->path) {
+    unlink(us->path);
+    free(us->path);
+  }
+  if (us->epollfd >= 0)
+    close(us->epollfd);
+  if (us->eventfd >= 0)
+    close(us->eventfd);
+  free(us->requests);
+  free(us->replies);
+  free(us);
+}
+
+static
+void _WBUnixServerWakeup(void *info) {
+  _WBUnixServer *us = (_WBUnixServer *)info;
+  uint64_t value = 1;
+  if (write(us->eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    spx_log_warning("write(eventfd): %s", strerror(errno));
+}
+
+static
+void _WBUnixServerClose(_WBUnixServer *us, _WBUnixClient *client) {
+  _WBUnixClient *last = us->clients[--us->count];
+  us->clients[client->index] = last;
+  last->index = client->index;
+  _WBUnixClientFree(client);
+}
+
+static
+void _WBUnixServerAccept(_WBUnixServer *us) {
+  for (;;) {
+    int fd = accept4(us->sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        spx_log_warning("accept: %s", strerror(errno));
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+    _WBUnixClient *client = NULL;
+    if (us->count == us->capacity) {
+      size_t capacity = us->capacity ? us->capacity * 2 : 16;
+      _WBUnixClient **clients = realloc(us->clients, capacity * sizeof(*clients));
+      if (!clients) {
+        close(fd);
+        continue;
+      }
+      us->clients = clients;
+      us->capacity = capacity;
+    }
+    if (!(client = calloc(1, sizeof(*client)))) {
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = client };
+    if (epoll_ctl(us->epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      spx_log_warning("epoll_ctl: %s", strerror(errno));
+      free(client);
+      close(fd);
+      continue;
+    }
+    client->index = us->count;
+    us->clients[us->count++] = client;
+  }
+}
+
+/* Returns the number of messages sent, or -1 on error */
+static
+int _WBUnixServerSendBatch(int fd, struct mmsghdr *msgs, unsigned count) {
+  unsigned sent = 0;
+  while (sent < count) {
+    int result = sendmmsg(fd, msgs + sent, count - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (result > 0)
+      sent += (unsigned)result;
+    else if (result < 0 && errno == EINTR)
+      continue;
+    else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    else
+      return -1;
+  }
+  return (int)sent;
+}
+
+/* Wait for the client to be writable (pending replies), or readable */
+static
+bool _WBUnixServerWatch(_WBUnixServer *us, _WBUnixClient *client) {
+  struct epoll_event event = { .events = client->count ? EPOLLOUT : EPOLLIN | EPOLLRDHUP, .data.ptr = client };
+  if (epoll_ctl(us->epollfd, EPOLL_CTL_MOD, client->fd, &event) < 0) {
+    spx_log_warning("epoll_ctl: %s", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+/* Send the batch replies, and queue the ones the client cannot receive yet. Returns false on error. */
+static
+bool _WBUnixServerSend(_WBUnixServer *us, _WBUnixClient *client, unsigned count) {
+  int sent = _WBUnixServerSendBatch(client->fd, us->smsgs, count);
+  bool success = sent >= 0;
+  for (unsigned idx = 0; idx < count; idx++) {
+    WBMessage *reply = &us->sent[idx];
+    if (success && idx >= (unsigned)sent) {
+      /* the client does not read its replies fast enough: do not block the other clients */
+      if (client->count == client->capacity) {
+        size_t capacity = client->capacity ? client->capacity * 2 : kWBUnixServerBatchSize;
+        _WBUnixReply *pending = realloc(client->pending, capacity * sizeof(*pending));
+        if (pending) {
+          client->pending = pending;
+          client->capacity = capacity;
+        }
+      }
+      _WBUnixReply *queued = client->count < client->capacity ? &client->pending[client->count] : NULL;
+      if (queued && (reply->flags & kWBMessageOwnsBuffer)) {
+        *queued = (_WBUnixReply){ reply->data, reply->length, reply->fd, true };
+        client->count++;
+        continue;
+      }
+      /* the batch buffer is reused */
+      if (queued && (queued->data = malloc(reply->length ? reply->length : 1))) {
+        memcpy(queued->data, reply->data, reply->length);
+        queued->length = reply->length;
+        queued->fd = reply->fd;
+        queued->owned = false;
+        client->count++;
+        continue;
+      }
+      success = false;
+    }
+    if (reply->fd >= 0)
+      close(reply->fd);
+    if (reply->flags & kWBMessageOwnsBuffer)
+      WBMessageFreeBuffer(reply->data, reply->length);
+  }
+  if (success && client->count > 0)
+    success = _WBUnixServerWatch(us, client);
+  return success;
+}
+
+/* The client is writable: send the pending replies. Returns false if the connection must be closed. */
+static
+bool _WBUnixServerFlush(_WBUnixServer *us, _WBUnixClient *client) {
+  unsigned count = client->count < kWBUnixServerBatchSize ? (unsigned)client->count : kWBUnixServerBatchSize;
+  for (unsigned idx = 0; idx < count; idx++) {
+    _WBUnixReply *reply = &client->pending[idx];
+    us->siovs[idx].iov_base = reply->data;
+    us->siovs[idx].iov_len = reply->length;
+    struct msghdr *shdr = &us->smsgs[idx].msg_hdr;
+    memset(shdr, 0, sizeof(*shdr));
+    shdr->msg_iov = &us->siovs[idx];
+    shdr->msg_iovlen = 1;
+    _WBMessageSetDescriptor(shdr, &us->scontrols[idx], reply->fd);
+  }
+  int sent = _WBUnixServerSendBatch(client->fd, us->smsgs, count);
+  if (sent < 0)
+    return false;
+  for (int idx = 0; idx < sent; idx++)
+    _WBUnixReplyRelease(&client->pending[idx]);
+  client->count -= (size_t)sent;
+  memmove(client->pending, client->pending + sent, client->count * sizeof(*client->pending));
+  /* resume reading once all the replies are sent */
+  return client->count > 0 || _WBUnixServerWatch(us, client);
+}
+
+/* Handle one batch of requests (the other clients are served before the next one).
+ Returns false if the connection must be closed. */
+static
+bool _WBUnixServerRead(WBMessageServerRef server, _WBUnixServer *us, _WBUnixClient *client) {
+  for (unsigned idx = 0; idx < kWBUnixServerBatchSize; idx++) {
+    us->riovs[idx].iov_base = us->requests + idx * us->maxSize;
+    us->riovs[idx].iov_len = us->maxSize;
+    struct msghdr *hdr = &us->rmsgs[idx].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_iov = &us->riovs[idx];
+    hdr->msg_iovlen = 1;
+    hdr->msg_control = us->rcontrols[idx].control;
+    hdr->msg_controllen = sizeof(us->rcontrols[idx].control);
+  }
+
+  int count = recvmmsg(client->fd, us->rmsgs, kWBUnixServerBatchSize, MSG_DONTWAIT | MSG_CMSG_CLOEXEC, NULL);
+  if (count < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+  bool eof = 0 == count;
+  unsigned replies = 0;
+  for (int idx = 0; idx < count; idx++) {
+    struct msghdr *hdr = &us->rmsgs[idx].msg_hdr;
+    int rfd = _WBMessageGetDescriptor(hdr);
+    /* the rest of the batch is dropped: close the descriptors already received */
+    if (eof) {
+      if (rfd >= 0)
+        close(rfd);
+      continue;
+    }
+    /* SOCK_SEQPACKET reports the end of stream as an empty message */
+    if (0 == us->rmsgs[idx].msg_len && rfd < 0) {
+      eof = true;
+      continue;
+    }
+    if (hdr->msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+      /* the client waits for a reply: close the connection, so it gets an error */
+      spx_log_warning("truncated request (maximum size: %zu bytes), closing the connection", us->maxSize);
+      if (rfd >= 0)
+        close(rfd);
+      eof = true;
+      continue;
+    }
+
+    WBMessage request = { us->riovs[idx].iov_base, us->rmsgs[idx].msg_len, rfd, 0 };
+    WBMessage reply = { us->replies + replies * us->maxSize, us->maxSize, -1, 0 };
+    if (_WBMessageServerHandle(server, &request, &reply)) {
+      us->siovs[replies].iov_base = reply.data;
+      us->siovs[replies].iov_len = reply.length;
+      struct msghdr *shdr = &us->smsgs[replies].msg_hdr;
+      memset(shdr, 0, sizeof(*shdr));
+      shdr->msg_iov = &us->siovs[replies];
+      shdr->msg_iovlen = 1;
+      _WBMessageSetDescriptor(shdr, &us->scontrols[replies], reply.fd);
+      us->sent[replies++] = reply;
+    } else if (reply.fd >= 0) {
+      close(reply.fd);
+    }
+  }
+
+  bool success = _WBUnixServerSend(us, client, replies);
+  return success && !eof;
+}
+
+static
+int _WBUnixServerRun(WBMessageServerRef server, void *info) {
+  _WBUnixServer *us = (_WBUnixServer *)info;
+  struct epoll_event events[kWBUnixServerMaxEvents];
+  while (!_WBMessageServerIsStopping(server)) {
+    int count = epoll_wait(us->epollfd, events, kWBUnixServerMaxEvents, _WBMessageServerGetWaitTimeout(server));
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    for (int idx = 0; idx < count; idx++) {
+      void *source = events[idx].data.ptr;
+      if (source == &us->eventfd) {
+        uint64_t value;
+        if (read(us->eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+          spx_log_warning("read(eventfd): %s", strerror(errno));
+      } else if (source == &us->sockfd) {
+        _WBUnixServerAccept(us);
+      } else {
+        _WBUnixClient *client = (_WBUnixClient *)source;
+        uint32_t ready = events[idx].events;
+        bool alive;
+        if (client->count > 0)
+          alive = (ready & EPOLLOUT) && _WBUnixServerFlush(us, client);
+        else
+          alive = (ready & EPOLLIN) && _WBUnixServerRead(server, us, client);
+        if (!alive)
+          _WBUnixServerClose(us, client);
+      }
+    }
+    _WBMessageServerCheckIdle(server);
+  }
+  return 0;
+}
+
+static const WBMessageServerTransport sUnixTransport = {
+  .name = "unix",
+  .run = _WBUnixServerRun,
+  .wakeup = _WBUnixServerWakeup,
+  .free = _WBUnixServerFree,
+};
+
+static
+WBMessageServerRef _WBUnixServerCreate(int sockfd, const char *path, size_t maxSize, WBMessageServerHandler handler, void *ctxt) {
+  if (sockfd < 0 || 0 == maxSize || !handler) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  _WBUnixServer *us = calloc(1, sizeof(*us));
+  if (!us)
+    return NULL;
+  us->sockfd = sockfd;
+  us->eventfd = us->epollfd = -1;
+  us->maxSize = maxSize;
+  /* removed on free */
+  if (path && !(us->path = strdup(path)))
+    goto error;
+  us->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  us->epollfd = epoll_create1(EPOLL_CLOEXEC);
+  us->requests = malloc(kWBUnixServerBatchSize * maxSize);
+  us->replies = malloc(kWBUnixServerBatchSize * maxSize);
+  if (us->eventfd < 0 || us->epollfd < 0 || !us->requests || !us->replies)
+    goto error;
+
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = &us->eventfd };
+  if (epoll_ctl(us->epollfd, EPOLL_CTL_ADD, us->eventfd, &event) < 0)
+    goto error;
+  event.data.ptr = &us->sockfd;
+  if (0 != WBIOSetNonBlocking(sockfd) || epoll_ctl(us->epollfd, EPOLL_CTL_ADD, sockfd, &event) < 0)
+    goto error;
+
+  WBMessageServerRef server = _WBMessageServerCreate(&sUnixTransport, us, maxSize, handler, ctxt);
+  if (server)
+    return server;
+
+error:
+  {
+    int err = errno;
+    /* the caller keeps the socket and the file on failure */
+    us->sockfd = -1;
+    free(us->path);
+    us->path = NULL;
+    _WBUnixServerFree(us);
+    errno = err;
+  }
+  return NULL;
+}
+
+WBMessageServerRef WBMessageServerCreateUnixWithSocket(int sockfd, size_t maxSize, WBMessageServerHandler handler, void *ctxt) {
+  return _WBUnixServerCreate(sockfd, NULL, maxSize, handler, ctxt);
+}
+
+WBMessageServerRef WBMessageServerCreateUnix(const char *path, size_t maxSize, WBMessageServerHandler handler, void *ctxt) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sockfd < 0)
+    return NULL;
+
+  unlink(path);
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sockfd, SOMAXCONN) < 0) {
+    int err = errno;
+    close(sockfd);
+    errno = err;
+    return NULL;
+  }
+
+  WBMessageServerRef server = _WBUnixServerCreate(sockfd, path, maxSize, handler, ctxt);
+  if (!server) {
+    int err = errno;
+    close(sockfd);
+    unlink(path);
+    errno = err;
+  }
+  return server;
+}
+
+#else
+
+/* recvmmsg(), sendmmsg() and SOCK_SEQPACKET Unix sockets are not available */
+WBMessageServerRef WBMessageServerCreateUnixWithSocket(int sockfd, size_t maxSize, WBMessageServerHandler handler, void *ctxt) {
+  errno = EPROTONOSUPPORT;
+  return NULL;
+}
+
+WBMessageServerRef WBMessageServerCreateUnix(const char *path, size_t maxSize, WBMessageServerHandler handler, void *ctxt) {
+  errno = EPROTONOSUPPORT;
+  return NULL;
+}
+
+#endif /* __linux__ */
+
+// MARK: Client
+int WBMessageClientConnect(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+    errno = EINVAL;
+    return -1;
+  }
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (sockfd < 0)
+    return -1;
+  fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+  if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    close(sockfd);
+    errno = err;
+    return -1;
+  }
+  return sockfd;
+}
+
+int WBMessageClientSendRequest(int sockfd, const WBMessage *request, WBMessage *reply) {
+  _WBMessageControl control;
+  struct iovec iov = { request->data, request->length };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  _WBMessageSetDescriptor(&msg, &control, request->fd);
+
+  int flags = 0;
+#if defined(MSG_NOSIGNAL)
+  flags |= MSG_NOSIGNAL;
+#endif
+  ssize_t result;
+  do {
+    result = sendmsg(sockfd, &msg, flags);
+  } while (result < 0 && errno == EINTR);
+  int err = result < 0 ? errno : 0;
+  if (request->flags & kWBMessageOwnsBuffer)
+    WBMessageFreeBuffer(request->data, request->length);
+  if (err)
+    return err;
+
+  iov.iov_base = reply->data;
+  iov.iov_len = reply->length;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.control;
+  msg.msg_controllen = sizeof(control.control);
+  do {
+    result = recvmsg(sockfd, &msg, 0);
+  } while (result < 0 && errno == EINTR);
+  if (result < 0)
+    return errno;
+
+  reply->flags = 0;
+  reply->fd = _WBMessageGetDescriptor(&msg);
+  if (0 == result && reply->fd < 0)
+    return ECONNRESET;
+  if (msg.msg_flags & MSG_TRUNC) {
+    if (reply->fd >= 0)
+      close(reply->fd);
+    reply->fd = -1;
+    return EMSGSIZE;
+  }
+  reply->length = (size_t)result;
+  return 0;
+}
@@ -9,8 +9,10 @@
  */
 
 #include "WBService.h"
+#include "WBMachDispatch.h"
 
 #include <launch.h>
+#include <stdatomic.h>
 #include <mach/mach_time.h>
 
 static struct _WBServiceContext {
@@ -19,6 +21,20 @@ static struct _WBServiceContext {
   mach_port_t timer;
   mach_port_t service;
   WBServiceDispatch dispatch;
+  /* receive loop */
+  size_t workers;
+  size_t maxDemux;
+  WBMachMessageServerRef server;
+  /* idle tracking: the timer checks the last request time when it fires */
+  _Atomic(uint64_t) activity;
+  _Atomic(bool) armed;
+  _Atomic(size_t) inflight;
+  /* backpressure */
+  size_t highWater, lowWater;
+  _Atomic(uint32_t) requests;
+  _Atomic(bool) overloaded;
+  void *overload_ctxt;
+  void (*overload)(bool overloaded, size_t depth, void *ctxt);
   /* timeout callback */
   void *timeout_ctxt;
   void (*timeout)(void *ctxt);
@@ -29,20 +45,81 @@ extern kern_return_t mk_timer_destroy(mach_port_name_t);
 extern kern_return_t mk_timer_arm(mach_port_name_t, uint64_t);
 extern kern_return_t mk_timer_cancel(mach_port_name_t, uint64_t*);
 
+/* queue depth is sampled once every 16 requests */
+#define kWBServiceLoadSampleInterval 16
+
+static
+void _WBServiceCheckLoad(size_t inflight) {
+  if (!sServiceContext.overload || !sServiceContext.highWater)
+    return;
+
+  mach_port_status_t status;
+  mach_msg_type_number_t count = MACH_PORT_RECEIVE_STATUS_COUNT;
+  if (KERN_SUCCESS != mach_port_get_attributes(mach_task_self(), sServiceContext.service, MACH_PORT_RECEIVE_STATUS,
+                                               (mach_port_info_t)&status, &count))
+    return;
+
+  /* requests waiting in the port queue, and requests being handled */
+  size_t depth = status.mps_msgcount + inflight;
+  if (depth >= sServiceContext.highWater) {
+    if (!atomic_exchange(&sServiceContext.overloaded, true))
+      sServiceContext.overload(true, depth, sServiceContext.overload_ctxt);
+  } else if (depth <= sServiceContext.lowWater && atomic_load(&sServiceContext.overloaded)) {
+    if (atomic_exchange(&sServiceContext.overloaded, false))
+      sServiceContext.overload(false, depth, sServiceContext.overload_ctxt);
+  }
+}
+
 static
-boolean_t _WBServiceDemuxer(mach_msg_header_t *msg, mach_msg_header_t *reply) {
+void _WBServiceTimerFired(void) {
+  /* a request received from now re-arms the timer */
+  atomic_store(&sServiceContext.armed, false);
+  /* read the last request time first: a request received meanwhile must not be in the future */
+  uint64_t last = atomic_load(&sServiceContext.activity);
+  uint64_t now = mach_absolute_time();
+  if (atomic_load(&sServiceContext.inflight) > 0 || last >= now || now - last < sServiceContext.idle) {
+    /* not idle: check again when the delay expires */
+    uint64_t deadline = atomic_load(&sServiceContext.inflight) > 0 ? now + sServiceContext.idle : last + sServiceContext.idle;
+    if (!atomic_exchange(&sServiceContext.armed, true))
+      mk_timer_arm(sServiceContext.timer, deadline);
+    return;
+  }
+
+  if (atomic_load(&sServiceContext.overloaded))
+    _WBServiceCheckLoad(0);
+
+  if (sServiceContext.timeout)
+    sServiceContext.timeout(sServiceContext.timeout_ctxt);
+  else
+    WBServiceStop();
+}
+
+static
+boolean_t _WBServiceDemuxer(mach_msg_header_t *msg, mach_msg_header_t *reply, void *ctxt) {
   if (msg->msgh_local_port == sServiceContext.service) {
-    if (sServiceContext.timer) // reset timer
-      mk_timer_arm(sServiceContext.timer, mach_absolute_time() + sServiceContext.idle);
+    if (sServiceContext.timer) {
+      uint64_t now = mach_absolute_time();
+      atomic_store(&sServiceContext.activity, now);
+      // the timer is only re-armed after it fired
+      if (!atomic_load(&sServiceContext.armed) && !atomic_exchange(&sServiceContext.armed, true))
+        mk_timer_arm(sServiceContext.timer, now + sServiceContext.idle);
+    }
+
+    size_t inflight = atomic_fetch_add(&sServiceContext.inflight, 1) + 1;
+    if (0 == atomic_fetch_add_explicit(&sServiceContext.requests, 1, memory_order_relaxed) % kWBServiceLoadSampleInterval)
+      _WBServiceCheckLoad(inflight);
 
+    boolean_t result = false;
     WBServiceDispatch dispatch = sServiceContext.dispatch;
     // FIXME: barrier
-    if (dispatch) return dispatch(msg, reply);
+    if (dispatch) result = dispatch(msg, reply);
+
+    /* last request handled while overloaded: the queue is probably empty */
+    if (1 == atomic_fetch_sub(&sServiceContext.inflight, 1) && atomic_load(&sServiceContext.overloaded))
+      _WBServiceCheckLoad(0);
+    return result;
   } else { // assume this is the timer
-    if (sServiceContext.timeout)
-      sServiceContext.timeout(sServiceContext.timeout_ctxt);
-    else
-      WBServiceStop();
+    _WBServiceTimerFired();
   }
   return false;
 }
@@ -114,11 +191,37 @@ bool WBServiceRun(const char *name, WBServiceDispatch dispatch, mach_msg_size_t
     return false;
   }
 
-  kr = mach_msg_server(_WBServiceDemuxer, msgMaxSize > 0 ? msgMaxSize : 512, sServiceContext.ports, MACH_RCV_LARGE);
-  spx_debug("mach_msg_server: %s", mach_error_string(kr));
+  WBMachMessageServerRef server = WBMachMessageServerCreate(_WBServiceDemuxer, msgMaxSize > 0 ? msgMaxSize : 512,
+                                                            sServiceContext.ports, MACH_RCV_LARGE, NULL);
+  if (!server) {
+    WBServiceStop();
+    if (outError)
+      *outError = CFErrorCreate(kCFAllocatorDefault, kCFErrorDomainMach, KERN_RESOURCE_SHORTAGE, NULL);
+    return false;
+  }
+  WBMachMessageServerSetMaxConcurrentDemux(server, sServiceContext.maxDemux);
+  sServiceContext.server = server;
+  kr = WBMachMessageServerRun(server, sServiceContext.workers > 0 ? sServiceContext.workers : 1);
+  spx_debug("WBMachMessageServerRun: %s", mach_error_string(kr));
+  sServiceContext.server = NULL;
+  WBMachMessageServerFree(server);
+  WBServiceStop();
   return true;
 }
 
+void WBServiceSetConcurrency(size_t workers, size_t maxDemux) {
+  assert(!sServiceContext.server && "Service already running");
+  sServiceContext.workers = workers;
+  sServiceContext.maxDemux = maxDemux;
+}
+
+void WBServiceSetMaxInFlight(size_t count) {
+  sServiceContext.maxDemux = count;
+  /* the demux cap can be changed while the workers are running */
+  if (sServiceContext.server)
+    WBMachMessageServerSetMaxConcurrentDemux(sServiceContext.server, count);
+}
+
 kern_return_t WBServiceSetTimeout(CFTimeInterval idle) {
   if (!sServiceContext.ports) return KERN_INVALID_TASK;
 
@@ -143,8 +246,12 @@ kern_return_t WBServiceSetTimeout(CFTimeInterval idle) {
       kr = mk_timer_cancel(sServiceContext.timer, &fire);
     }
 
-    if (KERN_SUCCESS == kr) // Arm the timer
-      kr = mk_timer_arm(sServiceContext.timer, mach_absolute_time() + sServiceContext.idle);
+    if (KERN_SUCCESS == kr) { // Arm the timer
+      uint64_t now = mach_absolute_time();
+      atomic_store(&sServiceContext.activity, now);
+      atomic_store(&sServiceContext.armed, true);
+      kr = mk_timer_arm(sServiceContext.timer, now + sServiceContext.idle);
+    }
   } else if (sServiceContext.timer) { // idle < 0, disable timer (if it is enabled)
     mk_timer_destroy(sServiceContext.timer);
     sServiceContext.timer = MACH_PORT_NULL;
@@ -153,6 +260,18 @@ kern_return_t WBServiceSetTimeout(CFTimeInterval idle) {
   return kr;
 }
 
+void WBServiceSetBackpressure(size_t highWater, size_t lowWater, void (*callback)(bool, size_t, void *), void *ctxt) {
+  assert(!sServiceContext.server && "Service already running");
+  sServiceContext.highWater = highWater;
+  sServiceContext.lowWater = lowWater < highWater ? lowWater : (highWater > 0 ? highWater - 1 : 0);
+  sServiceContext.overload = callback;
+  sServiceContext.overload_ctxt = ctxt;
+}
+
+bool WBServiceIsOverloaded(void) {
+  return atomic_load_explicit(&sServiceContext.overloaded, memory_order_relaxed);
+}
+
 kern_return_t WBServiceSetTimeoutCallBack(void (*callback)(void *), void *ctxt) {
   sServiceContext.timeout = callback;
   sServiceContext.timeout_ctxt = ctxt;
@@ -160,6 +279,11 @@ kern_return_t WBServiceSetTimeoutCallBack(void (*callback)(void *), void *ctxt)
 }
 
 void WBServiceStop(void) {
+  /* let the workers drain the queue, WBServiceRun() does the cleanup */
+  if (sServiceContext.server) {
+    WBMachMessageServerStop(sServiceContext.server);
+    return;
+  }
   if (sServiceContext.ports) {
     mach_port_destroy(mach_task_self(), sServiceContext.ports);
     sServiceContext.ports = MACH_PORT_NULL;
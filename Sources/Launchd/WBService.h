@@ -20,5 +20,25 @@ bool WBServiceRun(const char *name, WBServiceDispatch dispatch,
                   mach_msg_size_t msgMaxSize, CFTimeInterval idle, CFErrorRef *outError);
 WB_PRIVATE void WBServiceStop(void);
 
+/* Must be called before WBServiceRun. workers: number of receive threads (default 1).
+ maxDemux: maximum number of concurrent dispatch calls (0 for one per worker).
+ The dispatch function must be thread safe when more than one worker is used. */
+WB_PRIVATE void WBServiceSetConcurrency(size_t workers, size_t maxDemux);
+
+/* Maximum number of in-flight requests (the maxDemux of WBServiceSetConcurrency()). 0 for one per worker.
+ Can be called while the service is running, for example from the backpressure callback.
+ Workers wait for a free slot before calling the dispatch function. */
+WB_PRIVATE void WBServiceSetMaxInFlight(size_t count);
+
+/* Must be called before WBServiceRun. The load (queued and in-flight requests) is sampled periodically.
+ callback is called with overloaded = true when it reaches highWater, and with false when it goes back
+ to lowWater. The number of in-flight requests is limited by WBServiceSetMaxInFlight(). */
+WB_PRIVATE void WBServiceSetBackpressure(size_t highWater, size_t lowWater,
+                                         void (*callback)(bool overloaded, size_t depth, void *ctxt), void *ctxt);
+/* Can be used by the dispatch function to reject requests while overloaded */
+WB_PRIVATE bool WBServiceIsOverloaded(void);
+
+/* The service is idle when no request was received during 'idle' seconds, and no request is being handled.
+ The last request time is checked when the timer fires, so requests do not re-arm it. */
 WB_PRIVATE kern_return_t WBServiceSetTimeout(CFTimeInterval idle);
 WB_PRIVATE kern_return_t WBServiceSetTimeoutCallBack(void (*callback)(void *), void *ctxt);
@@ -0,0 +1,94 @@
+/*
+ *  WBCompiledTemplate.h
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+/*!
+    @header WBCompiledTemplate
+    @abstract   Parse once, render many times.
+    @discussion A compiled template is an immutable opcode list (literal UTF-8 slices, variable slots
+    and blocks) stored in a single buffer. It can be shared between threads, and saved to disk using
+    -dataRepresentation. Rendering is done by a WBTemplateRenderer, that follows the WBTemplate
+    semantic (set variables, dump blocks), but uses integer indexes instead of names.
+*/
+
+#import <WonderBox/WBBase.h>
+
+#import <Foundation/Foundation.h>
+
+@class WBTemplate;
+
+WB_OBJC_EXPORT
+@interface WBCompiledTemplate : NSObject {
+@private
+  NSData *wb_image;
+  const void *wb_ops;
+  const void *wb_blocks;
+  const void *wb_slots;
+  const char *wb_strings;
+  NSUInteger wb_opCount, wb_blockCount, wb_slotCount;
+}
+
+/* Parse the file using a WBTemplate with default options */
+- (id)initWithContentsOfFile:(NSString *)aFile encoding:(NSStringEncoding)encoding;
+/* compile a template (loading it if needed). Options like removeBlockLine are honored. */
+- (id)initWithTemplate:(WBTemplate *)aTemplate;
+
+/* Serialized form (native byte order). Returns nil if data is not a valid compiled template. */
+- (id)initWithData:(NSData *)data;
+- (NSData *)dataRepresentation;
+
+/* Block 0 is the root template. Blocks are numbered in document order. */
+- (NSUInteger)numberOfBlocks;
+- (NSUInteger)numberOfSlots;
+
+/* returns NSNotFound if there is no such block or variable */
+- (NSUInteger)indexOfBlock:(NSString *)aName;
+- (NSString *)nameOfBlock:(NSUInteger)block;
+- (NSUInteger)slotForVariable:(NSString *)aKey inBlock:(NSUInteger)block;
+
+@end
+
+WB_OBJC_EXPORT
+@interface WBTemplateRenderer : NSObject {
+@private
+  WBCompiledTemplate *wb_template;
+  /* values arena */
+  uint8_t *wb_arena;
+  size_t wb_arenaLength, wb_arenaSize;
+  /* current variables values */
+  void *wb_values;
+  /* dumped blocks */
+  void *wb_saved;
+  size_t wb_savedCount, wb_savedSize;
+  void *wb_instances;
+  size_t wb_instCount, wb_instSize;
+  size_t *wb_heads;
+  size_t wb_headCount, wb_headSize;
+  void *wb_pending;
+}
+
+- (id)initWithTemplate:(WBCompiledTemplate *)aTemplate;
+
+- (WBCompiledTemplate *)compiledTemplate;
+
+/* nil clears the variable */
+- (void)setVariable:(NSString *)aValue forSlot:(NSUInteger)slot;
+- (void)setUTF8Variable:(const char *)aValue length:(NSUInteger)length forSlot:(NSUInteger)slot;
+
+/* same as -[WBTemplate dumpBlock]: save the block variables and the dumped sub-blocks */
+- (void)dumpBlock:(NSUInteger)block;
+
+/* Dump the root block, and append the UTF-8 output to data */
+- (void)appendToData:(NSMutableData *)data;
+- (NSData *)data;
+- (NSString *)stringRepresentation;
+
+/* Clear all variables and blocks */
+- (void)reset;
+
+@end
@@ -0,0 +1,540 @@
+/*
+ *  WBCompiledTemplate.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <WonderBox/WBCompiledTemplate.h>
+#import <WonderBox/WBTemplate.h>
+
+@interface WBTemplate (WBCompiledTemplate)
+- (NSArray *)wb_contents;
+- (NSDictionary *)wb_variables;
+@end
+
+enum {
+  kWBTemplateOpLiteral = 0,
+  kWBTemplateOpVariable,
+  kWBTemplateOpBlock,
+};
+
+/* The image is: header, ops, blocks, slots and strings. All offsets are relative to the strings buffer. */
+typedef struct _WBTemplateHeader {
+  uint32_t magic;
+  uint32_t ops, blocks, slots;
+  uint32_t strings;
+} WBTemplateHeader;
+
+typedef struct _WBTemplateOp {
+  uint32_t type;
+  uint32_t value; // slot or block index
+  uint32_t offset, length; // literal
+} WBTemplateOp;
+
+typedef struct _WBTemplateBlock {
+  uint32_t name, length;
+  uint32_t parent, index; // index in the parent sub-blocks
+  uint32_t children;
+  uint32_t firstOp, opCount;
+  uint32_t firstSlot, slotCount;
+} WBTemplateBlock;
+
+typedef struct _WBTemplateSlot {
+  uint32_t name, length;
+  uint32_t block;
+} WBTemplateSlot;
+
+#define kWBTemplateMagic 0x31544257 // 'WBT1' in native byte order
+#define kWBTemplateNone UINT32_MAX
+
+#pragma mark Compiler
+typedef struct _WBTemplateCompiler {
+  NSMutableData *ops, *blocks, *slots, *strings;
+} WBTemplateCompiler;
+
+static
+uint32_t _WBTemplateAddString(WBTemplateCompiler *compiler, NSString *str, uint32_t *length) {
+  const char *utf8 = [str UTF8String] ? : "";
+  size_t len = strlen(utf8);
+  NSUInteger offset = [compiler->strings length];
+  if (len > UINT32_MAX || offset + len > UINT32_MAX)
+    SPXThrowException(NSRangeException, @"template too large");
+  [compiler->strings appendBytes:utf8 length:len];
+  *length = (uint32_t)len;
+  return (uint32_t)offset;
+}
+
+WB_INLINE
+uint32_t _WBTemplateCount(NSData *data, size_t size) {
+  return (uint32_t)([data length] / size);
+}
+
+static
+uint32_t _WBTemplateCompileBlock(WBTemplateCompiler *compiler, WBTemplate *tpl, uint32_t parent, uint32_t index) {
+  uint32_t bidx = _WBTemplateCount(compiler->blocks, sizeof(WBTemplateBlock));
+  WBTemplateBlock block = {
+    .parent = parent, .index = index,
+    .firstOp = _WBTemplateCount(compiler->ops, sizeof(WBTemplateOp)),
+    .firstSlot = _WBTemplateCount(compiler->slots, sizeof(WBTemplateSlot)),
+  };
+  block.name = _WBTemplateAddString(compiler, [tpl name], &block.length);
+
+  NSArray *contents = [tpl wb_contents];
+  NSDictionary *vars = [tpl wb_variables];
+  NSArray *children = [tpl children];
+  NSMutableDictionary *slots = [[NSMutableDictionary alloc] init];
+  /* block ops of each sub-block */
+  NSMutableArray *blocks = [[NSMutableArray alloc] initWithCapacity:[children count]];
+  for (NSUInteger idx = 0; idx < [children count]; idx++)
+    [blocks addObject:[NSMutableIndexSet indexSet]];
+  block.children = (uint32_t)[children count];
+  NSUInteger count = [contents count];
+  for (NSUInteger idx = 0; idx < count; idx++) {
+    NSString *item = [contents objectAtIndex:idx];
+    WBTemplateOp op = { kWBTemplateOpLiteral, 0, 0, 0 };
+    if (idx % 2 == 0) { /* String Value */
+      if (![item length]) continue;
+      op.offset = _WBTemplateAddString(compiler, item, &op.length);
+    } else if ([vars objectForKey:item]) { /* Var */
+      NSNumber *slot = [slots objectForKey:item];
+      if (!slot) {
+        WBTemplateSlot desc = { .block = bidx };
+        desc.name = _WBTemplateAddString(compiler, item, &desc.length);
+        slot = [NSNumber numberWithUnsignedInt:_WBTemplateCount(compiler->slots, sizeof(WBTemplateSlot))];
+        [compiler->slots appendBytes:&desc length:sizeof(desc)];
+        [slots setObject:slot forKey:item];
+      }
+      op.type = kWBTemplateOpVariable;
+      op.value = [slot unsignedIntValue];
+    } else { /* Block: resolved by name, as -[WBTemplate writeBlock:inBuffer:] does */
+      NSUInteger child = [children indexOfObjectIdenticalTo:[tpl blockWithName:item]];
+      /* only the sub-blocks are saved by -dumpBlock */
+      if (NSNotFound == child) continue;
+      op.type = kWBTemplateOpBlock;
+      op.value = kWBTemplateNone; // resolved below
+      [[blocks objectAtIndex:child] addIndex:_WBTemplateCount(compiler->ops, sizeof(WBTemplateOp))];
+    }
+    [compiler->ops appendBytes:&op length:sizeof(op)];
+  }
+  block.opCount = _WBTemplateCount(compiler->ops, sizeof(WBTemplateOp)) - block.firstOp;
+  block.slotCount = _WBTemplateCount(compiler->slots, sizeof(WBTemplateSlot)) - block.firstSlot;
+  [compiler->blocks appendBytes:&block length:sizeof(block)];
+  [slots release];
+
+  /* then the sub-blocks, so blocks are stored in document order (preorder) */
+  for (NSUInteger idx = 0; idx < [blocks count]; idx++) {
+    uint32_t child = _WBTemplateCompileBlock(compiler, [children objectAtIndex:idx], bidx, (uint32_t)idx);
+    WBTemplateOp *ops = [compiler->ops mutableBytes];
+    [[blocks objectAtIndex:idx] enumerateIndexesUsingBlock:^(NSUInteger op, BOOL *stop) {
+      ops[op].value = child;
+    }];
+  }
+  [blocks release];
+  return bidx;
+}
+
+#pragma mark Validation
+/* Do not trust data loaded from disk */
+static
+bool _WBTemplateValidateImage(const uint8_t *bytes, size_t length) {
+  if (length < sizeof(WBTemplateHeader)) return false;
+  const WBTemplateHeader *header = (const WBTemplateHeader *)bytes;
+  if (header->magic != kWBTemplateMagic || header->blocks < 1) return false;
+  uint64_t size = sizeof(WBTemplateHeader) + (uint64_t)header->ops * sizeof(WBTemplateOp) +
+    (uint64_t)header->blocks * sizeof(WBTemplateBlock) + (uint64_t)header->slots * sizeof(WBTemplateSlot) + header->strings;
+  if (size != length) return false;
+
+  const WBTemplateOp *ops = (const WBTemplateOp *)(header + 1);
+  const WBTemplateBlock *blocks = (const WBTemplateBlock *)(ops + header->ops);
+  const WBTemplateSlot *slots = (const WBTemplateSlot *)(blocks + header->blocks);
+  for (uint32_t idx = 0; idx < header->slots; idx++) {
+    if ((uint64_t)slots[idx].name + slots[idx].length > header->strings || slots[idx].block >= header->blocks)
+      return false;
+  }
+  for (uint32_t idx = 0; idx < header->blocks; idx++) {
+    const WBTemplateBlock *block = &blocks[idx];
+    if ((uint64_t)block->name + block->length > header->strings) return false;
+    if ((uint64_t)block->firstOp + block->opCount > header->ops) return false;
+    if ((uint64_t)block->firstSlot + block->slotCount > header->slots) return false;
+    if (idx == 0) {
+      if (block->parent != kWBTemplateNone) return false;
+    } else if (block->parent >= idx || block->index >= blocks[block->parent].children) {
+      return false;
+    }
+    for (uint32_t op = block->firstOp; op < block->firstOp + block->opCount; op++) {
+      switch (ops[op].type) {
+        case kWBTemplateOpLiteral:
+          if ((uint64_t)ops[op].offset + ops[op].length > header->strings) return false;
+          break;
+        case kWBTemplateOpVariable:
+          if (ops[op].value < block->firstSlot || ops[op].value - block->firstSlot >= block->slotCount) return false;
+          break;
+        case kWBTemplateOpBlock:
+          if (ops[op].value >= header->blocks || blocks[ops[op].value].parent != idx) return false;
+          break;
+        default:
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+#pragma mark -
+@implementation WBCompiledTemplate
+
+WB_INLINE
+const WBTemplateBlock *_WBTemplateGetBlock(WBCompiledTemplate *tpl, NSUInteger idx) {
+  return (const WBTemplateBlock *)tpl->wb_blocks + idx;
+}
+
+WB_INLINE
+const WBTemplateOp *_WBTemplateGetOps(WBCompiledTemplate *tpl) {
+  return tpl->wb_ops;
+}
+
+WB_INLINE
+const char *_WBTemplateGetStrings(WBCompiledTemplate *tpl) {
+  return tpl->wb_strings;
+}
+
+- (id)initWithContentsOfFile:(NSString *)aFile encoding:(NSStringEncoding)encoding {
+  WBTemplate *tpl = [[WBTemplate alloc] initWithContentsOfFile:aFile encoding:encoding];
+  self = [self initWithTemplate:tpl];
+  [tpl release];
+  return self;
+}
+
+- (id)initWithTemplate:(WBTemplate *)aTemplate {
+  if (![aTemplate wb_contents] && (![aTemplate load] || ![aTemplate wb_contents])) {
+    [self release];
+    return nil;
+  }
+  WBTemplateCompiler compiler = {
+    [NSMutableData data], [NSMutableData data], [NSMutableData data], [NSMutableData data]
+  };
+  @try {
+    _WBTemplateCompileBlock(&compiler, aTemplate, kWBTemplateNone, 0);
+  } @catch (id exception) {
+    SPXLogException(exception);
+    [self release];
+    return nil;
+  }
+  WBTemplateHeader header = {
+    kWBTemplateMagic,
+    _WBTemplateCount(compiler.ops, sizeof(WBTemplateOp)),
+    _WBTemplateCount(compiler.blocks, sizeof(WBTemplateBlock)),
+    _WBTemplateCount(compiler.slots, sizeof(WBTemplateSlot)),
+    (uint32_t)[compiler.strings length],
+  };
+  NSMutableData *image = [[NSMutableData alloc] initWithBytes:&header length:sizeof(header)];
+  [image appendData:compiler.ops];
+  [image appendData:compiler.blocks];
+  [image appendData:compiler.slots];
+  [image appendData:compiler.strings];
+  self = [self initWithData:image];
+  [image release];
+  return self;
+}
+
+- (id)initWithData:(NSData *)data {
+  if (!_WBTemplateValidateImage([data bytes], [data length])) {
+    [self release];
+    return nil;
+  }
+  if (self = [super init]) {
+    wb_image = [data copy];
+    const WBTemplateHeader *header = [wb_image bytes];
+    wb_opCount = header->ops;
+    wb_blockCount = header->blocks;
+    wb_slotCount = header->slots;
+    wb_ops = header + 1;
+    wb_blocks = (const WBTemplateOp *)wb_ops + wb_opCount;
+    wb_slots = (const WBTemplateBlock *)wb_blocks + wb_blockCount;
+    wb_strings = (const char *)((const WBTemplateSlot *)wb_slots + wb_slotCount);
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [wb_image release];
+  [super dealloc];
+}
+
+- (NSString *)description {
+  return [NSString stringWithFormat:@"<%@ %p> {blocks:%lu slots:%lu ops:%lu}",
+          NSStringFromClass([self class]), self,
+          (unsigned long)wb_blockCount, (unsigned long)wb_slotCount, (unsigned long)wb_opCount];
+}
+
+- (NSData *)dataRepresentation {
+  return wb_image;
+}
+
+#pragma mark -
+- (NSUInteger)numberOfBlocks {
+  return wb_blockCount;
+}
+- (NSUInteger)numberOfSlots {
+  return wb_slotCount;
+}
+
+static
+bool _WBTemplateNameEquals(const char *strings, uint32_t offset, uint32_t length, const char *name, size_t nlength) {
+  return length == nlength && 0 == memcmp(strings + offset, name, nlength);
+}
+
+- (NSUInteger)indexOfBlock:(NSString *)aName {
+  const char *name = [aName UTF8String];
+  if (!name) return NSNotFound;
+  size_t length = strlen(name);
+  for (NSUInteger idx = 0; idx < wb_blockCount; idx++) {
+    const WBTemplateBlock *block = _WBTemplateGetBlock(self, idx);
+    if (_WBTemplateNameEquals(wb_strings, block->name, block->length, name, length))
+      return idx;
+  }
+  return NSNotFound;
+}
+
+- (NSString *)nameOfBlock:(NSUInteger)idx {
+  if (idx >= wb_blockCount) return nil;
+  const WBTemplateBlock *block = _WBTemplateGetBlock(self, idx);
+  return [[[NSString alloc] initWithBytes:wb_strings + block->name length:block->length encoding:NSUTF8StringEncoding] autorelease];
+}
+
+- (NSUInteger)slotForVariable:(NSString *)aKey inBlock:(NSUInteger)idx {
+  const char *name = [aKey UTF8String];
+  if (!name || idx >= wb_blockCount) return NSNotFound;
+  size_t length = strlen(name);
+  const WBTemplateBlock *block = _WBTemplateGetBlock(self, idx);
+  const WBTemplateSlot *slots = wb_slots;
+  for (NSUInteger slot = block->firstSlot; slot < block->firstSlot + block->slotCount; slot++) {
+    if (_WBTemplateNameEquals(wb_strings, slots[slot].name, slots[slot].length, name, length))
+      return slot;
+  }
+  return NSNotFound;
+}
+
+@end
+
+#pragma mark -
+typedef struct _WBTemplateValue {
+  size_t offset; // SIZE_MAX: not set
+  size_t length;
+} WBTemplateValue;
+
+/* a dumped block */
+typedef struct _WBTemplateInstance {
+  size_t block;
+  size_t values; // index in saved values
+  size_t heads; // first dumped instance of each sub-block
+  size_t next; // next instance of the same block
+} WBTemplateInstance;
+
+typedef struct _WBTemplateList {
+  size_t head, tail;
+} WBTemplateList;
+
+#define kWBTemplateNil SIZE_MAX
+
+@implementation WBTemplateRenderer
+
+static
+void *_WBTemplateGrow(void *buffer, size_t *capacity, size_t count, size_t size) {
+  if (count <= *capacity) return buffer;
+  size_t newsize = MAX(*capacity * 2, (size_t)64);
+  while (newsize < count) newsize *= 2;
+  void *result = realloc(buffer, newsize * size);
+  if (!result) SPXThrowException(NSMallocException, @"out of memory");
+  *capacity = newsize;
+  return result;
+}
+
+- (id)initWithTemplate:(WBCompiledTemplate *)aTemplate {
+  NSParameterAssert(aTemplate);
+  if (self = [super init]) {
+    wb_template = [aTemplate retain];
+    wb_values = malloc(MAX([aTemplate numberOfSlots], (NSUInteger)1) * sizeof(WBTemplateValue));
+    wb_pending = malloc([aTemplate numberOfBlocks] * sizeof(WBTemplateList));
+    if (!wb_values || !wb_pending) {
+      [self release];
+      return nil;
+    }
+    [self reset];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  free(wb_pending);
+  free(wb_heads);
+  free(wb_instances);
+  free(wb_saved);
+  free(wb_values);
+  free(wb_arena);
+  [wb_template release];
+  [super dealloc];
+}
+
+- (WBCompiledTemplate *)compiledTemplate {
+  return wb_template;
+}
+
+- (void)reset {
+  WBTemplateValue *values = wb_values;
+  for (NSUInteger idx = 0; idx < [wb_template numberOfSlots]; idx++)
+    values[idx].offset = kWBTemplateNil;
+  WBTemplateList *pending = wb_pending;
+  for (NSUInteger idx = 0; idx < [wb_template numberOfBlocks]; idx++)
+    pending[idx].head = pending[idx].tail = kWBTemplateNil;
+  wb_arenaLength = 0;
+  wb_savedCount = 0;
+  wb_instCount = 0;
+  wb_headCount = 0;
+}
+
+#pragma mark Variables
+- (void)setUTF8Variable:(const char *)aValue length:(NSUInteger)length forSlot:(NSUInteger)slot {
+  if (slot >= [wb_template numberOfSlots])
+    SPXThrowException(NSRangeException, @"invalid slot %lu", (unsigned long)slot);
+  WBTemplateValue *value = (WBTemplateValue *)wb_values + slot;
+  if (!aValue) {
+    value->offset = kWBTemplateNil;
+    return;
+  }
+  wb_arena = _WBTemplateGrow(wb_arena, &wb_arenaSize, wb_arenaLength + length, 1);
+  memcpy(wb_arena + wb_arenaLength, aValue, length);
+  value->offset = wb_arenaLength;
+  value->length = length;
+  wb_arenaLength += length;
+}
+
+- (void)setVariable:(NSString *)aValue forSlot:(NSUInteger)slot {
+  if (!aValue) {
+    [self setUTF8Variable:NULL length:0 forSlot:slot];
+    return;
+  }
+  CFStringRef str = SPXNSToCFString(aValue);
+  const char *cstr = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+  if (cstr) {
+    [self setUTF8Variable:cstr length:strlen(cstr) forSlot:slot];
+    return;
+  }
+  if (slot >= [wb_template numberOfSlots])
+    SPXThrowException(NSRangeException, @"invalid slot %lu", (unsigned long)slot);
+  /* convert straight into the arena */
+  CFIndex length = CFStringGetLength(str);
+  CFIndex max = CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8);
+  wb_arena = _WBTemplateGrow(wb_arena, &wb_arenaSize, wb_arenaLength + max, 1);
+  CFIndex used = 0;
+  CFStringGetBytes(str, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, false, wb_arena + wb_arenaLength, max, &used);
+  WBTemplateValue *value = (WBTemplateValue *)wb_values + slot;
+  value->offset = wb_arenaLength;
+  value->length = used;
+  wb_arenaLength += used;
+}
+
+#pragma mark Blocks
+- (void)dumpBlock:(NSUInteger)idx {
+  if (idx >= [wb_template numberOfBlocks])
+    SPXThrowException(NSRangeException, @"invalid block %lu", (unsigned long)idx);
+  const WBTemplateBlock *block = _WBTemplateGetBlock(wb_template, idx);
+  WBTemplateList *pending = wb_pending;
+
+  wb_saved = _WBTemplateGrow(wb_saved, &wb_savedSize, wb_savedCount + block->slotCount, sizeof(WBTemplateValue));
+  wb_heads = _WBTemplateGrow(wb_heads, &wb_headSize, wb_headCount + block->children, sizeof(size_t));
+  wb_instances = _WBTemplateGrow(wb_instances, &wb_instSize, wb_instCount + 1, sizeof(WBTemplateInstance));
+
+  WBTemplateInstance *inst = (WBTemplateInstance *)wb_instances + wb_instCount;
+  inst->block = idx;
+  inst->values = wb_savedCount;
+  inst->heads = wb_headCount;
+  inst->next = kWBTemplateNil;
+
+  /* save and reset the variables */
+  WBTemplateValue *values = (WBTemplateValue *)wb_values + block->firstSlot;
+  memcpy((WBTemplateValue *)wb_saved + wb_savedCount, values, block->slotCount * sizeof(WBTemplateValue));
+  for (uint32_t slot = 0; slot < block->slotCount; slot++)
+    values[slot].offset = kWBTemplateNil;
+  wb_savedCount += block->slotCount;
+
+  /* take the dumped sub-blocks, whether they are referenced or not (as -[WBTemplate dumpBlock]).
+   The block descendants are contiguous in preorder. */
+  NSUInteger blockCount = [wb_template numberOfBlocks];
+  for (NSUInteger child = idx + 1; child < blockCount && _WBTemplateGetBlock(wb_template, child)->parent >= idx; child++) {
+    const WBTemplateBlock *desc = _WBTemplateGetBlock(wb_template, child);
+    if (desc->parent != idx) continue;
+    wb_heads[wb_headCount + desc->index] = pending[child].head;
+    if (pending[child].head != kWBTemplateNil) {
+      pending[child].head = pending[child].tail = kWBTemplateNil;
+      /* as -[WBTemplate resetBlock], also drop pending blocks of the sub-block children */
+      for (NSUInteger sub = child + 1; sub < blockCount && _WBTemplateGetBlock(wb_template, sub)->parent >= child; sub++)
+        pending[sub].head = pending[sub].tail = kWBTemplateNil;
+    }
+  }
+  wb_headCount += block->children;
+
+  if (pending[idx].tail == kWBTemplateNil)
+    pending[idx].head = wb_instCount;
+  else
+    ((WBTemplateInstance *)wb_instances)[pending[idx].tail].next = wb_instCount;
+  pending[idx].tail = wb_instCount;
+  wb_instCount++;
+}
+
+#pragma mark Output
+static
+void _WBTemplateRenderInstance(WBTemplateRenderer *self, size_t idx, NSMutableData *data) {
+  const WBTemplateInstance *inst = (const WBTemplateInstance *)self->wb_instances + idx;
+  const WBTemplateBlock *block = _WBTemplateGetBlock(self->wb_template, inst->block);
+  const WBTemplateOp *ops = _WBTemplateGetOps(self->wb_template);
+  const char *strings = _WBTemplateGetStrings(self->wb_template);
+  for (uint32_t op = block->firstOp; op < block->firstOp + block->opCount; op++) {
+    switch (ops[op].type) {
+      case kWBTemplateOpLiteral:
+        [data appendBytes:strings + ops[op].offset length:ops[op].length];
+        break;
+      case kWBTemplateOpVariable: {
+        const WBTemplateValue *value = (const WBTemplateValue *)self->wb_saved + inst->values + (ops[op].value - block->firstSlot);
+        if (value->offset != kWBTemplateNil)
+          [data appendBytes:self->wb_arena + value->offset length:value->length];
+      }
+        break;
+      case kWBTemplateOpBlock: {
+        size_t child = self->wb_heads[inst->heads + _WBTemplateGetBlock(self->wb_template, ops[op].value)->index];
+        while (child != kWBTemplateNil) {
+          _WBTemplateRenderInstance(self, child, data);
+          /* instances may not be moved while rendering */
+          child = ((const WBTemplateInstance *)self->wb_instances)[child].next;
+        }
+      }
+        break;
+    }
+  }
+}
+
+- (void)appendToData:(NSMutableData *)data {
+  /* If root then dump */
+  [self dumpBlock:0];
+  size_t inst = ((WBTemplateList *)wb_pending)[0].head;
+  while (inst != kWBTemplateNil) {
+    _WBTemplateRenderInstance(self, inst, data);
+    inst = ((const WBTemplateInstance *)wb_instances)[inst].next;
+  }
+}
+
+- (NSData *)data {
+  NSMutableData *data = [NSMutableData dataWithCapacity:wb_arenaLength + 4096];
+  [self appendToData:data];
+  return data;
+}
+
+- (NSString *)stringRepresentation {
+  return [[[NSString alloc] initWithData:[self data] encoding:NSUTF8StringEncoding] autorelease];
+}
+
+@end
@@ -15,6 +15,14 @@
 
 #import <WonderBox/WBTreeNode.h>
 
+@class WBTemplateParser;
+
+/* called concurrently from many threads: fill values (in keys order) for the given row. */
+typedef void (*WBTemplateRowProvider)(NSUInteger row, NSString **values, void *ctxt);
+
+/* must write all bytes, and return -1 on error */
+typedef intptr_t (*WBTemplateOutputFunction)(const void *bytes, size_t length, void *ctxt);
+
 /*!
     @class
     @abstract    (brief description)
@@ -56,6 +64,18 @@ WB_OBJC_EXPORT
 - (NSString *)variableForKey:(NSString *)aKey;
 - (void)setVariable:(NSString *)aValue forKey:(NSString *)aKey;
 
+/*!
+    @method     dumpRows:
+    @abstract   Batch version of -setVariable:forKey: / -dumpBlock.
+    @discussion Rows are rendered concurrently, and the result is stored as a single dumped item.
+    Each row is a dictionary of variables. Sub-blocks may be given using the @"_Blocks_" key
+    (a dictionary of block name to array of rows).
+    An exception raised while rendering a row is raised again on the calling thread, and nothing is dumped.
+*/
+- (void)dumpRows:(NSArray *)rows;
+/* provider variant: no dictionary per row. Sub-blocks are not supported. */
+- (void)dumpRows:(NSUInteger)count keys:(NSArray *)keys provider:(WBTemplateRowProvider)provider context:(void *)ctxt;
+
 - (BOOL)removeBlockLine;
 - (void)setRemoveBlockLine:(BOOL)flags;
 
@@ -63,8 +83,16 @@ WB_OBJC_EXPORT
 - (BOOL)writeToFile:(NSString *)file atomically:(BOOL)flag andReset:(BOOL)reset;
 - (BOOL)writeToURL:(NSURL *)Url atomically:(BOOL)flag andReset:(BOOL)reset;
 
+/* Streaming output: the document is converted to the template encoding and written block by block
+ through a bounded buffer, so memory usage does not depend on the output size. */
+- (BOOL)writeToFileDescriptor:(int)fd andReset:(BOOL)reset;
+- (BOOL)writeToStream:(CFWriteStreamRef)aStream andReset:(BOOL)reset;
+- (BOOL)writeUsingFunction:(WBTemplateOutputFunction)function context:(void *)ctxt andReset:(BOOL)reset;
+
 - (BOOL)load;
 - (BOOL)loadFile:(NSString *)aFile;
+/* called before parsing. Subclasses can set parser options. */
+- (void)configureParser:(WBTemplateParser *)parser;
 
 - (NSArray *)allKeys;
 - (NSArray *)allBlocks;
@@ -11,8 +11,87 @@
 #import <WonderBox/WBTemplate.h>
 #import <WonderBox/WBTemplateParser.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #define _WBTemplateNullPlaceholder (__bridge id)kCFNull
 
+#pragma mark Output Buffer
+#define kWBTemplateOutputBufferSize (64 * 1024)
+
+typedef struct _WBTemplateOutput {
+  CFIndex length;
+  CFStringEncoding encoding;
+  bool external; // BOM not written yet
+  bool error;
+  WBTemplateOutputFunction function;
+  void *ctxt;
+  UInt8 buffer[kWBTemplateOutputBufferSize];
+} WBTemplateOutput;
+
+static
+bool _WBTemplateOutputFlush(WBTemplateOutput *output) {
+  if (output->error) return false;
+  if (output->length > 0 && output->function(output->buffer, output->length, output->ctxt) < 0)
+    output->error = true;
+  output->length = 0;
+  return !output->error;
+}
+
+/* convert the string straight into the output buffer */
+static
+bool _WBTemplateOutputAppend(WBTemplateOutput *output, CFStringRef str) {
+  CFIndex length = CFStringGetLength(str);
+  CFIndex idx = 0;
+  while (idx < length && !output->error) {
+    /* enough room for any character and a BOM */
+    if (kWBTemplateOutputBufferSize - output->length < 16 && !_WBTemplateOutputFlush(output))
+      return false;
+    CFIndex used = 0;
+    CFIndex count = CFStringGetBytes(str, CFRangeMake(idx, length - idx), output->encoding, 0, output->external,
+                                     output->buffer + output->length, kWBTemplateOutputBufferSize - output->length, &used);
+    if (count <= 0) {
+      /* the buffer is not full: character not representable in this encoding */
+      output->error = true;
+      return false;
+    }
+    output->external = false;
+    output->length += used;
+    idx += count;
+  }
+  return !output->error;
+}
+
+static
+intptr_t _WBTemplateFileDescriptorOutput(const void *bytes, size_t length, void *ctxt) {
+  const UInt8 *cursor = bytes;
+  size_t left = length;
+  while (left > 0) {
+    ssize_t count = write((int)(intptr_t)ctxt, cursor, left);
+    if (count < 0) {
+      if (EINTR == errno) continue;
+      return -1;
+    }
+    cursor += count;
+    left -= count;
+  }
+  return (intptr_t)length;
+}
+
+static
+intptr_t _WBTemplateWriteStreamOutput(const void *bytes, size_t length, void *ctxt) {
+  const UInt8 *cursor = bytes;
+  size_t left = length;
+  while (left > 0) {
+    CFIndex count = CFWriteStreamWrite((CFWriteStreamRef)ctxt, cursor, (CFIndex)MIN(left, (size_t)LONG_MAX));
+    if (count <= 0) return -1;
+    cursor += count;
+    left -= count;
+  }
+  return (intptr_t)length;
+}
+
 @interface WBTemplate ()
 
 - (id)initBlockWithName:(NSString *)name;
@@ -161,6 +240,124 @@
   [self resetVariables];
 }
 
+#pragma mark Batch
+/* Rows are split in chunks rendered concurrently in their own buffer, then spliced in order.
+ An exception cannot leave a dispatch_apply worker: it is raised again on the calling thread. */
+- (void)dumpRowsCount:(NSUInteger)count usingBlock:(void (^)(NSUInteger row, NSMutableString *buffer))render {
+  if (count == 0) return;
+  NSUInteger chunks = MIN(count, [[NSProcessInfo processInfo] activeProcessorCount] * 4);
+  NSUInteger size = (count + chunks - 1) / chunks;
+  chunks = (count + size - 1) / size;
+  NSMutableString **buffers = calloc(chunks, sizeof(*buffers));
+  id *exceptions = calloc(chunks, sizeof(*exceptions));
+  if (!buffers || !exceptions) {
+    free(exceptions);
+    free(buffers);
+    SPXThrowException(NSMallocException, @"out of memory");
+  }
+
+  dispatch_apply(chunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk) {
+    @autoreleasepool {
+      NSMutableString *buffer = [[NSMutableString alloc] init];
+      NSUInteger end = MIN(count, (chunk + 1) * size);
+      @try {
+        for (NSUInteger row = chunk * size; row < end; row++)
+          render(row, buffer);
+      } @catch (id exception) {
+        /* must outlive the pool */
+        exceptions[chunk] = [exception retain];
+      }
+      buffers[chunk] = buffer;
+    }
+  });
+
+  /* first failing row */
+  id exception = nil;
+  for (NSUInteger idx = 0; idx < chunks; idx++) {
+    if (!exception)
+      exception = [exceptions[idx] autorelease];
+    else
+      [exceptions[idx] release];
+  }
+  free(exceptions);
+  if (exception) {
+    for (NSUInteger idx = 0; idx < chunks; idx++)
+      [buffers[idx] release];
+    free(buffers);
+    @throw exception;
+  }
+
+  NSMutableString *result = buffers[0];
+  for (NSUInteger idx = 1; idx < chunks; idx++) {
+    [result appendString:buffers[idx]];
+    [buffers[idx] release];
+  }
+  [wb_blocks addObject:result];
+  [result release];
+  free(buffers);
+}
+
+- (void)dumpRows:(NSArray *)rows {
+  if (!wb_contents) {
+    [self load];
+  }
+  /* resolve variables and blocks once */
+  NSUInteger count = [wb_contents count];
+  __unsafe_unretained WBTemplate **blocks = (__unsafe_unretained WBTemplate **)calloc(count, sizeof(*blocks));
+  for (NSUInteger idx = 1; idx < count; idx += 2) {
+    NSString *var = [wb_contents objectAtIndex:idx];
+    if (![wb_vars objectForKey:var])
+      blocks[idx] = [self blockWithName:var];
+  }
+  @try {
+    [self dumpRowsCount:[rows count] usingBlock:^(NSUInteger row, NSMutableString *buffer) {
+      NSDictionary *item = [rows objectAtIndex:row];
+      for (NSUInteger idx = 0; idx < count; idx++) {
+        NSString *var = [wb_contents objectAtIndex:idx];
+        if (idx % 2 == 0) {
+          [buffer appendString:var];
+        } else if (blocks[idx]) {
+          for (NSDictionary *sub in [[item objectForKey:@"_Blocks_"] objectForKey:[blocks[idx] name]])
+            [blocks[idx] writeBlock:sub inBuffer:buffer];
+        } else {
+          id string = [item objectForKey:var];
+          if (string && string != _WBTemplateNullPlaceholder)
+            [buffer appendString:string];
+        }
+      }
+    }];
+  } @finally {
+    free(blocks);
+  }
+}
+
+- (void)dumpRows:(NSUInteger)rows keys:(NSArray *)keys provider:(WBTemplateRowProvider)provider context:(void *)ctxt {
+  NSParameterAssert(provider);
+  if (!wb_contents) {
+    [self load];
+  }
+  /* map each variable to its index in keys */
+  NSUInteger count = [wb_contents count], nkeys = [keys count];
+  NSUInteger *slots = malloc(count * sizeof(*slots));
+  for (NSUInteger idx = 0; idx < count; idx++)
+    slots[idx] = (idx % 2) ? [keys indexOfObject:[wb_contents objectAtIndex:idx]] : NSNotFound;
+  @try {
+    [self dumpRowsCount:rows usingBlock:^(NSUInteger row, NSMutableString *buffer) {
+      __unsafe_unretained NSString *values[nkeys ? : 1];
+      memset(values, 0, sizeof(values));
+      provider(row, values, ctxt);
+      for (NSUInteger idx = 0; idx < count; idx++) {
+        if (idx % 2 == 0)
+          [buffer appendString:[wb_contents objectAtIndex:idx]];
+        else if (slots[idx] != NSNotFound && values[slots[idx]])
+          [buffer appendString:values[slots[idx]]];
+      }
+    }];
+  } @finally {
+    free(slots);
+  }
+}
+
 #pragma mark -
 #pragma mark Reset
 - (void)reset {
@@ -207,6 +404,10 @@
   return [self loadFile:wb_name];
 }
 
+- (void)configureParser:(WBTemplateParser *)parser {
+  /* subclass hook */
+}
+
 - (BOOL)loadFile:(NSString *)aFile {
   [self clear];
   BOOL result = NO;
@@ -214,6 +415,7 @@
     [self wb_init];
 
     WBTemplateParser *parser = [[WBTemplateParser alloc] initWithFile:aFile encoding:wb_encoding];
+    [self configureParser:parser];
     [parser setDelegate:self];
     @try {
       result = [parser parse];
@@ -279,6 +481,11 @@
 
 #pragma mark Output
 - (void)writeBlock:(NSDictionary *)block inBuffer:(NSMutableString *)buffer {
+  /* rows rendered by -dumpRows: */
+  if ([block isKindOfClass:[NSString class]]) {
+    [buffer appendString:(NSString *)block];
+    return;
+  }
   NSUInteger count = [wb_contents count];
   for (NSUInteger idx = 0; idx < count; idx++) {
     NSString *var = [wb_contents objectAtIndex:idx];
@@ -315,20 +522,134 @@
 }
 
 - (BOOL)writeToFile:(NSString *)file atomically:(BOOL)flag andReset:(BOOL)reset {
-  @autoreleasepool {
-    NSString *result = [self stringRepresentation];
-
-    BOOL ok = [result writeToFile:file atomically:flag encoding:wb_encoding error:nil];
+  if (!file) {
     if (reset)
       [self reset];
-    return ok;
+    return NO;
   }
+  int fd;
+  char *tmp = NULL;
+  const char *path = [file fileSystemRepresentation];
+  if (flag) {
+    /* write in a temporary file in the same directory, then rename it.
+     mkstemp() creates a 0600 file: create it with open() so a new file gets the process umask applied. */
+    struct stat st;
+    bool exists = 0 == stat(path, &st);
+    fd = -1;
+    for (int retry = 0; fd < 0 && retry < 16; retry++) {
+      free(tmp);
+      if (asprintf(&tmp, "%s.%08x", path, arc4random()) < 0) {
+        tmp = NULL;
+        break;
+      }
+      fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, exists ? st.st_mode & 07777 : 0666);
+      if (fd < 0 && EEXIST != errno)
+        break;
+    }
+    /* keep the mode of the replaced file */
+    if (fd >= 0 && exists)
+      fchmod(fd, st.st_mode & 07777);
+  } else {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  }
+  if (fd < 0) {
+    free(tmp);
+    if (reset)
+      [self reset];
+    return NO;
+  }
+  BOOL ok = [self writeToFileDescriptor:fd andReset:reset];
+  if (ok && flag && fsync(fd) < 0)
+    ok = NO;
+  if (close(fd) < 0)
+    ok = NO;
+  if (tmp) {
+    if (!ok || rename(tmp, path) < 0) {
+      unlink(tmp);
+      ok = NO;
+    }
+    free(tmp);
+  }
+  return ok;
 }
 
 - (BOOL)writeToURL:(NSURL *)url atomically:(BOOL)flag andReset:(BOOL)reset {
   return [self writeToFile:url.path atomically:flag andReset:reset];
 }
 
+#pragma mark Streaming
+- (BOOL)writeBlock:(NSDictionary *)block toOutput:(WBTemplateOutput *)output {
+  /* rows rendered by -dumpRows: */
+  if ([block isKindOfClass:[NSString class]])
+    return _WBTemplateOutputAppend(output, SPXNSToCFString((NSString *)block));
+  NSUInteger count = [wb_contents count];
+  for (NSUInteger idx = 0; idx < count && !output->error; idx++) {
+    NSString *var = [wb_contents objectAtIndex:idx];
+    if (idx % 2) {  /* Var or Block */
+      id string = [block objectForKey:var];
+      if (string) { /* string is a variable */
+        if (string != _WBTemplateNullPlaceholder)
+          _WBTemplateOutputAppend(output, SPXNSToCFString(string));
+      } else { /* string is a block */
+        WBTemplate *child = [self blockWithName:var];
+        if (child) {
+          for (NSDictionary *item in [[block objectForKey:@"_Blocks_"] objectForKey:[child name]]) {
+            @autoreleasepool {
+              if (![child writeBlock:item toOutput:output])
+                break;
+            }
+          }
+        }
+      }
+    } else { /* String Value */
+      _WBTemplateOutputAppend(output, SPXNSToCFString(var));
+    }
+  }
+  return !output->error;
+}
+
+- (BOOL)writeUsingFunction:(WBTemplateOutputFunction)function context:(void *)ctxt andReset:(BOOL)reset {
+  NSParameterAssert(function);
+  CFStringEncoding encoding = CFStringConvertNSStringEncodingToEncoding(wb_encoding);
+  WBTemplateOutput *output = malloc(sizeof(*output));
+  if (!output || kCFStringEncodingInvalidId == encoding) {
+    free(output);
+    if (reset)
+      [self reset];
+    return NO;
+  }
+  output->length = 0;
+  output->encoding = encoding;
+  /* as -[NSString writeToFile:atomically:encoding:error:], only UTF-16 and UTF-32 get a BOM */
+  output->external = kCFStringEncodingUnicode == encoding || kCFStringEncodingUTF32 == encoding;
+  output->error = false;
+  output->function = function;
+  output->ctxt = ctxt;
+
+  if (![self isBlock]) /* If root then dump */
+    [self dumpBlock];
+  NSUInteger count = [wb_blocks count];
+  for (NSUInteger idx = 0; idx < count; idx++) {
+    @autoreleasepool {
+      if (![self writeBlock:[wb_blocks objectAtIndex:idx] toOutput:output])
+        break;
+    }
+  }
+  BOOL ok = _WBTemplateOutputFlush(output);
+  free(output);
+  if (reset)
+    [self reset];
+  return ok;
+}
+
+- (BOOL)writeToFileDescriptor:(int)fd andReset:(BOOL)reset {
+  return [self writeUsingFunction:_WBTemplateFileDescriptorOutput context:(void *)(intptr_t)fd andReset:reset];
+}
+
+- (BOOL)writeToStream:(CFWriteStreamRef)aStream andReset:(BOOL)reset {
+  return [self writeUsingFunction:_WBTemplateWriteStreamOutput context:(void *)aStream andReset:reset];
+}
+
 #pragma mark -
 #pragma mark Parser Delegate
 - (void)templateParser:(WBTemplateParser *)parser foundCharacters:(NSString *)aString {
@@ -361,3 +682,16 @@
 }
 
 @end
+
+#pragma mark -
+@implementation WBTemplate (WBCompiledTemplate)
+
+/* used by WBCompiledTemplate */
+- (NSArray *)wb_contents {
+  return wb_contents;
+}
+- (NSDictionary *)wb_variables {
+  return wb_vars;
+}
+
+@end
@@ -20,6 +20,12 @@ WB_OBJC_EXPORT
   NSUInteger wb_blocks;
   NSUInteger wb_position;
   NSStringEncoding wb_encoding;
+  const uint8_t *wb_bytes;
+  struct _wb_tplexer {
+    unsigned int blockComments:1;
+    unsigned int afterBlock:1; // skip the comment end
+    unsigned int:6;
+  } wb_lexer;
   struct wb_tpimp {
     unsigned int foundChars:1;
     unsigned int foundVar:1;
@@ -28,7 +34,9 @@ WB_OBJC_EXPORT
     unsigned int startTemplate:1;
     unsigned int endTemplate:1;
     unsigned int warning:1;
-    unsigned int:1;
+    unsigned int foundCharsRange:1;
+    unsigned int foundVarRange:1;
+    unsigned int:7;
   } tpimp;
 }
 
@@ -44,6 +52,15 @@ WB_OBJC_EXPORT
 - (NSStringEncoding)encoding;
 - (void)setStringEncoding:(NSStringEncoding)encoding;
 
+/* XML templates: block markers are wrapped in comments (<!-- @Start:row! -->).
+ If set, the comment start that precedes a block marker, and the comment end that follows it are dropped. */
+- (BOOL)skipsBlockComments;
+- (void)setSkipsBlockComments:(BOOL)flag;
+
+/* UTF-8 and ASCII templates are mapped and scanned as bytes.
+ While parsing such template, returns the file content (else NULL). */
+- (const char *)bytes;
+
 @end
 
 extern BOOL WBTemplateLogWarning;
@@ -66,6 +83,11 @@ extern BOOL WBTemplateLogMessage;
 - (void)templateParser:(WBTemplateParser *)parser didStartBlock:(NSString *)blockName;
 - (void)templateParserDidEndBlock:(WBTemplateParser *)parser;
 
+/* If implemented, used instead of the string variants when the template is scanned as bytes.
+ Ranges are byte ranges in -[WBTemplateParser bytes]. */
+- (void)templateParser:(WBTemplateParser *)parser foundCharactersInRange:(NSRange)aRange;
+- (void)templateParser:(WBTemplateParser *)parser foundVariableInRange:(NSRange)aRange;
+
 - (void)templateParser:(WBTemplateParser *)parser warningOccured:(NSString *)warning;
 
 @end
@@ -10,12 +10,87 @@
 
 #import <WonderBox/WBTemplateParser.h>
 
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  #include <arm_neon.h>
+#endif
+
 BOOL WBTemplateLogWarning = NO;
 BOOL WBTemplateLogMessage = NO;
 
 #define _WBTemplateLogWarning(msg, ...)				({ if (WBTemplateLogWarning) [self logWarning:msg ,##__VA_ARGS__]; })
 #define _WBTemplateLogMessage(msg, indt, ...)		({ if (WBTemplateLogMessage) [self logMessage:msg indent:indt ,##__VA_ARGS__]; })
 
+#pragma mark Byte Scanner
+/* length of the kCFCharacterSetWhitespaceAndNewline character at str (UTF-8), or 0 */
+static
+size_t _WBTemplateWhitespaceLength(const uint8_t *str, const uint8_t *end) {
+  switch (str[0]) {
+    case ' ': case '\t': case '\n': case '\v': case '\f': case '\r':
+      return 1;
+    case 0xc2: // U+0085, U+00A0
+      if (end - str >= 2 && (0x85 == str[1] || 0xa0 == str[1])) return 2;
+      break;
+    case 0xe1: // U+1680
+      if (end - str >= 3 && 0x9a == str[1] && 0x80 == str[2]) return 3;
+      break;
+    case 0xe2: // U+2000-U+200A, U+2028, U+2029, U+202F, U+205F
+      if (end - str >= 3) {
+        if (0x80 == str[1] && (str[2] <= 0x8a || 0xa8 == str[2] || 0xa9 == str[2] || 0xaf == str[2])) return 3;
+        if (0x81 == str[1] && 0x9f == str[2]) return 3;
+      }
+      break;
+    case 0xe3: // U+3000
+      if (end - str >= 3 && 0x80 == str[1] && 0x80 == str[2]) return 3;
+      break;
+  }
+  return 0;
+}
+
+WB_INLINE
+bool _WBTemplateIsNameEnd(const uint8_t *str, const uint8_t *end) {
+  return '!' == *str || _WBTemplateWhitespaceLength(str, end) > 0;
+}
+
+/* Returns the first '!' or white space in [str, end), or end */
+static
+const uint8_t *_WBTemplateFindNameEnd(const uint8_t *str, const uint8_t *end) {
+#if defined(__SSE2__)
+  /* signed compare: catches controls, space, '!' and non ASCII bytes */
+  const __m128i limit = _mm_set1_epi8('"');
+  while (end - str >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)str);
+    int mask = _mm_movemask_epi8(_mm_cmplt_epi8(v, limit));
+    while (mask) {
+      const uint8_t *candidate = str + __builtin_ctz(mask);
+      if (_WBTemplateIsNameEnd(candidate, end))
+        return candidate;
+      mask &= mask - 1;
+    }
+    str += 16;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t space = vdupq_n_u8(' '), ascii = vdupq_n_u8(0x80), bang = vdupq_n_u8('!');
+  while (end - str >= 16) {
+    uint8x16_t v = vld1q_u8(str);
+    uint8x16_t m = vorrq_u8(vorrq_u8(vcleq_u8(v, space), vcgeq_u8(v, ascii)), vceqq_u8(v, bang));
+    if (vmaxvq_u8(m)) {
+      for (const uint8_t *candidate = str; candidate < str + 16; candidate++) {
+        if (_WBTemplateIsNameEnd(candidate, end))
+          return candidate;
+      }
+    }
+    str += 16;
+  }
+#endif
+  for (; str < end; str++) {
+    if (_WBTemplateIsNameEnd(str, end))
+      return str;
+  }
+  return end;
+}
+
 #pragma mark -
 @implementation WBTemplateParser
 
@@ -46,6 +121,8 @@ BOOL WBTemplateLogMessage = NO;
     tpimp.startTemplate = [wb_delegate respondsToSelector:@selector(templateParser:didStartTemplate:)] ? 1 : 0;
     tpimp.endTemplate = [wb_delegate respondsToSelector:@selector(templateParser:didEndTemplate:)] ? 1 : 0;
     tpimp.warning  = [wb_delegate respondsToSelector:@selector(templateParser:warningOccured:)] ? 1 : 0;
+    tpimp.foundCharsRange = [wb_delegate respondsToSelector:@selector(templateParser:foundCharactersInRange:)] ? 1 : 0;
+    tpimp.foundVarRange = [wb_delegate respondsToSelector:@selector(templateParser:foundVariableInRange:)] ? 1 : 0;
   } else {
     memset(&tpimp, 0, sizeof(tpimp));
   }
@@ -65,10 +142,73 @@ BOOL WBTemplateLogMessage = NO;
   wb_encoding = encoding;
 }
 
+- (const char *)bytes {
+  return (const char *)wb_bytes;
+}
+
+- (BOOL)skipsBlockComments {
+  return wb_lexer.blockComments;
+}
+- (void)setSkipsBlockComments:(BOOL)flag {
+  SPXFlagSet(wb_lexer.blockComments, flag);
+}
+
 #pragma mark -
+#pragma mark Comments
+/* Comments are searched forward in the text between two markers only, so the template is still scanned once */
+static
+NSRange _WBTemplateTrimStringComments(CFStringRef str, NSRange range, bool after, bool before) {
+  CFRange found;
+  if (after && CFStringFindWithOptions(str, CFSTR("-->"), CFRangeMake(range.location, range.length), kCFCompareLiteral, &found)) {
+    NSUInteger end = NSMaxRange(range);
+    range.location = found.location + found.length;
+    range.length = end - range.location;
+  }
+  if (before) {
+    NSUInteger start = range.location, end = NSMaxRange(range);
+    while (start < end && CFStringFindWithOptions(str, CFSTR("<!--"), CFRangeMake(start, end - start), kCFCompareLiteral, &found)) {
+      range.length = found.location - range.location;
+      start = found.location + found.length;
+    }
+  }
+  return range;
+}
+
+static
+NSRange _WBTemplateTrimBytesComments(const uint8_t *bytes, NSRange range, bool after, bool before) {
+  const uint8_t *start = bytes + range.location, *end = bytes + NSMaxRange(range);
+  if (after) {
+    const uint8_t *close = memmem(start, end - start, "-->", 3);
+    if (close)
+      start = close + 3;
+  }
+  if (before) {
+    const uint8_t *cursor = start, *open, *last = NULL;
+    while (cursor < end && (open = memmem(cursor, end - cursor, "<!--", 4))) {
+      last = open;
+      cursor = open + 4;
+    }
+    if (last)
+      end = last;
+  }
+  return NSMakeRange(start - bytes, end - start);
+}
+
 - (void)foundVariable:(CFStringRef)theVariable inString:(NSString *)theString atRange:(NSRange)aRange {
+  NSRange chars = NSMakeRange(wb_position, aRange.location - wb_position);
+  if (wb_lexer.blockComments) {
+    bool block = false;
+    if (theVariable) {
+      if (CFStringHasPrefix(theVariable, CFSTR("Start:")))
+        block = CFStringGetLength(theVariable) > 6;
+      else if (CFEqual(theVariable, CFSTR("End")))
+        block = wb_blocks > 0;
+    }
+    chars = _WBTemplateTrimStringComments(SPXNSToCFString(theString), chars, wb_lexer.afterBlock, block);
+    SPXFlagSet(wb_lexer.afterBlock, block);
+  }
   if (tpimp.foundChars) {
-    CFStringRef sub = CFStringCreateWithSubstring(kCFAllocatorDefault, SPXNSToCFString(theString), CFRangeMake(wb_position, aRange.location - wb_position));
+    CFStringRef sub = CFStringCreateWithSubstring(kCFAllocatorDefault, SPXNSToCFString(theString), CFRangeMake(chars.location, chars.length));
     if (sub) {
       [wb_delegate templateParser:self foundCharacters:SPXCFToNSString(sub)];
       CFRelease(sub);
@@ -112,12 +252,50 @@ BOOL WBTemplateLogMessage = NO;
   }
 }
 
+- (void)didStartTemplate {
+  _WBTemplateLogMessage(@"Start File: %@", wb_blocks, wb_file);
+  if (tpimp.startTemplate)
+    [wb_delegate templateParser:self didStartTemplate:wb_file];
+}
+
+- (void)didEndTemplate {
+  if (wb_blocks) {
+    _WBTemplateLogWarning(@"WARNING: %u blocks unclosed.", wb_blocks);
+    if (tpimp.warning)
+      [wb_delegate templateParser:self warningOccured:[NSString stringWithFormat:@"%lu blocks unclosed.", (unsigned long)wb_blocks]];
+
+    while (wb_blocks > 0) {
+      if (tpimp.endBlock)
+        [wb_delegate templateParserDidEndBlock:self];
+      wb_blocks--;
+    }
+  }
+  _WBTemplateLogMessage(@"End File: %@", wb_blocks, wb_file);
+  if (tpimp.endTemplate)
+    [wb_delegate templateParser:self didEndTemplate:wb_file];
+}
+
 - (BOOL)parse {
   if (!wb_file)
 		SPXThrowException(NSInternalInconsistencyException, @"A file must be set before parsing.");
 
   wb_blocks = 0;
   wb_position = 0;
+  wb_lexer.afterBlock = 0;
+
+  if (NSUTF8StringEncoding == wb_encoding || NSASCIIStringEncoding == wb_encoding) {
+    NSData *data = [[NSData alloc] initWithContentsOfFile:wb_file options:NSDataReadingMappedAlways error:NULL];
+    if (!data)
+      return NO;
+    BOOL result = NO;
+    @try {
+      result = [self parseBytes:[data bytes] length:[data length]];
+    } @finally {
+      wb_bytes = NULL;
+      [data release];
+    }
+    return result;
+  }
 
   CFStringRef str = SPXCFStringBridgingRetain(([[NSString alloc] initWithContentsOfFile:wb_file encoding:wb_encoding error:nil]));
 
@@ -127,9 +305,7 @@ BOOL WBTemplateLogMessage = NO;
   CFStringInlineBuffer inlineBuffer;
   CFIndex length = CFStringGetLength(str);
 
-  _WBTemplateLogMessage(@"Start File: %@", wb_blocks, wb_file);
-  if (tpimp.startTemplate)
-    [wb_delegate templateParser:self didStartTemplate:wb_file];
+  [self didStartTemplate];
 
   CFMutableCharacterSetRef charSet = CFCharacterSetCreateMutableCopy(kCFAllocatorDefault,
                                                                      CFCharacterSetGetPredefined(kCFCharacterSetWhitespaceAndNewline));
@@ -177,24 +353,125 @@ BOOL WBTemplateLogMessage = NO;
   CFRelease(varEndChars);
   CFRelease(str);
 
-  if (wb_blocks) {
-    _WBTemplateLogWarning(@"WARNING: %u blocks unclosed.", wb_blocks);
-    if (tpimp.warning)
-      [wb_delegate templateParser:self warningOccured:[NSString stringWithFormat:@"%lu blocks unclosed.", (unsigned long)wb_blocks]];
+  [self didEndTemplate];
 
-    while (wb_blocks > 0) {
+  return YES;
+}
+
+#pragma mark Bytes
+- (CFStringRef)copyStringInRange:(NSRange)aRange CF_RETURNS_RETAINED {
+  return CFStringCreateWithBytes(kCFAllocatorDefault, wb_bytes + aRange.location, aRange.length,
+                                 CFStringConvertNSStringEncodingToEncoding(wb_encoding), false);
+}
+
+/* Same as foundVariable:inString:atRange: using byte ranges. Returns NO if the content is not valid. */
+- (BOOL)foundVariableInRange:(NSRange)aVar atRange:(NSRange)aRange {
+  NSRange chars = NSMakeRange(wb_position, aRange.location - wb_position);
+  if (wb_lexer.blockComments) {
+    bool block = false;
+    if (aVar.location != NSNotFound) {
+      if (aVar.length >= 6 && 0 == memcmp(wb_bytes + aVar.location, "Start:", 6))
+        block = aVar.length > 6;
+      else if (aVar.length == 3 && 0 == memcmp(wb_bytes + aVar.location, "End", 3))
+        block = wb_blocks > 0;
+    }
+    chars = _WBTemplateTrimBytesComments(wb_bytes, chars, wb_lexer.afterBlock, block);
+    SPXFlagSet(wb_lexer.afterBlock, block);
+  }
+  if (tpimp.foundCharsRange) {
+    [wb_delegate templateParser:self foundCharactersInRange:chars];
+  } else if (tpimp.foundChars) {
+    CFStringRef sub = [self copyStringInRange:chars];
+    if (!sub) return NO;
+    [wb_delegate templateParser:self foundCharacters:SPXCFToNSString(sub)];
+    CFRelease(sub);
+  }
+  wb_position = NSMaxRange(aRange);
+
+  if (aVar.location == NSNotFound)
+    return YES;
+
+  const uint8_t *var = wb_bytes + aVar.location;
+  if (aVar.length >= 6 && 0 == memcmp(var, "Start:", 6)) {
+    CFStringRef name = aVar.length > 6 ? [self copyStringInRange:NSMakeRange(aVar.location + 6, aVar.length - 6)] : NULL;
+    if (name) {
+      _WBTemplateLogMessage(@"Start Block: %@", wb_blocks, name);
+      wb_blocks++;
+      if (tpimp.startBlock)
+        [wb_delegate templateParser:self didStartBlock:SPXCFToNSString(name)];
+      CFRelease(name);
+    } else {
+      CFStringRef invalid = [self copyStringInRange:aVar];
+      if (!invalid) return NO;
+      _WBTemplateLogWarning(@"WARNING: Invalid Block: %@", invalid);
+      if (tpimp.warning)
+        [wb_delegate templateParser:self warningOccured:[NSString stringWithFormat:@"Invalid Block: %@", invalid]];
+      CFRelease(invalid);
+    }
+  } else if (aVar.length == 3 && 0 == memcmp(var, "End", 3)) {
+    if (wb_blocks > 0) {
+      wb_blocks--;
+      _WBTemplateLogMessage(@"End Block", wb_blocks);
       if (tpimp.endBlock)
         [wb_delegate templateParserDidEndBlock:self];
-      wb_blocks--;
+    } else {
+      _WBTemplateLogWarning(@"WARNING: @End tag encounter but all blocks already closed.");
+      if (tpimp.warning)
+        [wb_delegate templateParser:self warningOccured:@"@End tag encounter but all blocks already closed."];
     }
+  } else if (tpimp.foundVarRange) {
+    [wb_delegate templateParser:self foundVariableInRange:aVar];
+  } else if (tpimp.foundVar || WBTemplateLogMessage) {
+    CFStringRef name = [self copyStringInRange:aVar];
+    if (!name) return NO;
+    _WBTemplateLogMessage(@"Variable: %@", wb_blocks, name);
+    if (tpimp.foundVar)
+      [wb_delegate templateParser:self foundVariable:SPXCFToNSString(name)];
+    CFRelease(name);
   }
-  _WBTemplateLogMessage(@"End File: %@", wb_blocks, wb_file);
-  if (tpimp.endTemplate)
-    [wb_delegate templateParser:self didEndTemplate:wb_file];
-
   return YES;
 }
 
+/* Jump from '@' to '@' using memchr(), and find the name end using a vector scan */
+- (BOOL)parseBytes:(const void *)bytes length:(NSUInteger)length {
+  wb_bytes = bytes;
+  const uint8_t *cursor = wb_bytes, *end = wb_bytes + length;
+  /* skip BOM */
+  if (NSUTF8StringEncoding == wb_encoding && length >= 3 && 0 == memcmp(cursor, "\xef\xbb\xbf", 3))
+    cursor += 3;
+  wb_position = cursor - wb_bytes;
+
+  [self didStartTemplate];
+
+  BOOL ok = YES;
+  while (ok && cursor < end) {
+    const uint8_t *at = memchr(cursor, '@', end - cursor);
+    if (!at) break;
+    const uint8_t *stop = _WBTemplateFindNameEnd(at + 1, end);
+    if (stop == end) break;
+    if ('!' == *stop) {
+      if (stop > at + 1)
+        ok = [self foundVariableInRange:NSMakeRange(at + 1 - wb_bytes, stop - at - 1)
+                                atRange:NSMakeRange(at - wb_bytes, stop - at + 1)];
+      cursor = stop + 1;
+    } else {
+#if defined(DEBUG)
+      if (stop > at + 1)
+        NSLog(@"Ignore: %.*s", (int)(stop - at), at);
+#endif
+      cursor = at + 1;
+    }
+  }
+  /* Send characters between last var and end of file */
+  if (ok)
+    ok = [self foundVariableInRange:NSMakeRange(NSNotFound, 0) atRange:NSMakeRange(length, 0)];
+
+  [self didEndTemplate];
+
+  wb_bytes = NULL;
+  return ok;
+}
+
 #pragma mark -
 #pragma mark Logging
 - (void)_logString:(NSString *)msg isWarning:(BOOL)err args:(va_list)args {
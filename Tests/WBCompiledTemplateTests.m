@@ -0,0 +1,125 @@
+/*
+ *  WBCompiledTemplateTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBTemplate.h"
+#import "WBCompiledTemplate.h"
+
+@interface WBCompiledTemplateTests : XCTestCase {
+@private
+  NSString *wb_path;
+}
+
+@end
+
+@implementation WBCompiledTemplateTests
+
+- (void)tearDown {
+  if (wb_path)
+    [[NSFileManager defaultManager] removeItemAtPath:wb_path error:NULL];
+  [wb_path release];
+  wb_path = nil;
+  [super tearDown];
+}
+
+- (WBTemplate *)templateWithString:(NSString *)content {
+  if (!wb_path)
+    wb_path = [[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]] retain];
+  XCTAssertTrue([content writeToFile:wb_path atomically:NO encoding:NSUTF8StringEncoding error:NULL], @"cannot write template");
+  WBTemplate *tpl = [[WBTemplate alloc] initWithContentsOfFile:wb_path encoding:NSUTF8StringEncoding];
+  XCTAssertTrue([tpl load], @"cannot load template");
+  return [tpl autorelease];
+}
+
+/* set a variable in both forms */
+- (void)setVariable:(NSString *)value forKey:(NSString *)key inBlock:(NSString *)name
+         template:(WBTemplate *)tpl renderer:(WBTemplateRenderer *)renderer {
+  WBCompiledTemplate *compiled = [renderer compiledTemplate];
+  NSUInteger block = name ? [compiled indexOfBlock:name] : 0;
+  XCTAssertTrue(block != NSNotFound, @"block %@ not found", name);
+  NSUInteger slot = [compiled slotForVariable:key inBlock:block];
+  XCTAssertTrue(slot != NSNotFound, @"variable %@ not found", key);
+  [renderer setVariable:value forSlot:slot];
+  [(name ? [tpl blockWithName:name] : tpl) setVariable:value forKey:key];
+}
+
+- (void)dumpBlock:(NSString *)name template:(WBTemplate *)tpl renderer:(WBTemplateRenderer *)renderer {
+  NSUInteger block = [[renderer compiledTemplate] indexOfBlock:name];
+  XCTAssertTrue(block != NSNotFound, @"block %@ not found", name);
+  [renderer dumpBlock:block];
+  [[tpl blockWithName:name] dumpBlock];
+}
+
+- (void)testNestedBlocks {
+  WBTemplate *tpl = [self templateWithString:@"<h1>@title!</h1><ul>@Start:item!<li>@name!@Start:tag! [@label!]@End!</li>@End!</ul>@footer!"];
+  WBCompiledTemplate *compiled = [[WBCompiledTemplate alloc] initWithTemplate:tpl];
+  XCTAssertNotNil(compiled, @"compilation failed");
+  WBTemplateRenderer *renderer = [[WBTemplateRenderer alloc] initWithTemplate:compiled];
+
+  [self setVariable:@"Title" forKey:@"title" inBlock:nil template:tpl renderer:renderer];
+  for (NSUInteger idx = 0; idx < 4; idx++) {
+    [self setVariable:[NSString stringWithFormat:@"item %lu", (unsigned long)idx] forKey:@"name" inBlock:@"item" template:tpl renderer:renderer];
+    /* no tag for the first item */
+    for (NSUInteger tag = 0; tag < idx; tag++) {
+      [self setVariable:[NSString stringWithFormat:@"t%lu", (unsigned long)tag] forKey:@"label" inBlock:@"tag" template:tpl renderer:renderer];
+      [self dumpBlock:@"tag" template:tpl renderer:renderer];
+    }
+    [self dumpBlock:@"item" template:tpl renderer:renderer];
+  }
+  NSString *expected = [tpl stringRepresentation];
+  XCTAssertTrue([expected rangeOfString:@"<li>item 3 [t0] [t1] [t2]</li>"].location != NSNotFound, @"unexpected output: %@", expected);
+  XCTAssertEqualObjects([renderer stringRepresentation], expected, @"compiled output mismatch");
+
+  [renderer release];
+  [compiled release];
+}
+
+/* a block named like a variable is output as the variable: the following blocks must not be shifted */
+- (void)testShadowedBlock {
+  WBTemplate *tpl = [self templateWithString:@"@title! @Start:title!hidden@End! <@Start:row!(@value!)@End!> @Start:other!{@value!}@End! end"];
+  WBCompiledTemplate *compiled = [[WBCompiledTemplate alloc] initWithTemplate:tpl];
+  XCTAssertNotNil(compiled, @"compilation failed");
+  WBTemplateRenderer *renderer = [[WBTemplateRenderer alloc] initWithTemplate:compiled];
+
+  [self setVariable:@"Title" forKey:@"title" inBlock:nil template:tpl renderer:renderer];
+  for (NSUInteger idx = 0; idx < 3; idx++) {
+    [self setVariable:[NSString stringWithFormat:@"%lu", (unsigned long)idx] forKey:@"value" inBlock:@"row" template:tpl renderer:renderer];
+    [self dumpBlock:@"row" template:tpl renderer:renderer];
+  }
+  [self setVariable:@"x" forKey:@"value" inBlock:@"other" template:tpl renderer:renderer];
+  [self dumpBlock:@"other" template:tpl renderer:renderer];
+
+  NSString *expected = [tpl stringRepresentation];
+  XCTAssertEqualObjects(expected, @"Title Title <(0)(1)(2)> {x} end", @"unexpected template output");
+  XCTAssertEqualObjects([renderer stringRepresentation], expected, @"compiled output mismatch");
+
+  /* same output after a round trip through the serialized form */
+  WBCompiledTemplate *loaded = [[WBCompiledTemplate alloc] initWithData:[compiled dataRepresentation]];
+  XCTAssertNotNil(loaded, @"cannot load compiled template");
+  WBTemplateRenderer *other = [[WBTemplateRenderer alloc] initWithTemplate:loaded];
+  [other setVariable:@"Title" forSlot:[loaded slotForVariable:@"title" inBlock:0]];
+  NSUInteger row = [loaded indexOfBlock:@"row"];
+  for (NSUInteger idx = 0; idx < 3; idx++) {
+    [other setVariable:[NSString stringWithFormat:@"%lu", (unsigned long)idx] forSlot:[loaded slotForVariable:@"value" inBlock:row]];
+    [other dumpBlock:row];
+  }
+  NSUInteger block = [loaded indexOfBlock:@"other"];
+  [other setVariable:@"x" forSlot:[loaded slotForVariable:@"value" inBlock:block]];
+  [other dumpBlock:block];
+  XCTAssertEqualObjects([other stringRepresentation], expected, @"loaded output mismatch");
+
+  [other release];
+  [loaded release];
+  [renderer release];
+  [compiled release];
+}
+
+@end
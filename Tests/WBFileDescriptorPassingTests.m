@@ -0,0 +1,100 @@
+/*
+ *  WBFileDescriptorPassingTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBUnixFunctions.h"
+
+#include <sys/socket.h>
+
+#define kWBFileDescriptorTestCount 1000
+
+@interface WBFileDescriptorPassingTests : XCTestCase {
+@private
+  int sockets[2];
+  int fds[WB_IO_MAX_DESCRIPTORS];
+}
+
+@end
+
+@implementation WBFileDescriptorPassingTests
+
+- (void)setUp {
+  [super setUp];
+  XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0, @"socketpair");
+  for (size_t idx = 0; idx < WB_IO_MAX_DESCRIPTORS; idx++)
+    fds[idx] = open("/dev/null", O_RDONLY);
+}
+
+- (void)tearDown {
+  for (size_t idx = 0; idx < WB_IO_MAX_DESCRIPTORS; idx++)
+    close(fds[idx]);
+  close(sockets[0]);
+  close(sockets[1]);
+  [super tearDown];
+}
+
+- (void)testBatch {
+  XCTAssertEqual(WBIOSendFileDescriptors(sockets[0], fds, WB_IO_MAX_DESCRIPTORS, "hello", 5), 0, @"send failed");
+
+  char payload[16];
+  int received[WB_IO_MAX_DESCRIPTORS];
+  size_t count = WB_IO_MAX_DESCRIPTORS, length = sizeof(payload);
+  XCTAssertEqual(WBIOReceiveFileDescriptors(sockets[1], received, &count, payload, &length), 0, @"receive failed");
+  XCTAssertEqual(count, (size_t)WB_IO_MAX_DESCRIPTORS, @"missing descriptors");
+  XCTAssertEqual(length, (size_t)5, @"invalid payload");
+  XCTAssertTrue(0 == memcmp(payload, "hello", 5), @"invalid payload");
+  XCTAssertTrue(fcntl(received[0], F_GETFD) & FD_CLOEXEC, @"descriptor should be close-on-exec");
+  for (size_t idx = 0; idx < count; idx++)
+    close(received[idx]);
+}
+
+- (void)testTooManyDescriptors {
+  XCTAssertEqual(WBIOSendFileDescriptors(sockets[0], fds, 10, NULL, 0), 0, @"send failed");
+  int received[4];
+  size_t count = 4;
+  XCTAssertEqual(WBIOReceiveFileDescriptors(sockets[1], received, &count, NULL, NULL), EMSGSIZE, @"truncation not reported");
+  XCTAssertEqual(count, (size_t)0, @"descriptors should be closed");
+}
+
+- (void)testEndOfFile {
+  close(sockets[0]);
+  sockets[0] = -1;
+  int fd;
+  size_t count = 1;
+  XCTAssertEqual(WBIOReceiveFileDescriptors(sockets[1], &fd, &count, NULL, NULL), EOF, @"end of file expected");
+}
+
+/* startup handoff: one message per descriptor, versus batches */
+- (void)testBenchmark {
+  int received[WB_IO_MAX_DESCRIPTORS];
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  for (size_t idx = 0; idx < kWBFileDescriptorTestCount; idx++) {
+    XCTAssertTrue(WBIOSendFileDescriptor(sockets[0], fds[idx % WB_IO_MAX_DESCRIPTORS]) >= 0, @"send failed");
+    XCTAssertTrue(WBIOReceiveFileDescriptor(sockets[1], &received[0]) > 0, @"receive failed");
+    close(received[0]);
+  }
+  CFAbsoluteTime single = CFAbsoluteTimeGetCurrent() - start;
+
+  start = CFAbsoluteTimeGetCurrent();
+  for (size_t idx = 0; idx < kWBFileDescriptorTestCount; idx += WB_IO_MAX_DESCRIPTORS) {
+    size_t count = MIN((size_t)WB_IO_MAX_DESCRIPTORS, kWBFileDescriptorTestCount - idx);
+    XCTAssertEqual(WBIOSendFileDescriptors(sockets[0], fds, count, NULL, 0), 0, @"send failed");
+    XCTAssertEqual(WBIOReceiveFileDescriptors(sockets[1], received, &count, NULL, NULL), 0, @"receive failed");
+    for (size_t fd = 0; fd < count; fd++)
+      close(received[fd]);
+  }
+  CFAbsoluteTime batch = CFAbsoluteTimeGetCurrent() - start;
+
+  NSLog(@"%d descriptors: single %.0f µs, batch %.0f µs (x%.1f)", kWBFileDescriptorTestCount,
+        single * 1e6, batch * 1e6, batch > 0 ? single / batch : 0);
+}
+
+@end
@@ -12,7 +12,19 @@
 
 #import "WBFunctions.h"
 #import "WBObjCRuntime.h"
+#import "WBProcessFunctions.h"
+#import "WBTextFunctions.h"
 #import "WBVersionFunctions.h"
+#import "NSArray+WonderBox.h"
+#import "NSString+WonderBox.h"
+
+#include <fcntl.h>
+
+static
+intptr_t _WBFunctionsTestAppend(const void *bytes, size_t length, void *ctxt) {
+  [(NSMutableData *)ctxt appendBytes:bytes length:length];
+  return (intptr_t)length;
+}
 
 @interface WBFunctionsTest : XCTestCase {
 
@@ -108,4 +120,150 @@ bool _CFArrayContainsClass(CFArrayRef classes, Class cls) {
   CFRelease(classes);
 }
 
+- (void)testWBTextLineIndex {
+  NSMutableString *str = [NSMutableString stringWithString:@"first\r\nsecond\rthird\u2028fourth\n"];
+  XCTAssertEqual(WBTextGetCountOfLines(SPXNSToCFString(str)), (CFIndex)4, @"invalid lines count");
+  CFRange range = WBTextGetRangeOfLine(SPXNSToCFString(str), 1);
+  XCTAssertTrue(range.location == 7 && range.length == 7, @"invalid line range");
+
+  WBTextLineIndexRef idx = WBTextLineIndexCreate(SPXNSToCFString(str));
+  XCTAssertEqual(WBTextLineIndexGetCountOfLines(idx), (CFIndex)4, @"invalid lines count");
+  XCTAssertEqual(WBTextLineIndexGetLineForOffset(idx, 7), (CFIndex)1, @"invalid line for offset");
+  XCTAssertEqual(WBTextLineIndexGetLineForOffset(idx, 6), (CFIndex)0, @"invalid line for offset");
+
+  /* join the CR with an inserted LF, and add a line */
+  [str replaceCharactersInRange:NSMakeRange(14, 0) withString:@"\nnew\n"];
+  WBTextLineIndexReplaceCharacters(idx, SPXNSToCFString(str), CFRangeMake(14, 0), 5);
+  XCTAssertEqual(WBTextLineIndexGetCountOfLines(idx), WBTextGetCountOfLines(SPXNSToCFString(str)), @"invalid lines count");
+  for (CFIndex line = 0; line < WBTextLineIndexGetCountOfLines(idx); line++) {
+    CFRange expected = WBTextGetRangeOfLine(SPXNSToCFString(str), line);
+    range = WBTextLineIndexGetRangeOfLine(idx, line);
+    XCTAssertTrue(range.location == expected.location && range.length == expected.length, @"invalid range for line %ld", (long)line);
+    XCTAssertTrue(NSEqualRanges(NSMakeRange(range.location, range.length), [str rangeOfLine:line + 1]), @"invalid range for line %ld", (long)line);
+  }
+  WBTextLineIndexFree(idx);
+}
+
+- (void)testLineEndingConversion {
+  /* NEL (U+0085) is not converted */
+  NSString *str = [NSString stringWithFormat:@"a\rb\nc\r\nd\u2028e\u2029f%Cg\r", (unichar)0x85];
+  CFIndex count = 0;
+  CFStringRef result = WBTextCreateStringByConvertingLineEnding(kCFAllocatorDefault, SPXNSToCFString(str), CFSTR("\n"), &count);
+  XCTAssertEqualObjects(SPXCFToNSString(result), ([NSString stringWithFormat:@"a\nb\nc\nd\ne\nf%Cg\n", (unichar)0x85]), @"invalid conversion");
+  XCTAssertEqual(count, (CFIndex)6, @"invalid line endings count");
+  SPXCFRelease(result);
+
+  NSMutableString *mstr = [NSMutableString stringWithString:str];
+  XCTAssertEqual(WBTextConvertLineEnding(SPXNSToCFString(mstr), CFSTR("\r\n")), (CFIndex)6, @"invalid line endings count");
+  XCTAssertEqualObjects(mstr, ([NSString stringWithFormat:@"a\r\nb\r\nc\r\nd\r\ne\r\nf%Cg\r\n", (unichar)0x85]), @"invalid in place conversion");
+
+  result = WBTextCreateStringByConvertingLineEnding(kCFAllocatorDefault, CFSTR(""), CFSTR("\n"), &count);
+  XCTAssertTrue(result && 0 == CFStringGetLength(result), @"invalid conversion of an empty string");
+  XCTAssertEqual(count, (CFIndex)0, @"invalid line endings count");
+  SPXCFRelease(result);
+}
+
+- (void)testLineEndingConverter {
+  /* CRLF, and the 3 bytes of U+2028 and U+2029, split at every offset */
+  NSData *input = [@"a\rb\nc\r\nd\u2028e\u2029f\u00e9\r" dataUsingEncoding:NSUTF8StringEncoding];
+  NSData *expected = [@"a\nb\nc\nd\ne\nf\u00e9\n" dataUsingEncoding:NSUTF8StringEncoding];
+  for (NSUInteger split = 0; split <= [input length]; split++) {
+    NSMutableData *output = [NSMutableData data];
+    WBTextLineEndingConverterRef converter = WBTextLineEndingConverterCreate("\n", _WBFunctionsTestAppend, output);
+    XCTAssertEqual(WBTextLineEndingConverterConvertBytes(converter, [input bytes], split), (intptr_t)split, @"convert failed");
+    XCTAssertEqual(WBTextLineEndingConverterConvertBytes(converter, (const uint8_t *)[input bytes] + split, [input length] - split),
+                   (intptr_t)([input length] - split), @"convert failed");
+    XCTAssertEqual(WBTextLineEndingConverterFinish(converter), (CFIndex)6, @"invalid line endings count (split at %lu)", (unsigned long)split);
+    WBTextLineEndingConverterFree(converter);
+    XCTAssertEqualObjects(output, expected, @"invalid conversion (split at %lu)", (unsigned long)split);
+  }
+
+  /* empty input */
+  NSMutableData *output = [NSMutableData data];
+  WBTextLineEndingConverterRef converter = WBTextLineEndingConverterCreate("\r\n", _WBFunctionsTestAppend, output);
+  XCTAssertEqual(WBTextLineEndingConverterFinish(converter), (CFIndex)0, @"invalid line endings count");
+  WBTextLineEndingConverterFree(converter);
+  XCTAssertEqual([output length], (NSUInteger)0, @"invalid output");
+}
+
+- (void)testLineEndingConversionWithFileDescriptors {
+  NSMutableString *str = [NSMutableString string];
+  for (NSUInteger idx = 0; idx < 20000; idx++)
+    [str appendFormat:@"line %lu \u00e9\n", (unsigned long)idx];
+  NSData *original = [str dataUsingEncoding:NSUTF8StringEncoding];
+
+  NSString *base = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+  NSString *paths[3] = { [base stringByAppendingString:@".lf"], [base stringByAppendingString:@".crlf"], [base stringByAppendingString:@".out"] };
+  XCTAssertTrue([original writeToFile:paths[0] atomically:NO], @"cannot write file");
+
+  /* LF to CRLF, and back */
+  const char *endings[2] = { "\r\n", "\n" };
+  for (NSUInteger idx = 0; idx < 2; idx++) {
+    int input = open([paths[idx] fileSystemRepresentation], O_RDONLY);
+    int output = open([paths[idx + 1] fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    XCTAssertTrue(input >= 0 && output >= 0, @"cannot open files");
+    XCTAssertEqual(WBTextConvertLineEndingWithFileDescriptors(input, output, endings[idx]), (CFIndex)20000, @"invalid line endings count");
+    close(input);
+    close(output);
+  }
+  NSData *crlf = [NSData dataWithContentsOfFile:paths[1]];
+  XCTAssertEqual([crlf length], [original length] + 20000, @"invalid CRLF file size");
+  XCTAssertEqualObjects([NSData dataWithContentsOfFile:paths[2]], original, @"round trip mismatch");
+
+  for (NSUInteger idx = 0; idx < 3; idx++)
+    [[NSFileManager defaultManager] removeItemAtPath:paths[idx] error:NULL];
+}
+
+- (void)testCollationKeys {
+  NSArray *names = @[@"file10.txt", @"File2.txt", @"file1.txt", @"file-1.txt", @"file_2", @"FILE", @"file 3", @"\u00e9t\u00e9 2",
+                     @"e\u0301te\u0301 10", @"a100b", @"a99b", @"a99c", @"", @"z", @"123456789012345678901234567890", @"9"];
+  NSArray *expected = [names sortedArrayUsingSelector:@selector(numericCompare:)];
+  NSArray *sorted = [names sortedArrayUsingCollationKeyForKeyPath:nil options:NSNumericSearch | NSCaseInsensitiveSearch];
+  XCTAssertEqualObjects(sorted, expected, @"collation keys order mismatch");
+
+  expected = [names sortedArrayUsingSelector:@selector(caseInsensitiveCompare:)];
+  sorted = [names sortedArrayUsingCollationKeyForKeyPath:nil options:NSCaseInsensitiveSearch];
+  XCTAssertEqualObjects(sorted, expected, @"collation keys order mismatch");
+
+  /* key path values are fetched on the calling thread */
+  NSMutableArray *items = [NSMutableArray array];
+  for (NSString *name in names)
+    [items addObject:@{ @"name": name }];
+  sorted = [items sortedArrayUsingCollationKeyForKeyPath:@"name" options:NSCaseInsensitiveSearch];
+  XCTAssertEqualObjects([sorted valueForKey:@"name"], expected, @"key path order mismatch");
+}
+
+- (void)testProcessNameCache {
+  pid_t parent = getppid();
+  CFStringRef name = WBProcessCopyNameForPID(parent);
+  XCTAssertTrue(name != NULL, @"parent process name not found");
+  /* cached */
+  CFStringRef cached = WBProcessCopyNameForPID(parent);
+  XCTAssertTrue(cached && CFEqual(name, cached), @"cached name mismatch");
+  SPXCFRelease(cached);
+
+  pid_t pids[] = { getpid(), parent, -1 };
+  CFStringRef names[3];
+  XCTAssertEqual(WBProcessCopyNamesForPIDs(pids, 3, names), 0, @"batch lookup failed");
+  XCTAssertTrue(names[0] != NULL, @"current process name not found");
+  XCTAssertTrue(names[1] && CFEqual(names[1], name), @"batch name mismatch");
+  XCTAssertTrue(NULL == names[2], @"invalid process found");
+  for (size_t idx = 0; idx < 3; idx++)
+    SPXCFRelease(names[idx]);
+
+  Boolean natives[3];
+  XCTAssertEqual(WBProcessGetNativeFlagsForPIDs(pids, 3, natives), 0, @"batch native lookup failed");
+  XCTAssertEqual(natives[0], WBProcessIsNative(getpid()), @"batch native flag mismatch");
+  XCTAssertEqual(natives[1], WBProcessIsNative(parent), @"batch native flag mismatch");
+  XCTAssertFalse(natives[2], @"invalid process is native");
+
+  /* disabled cache */
+  WBProcessSetCacheSize(0);
+  cached = WBProcessCopyNameForPID(parent);
+  XCTAssertTrue(cached && CFEqual(name, cached), @"uncached name mismatch");
+  SPXCFRelease(cached);
+  WBProcessSetCacheSize(256);
+  CFRelease(name);
+}
+
 @end
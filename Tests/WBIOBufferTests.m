@@ -0,0 +1,129 @@
+/*
+ *  WBIOBufferTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBIOBuffer.h"
+#import "WBUnixFunctions.h"
+
+#include <sys/socket.h>
+
+@interface WBIOBufferTests : XCTestCase {
+@private
+  uint8_t data[1000];
+}
+
+@end
+
+@implementation WBIOBufferTests
+
+- (void)setUp {
+  [super setUp];
+  for (size_t idx = 0; idx < sizeof(data); idx++)
+    data[idx] = (uint8_t)idx;
+}
+
+- (void)testRing {
+  WBIOBufferRef buffer = WBIOBufferCreate(-1, 60);
+  XCTAssertEqual(WBIOBufferGetCapacity(buffer), (size_t)64, @"capacity not rounded");
+
+  uint8_t tmp[64];
+  XCTAssertEqual(WBIOBufferWrite(buffer, data, 100), (size_t)64, @"write should be truncated");
+  XCTAssertEqual(WBIOBufferRead(buffer, tmp, 50), (size_t)50, @"invalid read");
+  XCTAssertEqual(WBIOBufferWrite(buffer, data + 64, 36), (size_t)36, @"invalid write");
+
+  /* 14 bytes at the end of the ring, and 36 at the beginning */
+  struct iovec iov[2];
+  XCTAssertEqual(WBIOBufferPeek(buffer, iov), 2, @"buffered bytes should wrap");
+  XCTAssertEqual(iov[0].iov_len + iov[1].iov_len, (size_t)50, @"invalid length");
+
+  const uint8_t *bytes = WBIOBufferPeekContiguous(buffer, 50);
+  XCTAssertTrue(bytes && 0 == memcmp(bytes, data + 50, 50), @"invalid contiguous bytes");
+  XCTAssertEqual(WBIOBufferPeek(buffer, iov), 1, @"buffered bytes should be contiguous");
+  XCTAssertTrue(NULL == WBIOBufferPeekContiguous(buffer, 51), @"not enough bytes");
+
+  WBIOBufferConsume(buffer, 50);
+  XCTAssertEqual(WBIOBufferReserve(buffer, iov), 1, @"empty buffer should restart at the beginning");
+  XCTAssertEqual(iov[0].iov_len, (size_t)64, @"invalid free space");
+  WBIOBufferFree(buffer);
+}
+
+- (void)testPipe {
+  int fds[2];
+  XCTAssertEqual(pipe(fds), 0, @"pipe");
+  WBIOBufferRef writer = WBIOBufferCreate(fds[1], 100);
+  WBIOBufferRef reader = WBIOBufferCreate(fds[0], 100);
+
+  uint8_t received[sizeof(data)];
+  size_t sent = 0, done = 0;
+  while (done < sizeof(data)) {
+    sent += WBIOBufferWrite(writer, data + sent, MIN((size_t)37, sizeof(data) - sent));
+    XCTAssertEqual(WBIOBufferFlush(writer, NULL), 0, @"flush");
+    XCTAssertEqual(WBIOBufferFill(reader, NULL), 0, @"fill");
+    /* fixed size records */
+    while (WBIOBufferGetLength(reader) >= 10) {
+      memcpy(received + done, WBIOBufferPeekContiguous(reader, 10), 10);
+      WBIOBufferConsume(reader, 10);
+      done += 10;
+    }
+  }
+  XCTAssertTrue(0 == memcmp(received, data, sizeof(data)), @"invalid data");
+
+  close(fds[1]);
+  XCTAssertEqual(WBIOBufferFill(reader, NULL), EOF, @"end of file expected");
+  close(fds[0]);
+  WBIOBufferFree(writer);
+  WBIOBufferFree(reader);
+}
+
+- (void)testVectoredIO {
+  int fds[2];
+  XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, @"socketpair");
+
+  struct iovec wiov[3] = { { data, 10 }, { data + 10, 0 }, { data + 10, sizeof(data) - 10 } };
+  size_t count = 0;
+  XCTAssertEqual(WBIOWritev(fds[0], wiov, 3, &count), 0, @"writev");
+  XCTAssertEqual(count, sizeof(data), @"invalid length");
+
+  uint8_t received[sizeof(data)];
+  struct iovec riov[2] = { { received, 500 }, { received + 500, 500 } };
+  XCTAssertEqual(WBIOReadv(fds[1], riov, 2, &count), 0, @"readv");
+  XCTAssertTrue(0 == memcmp(received, data, sizeof(data)), @"invalid data");
+
+  shutdown(fds[0], SHUT_WR);
+  riov[0].iov_base = received;
+  riov[0].iov_len = 1;
+  XCTAssertEqual(WBIOReadv(fds[1], riov, 1, &count), EOF, @"end of file expected");
+  close(fds[0]);
+  close(fds[1]);
+}
+
+- (void)testSendFile {
+  FILE *f = tmpfile();
+  fwrite(data, 1, sizeof(data), f);
+  fflush(f);
+
+  int fds[2];
+  XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, @"socketpair");
+  size_t count = 0;
+  XCTAssertEqual(WBIOSendFile(fds[0], fileno(f), 100, 0, &count), 0, @"sendfile");
+  XCTAssertEqual(count, sizeof(data) - 100, @"invalid length");
+
+  uint8_t received[sizeof(data)];
+  struct iovec iov = { received, sizeof(data) - 100 };
+  XCTAssertEqual(WBIOReadv(fds[1], &iov, 1, NULL), 0, @"readv");
+  XCTAssertTrue(0 == memcmp(received, data + 100, sizeof(data) - 100), @"invalid data");
+
+  fclose(f);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+@end
@@ -0,0 +1,139 @@
+/*
+ *  WBIOChannelTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBIOChannel.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define kWBIOChannelTestCount 256
+#define kWBIOChannelTestMessages 10
+
+typedef struct {
+  size_t closed;
+  size_t received;
+  size_t writable;
+} WBIOChannelTestState;
+
+static
+void _WBIOChannelTestEcho(WBIOChannelRef channel, WBIOBufferRef buffer, void *ctxt) {
+  struct iovec iov[2];
+  int count = WBIOBufferPeek(buffer, iov);
+  for (int idx = 0; idx < count; idx++)
+    WBIOChannelWrite(channel, iov[idx].iov_base, iov[idx].iov_len);
+  WBIOBufferConsume(buffer, WBIOBufferGetLength(buffer));
+}
+
+static
+void _WBIOChannelTestClosed(WBIOChannelRef channel, int error, void *ctxt) {
+  ((WBIOChannelTestState *)ctxt)->closed++;
+  WBIOChannelClose(channel);
+}
+
+static
+void _WBIOChannelTestWritable(WBIOChannelRef channel, void *ctxt) {
+  ((WBIOChannelTestState *)ctxt)->writable++;
+}
+
+/* 8 bytes messages, close the channel once all replies are received */
+static
+void _WBIOChannelTestClient(WBIOChannelRef channel, WBIOBufferRef buffer, void *ctxt) {
+  WBIOChannelTestState *state = (WBIOChannelTestState *)ctxt;
+  size_t count = WBIOBufferGetLength(buffer) / 8;
+  WBIOBufferConsume(buffer, count * 8);
+  state->received += count;
+  if (state->received % kWBIOChannelTestMessages == 0)
+    WBIOChannelClose(channel);
+}
+
+static
+void *_WBIOChannelTestStop(void *arg) {
+  usleep(50000);
+  WBIOReactorStop((WBIOReactorRef)arg);
+  return NULL;
+}
+
+@interface WBIOChannelTests : XCTestCase {
+@private
+  WBIOReactorRef reactor;
+}
+
+@end
+
+@implementation WBIOChannelTests
+
+- (void)setUp {
+  [super setUp];
+  reactor = WBIOReactorCreate();
+  XCTAssertTrue(reactor != NULL, @"cannot create reactor");
+}
+
+- (void)tearDown {
+  WBIOReactorFree(reactor);
+  [super tearDown];
+}
+
+- (void)testEcho {
+  WBIOChannelTestState server = {}, clients = {};
+  const WBIOChannelCallBacks serverCallBacks = { _WBIOChannelTestEcho, NULL, _WBIOChannelTestClosed };
+  const WBIOChannelCallBacks clientCallBacks = { _WBIOChannelTestClient, NULL, NULL };
+  for (int idx = 0; idx < kWBIOChannelTestCount; idx++) {
+    int fds[2];
+    XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, @"socketpair");
+    XCTAssertTrue(WBIOChannelCreate(reactor, fds[0], 256, &serverCallBacks, &server) != NULL, @"cannot create channel");
+    WBIOChannelRef client = WBIOChannelCreate(reactor, fds[1], 256, &clientCallBacks, &clients);
+    XCTAssertTrue(client != NULL, @"cannot create channel");
+    /* coalesced in a single write */
+    for (int msg = 0; msg < kWBIOChannelTestMessages; msg++)
+      XCTAssertTrue(WBIOChannelWrite(client, "message", 8), @"write failed");
+  }
+
+  for (int idx = 0; idx < 1000 && server.closed < kWBIOChannelTestCount; idx++)
+    XCTAssertTrue(WBIOReactorRunOnce(reactor, 1) >= 0, @"reactor failed");
+  XCTAssertEqual(server.closed, (size_t)kWBIOChannelTestCount, @"channels not closed");
+  XCTAssertEqual(clients.received, (size_t)(kWBIOChannelTestCount * kWBIOChannelTestMessages), @"missing replies");
+}
+
+- (void)testWatermarks {
+  int fds[2];
+  XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, @"socketpair");
+  WBIOChannelTestState state = {};
+  const WBIOChannelCallBacks callbacks = { _WBIOChannelTestEcho, _WBIOChannelTestWritable, NULL };
+  WBIOChannelRef channel = WBIOChannelCreate(reactor, fds[0], 256, &callbacks, &state);
+  WBIOChannelSetWatermarks(channel, 1024, 256);
+
+  char buffer[4096] = {};
+  XCTAssertFalse(WBIOChannelWrite(channel, buffer, sizeof(buffer)), @"high watermark exceeded");
+  XCTAssertEqual(WBIOChannelGetPendingLength(channel), sizeof(buffer), @"bytes not queued");
+
+  size_t total = 0;
+  for (int idx = 0; idx < 100 && total < sizeof(buffer); idx++) {
+    WBIOReactorRunOnce(reactor, 0.1);
+    ssize_t count = read(fds[1], buffer, sizeof(buffer));
+    if (count > 0)
+      total += count;
+  }
+  XCTAssertEqual(total, sizeof(buffer), @"bytes not sent");
+  XCTAssertEqual(state.writable, (size_t)1, @"writable callback not called");
+
+  WBIOChannelClose(channel);
+  close(fds[1]);
+}
+
+- (void)testStop {
+  pthread_t thread;
+  pthread_create(&thread, NULL, _WBIOChannelTestStop, reactor);
+  XCTAssertEqual(WBIOReactorRun(reactor), 0, @"reactor failed");
+  pthread_join(thread, NULL);
+}
+
+@end
@@ -0,0 +1,223 @@
+/*
+ *  WBMachMessageServerTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBMachDispatch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <mach/mig.h>
+#include <mach/mach_time.h>
+
+#define kWBMachServerTestFastID 1000
+#define kWBMachServerTestSlowID 1001
+
+typedef struct {
+  /* handler delay for the fast messages (us) */
+  useconds_t delay;
+  atomic_int running, maxRunning, handled;
+} WBMachServerTestState;
+
+static
+boolean_t _WBMachServerTestDemux(mach_msg_header_t *request, mach_msg_header_t *reply, void *ctxt) {
+  WBMachServerTestState *state = (WBMachServerTestState *)ctxt;
+  int running = atomic_fetch_add(&state->running, 1) + 1;
+  int max = atomic_load(&state->maxRunning);
+  while (running > max && !atomic_compare_exchange_weak(&state->maxRunning, &max, running))
+    continue;
+
+  usleep(request->msgh_id == kWBMachServerTestSlowID ? 500000 : state->delay);
+
+  atomic_fetch_sub(&state->running, 1);
+  atomic_fetch_add(&state->handled, 1);
+
+  /* MIG style reply */
+  mig_reply_error_t *error = (mig_reply_error_t *)reply;
+  error->Head.msgh_bits = MACH_MSGH_BITS(MACH_MSGH_BITS_REMOTE(request->msgh_bits), 0);
+  error->Head.msgh_size = (mach_msg_size_t)sizeof(*error);
+  error->Head.msgh_remote_port = request->msgh_remote_port;
+  error->Head.msgh_local_port = MACH_PORT_NULL;
+  error->Head.msgh_id = request->msgh_id + 100;
+  error->NDR = NDR_record;
+  error->RetCode = KERN_SUCCESS;
+  return TRUE;
+}
+
+/* one-way message */
+static
+kern_return_t _WBMachServerTestPost(mach_port_t port, mach_msg_id_t msgid) {
+  mach_msg_header_t msg = {};
+  msg.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, 0);
+  msg.msgh_size = (mach_msg_size_t)sizeof(msg);
+  msg.msgh_remote_port = port;
+  msg.msgh_id = msgid;
+  return mach_msg(&msg, MACH_SEND_MSG, msg.msgh_size, 0, MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+}
+
+static
+kern_return_t _WBMachServerTestSend(mach_port_t port, mach_msg_id_t msgid) {
+  union {
+    mach_msg_header_t header;
+    uint8_t buffer[sizeof(mig_reply_error_t) + MAX_TRAILER_SIZE];
+  } msg = {};
+  mach_port_t reply = mig_get_reply_port();
+  msg.header.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND, MACH_MSG_TYPE_MAKE_SEND_ONCE);
+  msg.header.msgh_size = (mach_msg_size_t)sizeof(mach_msg_header_t);
+  msg.header.msgh_remote_port = port;
+  msg.header.msgh_local_port = reply;
+  msg.header.msgh_id = msgid;
+  kern_return_t kr = mach_msg(&msg.header, MACH_SEND_MSG | MACH_RCV_MSG, msg.header.msgh_size, (mach_msg_size_t)sizeof(msg),
+                              reply, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+  if (KERN_SUCCESS == kr && msg.header.msgh_id != msgid + 100)
+    kr = MIG_REPLY_MISMATCH;
+  return kr;
+}
+
+typedef struct {
+  WBMachMessageServerRef server;
+  size_t workers;
+  mach_msg_return_t result;
+} WBMachServerTestRun;
+
+static
+void *_WBMachServerTestRun(void *arg) {
+  WBMachServerTestRun *run = (WBMachServerTestRun *)arg;
+  run->result = WBMachMessageServerRun(run->server, run->workers);
+  return NULL;
+}
+
+static
+void *_WBMachServerTestSlowClient(void *arg) {
+  _WBMachServerTestSend((mach_port_t)(uintptr_t)arg, kWBMachServerTestSlowID);
+  return NULL;
+}
+
+@interface WBMachMessageServerTests : XCTestCase {
+@private
+  mach_port_t wb_port;
+  pthread_t wb_thread;
+  WBMachServerTestRun wb_run;
+  WBMachServerTestState wb_state;
+}
+
+@end
+
+@implementation WBMachMessageServerTests
+
+- (void)setUp {
+  [super setUp];
+  memset(&wb_state, 0, sizeof(wb_state));
+  XCTAssertEqual(mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &wb_port), KERN_SUCCESS, @"mach_port_allocate");
+  XCTAssertEqual(mach_port_insert_right(mach_task_self(), wb_port, wb_port, MACH_MSG_TYPE_MAKE_SEND), KERN_SUCCESS, @"mach_port_insert_right");
+  wb_run.server = WBMachMessageServerCreate(_WBMachServerTestDemux, (mach_msg_size_t)sizeof(mig_reply_error_t),
+                                            wb_port, 0, &wb_state);
+  XCTAssertTrue(wb_run.server != NULL, @"cannot create server");
+}
+
+- (void)tearDown {
+  WBMachMessageServerFree(wb_run.server);
+  mach_port_mod_refs(mach_task_self(), wb_port, MACH_PORT_RIGHT_SEND, -1);
+  mach_port_mod_refs(mach_task_self(), wb_port, MACH_PORT_RIGHT_RECEIVE, -1);
+  [super tearDown];
+}
+
+- (void)startServer:(size_t)workers {
+  wb_run.workers = workers;
+  wb_run.result = KERN_FAILURE;
+  pthread_create(&wb_thread, NULL, _WBMachServerTestRun, &wb_run);
+}
+
+- (void)stopServer {
+  WBMachMessageServerStop(wb_run.server);
+  pthread_join(wb_thread, NULL);
+  XCTAssertEqual(wb_run.result, KERN_SUCCESS, @"server error: %s", mach_error_string(wb_run.result));
+}
+
+- (BOOL)waitHandled:(int)count {
+  for (int idx = 0; idx < 500 && atomic_load(&wb_state.handled) < count; idx++)
+    usleep(10000);
+  return atomic_load(&wb_state.handled) >= count;
+}
+
+- (void)testSlowHandler {
+  [self startServer:2];
+
+  pthread_t slow;
+  pthread_create(&slow, NULL, _WBMachServerTestSlowClient, (void *)(uintptr_t)wb_port);
+  for (int idx = 0; idx < 50 && 0 == atomic_load(&wb_state.running); idx++)
+    usleep(10000);
+
+  /* a second client is served by the other worker */
+  uint64_t start = mach_absolute_time();
+  XCTAssertEqual(_WBMachServerTestSend(wb_port, kWBMachServerTestFastID), KERN_SUCCESS, @"send request");
+  mach_timebase_info_data_t timebase;
+  mach_timebase_info(&timebase);
+  uint64_t elapsed = (mach_absolute_time() - start) * timebase.numer / timebase.denom;
+  XCTAssertTrue(elapsed < 250 * NSEC_PER_MSEC, @"request blocked by the slow handler (%llu ms)", elapsed / NSEC_PER_MSEC);
+  XCTAssertEqual(atomic_load(&wb_state.handled), 1, @"slow request already handled");
+
+  pthread_join(slow, NULL);
+  [self stopServer];
+}
+
+- (void)testStopDrainsQueue {
+  [self startServer:1];
+  /* the worker is busy while the other messages are queued */
+  XCTAssertEqual(_WBMachServerTestPost(wb_port, kWBMachServerTestSlowID), KERN_SUCCESS, @"post");
+  for (int idx = 0; idx < 50 && 0 == atomic_load(&wb_state.running); idx++)
+    usleep(10000);
+  for (int idx = 0; idx < 50; idx++)
+    XCTAssertEqual(_WBMachServerTestPost(wb_port, kWBMachServerTestFastID), KERN_SUCCESS, @"post");
+
+  [self stopServer];
+  XCTAssertEqual(atomic_load(&wb_state.handled), 51, @"queued messages not handled");
+}
+
+- (void)testMaxConcurrentDemux {
+  wb_state.delay = 5000;
+  WBMachMessageServerSetMaxConcurrentDemux(wb_run.server, 2);
+  for (int idx = 0; idx < 40; idx++)
+    XCTAssertEqual(_WBMachServerTestPost(wb_port, kWBMachServerTestFastID), KERN_SUCCESS, @"post");
+
+  [self startServer:4];
+  XCTAssertTrue([self waitHandled:40], @"messages not handled");
+  [self stopServer];
+  XCTAssertTrue(atomic_load(&wb_state.maxRunning) <= 2, @"demux cap not honored (%d)", atomic_load(&wb_state.maxRunning));
+  XCTAssertTrue(atomic_load(&wb_state.maxRunning) >= 1, @"no demux");
+}
+
+- (void)testStatistics {
+  for (int idx = 0; idx < 3; idx++)
+    XCTAssertEqual(_WBMachServerTestPost(wb_port, kWBMachServerTestFastID), KERN_SUCCESS, @"post");
+  /* -1 must not be confused with a free slot */
+  for (int idx = 0; idx < 2; idx++)
+    XCTAssertEqual(_WBMachServerTestPost(wb_port, -1), KERN_SUCCESS, @"post");
+
+  [self startServer:2];
+  XCTAssertTrue([self waitHandled:5], @"messages not handled");
+  [self stopServer];
+
+  WBMachMessageServerStatistics stats[4];
+  size_t count = WBMachMessageServerGetStatistics(wb_run.server, stats, 4);
+  XCTAssertEqual(count, (size_t)2, @"message ID count");
+  uint64_t fast = 0, minusOne = 0;
+  for (size_t idx = 0; idx < MIN(count, (size_t)4); idx++) {
+    if (stats[idx].msgid == kWBMachServerTestFastID)
+      fast = stats[idx].count;
+    else if (stats[idx].msgid == -1)
+      minusOne = stats[idx].count;
+    XCTAssertTrue(stats[idx].maxHandlerTime <= stats[idx].handlerTime, @"max handler time");
+  }
+  XCTAssertEqual(fast, (uint64_t)3, @"message count");
+  XCTAssertEqual(minusOne, (uint64_t)2, @"message count for msgid -1");
+}
+
+@end
@@ -0,0 +1,304 @@
+/*
+ *  WBMessageServerTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBMessageServer.h"
+
+#include <pthread.h>
+#include <mach/mach_time.h>
+
+static
+bool _WBMessageServerTestEcho(const WBMessage *request, WBMessage *reply, void *ctxt) {
+  memcpy(reply->data, request->data, request->length);
+  reply->length = request->length;
+  /* send the descriptor back */
+  reply->fd = request->fd;
+  return true;
+}
+
+/* large request: reply with its size, else reply with a large buffer */
+static
+bool _WBMessageServerTestLarge(const WBMessage *request, WBMessage *reply, void *ctxt) {
+  if (request->length > 1024) {
+    uint64_t size = request->length;
+    memcpy(reply->data, &size, sizeof(size));
+    reply->length = sizeof(size);
+    return true;
+  }
+  size_t length = 4 << 20;
+  uint8_t *buffer = WBMessageAllocateBuffer(length);
+  if (!buffer)
+    return false;
+  memset(buffer, 0xa5, length);
+  WBMessageSetBuffer(reply, buffer, length);
+  return true;
+}
+
+static
+void *_WBMessageServerTestRun(void *arg) {
+  WBMessageServerRun((WBMessageServerRef)arg);
+  return NULL;
+}
+
+/* Load generator */
+typedef int (*WBMessageServerTestSend)(void *client, const WBMessage *request, WBMessage *reply);
+
+typedef struct {
+  void *client;
+  WBMessageServerTestSend send;
+  size_t count;
+  uint64_t *latencies;
+  int error;
+} WBMessageServerLoad;
+
+static
+int _WBMessageServerTestSendUnix(void *client, const WBMessage *request, WBMessage *reply) {
+  return WBMessageClientSendRequest((int)(intptr_t)client, request, reply);
+}
+
+static
+int _WBMessageServerTestSendMach(void *client, const WBMessage *request, WBMessage *reply) {
+  return WBMessageClientSendMachRequest((mach_port_t)(uintptr_t)client, request, reply);
+}
+
+static
+void *_WBMessageServerTestLoad(void *arg) {
+  WBMessageServerLoad *load = (WBMessageServerLoad *)arg;
+  char buffer[128], rbuffer[128];
+  memset(buffer, 'r', sizeof(buffer));
+  for (size_t idx = 0; idx < load->count && !load->error; idx++) {
+    WBMessage request = { buffer, sizeof(buffer), -1 };
+    WBMessage reply = { rbuffer, sizeof(rbuffer), -1 };
+    uint64_t start = mach_absolute_time();
+    load->error = load->send(load->client, &request, &reply);
+    load->latencies[idx] = mach_absolute_time() - start;
+  }
+  return NULL;
+}
+
+static
+int _WBMessageServerTestCompare(const void *a, const void *b) {
+  uint64_t v1 = *(const uint64_t *)a, v2 = *(const uint64_t *)b;
+  return v1 < v2 ? -1 : (v1 > v2 ? 1 : 0);
+}
+
+@interface WBMessageServerTests : XCTestCase {
+@private
+  pthread_t thread;
+  WBMessageServerRef server;
+}
+
+@end
+
+@implementation WBMessageServerTests
+
+- (void)startServer:(WBMessageServerRef)aServer {
+  XCTAssertTrue(aServer != NULL, @"cannot create server");
+  server = aServer;
+  pthread_create(&thread, NULL, _WBMessageServerTestRun, server);
+}
+
+- (void)stopServer {
+  WBMessageServerStop(server);
+  pthread_join(thread, NULL);
+  WBMessageServerFree(server);
+  server = NULL;
+}
+
+- (mach_port_t)createPort {
+  mach_port_t port = MACH_PORT_NULL;
+  XCTAssertEqual(mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port), KERN_SUCCESS, @"mach_port_allocate");
+  XCTAssertEqual(mach_port_insert_right(mach_task_self(), port, port, MACH_MSG_TYPE_MAKE_SEND), KERN_SUCCESS, @"mach_port_insert_right");
+  return port;
+}
+
+- (void)destroyPort:(mach_port_t)port {
+  mach_port_mod_refs(mach_task_self(), port, MACH_PORT_RIGHT_SEND, -1);
+  mach_port_mod_refs(mach_task_self(), port, MACH_PORT_RIGHT_RECEIVE, -1);
+}
+
+- (NSString *)socketPath {
+  return [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"wbms-%d.sock", getpid()]];
+}
+
+/* Returns NULL if the platform does not support the Unix transport.
+ The transport requires epoll: the Unix tests are skipped on macOS, and only run on Linux builds. */
+- (WBMessageServerRef)createUnixServer {
+  WBMessageServerRef unix = WBMessageServerCreateUnix([[self socketPath] fileSystemRepresentation], 1024, _WBMessageServerTestEcho, NULL);
+  if (!unix) {
+    XCTAssertEqual(errno, EPROTONOSUPPORT, @"cannot create unix server");
+    NSLog(@"unix transport not supported: %s", strerror(errno));
+  }
+  return unix;
+}
+
+- (void)testMachTransport {
+  mach_port_t port = [self createPort];
+  [self startServer:WBMessageServerCreateMach(port, 1024, _WBMessageServerTestEcho, NULL)];
+  XCTAssertEqual(strcmp(WBMessageServerGetTransportName(server), "mach"), 0, @"transport name");
+
+  char rbuffer[64];
+  WBMessage request = { "hello", 5, -1 };
+  WBMessage reply = { rbuffer, sizeof(rbuffer), -1 };
+  XCTAssertEqual(WBMessageClientSendMachRequest(port, &request, &reply), KERN_SUCCESS, @"send request");
+  XCTAssertEqual(reply.length, (size_t)5, @"reply length");
+  XCTAssertEqual(memcmp(rbuffer, "hello", 5), 0, @"reply content");
+
+  [self stopServer];
+  [self destroyPort:port];
+}
+
+- (void)testMachOutOfLine {
+  mach_port_t port = [self createPort];
+  [self startServer:WBMessageServerCreateMach(port, 1024, _WBMessageServerTestLarge, NULL)];
+
+  /* reply larger than the client buffer and the server maximum size */
+  char rbuffer[64];
+  WBMessage request = { "large", 5, -1, 0 };
+  WBMessage reply = { rbuffer, sizeof(rbuffer), -1, 0 };
+  XCTAssertEqual(WBMessageClientSendMachRequest(port, &request, &reply), KERN_SUCCESS, @"send request");
+  XCTAssertTrue(reply.flags & kWBMessageOwnsBuffer, @"reply should be out-of-line");
+  XCTAssertEqual(reply.length, (size_t)(4 << 20), @"reply length");
+  XCTAssertEqual(((uint8_t *)reply.data)[reply.length - 1], 0xa5, @"reply content");
+  WBMessageFreeBuffer(reply.data, reply.length);
+
+  /* owned request buffer is moved to the server */
+  size_t length = 1 << 20;
+  void *buffer = WBMessageAllocateBuffer(length);
+  memset(buffer, 0x5a, length);
+  request = (WBMessage){ NULL, 0, -1, 0 };
+  WBMessageSetBuffer(&request, buffer, length);
+  reply = (WBMessage){ rbuffer, sizeof(rbuffer), -1, 0 };
+  XCTAssertEqual(WBMessageClientSendMachRequest(port, &request, &reply), KERN_SUCCESS, @"send request");
+  uint64_t size = 0;
+  memcpy(&size, rbuffer, sizeof(size));
+  XCTAssertEqual(size, (uint64_t)length, @"request length");
+
+  [self stopServer];
+  [self destroyPort:port];
+}
+
+- (void)testUnixTransport {
+  WBMessageServerRef unix = [self createUnixServer];
+  if (!unix)
+    return;
+  [self startServer:unix];
+
+  int sockfd = WBMessageClientConnect([[self socketPath] fileSystemRepresentation]);
+  XCTAssertTrue(sockfd >= 0, @"connect: %s", strerror(errno));
+
+  int fds[2];
+  XCTAssertEqual(pipe(fds), 0, @"pipe");
+  char rbuffer[64];
+  WBMessage request = { "hello", 5, fds[1] };
+  WBMessage reply = { rbuffer, sizeof(rbuffer), -1 };
+  XCTAssertEqual(WBMessageClientSendRequest(sockfd, &request, &reply), 0, @"send request");
+  XCTAssertEqual(reply.length, (size_t)5, @"reply length");
+  XCTAssertTrue(reply.fd >= 0, @"descriptor not passed");
+
+  /* the descriptor went through the server and back */
+  char c = 0;
+  XCTAssertEqual(write(reply.fd, "x", 1), (ssize_t)1, @"write");
+  XCTAssertEqual(read(fds[0], &c, 1), (ssize_t)1, @"read");
+  XCTAssertEqual(c, 'x', @"pipe content");
+  close(reply.fd);
+  close(fds[0]);
+  close(fds[1]);
+
+  /* reply larger than the buffer */
+  char large[512];
+  memset(large, 'l', sizeof(large));
+  request = (WBMessage){ large, sizeof(large), -1 };
+  reply = (WBMessage){ rbuffer, sizeof(rbuffer), -1 };
+  XCTAssertEqual(WBMessageClientSendRequest(sockfd, &request, &reply), EMSGSIZE, @"truncated reply");
+
+  /* request larger than the server maximum size: the connection is closed */
+  char huge[2048];
+  memset(huge, 'h', sizeof(huge));
+  request = (WBMessage){ huge, sizeof(huge), -1 };
+  reply = (WBMessage){ rbuffer, sizeof(rbuffer), -1 };
+  XCTAssertEqual(WBMessageClientSendRequest(sockfd, &request, &reply), ECONNRESET, @"truncated request");
+
+  close(sockfd);
+  [self stopServer];
+}
+
+- (void)testIdleTimeout {
+  mach_port_t port = [self createPort];
+  WBMessageServerRef idle = WBMessageServerCreateMach(port, 64, _WBMessageServerTestEcho, NULL);
+  WBMessageServerSetIdleTimeout(idle, 0.1);
+  CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+  /* default timeout callback stops the server */
+  XCTAssertEqual(WBMessageServerRun(idle), 0, @"run");
+  XCTAssertTrue(CFAbsoluteTimeGetCurrent() - start >= 0.09, @"server stopped before the idle timeout");
+  WBMessageServerFree(idle);
+  [self destroyPort:port];
+}
+
+- (void)runLoad:(WBMessageServerTestSend)send clients:(void **)clients count:(size_t)count {
+  const size_t requests = 20000;
+  pthread_t threads[count];
+  WBMessageServerLoad loads[count];
+  uint64_t *latencies = malloc(count * requests * sizeof(*latencies));
+
+  uint64_t start = mach_absolute_time();
+  for (size_t idx = 0; idx < count; idx++) {
+    loads[idx] = (WBMessageServerLoad){ clients[idx], send, requests, latencies + idx * requests, 0 };
+    pthread_create(&threads[idx], NULL, _WBMessageServerTestLoad, &loads[idx]);
+  }
+  for (size_t idx = 0; idx < count; idx++) {
+    pthread_join(threads[idx], NULL);
+    XCTAssertEqual(loads[idx].error, 0, @"request failed");
+  }
+  uint64_t elapsed = mach_absolute_time() - start;
+
+  mach_timebase_info_data_t timebase;
+  mach_timebase_info(&timebase);
+  size_t total = count * requests;
+  qsort(latencies, total, sizeof(*latencies), _WBMessageServerTestCompare);
+  double seconds = (double)elapsed * timebase.numer / timebase.denom / 1e9;
+  double p50 = (double)latencies[total / 2] * timebase.numer / timebase.denom / 1e3;
+  double p99 = (double)latencies[total * 99 / 100] * timebase.numer / timebase.denom / 1e3;
+  NSLog(@"%s: %lu clients, %.0f requests/s, p50: %.1f µs, p99: %.1f µs", WBMessageServerGetTransportName(server),
+        (unsigned long)count, total / seconds, p50, p99);
+  free(latencies);
+}
+
+- (void)testMachBenchmark {
+  mach_port_t port = [self createPort];
+  [self startServer:WBMessageServerCreateMach(port, 1024, _WBMessageServerTestEcho, NULL)];
+
+  void *clients[4];
+  for (size_t idx = 0; idx < 4; idx++)
+    clients[idx] = (void *)(uintptr_t)port;
+  [self runLoad:_WBMessageServerTestSendMach clients:clients count:4];
+
+  [self stopServer];
+  [self destroyPort:port];
+}
+
+- (void)testUnixBenchmark {
+  WBMessageServerRef unix = [self createUnixServer];
+  if (!unix)
+    return;
+  [self startServer:unix];
+
+  void *clients[4];
+  for (size_t idx = 0; idx < 4; idx++)
+    clients[idx] = (void *)(intptr_t)WBMessageClientConnect([[self socketPath] fileSystemRepresentation]);
+  [self runLoad:_WBMessageServerTestSendUnix clients:clients count:4];
+  for (size_t idx = 0; idx < 4; idx++)
+    close((int)(intptr_t)clients[idx]);
+
+  [self stopServer];
+}
+
+@end
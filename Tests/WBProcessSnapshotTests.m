@@ -0,0 +1,87 @@
+/*
+ *  WBProcessSnapshotTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBProcessSnapshot.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+typedef struct {
+  pid_t pid;
+  size_t added, removed, changed;
+  char name[WB_PROCESS_NAME_MAX];
+} WBProcessSnapshotTestState;
+
+static
+void _WBProcessSnapshotTestCallBack(WBProcessChange change, const WBProcessInfo *info, void *ctxt) {
+  WBProcessSnapshotTestState *state = (WBProcessSnapshotTestState *)ctxt;
+  if (info->pid != state->pid)
+    return;
+  switch (change) {
+    case kWBProcessAdded: state->added++; break;
+    case kWBProcessRemoved: state->removed++; break;
+    case kWBProcessChanged: state->changed++; break;
+  }
+  strlcpy(state->name, info->name, sizeof(state->name));
+}
+
+@interface WBProcessSnapshotTests : XCTestCase
+
+@end
+
+@implementation WBProcessSnapshotTests
+
+- (void)testSnapshot {
+  WBProcessSnapshotRef snapshot = WBProcessSnapshotCreate();
+  XCTAssertEqual(WBProcessSnapshotUpdate(snapshot, NULL, NULL), 0, @"update failed");
+  XCTAssertTrue(WBProcessSnapshotGetCount(snapshot) > 0, @"empty snapshot");
+
+  const WBProcessInfo *info = WBProcessSnapshotGetProcess(snapshot, getpid());
+  XCTAssertTrue(info != NULL, @"current process not found");
+  XCTAssertEqual(info->ppid, getppid(), @"invalid parent");
+  XCTAssertEqual(info->uid, geteuid(), @"invalid user");
+
+  /* child waiting before exec */
+  int fds[2];
+  XCTAssertEqual(pipe(fds), 0, @"pipe");
+  pid_t child = fork();
+  if (0 == child) {
+    char c;
+    read(fds[0], &c, 1);
+    execl("/bin/sleep", "sleep", "10", NULL);
+    _exit(1);
+  }
+
+  WBProcessSnapshotTestState state = { .pid = child };
+  XCTAssertEqual(WBProcessSnapshotUpdate(snapshot, _WBProcessSnapshotTestCallBack, &state), 0, @"update failed");
+  XCTAssertEqual(state.added, (size_t)1, @"child not added");
+
+  write(fds[1], "x", 1);
+  for (int idx = 0; idx < 50 && !state.changed; idx++) {
+    usleep(20000);
+    WBProcessSnapshotUpdate(snapshot, _WBProcessSnapshotTestCallBack, &state);
+  }
+  XCTAssertEqual(state.changed, (size_t)1, @"exec not reported");
+  XCTAssertTrue(0 == strcmp(state.name, "sleep"), @"invalid name");
+
+  kill(child, SIGKILL);
+  waitpid(child, NULL, 0);
+  XCTAssertEqual(WBProcessSnapshotUpdate(snapshot, _WBProcessSnapshotTestCallBack, &state), 0, @"update failed");
+  XCTAssertEqual(state.removed, (size_t)1, @"child not removed");
+  XCTAssertTrue(NULL == WBProcessSnapshotGetProcess(snapshot, child), @"child still in snapshot");
+
+  close(fds[0]);
+  close(fds[1]);
+  WBProcessSnapshotFree(snapshot);
+}
+
+@end
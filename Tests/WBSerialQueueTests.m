@@ -0,0 +1,163 @@
+/*
+ *  WBSerialQueueTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBSerialQueue.h"
+
+#include <stdatomic.h>
+
+@interface WBSerialQueueTests : XCTestCase {
+@private
+  NSMutableArray *values;
+}
+
+@end
+
+static
+void _WBSerialQueueTestSleep(void *ctxt) {
+  usleep(20000);
+}
+
+static
+void _WBSerialQueueTestNoop(void *ctxt) {}
+
+static atomic_int sConcurrent, sMaxConcurrent, sBarrierErrors;
+
+static
+void _WBExecutorTestConcurrent(void *ctxt) {
+  int running = atomic_fetch_add(&sConcurrent, 1) + 1;
+  int max = atomic_load(&sMaxConcurrent);
+  while (running > max && !atomic_compare_exchange_weak(&sMaxConcurrent, &max, running))
+    continue;
+  usleep(100);
+  atomic_fetch_sub(&sConcurrent, 1);
+}
+
+static
+void _WBExecutorTestBarrier(void *ctxt) {
+  if (atomic_load(&sConcurrent) != 0)
+    atomic_fetch_add(&sBarrierErrors, 1);
+}
+
+@implementation WBSerialQueueTests
+
+- (void)setUp {
+  [super setUp];
+  values = [[NSMutableArray alloc] init];
+}
+
+- (void)tearDown {
+  [values release];
+  [super tearDown];
+}
+
+- (void)append:(NSNumber *)value {
+  [values addObject:value];
+}
+
+- (void)checkQueue:(WBSerialQueue *)queue {
+  for (NSUInteger idx = 0; idx < 1000; idx++)
+    [queue addOperationWithTarget:self selector:@selector(append:) object:@(idx) waitUntilFinished:(idx % 100) == 0];
+  [queue waitUntilAllOperationsAreFinished];
+  XCTAssertEqual([values count], (NSUInteger)1000, @"missing operations");
+  for (NSUInteger idx = 0; idx < [values count]; idx++)
+    XCTAssertEqualObjects(values[idx], @(idx), @"operations not performed in order");
+
+  [values removeAllObjects];
+  [queue addOperationWithFunction:_WBSerialQueueTestSleep context:NULL];
+  for (NSUInteger idx = 0; idx < 100; idx++)
+    [queue addOperationWithTarget:self selector:@selector(append:) object:@(idx)];
+  [queue cancelAllOperations];
+  [queue waitUntilAllOperationsAreFinished];
+  XCTAssertEqual([values count], (NSUInteger)0, @"cancelled operations performed");
+}
+
+- (void)testGCDQueue {
+  WBSerialQueue *queue = [[WBSerialQueue alloc] init];
+  [self checkQueue:queue];
+  [queue release];
+}
+
+- (void)testExecutorQueue {
+  WBSerialQueue *queue = [[WBSerialQueue alloc] initWithName:@"test" executor:NULL priority:kWBExecutorPriorityDefault];
+  [self checkQueue:queue];
+
+  WBExecutorStatistics stats;
+  XCTAssertTrue([queue getStatistics:&stats], @"statistics not supported");
+  XCTAssertEqual(stats.depth, (uint64_t)0, @"pending operations");
+  XCTAssertTrue(stats.cancelled >= 100, @"cancelled count");
+  [queue release];
+}
+
+- (void)testExecutorCancelWhileWaiting {
+  WBSerialQueue *queue = [[WBSerialQueue alloc] initWithName:@"cancel" executor:NULL priority:kWBExecutorPriorityDefault];
+  for (NSUInteger idx = 0; idx < 5; idx++)
+    [queue addOperationWithFunction:_WBSerialQueueTestSleep context:NULL];
+
+  /* the wait barrier is cancelled with the pending operations */
+  dispatch_group_t group = dispatch_group_create();
+  dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+    [queue waitUntilAllOperationsAreFinished];
+  });
+  usleep(30000);
+  [queue cancelAllOperations];
+  XCTAssertEqual(dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC)), 0L, @"wait not finished");
+  dispatch_release(group);
+
+  [queue waitUntilAllOperationsAreFinished];
+  WBExecutorStatistics stats;
+  XCTAssertTrue([queue getStatistics:&stats], @"statistics not supported");
+  XCTAssertEqual(stats.depth, (uint64_t)0, @"pending operations");
+  [queue release];
+}
+
+- (void)testExecutorLanes {
+  WBExecutorRef executor = WBExecutorCreate(4);
+  WBExecutorGroupRef group = WBExecutorGroupCreate();
+  WBExecutorLaneRef lane = WBExecutorLaneCreate(executor, "concurrent", kWBExecutorPriorityHigh, 3);
+  for (NSUInteger idx = 0; idx < 300; idx++) {
+    WBExecutorLaneAsync(lane, group, _WBExecutorTestConcurrent, NULL);
+    if (idx % 50 == 0)
+      WBExecutorLaneBarrierAsync(lane, group, _WBExecutorTestBarrier, NULL);
+  }
+  XCTAssertTrue(WBExecutorGroupWait(group, 0), @"group wait");
+  XCTAssertTrue(atomic_load(&sMaxConcurrent) <= 3, @"lane width not honored");
+  XCTAssertEqual(atomic_load(&sBarrierErrors), 0, @"barrier runs concurrently");
+
+  WBExecutorStatistics stats;
+  WBExecutorGetStatistics(executor, &stats);
+  XCTAssertEqual(stats.completed, (uint64_t)306, @"executor completed count");
+  WBExecutorLaneRelease(lane);
+  WBExecutorGroupFree(group);
+  WBExecutorDestroy(executor);
+}
+
+- (void)measureQueue:(WBSerialQueue *)queue {
+  [self measureBlock:^{
+    for (NSUInteger idx = 0; idx < 100000; idx++)
+      [queue addOperationWithFunction:_WBSerialQueueTestNoop context:NULL];
+    [queue waitUntilAllOperationsAreFinished];
+  }];
+}
+
+- (void)testGCDQueuePerformance {
+  WBSerialQueue *queue = [[WBSerialQueue alloc] init];
+  [self measureQueue:queue];
+  [queue release];
+}
+
+- (void)testExecutorQueuePerformance {
+  WBSerialQueue *queue = [[WBSerialQueue alloc] initWithName:@"perf" executor:NULL priority:kWBExecutorPriorityDefault];
+  [self measureQueue:queue];
+  [queue release];
+}
+
+@end
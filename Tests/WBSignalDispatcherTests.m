@@ -0,0 +1,113 @@
+/*
+ *  WBSignalDispatcherTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBSignalDispatcher.h"
+
+#include <poll.h>
+#include <signal.h>
+
+typedef struct {
+  uint64_t count;
+  uint64_t calls;
+  /* token removed by the handler */
+  int remove;
+} WBSignalDispatcherTestState;
+
+static
+void _WBSignalDispatcherTestHandler(int signo, uint64_t count, void *ctxt) {
+  WBSignalDispatcherTestState *state = (WBSignalDispatcherTestState *)ctxt;
+  state->count += count;
+  state->calls++;
+  if (state->remove > 0) {
+    WBSignalDispatcherRemoveHandler(state->remove);
+    state->remove = 0;
+  }
+}
+
+@interface WBSignalDispatcherTests : XCTestCase
+
+@end
+
+@implementation WBSignalDispatcherTests
+
+- (bool)waitSignals {
+  struct pollfd pfd = { WBSignalDispatcherGetDescriptor(), POLLIN, 0 };
+  return poll(&pfd, 1, 1000) == 1;
+}
+
+- (void)testCoalescing {
+  WBSignalDispatcherTestState s1 = {}, s2 = {};
+  int t1 = WBSignalDispatcherAddHandler(SIGUSR1, _WBSignalDispatcherTestHandler, &s1);
+  int t2 = WBSignalDispatcherAddHandler(SIGUSR1, _WBSignalDispatcherTestHandler, &s2);
+  XCTAssertTrue(t1 > 0 && t2 > 0 && t1 != t2, @"invalid tokens");
+
+  for (int idx = 0; idx < 5; idx++)
+    raise(SIGUSR1);
+  XCTAssertTrue([self waitSignals], @"descriptor not readable");
+  XCTAssertTrue(WBSignalDispatcherDispatch() > 0, @"no signal dispatched");
+
+  /* one call per dispatch, whatever the number of signals */
+  XCTAssertEqual(s1.calls, (uint64_t)1, @"signals not coalesced");
+  XCTAssertEqual(s2.calls, (uint64_t)1, @"signals not coalesced");
+  XCTAssertTrue(s1.count >= 1 && s1.count <= 5, @"invalid count");
+  XCTAssertEqual(s1.count, s2.count, @"handlers received different counts");
+
+  WBSignalDispatcherRemoveHandler(t2);
+  raise(SIGUSR1);
+  XCTAssertTrue([self waitSignals], @"descriptor not readable");
+  WBSignalDispatcherDispatch();
+  XCTAssertEqual(s1.calls, (uint64_t)2, @"handler not called");
+  XCTAssertEqual(s2.calls, (uint64_t)1, @"removed handler called");
+
+  WBSignalDispatcherRemoveHandler(t1);
+  struct sigaction action;
+  sigaction(SIGUSR1, NULL, &action);
+  XCTAssertTrue(action.sa_handler == SIG_DFL, @"disposition not restored");
+}
+
+- (void)testRemoveFromHandler {
+  WBSignalDispatcherTestState s1 = {}, s2 = {};
+  int t1 = WBSignalDispatcherAddHandler(SIGUSR2, _WBSignalDispatcherTestHandler, &s1);
+  int t2 = WBSignalDispatcherAddHandler(SIGUSR2, _WBSignalDispatcherTestHandler, &s2);
+  /* the first handler removes the second before it is called */
+  s1.remove = t2;
+
+  raise(SIGUSR2);
+  XCTAssertTrue([self waitSignals], @"descriptor not readable");
+  WBSignalDispatcherDispatch();
+  XCTAssertEqual(s1.calls, (uint64_t)1, @"handler not called");
+  XCTAssertEqual(s2.calls, (uint64_t)0, @"removed handler called");
+
+  WBSignalDispatcherRemoveHandler(t1);
+}
+
+- (void)testInvalidSignal {
+  XCTAssertEqual(WBSignalDispatcherAddHandler(SIGKILL, _WBSignalDispatcherTestHandler, NULL), -1, @"SIGKILL cannot be handled");
+  XCTAssertEqual(errno, EINVAL, @"invalid error");
+  XCTAssertEqual(WBSignalDispatcherAddHandler(NSIG, _WBSignalDispatcherTestHandler, NULL), -1, @"invalid signal");
+}
+
+- (void)testRunLoop {
+  WBSignalDispatcherTestState state = {};
+  int token = WBSignalDispatcherAddHandler(SIGUSR1, _WBSignalDispatcherTestHandler, &state);
+  XCTAssertEqual(WBSignalDispatcherScheduleInRunLoop(CFRunLoopGetCurrent(), kCFRunLoopDefaultMode), 0, @"cannot schedule dispatcher");
+
+  raise(SIGUSR1);
+  for (int idx = 0; idx < 10 && !state.calls; idx++)
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, true);
+  XCTAssertEqual(state.calls, (uint64_t)1, @"handler not called from the run loop");
+
+  WBSignalDispatcherUnscheduleFromRunLoop(CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+  WBSignalDispatcherRemoveHandler(token);
+}
+
+@end
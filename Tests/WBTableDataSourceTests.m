@@ -0,0 +1,89 @@
+/*
+ *  WBTableDataSourceTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBTableDataSource.h"
+
+@interface WBTableDataSourceTests : XCTestCase {
+@private
+  NSArray *rows;
+}
+
+@end
+
+@implementation WBTableDataSourceTests
+
+- (NSArray *)rowsWithCount:(NSUInteger)count {
+  NSMutableArray *array = [NSMutableArray arrayWithCapacity:count];
+  for (NSUInteger idx = 0; idx < count; idx++)
+    [array addObject:[NSString stringWithFormat:@"Row %lu - %lx", (unsigned long)idx, (unsigned long)(idx * 2654435761u)]];
+  return array;
+}
+
+- (WBTableDataSource *)dataSourceWithOptions:(WBFilterOptions)options {
+  WBTableDataSource *source = [[[WBTableDataSource alloc] init] autorelease];
+  [source setFilterOptions:options];
+  [source setFilterBlock:^BOOL(NSString *search, id row) {
+    return !search || [row rangeOfString:search options:NSCaseInsensitiveSearch].location != NSNotFound;
+  }];
+  [source setContent:rows];
+  return source;
+}
+
+- (NSArray *)filter:(NSString *)search {
+  NSPredicate *predicate = [NSPredicate predicateWithBlock:^BOOL(id row, NSDictionary *bindings) {
+    return [row rangeOfString:search options:NSCaseInsensitiveSearch].location != NSNotFound;
+  }];
+  return [rows filteredArrayUsingPredicate:predicate];
+}
+
+- (void)tearDown {
+  [rows release];
+  rows = nil;
+  [super tearDown];
+}
+
+- (void)testIncrementalFilter {
+  rows = [[self rowsWithCount:50000] retain];
+  WBTableDataSource *source = [self dataSourceWithOptions:WBFilterIncremental | WBFilterConcurrent];
+  for (NSString *search in @[@"1", @"12", @"12 - a", @"2", @"", @"7f"]) {
+    [source setSearchString:search];
+    NSArray *expected = [search length] ? [self filter:search] : rows;
+    XCTAssertEqualObjects([source arrangedObjects], expected, @"invalid result for '%@'", search);
+  }
+}
+
+- (void)testAsynchronousFilter {
+  rows = [[self rowsWithCount:50000] retain];
+  WBTableDataSource *source = [self dataSourceWithOptions:WBFilterAsynchronous | WBFilterIncremental | WBFilterConcurrent];
+  [source setSearchString:@"1"];
+  [source setSearchString:@"12"];
+  /* only the last search updates the content */
+  NSArray *expected = [self filter:@"12"];
+  NSDate *limit = [NSDate dateWithTimeIntervalSinceNow:10];
+  while (![[source arrangedObjects] isEqualToArray:expected] && [limit timeIntervalSinceNow] > 0)
+    [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+  XCTAssertEqualObjects([source arrangedObjects], expected, @"background filter did not complete");
+}
+
+- (void)testFilterPerformance {
+  rows = [[self rowsWithCount:1000000] retain];
+  NSArray *expected = [self filter:@"1234"];
+  /* typing a search string, one character at a time */
+  [self measureBlock:^{
+    WBTableDataSource *source = [self dataSourceWithOptions:WBFilterIncremental | WBFilterConcurrent];
+    for (NSString *search in @[@"1", @"12", @"123", @"1234"])
+      [source setSearchString:search];
+    XCTAssertEqualObjects([source arrangedObjects], expected, @"invalid result");
+  }];
+}
+
+@end
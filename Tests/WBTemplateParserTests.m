@@ -0,0 +1,134 @@
+/*
+ *  WBTemplateParserTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBTemplateParser.h"
+
+@interface WBTemplateParserRecorder : NSObject {
+@public
+  NSMutableArray *events;
+}
+@end
+
+@implementation WBTemplateParserRecorder
+
+- (id)init {
+  if (self = [super init])
+    events = [[NSMutableArray alloc] init];
+  return self;
+}
+
+- (void)dealloc {
+  [events release];
+  [super dealloc];
+}
+
+- (void)templateParser:(WBTemplateParser *)parser foundCharacters:(NSString *)aString {
+  [events addObject:[@"C:" stringByAppendingString:aString]];
+}
+- (void)templateParser:(WBTemplateParser *)parser foundVariable:(NSString *)variable {
+  [events addObject:[@"V:" stringByAppendingString:variable]];
+}
+- (void)templateParser:(WBTemplateParser *)parser didStartBlock:(NSString *)blockName {
+  [events addObject:[@"S:" stringByAppendingString:blockName]];
+}
+- (void)templateParserDidEndBlock:(WBTemplateParser *)parser {
+  [events addObject:@"E"];
+}
+
+@end
+
+/* byte range events only */
+@interface WBTemplateParserCounter : NSObject {
+@public
+  NSUInteger chars, vars;
+}
+@end
+
+@implementation WBTemplateParserCounter
+
+- (void)templateParser:(WBTemplateParser *)parser foundCharactersInRange:(NSRange)aRange {
+  chars += aRange.length;
+}
+- (void)templateParser:(WBTemplateParser *)parser foundVariableInRange:(NSRange)aRange {
+  vars++;
+}
+
+@end
+
+@interface WBTemplateParserTests : XCTestCase {
+
+}
+
+@end
+
+@implementation WBTemplateParserTests
+
+- (NSString *)writeTemplate:(NSString *)content encoding:(NSStringEncoding)encoding {
+  NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+  XCTAssertTrue([content writeToFile:path atomically:NO encoding:encoding error:NULL], @"cannot write template");
+  return path;
+}
+
+- (NSArray *)eventsForTemplate:(NSString *)content encoding:(NSStringEncoding)encoding {
+  return [self eventsForTemplate:content encoding:encoding skipsComments:NO];
+}
+
+- (NSArray *)eventsForTemplate:(NSString *)content encoding:(NSStringEncoding)encoding skipsComments:(BOOL)skips {
+  NSString *path = [self writeTemplate:content encoding:encoding];
+  WBTemplateParserRecorder *recorder = [[WBTemplateParserRecorder alloc] init];
+  WBTemplateParser *parser = [[WBTemplateParser alloc] initWithFile:path encoding:encoding];
+  [parser setSkipsBlockComments:skips];
+  [parser setDelegate:recorder];
+  XCTAssertTrue([parser parse], @"parse failed");
+  NSArray *events = [[recorder->events copy] autorelease];
+  [parser release];
+  [recorder release];
+  [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+  return events;
+}
+
+- (void)testByteScannerMatchesStringScanner {
+  NSString *content = @"Hello @name! @ not a var\n@Start:item!<li>@value! @ignored x</li>@End!"
+    "@a@b! café @été! @! @End! tail @unterminated";
+  /* UTF-16 uses the string scanner, UTF-8 the byte scanner */
+  NSArray *expected = [self eventsForTemplate:content encoding:NSUTF16StringEncoding];
+  NSArray *events = [self eventsForTemplate:content encoding:NSUTF8StringEncoding];
+  XCTAssertEqualObjects(events, expected, @"byte scanner events mismatch");
+}
+
+- (void)testBlockComments {
+  NSString *content = @"<ul><!-- <!-- @Start:item! --><li>@value!</li><!-- @End! --></ul> <!-- @var! -->";
+  NSArray *expected = @[@"C:<ul><!-- ", @"S:item", @"C:<li>", @"V:value", @"C:</li>", @"E", @"C:</ul> <!-- ", @"V:var", @"C: -->"];
+  XCTAssertEqualObjects([self eventsForTemplate:content encoding:NSUTF8StringEncoding skipsComments:YES], expected, @"byte scanner");
+  XCTAssertEqualObjects([self eventsForTemplate:content encoding:NSUTF16StringEncoding skipsComments:YES], expected, @"string scanner");
+}
+
+- (void)testParsePerformance {
+  NSMutableString *content = [NSMutableString string];
+  for (NSUInteger idx = 0; idx < 50000; idx++)
+    [content appendString:@"<tr><td class=\"name\">@name!</td><td>@value!</td><td>café @ 12 — text</td></tr>\n"];
+  NSString *path = [self writeTemplate:content encoding:NSUTF8StringEncoding];
+  NSLog(@"template size: %lu bytes", (unsigned long)[[content dataUsingEncoding:NSUTF8StringEncoding] length]);
+
+  [self measureBlock:^{
+    WBTemplateParserCounter *counter = [[WBTemplateParserCounter alloc] init];
+    WBTemplateParser *parser = [[WBTemplateParser alloc] initWithFile:path encoding:NSUTF8StringEncoding];
+    [parser setDelegate:counter];
+    XCTAssertTrue([parser parse], @"parse failed");
+    XCTAssertEqual(counter->vars, (NSUInteger)100000, @"invalid variables count");
+    [parser release];
+    [counter release];
+  }];
+  [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+@end
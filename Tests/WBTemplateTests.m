@@ -0,0 +1,89 @@
+/*
+ *  WBTemplateTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBTemplate.h"
+
+#define kWBTemplateTestRows 1000
+
+static
+void _WBTemplateTestProvider(NSUInteger row, NSString **values, void *ctxt) {
+  if (row == 737)
+    [NSException raise:NSInternalInconsistencyException format:@"row %lu", (unsigned long)row];
+  values[0] = @"name";
+}
+
+@interface WBTemplateTests : XCTestCase {
+@private
+  NSString *wb_path;
+}
+
+@end
+
+@implementation WBTemplateTests
+
+- (void)setUp {
+  [super setUp];
+  wb_path = [[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]] retain];
+  NSString *content = @"<table>@Start:row!<tr>@name!|@value!@Start:cell![@label!]@End!</tr>@End!</table>";
+  XCTAssertTrue([content writeToFile:wb_path atomically:NO encoding:NSUTF8StringEncoding error:NULL], @"cannot write template");
+}
+
+- (void)tearDown {
+  [[NSFileManager defaultManager] removeItemAtPath:wb_path error:NULL];
+  [wb_path release];
+  [super tearDown];
+}
+
+- (WBTemplate *)template {
+  WBTemplate *tpl = [[WBTemplate alloc] initWithContentsOfFile:wb_path encoding:NSUTF8StringEncoding];
+  XCTAssertTrue([tpl load], @"cannot load template");
+  return [tpl autorelease];
+}
+
+- (void)testDumpRowsMatchesDumpBlock {
+  WBTemplate *serial = [self template];
+  WBTemplate *row = [serial blockWithName:@"row"];
+  WBTemplate *cell = [serial blockWithName:@"cell"];
+  NSMutableArray *rows = [NSMutableArray array];
+  for (NSUInteger idx = 0; idx < kWBTemplateTestRows; idx++) {
+    NSString *name = [NSString stringWithFormat:@"row %lu", (unsigned long)idx];
+    NSString *value = [NSString stringWithFormat:@"%lu €", (unsigned long)(idx * 7)];
+    NSMutableArray *cells = [NSMutableArray array];
+    for (NSUInteger label = 0; label < idx % 3; label++) {
+      NSString *str = [NSString stringWithFormat:@"c%lu", (unsigned long)label];
+      [cell setVariable:str forKey:@"label"];
+      [cell dumpBlock];
+      [cells addObject:@{ @"label": str }];
+    }
+    [row setVariable:name forKey:@"name"];
+    [row setVariable:value forKey:@"value"];
+    [row dumpBlock];
+    [rows addObject:@{ @"name": name, @"value": value, @"_Blocks_": @{ @"cell": cells } }];
+  }
+  NSString *expected = [serial stringRepresentation];
+
+  WBTemplate *batch = [self template];
+  [[batch blockWithName:@"row"] dumpRows:rows];
+  XCTAssertEqualObjects([batch stringRepresentation], expected, @"batch output mismatch");
+}
+
+- (void)testDumpRowsException {
+  WBTemplate *tpl = [self template];
+  WBTemplate *row = [tpl blockWithName:@"row"];
+  XCTAssertThrowsSpecificNamed([row dumpRows:kWBTemplateTestRows keys:@[@"name"] provider:_WBTemplateTestProvider context:NULL],
+                               NSException, NSInternalInconsistencyException, @"exception not raised on the calling thread");
+
+  /* nothing dumped */
+  XCTAssertEqualObjects([tpl stringRepresentation], @"<table></table>", @"rows dumped despite the exception");
+}
+
+@end
@@ -0,0 +1,148 @@
+/*
+ *  WBThreadPortTests.m
+ *  WonderBox
+ *
+ *  Created by Jean-Daniel Dupas.
+ *  Copyright (c) 2004 - 2009 Jean-Daniel Dupas. All rights reserved.
+ *
+ *  This file is distributed under the MIT License. See LICENSE.TXT for details.
+ */
+
+#import <XCTest/XCTest.h>
+
+#import "WBThreadPort.h"
+
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+
+@interface WBThreadPortServer : NSObject {
+@public
+  volatile bool stop;
+  NSUInteger count;
+}
+
+- (NSUInteger)increment;
+- (void)fail;
+- (void)sleep:(NSTimeInterval)delay;
+- (void)stop;
+
+@end
+
+@implementation WBThreadPortServer
+
+- (void)run:(id)argument {
+  @autoreleasepool {
+    /* the port source keeps the run loop alive */
+    [WBThreadPort currentPort];
+    while (!stop) {
+      @autoreleasepool {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+      }
+    }
+  }
+}
+
+- (NSUInteger)increment { return ++count; }
+- (void)fail { [NSException raise:NSInvalidArgumentException format:@"expected failure"]; }
+- (void)sleep:(NSTimeInterval)delay { [NSThread sleepForTimeInterval:delay]; }
+- (void)stop { stop = true; }
+
+@end
+
+@interface WBThreadPortTests : XCTestCase {
+@private
+  WBThreadPort *port;
+  WBThreadPortServer *server;
+}
+
+@end
+
+@implementation WBThreadPortTests
+
+- (void)setUp {
+  [super setUp];
+  server = [[WBThreadPortServer alloc] init];
+  port = [[WBThreadPort detachThreadSelector:@selector(run:) toTarget:server withObject:nil] retain];
+}
+
+- (void)tearDown {
+  [port setTimeout:0];
+  [port performSelector:@selector(stop) target:server argument:nil waitUntilDone:YES];
+  [port release];
+  [server release];
+  [super tearDown];
+}
+
+- (void)checkTransport:(NSInteger)transport {
+  [port setTransport:transport];
+  WBThreadPortServer *proxy = [port prepareWithInvocationTarget:server];
+  XCTAssertEqual([proxy increment], (NSUInteger)1, @"synchronous call");
+
+  for (NSUInteger idx = 0; idx < 1000; idx++)
+    [[port prepareWithInvocationTarget:server waitUntilDone:kWBThreadPortDontWait] increment];
+  /* invocations are performed in order */
+  XCTAssertEqual([[port prepareWithInvocationTarget:server] increment], (NSUInteger)1002, @"asynchronous calls");
+
+  XCTAssertThrowsSpecificNamed([[port prepareWithInvocationTarget:server waitUntilDone:kWBThreadPortWait] fail],
+                               NSException, NSInvalidArgumentException, @"exception not forwarded");
+
+  /* a timed out call is still performed */
+  [port setTimeout:20];
+  XCTAssertThrowsSpecificNamed([[port prepareWithInvocationTarget:server waitUntilDone:kWBThreadPortWait] sleep:0.2],
+                               NSException, NSPortTimeoutException, @"timeout expected");
+  [port setTimeout:0];
+  XCTAssertEqual([[port prepareWithInvocationTarget:server] increment], (NSUInteger)1003, @"call after timeout");
+}
+
+- (void)testQueueTransport {
+  [self checkTransport:kWBThreadPortQueueTransport];
+}
+
+- (void)testMachTransport {
+  [self checkTransport:kWBThreadPortMachTransport];
+}
+
+static
+void _WBThreadPortTestIncrement(void *ctxt) {
+  [(WBThreadPortServer *)ctxt increment];
+}
+
+- (void)testFunction {
+  for (NSUInteger idx = 0; idx < 1000; idx++)
+    [port performFunction:_WBThreadPortTestIncrement context:server waitUntilDone:NO timeout:0];
+  [port performFunction:_WBThreadPortTestIncrement context:server waitUntilDone:YES timeout:0];
+  XCTAssertEqual(server->count, (NSUInteger)1001, @"function calls");
+}
+
+// MARK: Benchmarks
+- (void)measureLatency:(NSInteger)transport {
+  [port setTransport:transport];
+  [self measureBlock:^{
+    for (NSUInteger idx = 0; idx < 10000; idx++)
+      [[port prepareWithInvocationTarget:server] increment];
+  }];
+}
+
+- (void)measureThroughput:(NSInteger)transport {
+  [port setTransport:transport];
+  [self measureBlock:^{
+    for (NSUInteger idx = 0; idx < 100000; idx++)
+      [port performSelector:@selector(increment) target:server argument:nil waitUntilDone:NO];
+    /* wait completion */
+    [port performSelector:@selector(increment) target:server argument:nil waitUntilDone:YES];
+  }];
+}
+
+- (void)testQueueLatency { [self measureLatency:kWBThreadPortQueueTransport]; }
+- (void)testMachLatency { [self measureLatency:kWBThreadPortMachTransport]; }
+
+- (void)testQueueThroughput { [self measureThroughput:kWBThreadPortQueueTransport]; }
+- (void)testFunctionThroughput {
+  [self measureBlock:^{
+    for (NSUInteger idx = 0; idx < 100000; idx++)
+      [port performFunction:_WBThreadPortTestIncrement context:server waitUntilDone:NO timeout:0];
+    [port performFunction:_WBThreadPortTestIncrement context:server waitUntilDone:YES timeout:0];
+  }];
+}
+- (void)testMachThroughput { [self measureThroughput:kWBThreadPortMachTransport]; }
+
+@end